@@ -72,6 +72,19 @@ class EspConnection {
   final String path = '/ws';
   int port = 80;
 
+  // Local lamp proxy (Linux runner background mode); replaces mDNS discovery
+  String? _proxyHost;
+
+  void useProxy(String hostPort) {
+    final colon = hostPort.lastIndexOf(':');
+    final proxyPort = int.tryParse(hostPort.substring(colon + 1));
+    if (colon <= 0 || proxyPort == null) {
+      return;
+    }
+    _proxyHost = hostPort.substring(0, colon);
+    port = proxyPort;
+  }
+
   // Stream of incoming messages from ESP32
   final _incoming = StreamController<Map<String, dynamic>>.broadcast();
   Stream<Map<String, dynamic>> get messages => _incoming.stream;
@@ -85,6 +98,32 @@ class EspConnection {
   final _stateUpdates = StreamController<EspState>.broadcast();
   Stream<EspState> get stateUpdates => _stateUpdates.stream;
 
+  // Hello bundle sent by the firmware to this connection only (state,
+  // capabilities, schedule generation/digest, active automations)
+  Map<String, dynamic>? _hello;
+  Map<String, dynamic>? get hello => _hello;
+
+  // The hello bundle for the current connection, waiting briefly for it
+  // when it has not arrived yet; null from firmware that never sends one
+  Future<Map<String, dynamic>?> awaitHello({
+    Duration timeout = const Duration(milliseconds: 500),
+  }) async {
+    if (_hello != null) {
+      return _hello;
+    }
+    try {
+      return await messages
+          .firstWhere((json) => json['type'] == 'hello')
+          .timeout(timeout);
+    } catch (_) {
+      return null;
+    }
+  }
+
+  // Newest state version seen on this connection; the firmware bumps it on
+  // every broadcast, so anything older arrived out of order and is dropped
+  int? _lastStateVersion;
+
   // Connect to ESP32 via WebSocket, with automatic mDNS resolution
   // and reconnection
   Future<void> connect({
@@ -101,6 +140,8 @@ class EspConnection {
     try {
       if (ipOrHost != null) {
         target = ipOrHost;
+      } else if (_proxyHost != null) {
+        target = _proxyHost;
       } else if (Platform.isIOS) {
         // On iOS, rely on system Bonjour for .local hostnames
         // to avoid multicast join errors
@@ -122,6 +163,8 @@ class EspConnection {
     }
 
     final url = 'ws://$target:$port$path';
+    _hello = null;
+    _lastStateVersion = null; // versions restart when the lamp reboots
     try {
       final socket = await WebSocket.connect(url);
       _ch = IOWebSocketChannel(socket);
@@ -131,10 +174,21 @@ class EspConnection {
         (data) {
           try {
             final Map<String, dynamic> json = jsonDecode(data as String);
+            if (json['type'] == 'hello') {
+              _hello = json;
+            }
             _incoming.add(json);
 
             // Check if this is a state update from ESP32
             if (json.containsKey('state')) {
+              final version = json['state']['version'];
+              final last = _lastStateVersion;
+              if (version is int && last != null && version < last) {
+                return; // stale update overtaken by a newer one
+              }
+              if (version is int) {
+                _lastStateVersion = version;
+              }
               final state = EspState.fromJson(json['state']);
               _stateUpdates.add(state);
             }
@@ -147,9 +201,12 @@ class EspConnection {
         cancelOnError: true,
       );
 
-      // Request current state from ESP after successful connection
+      // Older firmware does not send a hello bundle; fall back to
+      // requesting the current state explicitly
       Timer(const Duration(milliseconds: 500), () {
-        requestCurrentState();
+        if (_hello == null) {
+          requestCurrentState();
+        }
       });
     } catch (_) {
       _handleDisconnect(retry);
@@ -241,6 +298,67 @@ class EspConnection {
   void setMode(int value) => send({'mode': value.clamp(0, 2)});
   void setOn(bool on) => send({'on': on});
 
+  // Streaming brightness (smooth remote dimming): samples carry a timestamp
+  // from this stopwatch and a Q8 level (brightness * 256); the lamp plays them
+  // back through a short jitter buffer and interpolates between them.
+  // Samples are thinned so one delay window never holds more than half of
+  // the lamp's buffer, and sent in batches a few times per delay window.
+  static const int _streamBufferDepth = 16; // STREAM_BUFFER_DEPTH in firmware
+  final Stopwatch _streamClock = Stopwatch();
+  final List<List<int>> _streamPending = [];
+  Timer? _streamFlushTimer;
+  int _streamSampleGapMs = 15;
+
+  // Whether the hello bundle lists `capability` in protocol.capabilities
+  bool supports(String capability) {
+    final caps = _hello?['protocol']?['capabilities'];
+    return caps is List && caps.contains(capability);
+  }
+
+  void beginBrightnessStream({int delayMs = 120}) {
+    _streamClock
+      ..reset()
+      ..start();
+    _streamPending.clear();
+    _streamSampleGapMs = (delayMs ~/ (_streamBufferDepth ~/ 2)).clamp(10, 100);
+    _streamFlushTimer?.cancel();
+    _streamFlushTimer = Timer.periodic(
+      Duration(milliseconds: (delayMs ~/ 3).clamp(20, 250)),
+      (_) => _flushStreamSamples(),
+    );
+    send({'type': 'stream_begin', 'delay_ms': delayMs});
+  }
+
+  void streamBrightness(double value) {
+    final sample = [
+      _streamClock.elapsedMilliseconds,
+      (value.clamp(1.0, 15.0) * 256).round(),
+    ];
+    if (_streamPending.isNotEmpty &&
+        sample[0] - _streamPending.last[0] < _streamSampleGapMs) {
+      // keep only the newest sample within the gap
+      _streamPending[_streamPending.length - 1] = sample;
+    } else {
+      _streamPending.add(sample);
+    }
+  }
+
+  void _flushStreamSamples() {
+    if (_streamPending.isEmpty) {
+      return;
+    }
+    send({'type': 'stream_samples', 'samples': List.of(_streamPending)});
+    _streamPending.clear();
+  }
+
+  void endBrightnessStream() {
+    _flushStreamSamples();
+    _streamFlushTimer?.cancel();
+    _streamFlushTimer = null;
+    _streamClock.stop();
+    send({'type': 'stream_end'});
+  }
+
   // Request current state from ESP32
   void requestCurrentState() => send({'request_state': true});
 
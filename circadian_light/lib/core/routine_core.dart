@@ -6,6 +6,7 @@ import 'dart:math' as math;
 import 'package:flutter/material.dart';
 
 import '../core/esp_connection.dart';
+import '../core/schedule_engine.dart';
 import '../models/alarm.dart';
 import '../models/routine.dart';
 import '../services/database_service.dart';
@@ -186,7 +187,21 @@ class RoutineCore extends ChangeNotifier {
   // ===================== Helpers =====================
 
   /// Convert TimeOfDay to total minutes since midnight
-  int _toMinutes(TimeOfDay time) => time.hour * 60 + time.minute;
+  static int _toMinutes(TimeOfDay time) => time.hour * 60 + time.minute;
+
+  /// The routine the lamp is running at [at]: the first enabled routine whose
+  /// window contains that minute, evaluated by the engine the firmware uses.
+  static Routine? activeRoutine(List<Routine> routines, DateTime at) {
+    final index = ScheduleEngine.instance.activeIndex([
+      for (final routine in routines)
+        (
+          start: _toMinutes(routine.startTime),
+          end: _toMinutes(routine.endTime),
+          enabled: routine.enabled,
+        ),
+    ], at.hour * 60 + at.minute);
+    return index < 0 ? null : routines[index];
+  }
 
   /// Check if two time ranges overlap, accounting for 24-hour wraparound
   bool _timeRangesOverlap(
@@ -195,27 +210,13 @@ class RoutineCore extends ChangeNotifier {
     TimeOfDay start2,
     TimeOfDay end2,
   ) {
-    final s1 = _toMinutes(start1);
-    final e1 = _toMinutes(end1);
-    final s2 = _toMinutes(start2);
-    final e2 = _toMinutes(end2);
-
-    final wraps1 = s1 > e1; // first range wraps midnight
-    final wraps2 = s2 > e2; // second range wraps midnight
-
-    if (!wraps1 && !wraps2) {
-      // Neither wraps: standard overlap check
-      return s1 < e2 && s2 < e1;
-    } else if (wraps1 && wraps2) {
-      // Both wrap: they always overlap
-      return true;
-    } else if (wraps1) {
-      // Only first wraps: [s1, 24h) + [0, e1) overlaps with [s2, e2)
-      return s2 < e1 || e2 > s1;
-    } else {
-      // Only second wraps: [s2, 24h) + [0, e2) overlaps with [s1, e1)
-      return s1 < e2 || e1 > s2;
-    }
+    // Evaluated by the schedule engine shared with the firmware
+    return ScheduleEngine.instance.rangesOverlap(
+      _toMinutes(start1),
+      _toMinutes(end1),
+      _toMinutes(start2),
+      _toMinutes(end2),
+    );
   }
 
   /// Disable all routines and alarms that overlap with the given time range
@@ -345,9 +346,10 @@ class RoutineCore extends ChangeNotifier {
     TimeOfDay wakeUpTime,
     int durationMinutes,
   ) {
-    final total = wakeUpTime.hour * 60 + wakeUpTime.minute - durationMinutes;
-    final hour = ((total ~/ 60) % 24 + 24) % 24; // normalize
-    final minute = (total % 60 + 60) % 60;
-    return TimeOfDay(hour: hour, minute: minute);
+    final start = ScheduleEngine.instance.alarmStartMinute(
+      wakeUpTime.hour * 60 + wakeUpTime.minute,
+      durationMinutes,
+    );
+    return TimeOfDay(hour: start ~/ 60, minute: start % 60);
   }
 }
@@ -0,0 +1,277 @@
+// Schedule evaluation shared with the ESP32 firmware. On Linux the runner
+// bundles libschedule_core (esp_code/lib/schedule_core) and this class calls it
+// through dart:ffi, so previews match the device exactly. Other platforms use
+// the Dart ports below, which follow the same integer rules;
+// test/schedule_engine_test.dart pins them to values taken from the C library.
+
+import 'dart:ffi' as ffi;
+import 'dart:io';
+import 'dart:math' as math;
+
+import 'package:ffi/ffi.dart';
+import 'package:flutter/foundation.dart' show visibleForTesting;
+
+const int _minutesPerDay = 1440;
+const int _levelQ8Max = 15 << 8;
+const int _curvePoints = 33; // SC_ALARM_CURVE_POINTS
+
+final class _ScRoutine extends ffi.Struct {
+  @ffi.Int32()
+  external int id;
+  @ffi.Int32()
+  external int enabled;
+  @ffi.Int32()
+  external int startMinute;
+  @ffi.Int32()
+  external int endMinute;
+  @ffi.Int32()
+  external int brightness;
+  @ffi.Int32()
+  external int mode;
+}
+
+typedef _Int3Native = ffi.Int32 Function(ffi.Int32, ffi.Int32, ffi.Int32);
+typedef _Int3 = int Function(int, int, int);
+typedef _Int4Native = ffi.Int32 Function(
+  ffi.Int32,
+  ffi.Int32,
+  ffi.Int32,
+  ffi.Int32,
+);
+typedef _Int4 = int Function(int, int, int, int);
+typedef _Int2Native = ffi.Int32 Function(ffi.Int32, ffi.Int32);
+typedef _Int2 = int Function(int, int);
+typedef _FindRoutineNative = ffi.Int32 Function(
+  ffi.Pointer<_ScRoutine>,
+  ffi.Int32,
+  ffi.Int32,
+);
+typedef _FindRoutine = int Function(ffi.Pointer<_ScRoutine>, int, int);
+typedef _AlarmLevelsNative = ffi.Void Function(
+  ffi.Int32,
+  ffi.Int32,
+  ffi.Pointer<ffi.Uint16>,
+  ffi.Pointer<ffi.Uint16>,
+);
+typedef _AlarmLevels = void Function(
+  int,
+  int,
+  ffi.Pointer<ffi.Uint16>,
+  ffi.Pointer<ffi.Uint16>,
+);
+
+/// Warm/white output of a sunrise alarm, Q8 on the lamp's 0-15 scale.
+class SunriseLevels {
+  final int warmQ8;
+  final int whiteQ8;
+
+  const SunriseLevels(this.warmQ8, this.whiteQ8);
+
+  double get warm => warmQ8 / _levelQ8Max;
+  double get white => whiteQ8 / _levelQ8Max;
+}
+
+/// A schedule window in minutes since midnight, as the firmware sees it.
+typedef ScheduleWindow = ({int start, int end, bool enabled});
+
+class ScheduleEngine {
+  ScheduleEngine._() {
+    _bind();
+  }
+
+  /// Dart ports only, whatever the platform; tests check them against the C
+  /// library's output.
+  @visibleForTesting
+  ScheduleEngine.portable();
+
+  static final ScheduleEngine instance = ScheduleEngine._();
+
+  _Int3? _inWindow;
+  _Int4? _rangesOverlap;
+  _Int2? _alarmStartMinute;
+  _FindRoutine? _findActiveRoutine;
+  _AlarmLevels? _alarmLevels;
+  List<SunriseLevels>? _dartCurve;
+
+  /// True when evaluation runs in the shared native library.
+  bool get isNative => _inWindow != null;
+
+  void _bind() {
+    if (!Platform.isLinux) {
+      return;
+    }
+    final ffi.DynamicLibrary lib;
+    try {
+      // The bundle installs the library next to the engine in <bundle>/lib
+      final bundleDir = File(Platform.resolvedExecutable).parent.path;
+      lib = ffi.DynamicLibrary.open('$bundleDir/lib/libschedule_core.so');
+    } catch (_) {
+      return; // not bundled (e.g. running tests); use the Dart ports
+    }
+
+    _inWindow = lib.lookupFunction<_Int3Native, _Int3>('sc_in_window');
+    _rangesOverlap = lib.lookupFunction<_Int4Native, _Int4>(
+      'sc_ranges_overlap',
+    );
+    _alarmStartMinute = lib.lookupFunction<_Int2Native, _Int2>(
+      'sc_alarm_start_minute',
+    );
+    _findActiveRoutine = lib.lookupFunction<_FindRoutineNative, _FindRoutine>(
+      'sc_find_active_routine',
+    );
+    _alarmLevels = lib.lookupFunction<_AlarmLevelsNative, _AlarmLevels>(
+      'sc_alarm_levels',
+    );
+  }
+
+  /// Whether [now] falls in the inclusive window [start, end]; an end before
+  /// the start wraps past midnight and start == end is that single minute.
+  /// Same rule the lamp uses for routines, alarms and suppression windows.
+  bool inWindow(int start, int end, int now) {
+    final native = _inWindow;
+    if (native != null) {
+      return native(start, end, now) != 0;
+    }
+    if (end == start) {
+      return now == start;
+    }
+    if (end > start) {
+      return now >= start && now <= end;
+    }
+    return now >= start || now <= end;
+  }
+
+  /// Half-open overlap of two ranges, accounting for midnight wraparound.
+  bool rangesOverlap(int start1, int end1, int start2, int end2) {
+    final native = _rangesOverlap;
+    if (native != null) {
+      return native(start1, end1, start2, end2) != 0;
+    }
+    final wraps1 = start1 > end1;
+    final wraps2 = start2 > end2;
+    if (!wraps1 && !wraps2) {
+      return start1 < end2 && start2 < end1;
+    } else if (wraps1 && wraps2) {
+      return true;
+    } else if (wraps1) {
+      return start2 < end1 || end2 > start1;
+    }
+    return start1 < end2 || end1 > start2;
+  }
+
+  /// Minute of day an alarm waking at [wakeMinute] starts its ramp.
+  int alarmStartMinute(int wakeMinute, int durationMinutes) {
+    final native = _alarmStartMinute;
+    if (native != null) {
+      return native(wakeMinute, durationMinutes);
+    }
+    return ((wakeMinute - durationMinutes) % _minutesPerDay + _minutesPerDay) %
+        _minutesPerDay;
+  }
+
+  /// Index of the first enabled window containing [now], or -1; the lamp
+  /// applies that routine.
+  int activeIndex(List<ScheduleWindow> windows, int now) {
+    final native = _findActiveRoutine;
+    if (native == null) {
+      for (var i = 0; i < windows.length; i++) {
+        final w = windows[i];
+        if (w.enabled && inWindow(w.start, w.end, now)) {
+          return i;
+        }
+      }
+      return -1;
+    }
+    if (windows.isEmpty) {
+      return -1;
+    }
+    final buffer = calloc<_ScRoutine>(windows.length);
+    try {
+      for (var i = 0; i < windows.length; i++) {
+        buffer[i]
+          ..id = i
+          ..enabled = windows[i].enabled ? 1 : 0
+          ..startMinute = windows[i].start
+          ..endMinute = windows[i].end;
+      }
+      return native(buffer, windows.length, now);
+    } finally {
+      calloc.free(buffer);
+    }
+  }
+
+  /// Sunrise output [elapsedSeconds] into a ramp of [durationMinutes].
+  SunriseLevels sunriseLevels(int durationMinutes, int elapsedSeconds) {
+    final native = _alarmLevels;
+    if (native != null) {
+      final out = malloc<ffi.Uint16>(2);
+      try {
+        native(durationMinutes, elapsedSeconds, out, out + 1);
+        return SunriseLevels(out[0], out[1]);
+      } finally {
+        malloc.free(out);
+      }
+    }
+    return _dartSunriseLevels(durationMinutes, elapsedSeconds);
+  }
+
+  /// Evenly spaced samples across a whole sunrise, for drawing the preview.
+  List<SunriseLevels> sunrisePreview(int durationMinutes, {int samples = 60}) {
+    final totalS = durationMinutes * 60;
+    return List.generate(
+      samples + 1,
+      (i) => sunriseLevels(durationMinutes, totalS * i ~/ samples),
+    );
+  }
+
+  // Dart port of sc_alarm_levels; the table is derived from the formula
+  // documented on SC_ALARM_CURVE, integer Q16, so it matches the C table
+  SunriseLevels _dartSunriseLevels(int durationMinutes, int elapsedSeconds) {
+    final curve = _dartCurve ??= List.generate(_curvePoints, (i) {
+      const one = 1 << 16;
+      const whiteDelay = 22938; // 0.35 in Q16
+      final p = i * one ~/ (_curvePoints - 1);
+      final warm = ((p * p) >> 16) * (3 * one - 2 * p) >> 16;
+      final w = p <= whiteDelay
+          ? 0
+          : (p - whiteDelay) * one ~/ (one - whiteDelay);
+      final white = w * _isqrt(w << 16) >> 16;
+      return SunriseLevels(_q16ToLevel(warm), _q16ToLevel(white));
+    });
+
+    final totalS = durationMinutes * 60;
+    if (totalS <= 0 || elapsedSeconds >= totalS) {
+      return curve.last;
+    }
+    final elapsed = math.max(0, elapsedSeconds);
+    final posQ8 = elapsed * (_curvePoints - 1) * 256 ~/ totalS;
+    final index = posQ8 >> 8;
+    final frac = posQ8 & 0xFF;
+    final a = curve[index];
+    final b = curve[index + 1];
+    return SunriseLevels(
+      a.warmQ8 + (((b.warmQ8 - a.warmQ8) * frac) >> 8),
+      a.whiteQ8 + (((b.whiteQ8 - a.whiteQ8) * frac) >> 8),
+    );
+  }
+
+  static int _isqrt(int value) {
+    var root = 0;
+    var bit = 1 << 62;
+    while (bit > value) {
+      bit >>= 2;
+    }
+    while (bit != 0) {
+      if (value >= root + bit) {
+        value -= root + bit;
+        root = (root >> 1) + bit;
+      } else {
+        root >>= 1;
+      }
+      bit >>= 2;
+    }
+    return root;
+  }
+
+  static int _q16ToLevel(int value) => (value * _levelQ8Max + 0x8000) >> 16;
+}
@@ -14,8 +14,14 @@ import 'screens/settings.dart';
 import 'services/database_service.dart';
 import 'services/esp_sync_service.dart';
 
-// Main function: entry point of the app
-void main() {
+// Main function: entry point of the app. The Linux runner passes
+// --lamp-proxy=host:port when its native lamp service holds the connection.
+void main(List<String> args) {
+  for (final arg in args) {
+    if (arg.startsWith('--lamp-proxy=')) {
+      EspConnection.instance.useProxy(arg.substring('--lamp-proxy='.length));
+    }
+  }
   runApp(const MainApp());
 }
 
@@ -1,5 +1,7 @@
 import 'package:flutter/material.dart';
 
+import '../core/schedule_engine.dart';
+
 // Model class representing an alarm for sunrise simulation
 
 // Data class for alarm configuration with wake time, duration, and enable state
@@ -23,13 +25,13 @@ class Alarm {
   }) : createdAt = createdAt ?? DateTime.now(),
        updatedAt = updatedAt ?? DateTime.now();
 
-  // Calculate start time (when lamp begins to brighten)
+  // Calculate start time (when lamp begins to brighten), as the lamp does
   TimeOfDay get startTime {
-    final startMinutes =
-        wakeUpTime.hour * 60 + wakeUpTime.minute - durationMinutes;
-    final hour = (startMinutes ~/ 60) % 24;
-    final minute = startMinutes % 60;
-    return TimeOfDay(hour: hour < 0 ? hour + 24 : hour, minute: minute);
+    final startMinutes = ScheduleEngine.instance.alarmStartMinute(
+      wakeUpTime.hour * 60 + wakeUpTime.minute,
+      durationMinutes,
+    );
+    return TimeOfDay(hour: startMinutes ~/ 60, minute: startMinutes % 60);
   }
 
   Alarm copyWith({
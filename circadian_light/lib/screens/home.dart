@@ -1,6 +1,7 @@
 import 'dart:async';
 
 import 'package:circadian_light/core/esp_connection.dart';
+import 'package:circadian_light/core/routine_core.dart';
 import 'package:circadian_light/models/lamp_state.dart';
 import 'package:circadian_light/models/routine.dart';
 import 'package:circadian_light/services/database_service.dart';
@@ -37,6 +38,7 @@ class _HomeScreenState extends State<HomeScreen> {
 
   // Debounce timers for sliders
   Timer? _brightTimer;
+  bool _streaming = false; // brightness drag is streamed to the lamp
   Timer? _tempTimer;
 
   // Stream subscription for ESP state updates
@@ -80,7 +82,10 @@ class _HomeScreenState extends State<HomeScreen> {
   /// Load saved lamp state from database on startup
   Future<void> _loadStateFromDatabase() async {
     try {
-      final Routine? routine = await db.getActiveRoutine();
+      final Routine? routine = RoutineCore.activeRoutine(
+        await db.getAllRoutines(),
+        DateTime.now(),
+      );
       if (!mounted) {
         return;
       }
@@ -133,7 +138,10 @@ class _HomeScreenState extends State<HomeScreen> {
     }
     _isCheckingRoutine = true;
     try {
-      final Routine? routine = await db.getActiveRoutine();
+      final Routine? routine = RoutineCore.activeRoutine(
+        await db.getAllRoutines(),
+        DateTime.now(),
+      );
       if (!mounted) {
         return;
       }
@@ -538,8 +546,25 @@ class _HomeScreenState extends State<HomeScreen> {
                   min: 0.0,
                   max: 1.0,
                   value: _brightness,
+                  onChangeStart: (_) {
+                    final esp = EspConnection.instance;
+                    _streaming =
+                        _isOn &&
+                        esp.isConnected &&
+                        esp.supports('stream_control');
+                    if (_streaming) {
+                      esp.beginBrightnessStream();
+                    }
+                  },
                   onChanged: (v) {
                     setState(() => _brightness = v);
+                    if (_streaming) {
+                      // 1.0-15.0 without rounding, so the lamp dims smoothly
+                      EspConnection.instance.streamBrightness(
+                        _brightness.clamp(0.0, 1.0) * 14 + 1,
+                      );
+                      return;
+                    }
                     _brightTimer?.cancel();
                     _brightTimer = Timer(const Duration(milliseconds: 60), () {
                       final b = _mapBrightnessTo15(_brightness);
@@ -548,6 +573,14 @@ class _HomeScreenState extends State<HomeScreen> {
                       // changes brightness
                     });
                   },
+                  onChangeEnd: (_) {
+                    if (_streaming) {
+                      // The lamp commits the last sample as its brightness
+                      EspConnection.instance.endBrightnessStream();
+                      _streaming = false;
+                      _saveStateToDatabase();
+                    }
+                  },
                 ),
               ),
             );
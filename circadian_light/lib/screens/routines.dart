@@ -10,6 +10,7 @@ import '../widgets/alarm_card.dart';
 import '../widgets/alarm_duration_selector.dart';
 import '../widgets/neumorphic_slider.dart';
 import '../widgets/routine_card.dart';
+import '../widgets/sunrise_preview.dart';
 import '../widgets/time_picker_sheet.dart';
 
 /// Screen for managing circadian lighting routines and wake-up alarms.
@@ -859,6 +860,8 @@ class _RoutinesScreenState extends State<RoutinesScreen> {
                       onChanged: (v) =>
                           setSheetState(() => durationMinutes = v),
                     ),
+                    const SizedBox(height: 16),
+                    SunrisePreview(durationMinutes: durationMinutes),
                     const SizedBox(height: 20),
                     FilledButton(
                       style: FilledButton.styleFrom(
@@ -1207,6 +1210,8 @@ class _RoutinesScreenState extends State<RoutinesScreen> {
                             'reaching full brightness at wake-up time.',
                             style: TextStyle(color: Colors.blue.shade700),
                           ),
+                          const SizedBox(height: 12),
+                          SunrisePreview(durationMinutes: durationMinutes),
                         ],
                       ),
                     ),
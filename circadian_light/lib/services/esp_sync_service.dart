@@ -1,3 +1,5 @@
+import 'dart:async';
+import 'dart:convert';
 import 'dart:developer' as dev;
 
 import '../core/esp_connection.dart';
@@ -19,6 +21,10 @@ class EspSyncService {
 
   static const String _logTag = 'EspSyncService';
 
+  /// Schedule identity the lamp reported for the last full_sync it
+  /// accepted, and the routines/alarms payload that was sent with it.
+  _SyncedSchedule? _synced;
+
   /// Synchronizes current time to ESP32 for accurate scheduling.
   ///
   /// Sends UTC timestamp to ESP32 and logs detailed time information
@@ -229,20 +235,57 @@ class EspSyncService {
       // Get all routines and alarms from database
       final routines = await db.getAllRoutines();
       final alarms = await db.getAllAlarms();
+      final routineData = routines.map((r) => _routineToEspFormat(r)).toList();
+      final alarmData = alarms.map((a) => _alarmToEspFormat(a)).toList();
+      final payload = jsonEncode([routineData, alarmData]);
+
+      // Skip the bulk upload when the lamp still holds what we last sent
+      final hello = await EspConnection.instance.awaitHello();
+      final schedule = hello?['schedule'];
+      if (schedule is Map<String, dynamic> &&
+          _synced?.matches(schedule, payload) == true) {
+        dev.log(
+          'Lamp schedule unchanged since last sync '
+          '(generation ${schedule['generation']}, '
+          'digest ${schedule['digest']}), skipping full sync',
+          name: _logTag,
+        );
+        return true;
+      }
 
       // Prepare data for bulk sync
       final allData = {
         'type': 'full_sync',
-        'routines': routines.map((r) => _routineToEspFormat(r)).toList(),
-        'alarms': alarms.map((a) => _alarmToEspFormat(a)).toList(),
+        'routines': routineData,
+        'alarms': alarmData,
         'preserve_state': true, // Tell ESP32 to preserve current state
       };
 
+      final response = EspConnection.instance.messages
+          .firstWhere((json) => json['type'] == 'full_sync_response')
+          .timeout(const Duration(seconds: 3));
       EspConnection.instance.send(allData);
       final syncAllStr =
           'Synced ${routines.length} routines and '
           '${alarms.length} alarms to ESP32 with time and state preservation';
       dev.log(syncAllStr, name: _logTag);
+
+      _synced = null;
+      try {
+        final result = await response;
+        if (result['success'] == true) {
+          _synced = _SyncedSchedule(
+            bootId: schedule is Map<String, dynamic>
+                ? schedule['boot_id'] as int?
+                : null,
+            generation: result['schedule_generation'] as int?,
+            digest: result['schedule_digest'] as String?,
+            payload: payload,
+          );
+        }
+      } on TimeoutException {
+        dev.log('No full_sync_response from ESP32', name: _logTag);
+      }
       return true;
     } catch (e) {
       dev.log('Failed to sync all data: $e', name: _logTag);
@@ -394,3 +437,36 @@ class EspSyncService {
     }
   }
 }
+
+/// What the lamp reported after accepting a full_sync.
+class _SyncedSchedule {
+  const _SyncedSchedule({
+    required this.bootId,
+    required this.generation,
+    required this.digest,
+    required this.payload,
+  });
+
+  final int? bootId;
+  final int? generation;
+  final String? digest;
+  final String payload;
+
+  /// True when a hello `schedule` object shows the lamp still holds this
+  /// sync and the app has nothing newer to send. The generation only
+  /// counts within one boot. The digest hashes what the lamp holds now;
+  /// the schedule is not persisted, so after a reboot it matches only if
+  /// the last sync was empty too, and anything else is sent again.
+  bool matches(Map<String, dynamic> schedule, String currentPayload) {
+    if (currentPayload != payload) {
+      return false;
+    }
+    final sameBoot = bootId != null && schedule['boot_id'] == bootId;
+    if (sameBoot &&
+        generation != null &&
+        schedule['generation'] == generation) {
+      return true;
+    }
+    return digest != null && schedule['digest'] == digest;
+  }
+}
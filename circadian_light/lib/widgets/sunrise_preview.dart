@@ -0,0 +1,81 @@
+import 'package:flutter/material.dart';
+
+import '../core/schedule_engine.dart';
+
+// Warm and white output across a sunrise ramp, sampled from the same curve
+// the lamp runs
+class SunrisePreview extends StatelessWidget {
+  final int durationMinutes;
+  final double height;
+
+  const SunrisePreview({
+    super.key,
+    required this.durationMinutes,
+    this.height = 72,
+  });
+
+  static const Color warmColor = Color(0xFFFFB04A);
+  static const Color whiteColor = Color(0xFF8FB8F0);
+
+  @override
+  Widget build(BuildContext context) {
+    return SizedBox(
+      height: height,
+      width: double.infinity,
+      child: CustomPaint(
+        painter: _SunrisePainter(
+          ScheduleEngine.instance.sunrisePreview(durationMinutes),
+        ),
+      ),
+    );
+  }
+}
+
+class _SunrisePainter extends CustomPainter {
+  final List<SunriseLevels> samples;
+
+  _SunrisePainter(this.samples);
+
+  @override
+  void paint(Canvas canvas, Size size) {
+    if (samples.length < 2) {
+      return;
+    }
+    _drawChannel(canvas, size, SunrisePreview.warmColor, (s) => s.warm);
+    _drawChannel(canvas, size, SunrisePreview.whiteColor, (s) => s.white);
+  }
+
+  void _drawChannel(
+    Canvas canvas,
+    Size size,
+    Color color,
+    double Function(SunriseLevels) level,
+  ) {
+    final path = Path();
+    for (var i = 0; i < samples.length; i++) {
+      final x = size.width * i / (samples.length - 1);
+      final y = size.height * (1 - level(samples[i]));
+      if (i == 0) {
+        path.moveTo(x, y);
+      } else {
+        path.lineTo(x, y);
+      }
+    }
+    final fill = Path.from(path)
+      ..lineTo(size.width, size.height)
+      ..lineTo(0, size.height)
+      ..close();
+    canvas.drawPath(fill, Paint()..color = color.withValues(alpha: 0.25));
+    canvas.drawPath(
+      path,
+      Paint()
+        ..color = color
+        ..style = PaintingStyle.stroke
+        ..strokeWidth = 2,
+    );
+  }
+
+  @override
+  bool shouldRepaint(_SunrisePainter oldDelegate) =>
+      oldDelegate.samples != samples;
+}
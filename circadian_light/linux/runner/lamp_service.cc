@@ -0,0 +1,96 @@
+#include "lamp_service.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace {
+
+const char LAMP_NAME[] = "lamp";
+const char SERVICE_TYPE[] = "_ws._tcp.local";
+const uint16_t LAMP_PORT = 80;
+const int DISCOVER_WINDOW_MS = 1500;
+const int DISCOVER_RETRY_MS = 10000;
+
+// $CIRCADIAN_LAMP, or an empty host to have discover() fill it in
+Endpoint configuredLamp() {
+  Endpoint endpoint = {"", LAMP_PORT};
+  const char* value = getenv("CIRCADIAN_LAMP");
+  if (value != nullptr && *value != '\0' && !parseEndpoint(value, LAMP_PORT, endpoint)) {
+    fprintf(stderr, "lamp: ignoring invalid CIRCADIAN_LAMP=%s\n", value);
+    endpoint.host.clear();
+  }
+  return endpoint;
+}
+
+}  // namespace
+
+LampService::LampService() : port_(0) {}
+
+LampService::~LampService() {
+  stop();
+}
+
+bool LampService::start() {
+  std::promise<uint16_t> started;
+  std::future<uint16_t> port = started.get_future();
+  thread_ = std::thread([this, &started]() { run(started); });
+  port_ = port.get();
+  if (port_ == 0) {
+    thread_.join();
+    return false;
+  }
+  return true;
+}
+
+void LampService::stop() {
+  if (thread_.joinable()) {
+    loop_.stop();
+    thread_.join();
+  }
+  port_ = 0;
+}
+
+void LampService::run(std::promise<uint16_t>& started) {
+  LampProxyOptions options;
+  options.listen = {"127.0.0.1", 0};
+  options.lamps.push_back({LAMP_NAME, configuredLamp()});
+  bool discovering = options.lamps.front().endpoint.host.empty();
+  proxy_.reset(new LampProxy(loop_, options));
+  if (!proxy_->start()) {
+    proxy_.reset();
+    started.set_value(0);
+    return;
+  }
+  if (discovering) {
+    browser_.reset(new MdnsBrowser(loop_));
+    discover();
+  }
+
+  // Reported from inside run(), so a stop() issued after start() returns is never lost
+  loop_.after(0, [this, &started]() { started.set_value(proxy_->port()); });
+  loop_.run();
+  browser_.reset();
+  proxy_.reset();
+}
+
+// The firmware advertises a chip id in TXT; prefer those over other _ws._tcp services
+void LampService::discover() {
+  bool browsing = browser_->browse(SERVICE_TYPE, DISCOVER_WINDOW_MS, [this](const std::vector<MdnsService>& found) {
+    const MdnsService* lamp = nullptr;
+    for (const MdnsService& service : found) {
+      if (lamp == nullptr || (service.txt.count("id") != 0 && lamp->txt.count("id") == 0)) {
+        lamp = &service;
+      }
+    }
+    if (lamp == nullptr) {
+      loop_.after(DISCOVER_RETRY_MS, [this]() { discover(); });
+      return;
+    }
+    Endpoint endpoint = {lamp->address.empty() ? lamp->host : lamp->address, lamp->port};
+    fprintf(stderr, "lamp: found %s at %s:%u\n", lamp->instance.c_str(), endpoint.host.c_str(), endpoint.port);
+    proxy_->setLampEndpoint(LAMP_NAME, endpoint);
+  });
+  if (!browsing) {
+    loop_.after(DISCOVER_RETRY_MS, [this]() { discover(); });
+  }
+}
@@ -0,0 +1,44 @@
+#ifndef RUNNER_LAMP_SERVICE_H_
+#define RUNNER_LAMP_SERVICE_H_
+
+#include <stdint.h>
+
+#include <future>
+#include <memory>
+#include <thread>
+
+#include "lamp_proxy.h"
+#include "mdns.h"
+
+// Native side of the lamp connection, so it outlives the Flutter engine in background
+// mode. A LampProxy (see linux/tools) runs on its own thread and listens on an ephemeral
+// loopback port; the Dart app connects there instead of to the lamp. The proxy's cached
+// hello and state seed a freshly created view without a round trip to the lamp.
+//
+// The lamp is taken from $CIRCADIAN_LAMP (host[:port]) or found over mDNS.
+class LampService {
+ public:
+  LampService();
+  ~LampService();
+  LampService(const LampService&) = delete;
+  LampService& operator=(const LampService&) = delete;
+
+  // Starts the proxy thread; false if the proxy cannot listen
+  bool start();
+  void stop();
+
+  // Loopback port for ws://127.0.0.1:<port>/ws, 0 until started
+  uint16_t port() const { return port_; }
+
+ private:
+  void run(std::promise<uint16_t>& started);
+  void discover();
+
+  EventLoop loop_;
+  std::unique_ptr<LampProxy> proxy_;          // both only touched on the proxy thread
+  std::unique_ptr<MdnsBrowser> browser_;
+  std::thread thread_;
+  uint16_t port_;
+};
+
+#endif  // RUNNER_LAMP_SERVICE_H_
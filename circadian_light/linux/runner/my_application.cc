@@ -5,20 +5,79 @@
 #include <gdk/gdkx.h>
 #endif
 
+#include <malloc.h>
+
 #include "flutter/generated_plugin_registrant.h"
+#include "lamp_service.h"
+
+// Background mode: closing the window destroys it together with the FlView and its
+// engine, leaving a tray icon and the native lamp connection (LampService). The tray
+// icon brings the window back with a fresh engine, which the lamp service seeds with the
+// cached hello/state as soon as the app connects. Without a system tray, closing the
+// window quits as usual.
 
 struct _MyApplication {
   GtkApplication parent_instance;
   char** dart_entrypoint_arguments;
+  GtkWindow* window;            // nullptr while running in the background
+  GtkStatusIcon* tray_icon;
+  GtkWidget* tray_menu;
+  LampService* lamp_service;
 };
 
 G_DEFINE_TYPE(MyApplication, my_application, GTK_TYPE_APPLICATION)
 
-// Implements GApplication::activate.
-static void my_application_activate(GApplication* application) {
-  MyApplication* self = MY_APPLICATION(application);
+static void my_application_show_window(MyApplication* self);
+
+// Hands the heap the engine just released back to the system, so the background RSS is
+// the GTK main loop and the lamp service rather than the engine's high-water mark.
+static gboolean trim_heap(gpointer user_data) {
+  malloc_trim(0);
+  return G_SOURCE_REMOVE;
+}
+
+// Window "delete-event": go to the background instead of quitting when the tray icon
+// is visible.
+static gboolean window_delete_cb(GtkWidget* widget, GdkEvent* event, gpointer user_data) {
+  MyApplication* self = MY_APPLICATION(user_data);
+  G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+  gboolean in_tray = self->tray_icon != nullptr && gtk_status_icon_is_embedded(self->tray_icon);
+  G_GNUC_END_IGNORE_DEPRECATIONS
+  if (!in_tray) {
+    g_application_quit(G_APPLICATION(self));
+    return FALSE;
+  }
+  gtk_widget_destroy(widget);   // takes the FlView and its engine with it
+  g_idle_add(trim_heap, nullptr);
+  return TRUE;
+}
+
+// Tray icon "activate": restore the window, or raise it if it is already up.
+static void tray_activate_cb(GtkStatusIcon* icon, gpointer user_data) {
+  my_application_show_window(MY_APPLICATION(user_data));
+}
+
+static void tray_quit_cb(GtkMenuItem* item, gpointer user_data) {
+  g_application_quit(G_APPLICATION(user_data));
+}
+
+// Tray icon "popup-menu".
+static void tray_popup_menu_cb(GtkStatusIcon* icon, guint button, guint activate_time, gpointer user_data) {
+  MyApplication* self = MY_APPLICATION(user_data);
+  gtk_menu_popup_at_pointer(GTK_MENU(self->tray_menu), nullptr);
+}
+
+// Creates the window with a new FlView (and engine), or presents the existing one.
+static void my_application_show_window(MyApplication* self) {
+  if (self->window != nullptr) {
+    gtk_window_present(self->window);
+    return;
+  }
   GtkWindow* window =
-      GTK_WINDOW(gtk_application_window_new(GTK_APPLICATION(application)));
+      GTK_WINDOW(gtk_application_window_new(GTK_APPLICATION(self)));
+  self->window = window;
+  g_object_add_weak_pointer(G_OBJECT(window), reinterpret_cast<gpointer*>(&self->window));
+  g_signal_connect(window, "delete-event", G_CALLBACK(window_delete_cb), self);
 
   // Use a header bar when running in GNOME as this is the common style used
   // by applications and is the setup most users will be using (e.g. Ubuntu
@@ -50,8 +109,18 @@ static void my_application_activate(GApplication* application) {
   gtk_window_set_default_size(window, 1280, 720);
   gtk_widget_show(GTK_WIDGET(window));
 
+  // The app reaches the lamp through the lamp service when it is running
+  g_autoptr(GPtrArray) arguments = g_ptr_array_new_with_free_func(g_free);
+  for (char** argument = self->dart_entrypoint_arguments; argument != nullptr && *argument != nullptr; argument++) {
+    g_ptr_array_add(arguments, g_strdup(*argument));
+  }
+  if (self->lamp_service != nullptr) {
+    g_ptr_array_add(arguments, g_strdup_printf("--lamp-proxy=127.0.0.1:%u", self->lamp_service->port()));
+  }
+  g_ptr_array_add(arguments, nullptr);
+
   g_autoptr(FlDartProject) project = fl_dart_project_new();
-  fl_dart_project_set_dart_entrypoint_arguments(project, self->dart_entrypoint_arguments);
+  fl_dart_project_set_dart_entrypoint_arguments(project, reinterpret_cast<char**>(arguments->pdata));
 
   FlView* view = fl_view_new(project);
   gtk_widget_show(GTK_WIDGET(view));
@@ -62,6 +131,11 @@ static void my_application_activate(GApplication* application) {
   gtk_widget_grab_focus(GTK_WIDGET(view));
 }
 
+// Implements GApplication::activate.
+static void my_application_activate(GApplication* application) {
+  my_application_show_window(MY_APPLICATION(application));
+}
+
 // Implements GApplication::local_command_line.
 static gboolean my_application_local_command_line(GApplication* application, gchar*** arguments, int* exit_status) {
   MyApplication* self = MY_APPLICATION(application);
@@ -83,18 +157,54 @@ static gboolean my_application_local_command_line(GApplication* application, gch
 
 // Implements GApplication::startup.
 static void my_application_startup(GApplication* application) {
-  //MyApplication* self = MY_APPLICATION(object);
-
-  // Perform any actions required at application startup.
+  MyApplication* self = MY_APPLICATION(application);
 
   G_APPLICATION_CLASS(my_application_parent_class)->startup(application);
+
+  self->lamp_service = new LampService();
+  if (!self->lamp_service->start()) {
+    g_warning("Lamp service unavailable; the app will connect to the lamp directly");
+    delete self->lamp_service;
+    self->lamp_service = nullptr;
+  }
+
+  // GtkStatusIcon is deprecated but needs nothing beyond GTK; where no tray hosts it,
+  // it never gets embedded and closing the window quits as before.
+  G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+  self->tray_icon = gtk_status_icon_new_from_icon_name("weather-clear-night");
+  gtk_status_icon_set_tooltip_text(self->tray_icon, "circadian_light");
+  G_GNUC_END_IGNORE_DEPRECATIONS
+  g_signal_connect(self->tray_icon, "activate", G_CALLBACK(tray_activate_cb), self);
+  g_signal_connect(self->tray_icon, "popup-menu", G_CALLBACK(tray_popup_menu_cb), self);
+
+  self->tray_menu = gtk_menu_new();
+  g_object_ref_sink(self->tray_menu);
+  GtkWidget* open_item = gtk_menu_item_new_with_label("Open");
+  GtkWidget* quit_item = gtk_menu_item_new_with_label("Quit");
+  g_signal_connect_swapped(open_item, "activate", G_CALLBACK(my_application_show_window), self);
+  g_signal_connect(quit_item, "activate", G_CALLBACK(tray_quit_cb), self);
+  gtk_menu_shell_append(GTK_MENU_SHELL(self->tray_menu), open_item);
+  gtk_menu_shell_append(GTK_MENU_SHELL(self->tray_menu), quit_item);
+  gtk_widget_show_all(self->tray_menu);
+
+  // Keep running with no window open; every way out goes through g_application_quit()
+  g_application_hold(application);
 }
 
 // Implements GApplication::shutdown.
 static void my_application_shutdown(GApplication* application) {
-  //MyApplication* self = MY_APPLICATION(object);
+  MyApplication* self = MY_APPLICATION(application);
 
-  // Perform any actions required at application shutdown.
+  g_clear_object(&self->tray_icon);
+  if (self->tray_menu != nullptr) {
+    gtk_widget_destroy(self->tray_menu);
+    g_clear_object(&self->tray_menu);
+  }
+  if (self->lamp_service != nullptr) {
+    self->lamp_service->stop();
+    delete self->lamp_service;
+    self->lamp_service = nullptr;
+  }
 
   G_APPLICATION_CLASS(my_application_parent_class)->shutdown(application);
 }
@@ -0,0 +1,468 @@
+// Fleet orchestrator: finds lamps over mDNS and pushes a firmware image (POST /update) or
+// a configuration snapshot (POST /snapshot, see GET /snapshot) to all of them at once.
+//
+//   lamp_fleet [--discover] [--discover-ms N] [--lamp name=host[:port]] ...
+//              [--parallel N] [--retries N] [--timeout-ms N] [--token T] [--tokens FILE]
+//              (--list | --ota firmware.bin | --snapshot config.bin)
+//
+// Lamps come from mDNS (_ws._tcp) unless --lamp is given; --discover adds the discovered
+// ones to an explicit list. Each lamp is one job: at most --parallel upload at a time,
+// transport errors, timeouts and 5xx/409 replies are retried with backoff, and an image
+// the lamp rejects (4xx) is not. Progress goes to stderr, the result table to stdout, and
+// the exit status is 1 if any lamp failed.
+//
+// Each lamp only accepts an image carrying its own OTA token (generated on first boot and
+// printed on its serial console). --tokens reads "<name or chip id> <token>" lines, '#'
+// starting a comment; --token is used for lamps the file does not list. A lamp without a
+// token fails without being contacted.
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "mdns.h"
+#include "net.h"
+#include "protocol_keys.h"
+
+namespace key = lamp_protocol::key;
+
+namespace {
+
+const char SERVICE_TYPE[] = "_ws._tcp.local";
+const uint16_t LAMP_PORT = 80;
+const int DEFAULT_DISCOVER_MS = 2000;
+const int DEFAULT_PARALLEL = 4;
+const int DEFAULT_RETRIES = 3;
+const int OTA_TIMEOUT_MS = 180000;            // ~1.5 MB written to flash over Wi-Fi
+const int SNAPSHOT_TIMEOUT_MS = 10000;
+const int BACKOFF_MS = 1000;                  // doubled per retry
+const int MAX_BACKOFF_MS = 8000;
+const int PROGRESS_STEP_PERCENT = 10;
+
+// Sanity checks before anything is sent; the lamp validates the payload fully
+const size_t OTA_SLOT_SIZE = 0x1E0000;        // app0/app1 in esp_code/partitions.csv
+const uint8_t ESP_IMAGE_MAGIC = 0xE9;
+const char SNAPSHOT_MAGIC[] = "LCFG";         // SNAPSHOT_MAGIC in esp_code/src/main.cpp
+
+EventLoop* activeLoop = nullptr;
+
+enum class Action { List, Ota, Snapshot };
+
+struct Options {
+  Action action = Action::List;
+  std::string payloadPath;
+  bool discover = false;
+  int discoverMs = DEFAULT_DISCOVER_MS;
+  int parallel = DEFAULT_PARALLEL;
+  int retries = DEFAULT_RETRIES;
+  int timeoutMs = 0;                          // 0: per-action default
+  std::string token;                          // OTA token for lamps not in `tokens`
+  std::map<std::string, std::string> tokens;  // lamp name or chip id -> OTA token
+};
+
+struct LampTarget {
+  std::string name;
+  Endpoint endpoint;
+  std::string chipId;                         // TXT "id", "" for --lamp entries
+  std::string firmware;                       // TXT "fw"
+  std::string token;                          // sent as X-Lamp-Token on /update
+};
+
+enum class JobState { Queued, Running, Waiting, Done, Failed };
+
+struct Job {
+  LampTarget lamp;
+  JobState state = JobState::Queued;
+  int attempts = 0;
+  int lastPercent = -1;
+  int64_t startedMs = 0;
+  int64_t finishedMs = 0;
+  std::string message;
+  HttpClient::Ptr request;
+  uint64_t timeoutTimer = 0;
+};
+
+class Fleet {
+ public:
+  Fleet(EventLoop& loop, const Options& options, const std::string& payload)
+      : loop_(loop), options_(options), payload_(payload), running_(0) {}
+
+  void run(const std::vector<LampTarget>& lamps) {
+    for (const LampTarget& lamp : lamps) {
+      jobs_.emplace_back(new Job());
+      jobs_.back()->lamp = lamp;
+      if (options_.action == Action::Ota && lamp.token.empty()) {
+        jobs_.back()->state = JobState::Failed;
+        jobs_.back()->message = "no OTA token";
+        fprintf(stderr, "%-20s FAILED: no OTA token\n", lamp.name.c_str());
+      }
+    }
+    startQueued();
+  }
+
+  bool allFinished() const {
+    for (const auto& job : jobs_) {
+      if (job->state != JobState::Done && job->state != JobState::Failed) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  int printSummary() const {
+    int failed = 0;
+    printf("%-20s %-24s %-8s %-8s %s\n", "LAMP", "ADDRESS", "RESULT", "ATTEMPTS", "MESSAGE");
+    for (const auto& job : jobs_) {
+      std::string address = job->lamp.endpoint.host + ":" + std::to_string(job->lamp.endpoint.port);
+      bool ok = job->state == JobState::Done;
+      failed += ok ? 0 : 1;
+      printf("%-20s %-24s %-8s %-8d %s\n", job->lamp.name.c_str(), address.c_str(), ok ? "ok" : "FAILED",
+             job->attempts, job->message.c_str());
+    }
+    fprintf(stderr, "fleet: %zu ok, %d failed\n", jobs_.size() - failed, failed);
+    return failed;
+  }
+
+ private:
+  const char* path() const { return options_.action == Action::Ota ? "/update" : "/snapshot"; }
+
+  int timeoutMs() const {
+    if (options_.timeoutMs > 0) {
+      return options_.timeoutMs;
+    }
+    return options_.action == Action::Ota ? OTA_TIMEOUT_MS : SNAPSHOT_TIMEOUT_MS;
+  }
+
+  // Fills free slots in list order; called whenever a job leaves the Running state
+  void startQueued() {
+    for (auto& job : jobs_) {
+      if (running_ >= options_.parallel) {
+        break;
+      }
+      if (job->state == JobState::Queued) {
+        startAttempt(*job);
+      }
+    }
+    if (allFinished()) {
+      loop_.stop();
+    }
+  }
+
+  void startAttempt(Job& job) {
+    job.state = JobState::Running;
+    job.attempts++;
+    job.lastPercent = -1;
+    job.message.clear();
+    if (job.attempts == 1) {
+      job.startedMs = EventLoop::nowMs();
+    }
+    running_++;
+
+    HttpRequest request;
+    request.method = "POST";
+    request.path = path();
+    request.body = payload_;
+    if (options_.action == Action::Ota) {
+      request.headers[key::LAMP_TOKEN] = job.lamp.token;
+    }
+    job.request = HttpClient::start(loop_, job.lamp.endpoint, request, "application/octet-stream");
+    if (!job.request) {
+      loop_.after(0, [this, &job]() { finishAttempt(job, 0, "cannot connect"); });
+      return;
+    }
+    Job* target = &job;
+    job.request->onProgress = [this, target](size_t sent, size_t total) { reportProgress(*target, sent, total); };
+    job.request->onDone = [this, target](int status, const std::string& body) {
+      finishAttempt(*target, status, body);
+    };
+    job.timeoutTimer = loop_.after(timeoutMs(), [target]() {
+      target->timeoutTimer = 0;
+      if (target->request) {
+        target->message = "timed out";
+        target->request->abort();
+      }
+    });
+  }
+
+  void reportProgress(Job& job, size_t sent, size_t total) {
+    int percent = total == 0 ? 100 : (int)(sent * 100 / total);
+    int step = percent / PROGRESS_STEP_PERCENT * PROGRESS_STEP_PERCENT;
+    if (step == job.lastPercent) {
+      return;
+    }
+    job.lastPercent = step;
+    fprintf(stderr, "%-20s %3d%%  %zu/%zu KiB%s\n", job.lamp.name.c_str(), step, sent / 1024, total / 1024,
+            sent == total ? "  (waiting for the lamp)" : "");
+  }
+
+  void finishAttempt(Job& job, int status, const std::string& body) {
+    if (job.timeoutTimer != 0) {
+      loop_.cancel(job.timeoutTimer);
+      job.timeoutTimer = 0;
+    }
+    job.request.reset();
+    running_--;
+
+    std::string lampMessage = messageOf(body);
+    bool success = status == 200 && body.find(std::string("\"") + key::SUCCESS + "\":true") != std::string::npos;
+    bool retryable = status == 0 || status == 409 || status >= 500;
+    if (status == 0 && job.message != "timed out") {
+      job.message = body.empty() ? "connection failed" : body;
+    } else if (status != 0) {
+      job.message = lampMessage.empty() ? "HTTP " + std::to_string(status) : lampMessage;
+    }
+
+    if (success) {
+      job.state = JobState::Done;
+      job.finishedMs = EventLoop::nowMs();
+      fprintf(stderr, "%-20s done in %.1f s: %s\n", job.lamp.name.c_str(), (job.finishedMs - job.startedMs) / 1000.0,
+              job.message.c_str());
+    } else if (retryable && job.attempts <= options_.retries) {
+      int delay = std::min(BACKOFF_MS << (job.attempts - 1), MAX_BACKOFF_MS);
+      fprintf(stderr, "%-20s attempt %d failed (%s), retrying in %d ms\n", job.lamp.name.c_str(), job.attempts,
+              job.message.c_str(), delay);
+      job.state = JobState::Waiting;
+      Job* target = &job;
+      loop_.after(delay, [this, target]() {
+        target->state = JobState::Queued;
+        startQueued();
+      });
+    } else {
+      job.state = JobState::Failed;
+      job.finishedMs = EventLoop::nowMs();
+      fprintf(stderr, "%-20s FAILED after %d attempt(s): %s\n", job.lamp.name.c_str(), job.attempts,
+              job.message.c_str());
+    }
+    startQueued();
+  }
+
+  // "message" from the lamp's {"success":..,"message":".."} reply
+  static std::string messageOf(const std::string& body) {
+    std::string field = std::string("\"") + key::MESSAGE + "\":\"";
+    size_t start = body.find(field);
+    if (start == std::string::npos) {
+      return "";
+    }
+    start += field.size();
+    size_t end = body.find('"', start);
+    return end == std::string::npos ? "" : body.substr(start, end - start);
+  }
+
+  EventLoop& loop_;
+  const Options& options_;
+  const std::string& payload_;
+  std::vector<std::unique_ptr<Job>> jobs_;    // stable addresses for timer captures
+  int running_;
+};
+
+bool readFile(const std::string& path, std::string& out) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  std::ostringstream buffer;
+  buffer << file.rdbuf();
+  out = buffer.str();
+  return true;
+}
+
+bool readTokens(const std::string& path, std::map<std::string, std::string>& out) {
+  std::ifstream file(path);
+  if (!file) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream fields(line.substr(0, line.find('#')));
+    std::string lamp;
+    std::string token;
+    if (fields >> lamp >> token) {
+      out[lamp] = token;
+    }
+  }
+  return true;
+}
+
+// The chip id is stable across renames, so it wins over the name
+std::string tokenFor(const Options& options, const LampTarget& lamp) {
+  auto byId = lamp.chipId.empty() ? options.tokens.end() : options.tokens.find(lamp.chipId);
+  if (byId != options.tokens.end()) {
+    return byId->second;
+  }
+  auto byName = options.tokens.find(lamp.name);
+  return byName != options.tokens.end() ? byName->second : options.token;
+}
+
+bool checkPayload(const Options& options, const std::string& payload) {
+  if (options.action == Action::Ota) {
+    if (payload.empty() || (uint8_t)payload[0] != ESP_IMAGE_MAGIC) {
+      fprintf(stderr, "%s is not an ESP32 application image\n", options.payloadPath.c_str());
+      return false;
+    }
+    if (payload.size() > OTA_SLOT_SIZE) {
+      fprintf(stderr, "%s is larger than the OTA slot (%zu > %zu bytes)\n", options.payloadPath.c_str(),
+              payload.size(), OTA_SLOT_SIZE);
+      return false;
+    }
+  } else if (options.action == Action::Snapshot && payload.compare(0, 4, SNAPSHOT_MAGIC) != 0) {
+    fprintf(stderr, "%s is not a configuration snapshot (GET /snapshot)\n", options.payloadPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Lamps share the hostname, so the chip id (else the address) identifies duplicates
+void addDiscovered(const std::vector<MdnsService>& services, std::vector<LampTarget>& lamps) {
+  std::set<std::string> seen;
+  for (const LampTarget& lamp : lamps) {
+    seen.insert(lamp.endpoint.host + ":" + std::to_string(lamp.endpoint.port));
+  }
+  for (const MdnsService& service : services) {
+    LampTarget lamp;
+    lamp.name = service.instance.substr(0, service.instance.find('.'));
+    lamp.endpoint.host = service.address.empty() ? service.host : service.address;
+    lamp.endpoint.port = service.port;
+    auto id = service.txt.find("id");
+    auto fw = service.txt.find("fw");
+    lamp.chipId = id == service.txt.end() ? "" : id->second;
+    lamp.firmware = fw == service.txt.end() ? "" : fw->second;
+    std::string address = lamp.endpoint.host + ":" + std::to_string(lamp.endpoint.port);
+    if ((!lamp.chipId.empty() && !seen.insert(lamp.chipId).second) || !seen.insert(address).second) {
+      continue;
+    }
+    lamps.push_back(lamp);
+  }
+}
+
+void onSignal(int) {
+  if (activeLoop != nullptr) {
+    activeLoop->stop();
+  }
+}
+
+int usage(const char* argv0) {
+  fprintf(stderr,
+          "usage: %s [--discover] [--discover-ms N] [--lamp name=host[:port]] ...\n"
+          "          [--parallel N] [--retries N] [--timeout-ms N] [--token T] [--tokens FILE]\n"
+          "          (--list | --ota firmware.bin | --snapshot config.bin)\n",
+          argv0);
+  return 2;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  std::vector<LampTarget> lamps;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--list") == 0) {
+      options.action = Action::List;
+    } else if (strcmp(argv[i], "--ota") == 0 && i + 1 < argc) {
+      options.action = Action::Ota;
+      options.payloadPath = argv[++i];
+    } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+      options.action = Action::Snapshot;
+      options.payloadPath = argv[++i];
+    } else if (strcmp(argv[i], "--discover") == 0) {
+      options.discover = true;
+    } else if (strcmp(argv[i], "--discover-ms") == 0 && i + 1 < argc) {
+      options.discoverMs = atoi(argv[++i]);
+      options.discover = true;
+    } else if (strcmp(argv[i], "--parallel") == 0 && i + 1 < argc) {
+      options.parallel = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--retries") == 0 && i + 1 < argc) {
+      options.retries = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--timeout-ms") == 0 && i + 1 < argc) {
+      options.timeoutMs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--token") == 0 && i + 1 < argc) {
+      options.token = argv[++i];
+    } else if (strcmp(argv[i], "--tokens") == 0 && i + 1 < argc) {
+      const char* path = argv[++i];
+      if (!readTokens(path, options.tokens)) {
+        fprintf(stderr, "cannot read %s\n", path);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--lamp") == 0 && i + 1 < argc) {
+      const char* spec = argv[++i];
+      const char* eq = strchr(spec, '=');
+      LampTarget lamp;
+      if (eq == nullptr || eq == spec || !parseEndpoint(eq + 1, LAMP_PORT, lamp.endpoint)) {
+        return usage(argv[0]);
+      }
+      lamp.name.assign(spec, eq - spec);
+      lamps.push_back(lamp);
+    } else {
+      return usage(argv[0]);
+    }
+  }
+  if (options.parallel < 1 || options.retries < 0 || options.discoverMs <= 0) {
+    return usage(argv[0]);
+  }
+  if (lamps.empty()) {
+    options.discover = true;
+  }
+
+  std::string payload;
+  if (options.action != Action::List) {
+    if (!readFile(options.payloadPath, payload)) {
+      fprintf(stderr, "cannot read %s\n", options.payloadPath.c_str());
+      return 1;
+    }
+    if (!checkPayload(options, payload)) {
+      return 1;
+    }
+  }
+
+  EventLoop loop;
+  activeLoop = &loop;
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  if (options.discover) {
+    MdnsBrowser browser(loop);
+    auto onFound = [&loop, &lamps](const std::vector<MdnsService>& found) {
+      addDiscovered(found, lamps);
+      loop.stop();
+    };
+    bool browsing = browser.browse(SERVICE_TYPE, options.discoverMs, onFound);
+    if (!browsing) {
+      fprintf(stderr, "mDNS discovery unavailable\n");
+      return 1;
+    }
+    loop.run();
+    fprintf(stderr, "fleet: %zu lamp(s)\n", lamps.size());
+  }
+
+  if (options.action == Action::List) {
+    printf("%-20s %-24s %-14s %s\n", "LAMP", "ADDRESS", "CHIP ID", "FIRMWARE");
+    for (const LampTarget& lamp : lamps) {
+      std::string address = lamp.endpoint.host + ":" + std::to_string(lamp.endpoint.port);
+      printf("%-20s %-24s %-14s %s\n", lamp.name.c_str(), address.c_str(), lamp.chipId.c_str(), lamp.firmware.c_str());
+    }
+    return 0;
+  }
+  if (lamps.empty()) {
+    fprintf(stderr, "no lamps to update\n");
+    return 1;
+  }
+
+  for (LampTarget& lamp : lamps) {
+    lamp.token = tokenFor(options, lamp);
+  }
+  Fleet fleet(loop, options, payload);
+  fleet.run(lamps);
+  if (!fleet.allFinished()) {
+    loop.run();
+  }
+  return fleet.printSummary() == 0 ? 0 : 1;
+}
@@ -0,0 +1,450 @@
+#include "lamp_proxy.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "protocol_keys.h"
+
+namespace key = lamp_protocol::key;
+namespace msg = lamp_protocol::msg;
+
+namespace {
+
+const int BACKOFF_MIN_MS = 500;
+const int BACKOFF_MAX_MS = 30000;
+const int64_t UPSTREAM_IDLE_MS = 60000;   // the lamp pings quiet clients every 20 s
+const int64_t REFRESH_DELAY_MS = 60;      // lets the lamp's 20 ms control tick apply the change
+const uint16_t CLOSE_TRY_AGAIN_LATER = 1013;
+
+// Request types answered to the requesting connection only, and the reply they produce
+const struct {
+  const char* request;
+  const char* reply;
+} REPLY_ROUTES[] = {
+  {msg::METRICS_REQUEST, msg::METRICS},
+  {msg::TASK_STATS_REQUEST, msg::TASK_STATS},
+  {msg::HEAP_STATS_REQUEST, msg::HEAP_STATS},
+  {msg::ENERGY_REQUEST, msg::ENERGY_REPORT},
+  {msg::TUNABLES_REQUEST, msg::TUNABLES},
+};
+
+// Value of the first "type" key; the protocol never nests one before the top-level type
+std::string messageType(const std::string& text) {
+  std::string needle = std::string("\"") + key::TYPE + "\"";
+  size_t pos = text.find(needle);
+  if (pos == std::string::npos) {
+    return "";
+  }
+  pos = text.find(':', pos + needle.size());
+  if (pos == std::string::npos) {
+    return "";
+  }
+  pos = text.find('"', pos);
+  size_t end = pos == std::string::npos ? pos : text.find('"', pos + 1);
+  if (end == std::string::npos) {
+    return "";
+  }
+  return text.substr(pos + 1, end - pos - 1);
+}
+
+bool startsWithKey(const std::string& text, const char* name) {
+  std::string prefix = std::string("{\"") + name + "\":";
+  return text.compare(0, prefix.size(), prefix) == 0;
+}
+
+bool isStateRequest(const std::string& text) {
+  std::string compact;
+  for (char c : text) {
+    if (c != ' ' && c != '\t' && c != '\r' && c != '\n') {
+      compact.push_back(c);
+    }
+  }
+  return compact == std::string("{\"") + key::REQUEST_STATE + "\":true}";
+}
+
+std::string encodeControl(const lamp_protocol::ControlFrame& frame) {
+  std::string out = "{";
+  auto field = [&out](const char* name, const std::string& value) {
+    if (out.size() > 1) {
+      out += ",";
+    }
+    out += std::string("\"") + name + "\":" + value;
+  };
+  if (frame.hasBrightness) field(key::BRIGHTNESS, std::to_string(frame.brightness));
+  if (frame.hasMode) field(key::MODE, std::to_string(frame.mode));
+  if (frame.hasOn) field(key::ON, frame.on ? "true" : "false");
+  return out + "}";
+}
+
+}  // namespace
+
+LampProxy::LampProxy(EventLoop& loop, LampProxyOptions options)
+    : loop_(loop),
+      options_(std::move(options)),
+      listener_(loop, [this](WsConnection::Ptr conn) {
+        conn->onHttp = [this](const HttpRequest& request) { return handleHttp(request); };
+        WsConnection* raw = conn.get();
+        conn->onOpen = [this, raw](const std::string& path) {
+          Lamp* lamp = lampForPath(path);
+          if (lamp == nullptr) {
+            fprintf(stderr, "proxy: %s asked for unknown lamp path %s\n", raw->peer().c_str(), path.c_str());
+            raw->close();
+            return;
+          }
+          attachSubscriber(*lamp, raw->shared_from_this());
+        };
+      }),
+      nextSubscriberId_(1) {
+  for (const LampProxyOptions::Lamp& config : options_.lamps) {
+    Lamp* lamp = new Lamp();
+    lamp->name = config.name;
+    lamp->endpoint = config.endpoint;
+    lamps_.push_back(lamp);
+  }
+}
+
+LampProxy::~LampProxy() {
+  for (Lamp* lamp : lamps_) {
+    loop_.cancel(lamp->reconnectTimer);
+    loop_.cancel(lamp->watchdogTimer);
+    loop_.cancel(lamp->flushTimer);
+    loop_.cancel(lamp->refreshTimer);
+    for (auto& entry : lamp->subscribers) {
+      entry.second->onClose = nullptr;
+      entry.second->close();
+    }
+    if (lamp->upstream) {
+      lamp->upstream->onClose = nullptr;
+      lamp->upstream->close();
+    }
+    delete lamp;
+  }
+}
+
+bool LampProxy::start() {
+  if (!listener_.listen(options_.listen)) {
+    fprintf(stderr, "proxy: cannot listen on %s:%u\n", options_.listen.host.c_str(), options_.listen.port);
+    return false;
+  }
+  for (Lamp* lamp : lamps_) {
+    connectUpstream(*lamp);
+  }
+  return true;
+}
+
+std::string LampProxy::cachedState(const std::string& name) const {
+  for (const Lamp* lamp : lamps_) {
+    if (lamp->name == name) {
+      return lamp->state.empty() ? lamp->hello : lamp->state;
+    }
+  }
+  return "";
+}
+
+void LampProxy::setLampEndpoint(const std::string& name, const Endpoint& endpoint) {
+  for (Lamp* lamp : lamps_) {
+    if (lamp->name != name) {
+      continue;
+    }
+    lamp->endpoint = endpoint;
+    lamp->backoffMs = 0;
+    if (lamp->upstream) {
+      lamp->upstream->close();         // onClose schedules the reconnect
+    } else {
+      loop_.cancel(lamp->reconnectTimer);
+      connectUpstream(*lamp);
+    }
+    return;
+  }
+}
+
+// ===== Upstream (one connection per lamp) =====
+
+void LampProxy::connectUpstream(Lamp& lamp) {
+  lamp.reconnectTimer = 0;
+  if (lamp.endpoint.host.empty()) {
+    return;
+  }
+  WsConnection::Ptr conn = WsConnection::connect(loop_, lamp.endpoint, "/ws");
+  if (!conn) {
+    scheduleReconnect(lamp);
+    return;
+  }
+  Lamp* target = &lamp;
+  conn->onOpen = [this, target](const std::string&) {
+    target->connected = true;
+    target->backoffMs = 0;
+    fprintf(stderr, "proxy: %s connected (%s)\n", target->name.c_str(), target->upstream->peer().c_str());
+    watchUpstream(*target);
+  };
+  conn->onText = [this, target](const std::string& text) { handleUpstreamText(*target, text); };
+  conn->onDrain = [this, target]() {
+    if (target->hasPending) {
+      flushControl(*target);
+    }
+  };
+  conn->onClose = [this, target]() {
+    bool wasConnected = target->connected;
+    target->connected = false;
+    target->upstream.reset();
+    target->hasPending = false;
+    target->awaitingRefresh = false;
+    target->replyRoutes.clear();
+    loop_.cancel(target->watchdogTimer);
+    target->watchdogTimer = 0;
+    if (wasConnected) {
+      // Subscribers reconnect through their own retry logic and get a fresh hello
+      fprintf(stderr, "proxy: %s disconnected; closing %zu subscribers\n", target->name.c_str(),
+              target->subscribers.size());
+      std::map<uint64_t, WsConnection::Ptr> subscribers;
+      subscribers.swap(target->subscribers);
+      for (auto& entry : subscribers) {
+        entry.second->close();
+      }
+      target->hello.clear();
+      target->state.clear();
+    }
+    scheduleReconnect(*target);
+  };
+  lamp.upstream = conn;
+}
+
+void LampProxy::scheduleReconnect(Lamp& lamp) {
+  lamp.backoffMs = lamp.backoffMs == 0 ? BACKOFF_MIN_MS : std::min(lamp.backoffMs * 2, BACKOFF_MAX_MS);
+  Lamp* target = &lamp;
+  lamp.reconnectTimer = loop_.after(lamp.backoffMs, [this, target]() { connectUpstream(*target); });
+}
+
+// Drop an upstream that went silent; the lamp pings idle clients, so silence means dead
+void LampProxy::watchUpstream(Lamp& lamp) {
+  Lamp* target = &lamp;
+  lamp.watchdogTimer = loop_.after(UPSTREAM_IDLE_MS / 4, [this, target]() {
+    target->watchdogTimer = 0;
+    if (!target->upstream) {
+      return;
+    }
+    if (EventLoop::nowMs() - target->upstream->lastRxMs() > UPSTREAM_IDLE_MS) {
+      fprintf(stderr, "proxy: %s silent for %lld ms; reconnecting\n", target->name.c_str(),
+              (long long)UPSTREAM_IDLE_MS);
+      target->upstream->close();
+      return;
+    }
+    watchUpstream(*target);
+  });
+}
+
+void LampProxy::handleUpstreamText(Lamp& lamp, const std::string& text) {
+  if (startsWithKey(text, key::STATE)) {
+    lamp.state = text;
+    if (lamp.awaitingRefresh) {
+      lamp.awaitingRefresh = false;
+      std::set<uint64_t> excluded;
+      excluded.swap(lamp.refreshExcluded);
+      fanOut(lamp, text, &excluded);
+    } else {
+      fanOut(lamp, text, nullptr);
+    }
+    return;
+  }
+
+  std::string type = messageType(text);
+  if (type == msg::HELLO) {
+    lamp.hello = text;
+    lamp.state.clear();                 // the hello carries the state it was built with
+  }
+  auto route = lamp.replyRoutes.find(type);
+  if (route != lamp.replyRoutes.end()) {
+    while (!route->second.empty()) {
+      uint64_t id = route->second.front();
+      route->second.pop_front();
+      auto subscriber = lamp.subscribers.find(id);
+      if (subscriber != lamp.subscribers.end()) {
+        subscriber->second->sendText(text);
+        return;
+      }
+    }
+  }
+  fanOut(lamp, text, nullptr);
+}
+
+// ===== Subscribers =====
+
+LampProxy::Lamp* LampProxy::lampForPath(const std::string& path) {
+  // "/ws" is the first lamp, so an unmodified app can point at the proxy;
+  // "/<name>/ws" selects a lamp by name
+  if (path == "/ws") {
+    return lamps_.empty() ? nullptr : lamps_.front();
+  }
+  for (Lamp* lamp : lamps_) {
+    if (path == "/" + lamp->name + "/ws") {
+      return lamp;
+    }
+  }
+  return nullptr;
+}
+
+void LampProxy::attachSubscriber(Lamp& lamp, WsConnection::Ptr conn) {
+  if (!lamp.connected) {
+    // Nothing to seed it with and nowhere to send its controls; the app retries on close
+    fprintf(stderr, "proxy: %s is offline; refusing subscriber from %s\n", lamp.name.c_str(),
+            conn->peer().c_str());
+    conn->closeWithStatus(CLOSE_TRY_AGAIN_LATER, "lamp offline");
+    return;
+  }
+  uint64_t id = nextSubscriberId_++;
+  lamp.subscribers[id] = conn;
+  Lamp* target = &lamp;
+  conn->onText = [this, target, id](const std::string& text) { handleSubscriberText(*target, id, text); };
+  conn->onClose = [target, id]() {
+    target->subscribers.erase(id);
+    target->controlOrigins.erase(id);
+    target->refreshExcluded.erase(id);
+  };
+
+  // Seed the newcomer the way a direct connection would be: hello, then newer state
+  if (!lamp.hello.empty()) {
+    conn->sendText(lamp.hello);
+  }
+  if (!lamp.state.empty()) {
+    conn->sendText(lamp.state);
+  }
+  fprintf(stderr, "proxy: %s subscriber #%llu from %s (%zu total)\n", lamp.name.c_str(),
+          (unsigned long long)id, conn->peer().c_str(), lamp.subscribers.size());
+}
+
+void LampProxy::handleSubscriberText(Lamp& lamp, uint64_t id, const std::string& text) {
+  lamp_protocol::ControlFrame frame;
+  if (lamp_protocol::parseControlFrame(reinterpret_cast<const uint8_t*>(text.data()), text.size(), frame)) {
+    queueControl(lamp, id, frame);
+    return;
+  }
+  if (isStateRequest(text) && !lamp.state.empty()) {
+    auto subscriber = lamp.subscribers.find(id);
+    if (subscriber != lamp.subscribers.end()) {
+      subscriber->second->sendText(lamp.state);
+    }
+    return;
+  }
+  if (!lamp.upstream || !lamp.connected) {
+    return;                             // dropped like a message sent to an offline lamp
+  }
+
+  // Keep order: controls queued before this message reach the lamp first
+  if (lamp.hasPending) {
+    flushControl(lamp);
+  }
+  std::string type = messageType(text);
+  for (const auto& route : REPLY_ROUTES) {
+    if (type == route.request) {
+      lamp.replyRoutes[route.reply].push_back(id);
+      break;
+    }
+  }
+  lamp.upstream->sendText(text);
+  lamp.forwarded++;
+}
+
+// Merge into the pending frame; newer fields win, like the lamp's own control mailbox
+void LampProxy::queueControl(Lamp& lamp, uint64_t id, const lamp_protocol::ControlFrame& frame) {
+  if (lamp.hasPending) {
+    lamp.coalesced++;
+  }
+  if (frame.hasBrightness) {
+    lamp.pending.hasBrightness = true;
+    lamp.pending.brightness = frame.brightness;
+  }
+  if (frame.hasMode) {
+    lamp.pending.hasMode = true;
+    lamp.pending.mode = frame.mode;
+  }
+  if (frame.hasOn) {
+    lamp.pending.hasOn = true;
+    lamp.pending.on = frame.on;
+  }
+  lamp.hasPending = true;
+  lamp.controlOrigins.insert(id);
+
+  int64_t due = lamp.lastFlushMs + options_.coalesceMs;
+  int64_t now = EventLoop::nowMs();
+  if (now >= due) {
+    flushControl(lamp);
+  } else if (lamp.flushTimer == 0) {
+    Lamp* target = &lamp;
+    lamp.flushTimer = loop_.after(due - now, [this, target]() {
+      target->flushTimer = 0;
+      flushControl(*target);
+    });
+  }
+}
+
+// Forward the merged frame unless the lamp is still draining earlier frames; onDrain retries
+void LampProxy::flushControl(Lamp& lamp) {
+  if (!lamp.hasPending || !lamp.upstream || !lamp.connected || lamp.upstream->queuedBytes() > 0) {
+    return;
+  }
+  if (lamp.flushTimer != 0) {
+    loop_.cancel(lamp.flushTimer);
+    lamp.flushTimer = 0;
+  }
+  std::string text = encodeControl(lamp.pending);
+  lamp.pending = lamp_protocol::ControlFrame();
+  lamp.hasPending = false;
+  lamp.forwarded++;
+  lamp.lastFlushMs = EventLoop::nowMs();
+  lamp.upstream->sendText(text);
+  scheduleRefresh(lamp);
+}
+
+void LampProxy::scheduleRefresh(Lamp& lamp) {
+  lamp.refreshExcluded.insert(lamp.controlOrigins.begin(), lamp.controlOrigins.end());
+  lamp.controlOrigins.clear();
+  if (lamp.refreshTimer != 0) {
+    return;
+  }
+  Lamp* target = &lamp;
+  lamp.refreshTimer = loop_.after(REFRESH_DELAY_MS, [target]() {
+    target->refreshTimer = 0;
+    if (!target->upstream || !target->connected) {
+      return;
+    }
+    target->awaitingRefresh = true;
+    target->upstream->sendText(std::string("{\"") + key::REQUEST_STATE + "\":true}");
+  });
+}
+
+void LampProxy::fanOut(Lamp& lamp, const std::string& text, const std::set<uint64_t>* exclude) {
+  // Copy first: a failing send closes the subscriber and erases it from the map
+  std::vector<WsConnection::Ptr> targets;
+  for (auto& entry : lamp.subscribers) {
+    if (exclude == nullptr || exclude->count(entry.first) == 0) {
+      targets.push_back(entry.second);
+    }
+  }
+  for (WsConnection::Ptr& conn : targets) {
+    conn->sendText(text);
+  }
+  lamp.fannedOut += targets.size();
+}
+
+// GET /stats: per-lamp connection and forwarding counters
+HttpResponse LampProxy::handleHttp(const HttpRequest& request) {
+  HttpResponse response;
+  if (request.method != "GET" || request.path != "/stats") {
+    response.status = 404;
+    return response;
+  }
+  std::string body = "{\"lamps\":[";
+  for (size_t i = 0; i < lamps_.size(); i++) {
+    const Lamp& lamp = *lamps_[i];
+    char entry[256];
+    snprintf(entry, sizeof(entry),
+             "%s{\"name\":\"%s\",\"connected\":%s,\"subscribers\":%zu,\"forwarded\":%llu,"
+             "\"coalesced\":%llu,\"fanned_out\":%llu}",
+             i > 0 ? "," : "", lamp.name.c_str(), lamp.connected ? "true" : "false", lamp.subscribers.size(),
+             (unsigned long long)lamp.forwarded, (unsigned long long)lamp.coalesced,
+             (unsigned long long)lamp.fannedOut);
+    body += entry;
+  }
+  response.body = body + "]}";
+  return response;
+}
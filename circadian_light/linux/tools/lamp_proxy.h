@@ -0,0 +1,109 @@
+#ifndef LAMP_TOOLS_LAMP_PROXY_H_
+#define LAMP_TOOLS_LAMP_PROXY_H_
+
+// Lamp connection multiplexer. Holds exactly one WebSocket per lamp and lets any number of
+// local subscribers (app windows, phones on the LAN, scripts) share it:
+//   - lamp -> subscribers: state, hello and broadcast messages fan out to every
+//     subscriber; replies to metrics/energy/... requests go back to the requester only.
+//     The newest hello and state are cached and replayed to subscribers as they join,
+//     and {"request_state":true} is answered from the cache without a lamp round trip.
+//     Subscribers are only accepted while the lamp link is open; until then the upgrade
+//     is closed with 1013 (try again later).
+//   - subscribers -> lamp: control frames ({"brightness":..,"mode":..,"on":..}) are merged
+//     and forwarded at most once per coalesce interval, and only while the lamp's send
+//     queue is empty; everything else is forwarded verbatim, after any pending controls.
+// The lamp does not echo a control change to the connection it came from, so after
+// forwarding controls the proxy asks for the state and fans it out to everyone else.
+
+#include <stdint.h>
+
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "control_frame.h"
+#include "net.h"
+
+struct LampProxyOptions {
+  struct Lamp {
+    std::string name;
+    Endpoint endpoint;                 // empty host: wait for setLampEndpoint()
+  };
+
+  Endpoint listen;
+  int coalesceMs = 20;
+  std::vector<Lamp> lamps;
+};
+
+class LampProxy {
+ public:
+  LampProxy(EventLoop& loop, LampProxyOptions options);
+  ~LampProxy();
+  LampProxy(const LampProxy&) = delete;
+  LampProxy& operator=(const LampProxy&) = delete;
+
+  // Binds the listener and starts connecting to every lamp that has an address
+  bool start();
+
+  // Port subscribers connect to (useful with listen port 0)
+  uint16_t port() const { return listener_.port(); }
+
+  // Points `lamp` at a new address, e.g. once discovery found it, and reconnects now
+  void setLampEndpoint(const std::string& lamp, const Endpoint& endpoint);
+
+  // Newest message carrying `lamp`'s state: a state update, else the hello ("" if neither)
+  std::string cachedState(const std::string& lamp) const;
+
+ private:
+  struct Lamp {
+    std::string name;
+    Endpoint endpoint;
+    WsConnection::Ptr upstream;
+    bool connected = false;
+    int backoffMs = 0;
+    uint64_t reconnectTimer = 0;
+    uint64_t watchdogTimer = 0;
+
+    std::string hello;                 // newest hello from the lamp
+    std::string state;                 // newest {"state":{...}} message
+    std::map<uint64_t, WsConnection::Ptr> subscribers;
+
+    lamp_protocol::ControlFrame pending = {};
+    bool hasPending = false;
+    int64_t lastFlushMs = 0;
+    uint64_t flushTimer = 0;
+    std::set<uint64_t> controlOrigins; // subscribers whose controls were forwarded
+    uint64_t refreshTimer = 0;
+    bool awaitingRefresh = false;
+    std::set<uint64_t> refreshExcluded;
+
+    std::map<std::string, std::deque<uint64_t>> replyRoutes;   // reply type -> requesters
+
+    uint64_t forwarded = 0;
+    uint64_t coalesced = 0;
+    uint64_t fannedOut = 0;
+  };
+
+  void connectUpstream(Lamp& lamp);
+  void scheduleReconnect(Lamp& lamp);
+  void watchUpstream(Lamp& lamp);
+  void handleUpstreamText(Lamp& lamp, const std::string& text);
+  void attachSubscriber(Lamp& lamp, WsConnection::Ptr conn);
+  void handleSubscriberText(Lamp& lamp, uint64_t id, const std::string& text);
+  void queueControl(Lamp& lamp, uint64_t id, const lamp_protocol::ControlFrame& frame);
+  void flushControl(Lamp& lamp);
+  void scheduleRefresh(Lamp& lamp);
+  void fanOut(Lamp& lamp, const std::string& text, const std::set<uint64_t>* exclude);
+  Lamp* lampForPath(const std::string& path);
+  HttpResponse handleHttp(const HttpRequest& request);
+
+  EventLoop& loop_;
+  LampProxyOptions options_;
+  TcpListener listener_;
+  std::vector<Lamp*> lamps_;
+  uint64_t nextSubscriberId_;
+};
+
+#endif  // LAMP_TOOLS_LAMP_PROXY_H_
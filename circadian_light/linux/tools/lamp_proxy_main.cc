@@ -0,0 +1,75 @@
+// Standalone lamp connection proxy; see lamp_proxy.h for the forwarding rules.
+//
+//   lamp_proxy [--listen [host]:port] [--coalesce-ms N] --lamp name=host[:port] ...
+//
+// Subscribers connect to ws://<listen>/<name>/ws, or /ws for the first lamp, and
+// GET /stats reports per-lamp counters.
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lamp_proxy.h"
+
+namespace {
+
+EventLoop* activeLoop = nullptr;
+
+void onSignal(int) {
+  if (activeLoop != nullptr) {
+    activeLoop->stop();
+  }
+}
+
+int usage(const char* argv0) {
+  fprintf(stderr, "usage: %s [--listen [host]:port] [--coalesce-ms N] --lamp name=host[:port] ...\n", argv0);
+  return 2;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  LampProxyOptions options;
+  options.listen = {"127.0.0.1", 8765};
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+      if (!parseEndpoint(argv[++i], 8765, options.listen)) {
+        return usage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "--coalesce-ms") == 0 && i + 1 < argc) {
+      options.coalesceMs = atoi(argv[++i]);
+      if (options.coalesceMs < 0) {
+        return usage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "--lamp") == 0 && i + 1 < argc) {
+      const char* spec = argv[++i];
+      const char* eq = strchr(spec, '=');
+      LampProxyOptions::Lamp lamp;
+      if (eq == nullptr || eq == spec || !parseEndpoint(eq + 1, 80, lamp.endpoint)) {
+        return usage(argv[0]);
+      }
+      lamp.name.assign(spec, eq - spec);
+      options.lamps.push_back(lamp);
+    } else {
+      return usage(argv[0]);
+    }
+  }
+  if (options.lamps.empty()) {
+    return usage(argv[0]);
+  }
+
+  EventLoop loop;
+  LampProxy proxy(loop, options);
+  if (!proxy.start()) {
+    return 1;
+  }
+  fprintf(stderr, "proxy: listening on %s:%u for %zu lamp(s)\n", options.listen.host.c_str(), proxy.port(),
+          options.lamps.size());
+
+  activeLoop = &loop;
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  loop.run();
+  return 0;
+}
@@ -0,0 +1,314 @@
+// Native lamp stand-in for exercising the Linux tools without hardware. Speaks the
+// subset of the firmware's protocol the tools rely on:
+//   - WebSocket on /ws: hello on connect, control frames applied and broadcast to every
+//     other client (never echoed to the sender), {"request_state":true}, metrics_request
+//     with the control counters, and *_sync messages acknowledged with a *_response
+//   - GET/POST /snapshot: stores and returns the configuration blob verbatim
+//   - POST /update: accepts an application image (checked for the ESP image magic only)
+//     and then "restarts": every client is dropped and the boot id changes. With --token,
+//     the upload must carry it in X-Lamp-Token like the firmware's OTA token.
+//   - with --advertise, answers mDNS queries for _ws._tcp like the firmware
+// Quiet clients are pinged like the firmware does, so idle watchdogs behave the same.
+// --fail-updates N refuses the first N images, for exercising retries; --flash-ms N blocks
+// that long on each image like the firmware's flash write. Every answered update is logged
+// with its CLOCK_MONOTONIC window, which tools/test/fleet_test.cc reads back.
+//
+//   lamp_standin [--listen [host]:port] [--name name] [--advertise] [--fail-updates N]
+//                [--flash-ms N] [--token T]
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+
+#include "control_frame.h"
+#include "mdns.h"
+#include "net.h"
+#include "protocol_keys.h"
+
+namespace key = lamp_protocol::key;
+namespace msg = lamp_protocol::msg;
+
+namespace {
+
+const int64_t PING_IDLE_MS = 20000;
+const size_t OTA_SLOT_SIZE = 0x1E0000;        // app0/app1 in esp_code/partitions.csv
+const uint8_t ESP_IMAGE_MAGIC = 0xE9;
+const int64_t RESTART_DELAY_MS = 1000;        // OTA_RESTART_DELAY_MS in the firmware
+
+EventLoop* activeLoop = nullptr;
+
+struct Lamp {
+  std::string name = "standin";
+  uint32_t bootId = 0;
+  uint32_t stateVersion = 0;
+  uint32_t scheduleGeneration = 0;
+  int brightness = 8;
+  int mode = 2;
+  bool on = true;
+  uint64_t commands = 0;               // control frames received
+  uint64_t applied = 0;                // ones that changed the state
+  std::string snapshot;
+  std::string firmware = "standin";
+  int failUpdates = 0;                 // images still to refuse
+  int flashMs = 0;                     // time spent "writing" each image
+  std::string otaToken;                // required on /update when set
+  bool restartPending = false;
+  std::map<uint64_t, WsConnection::Ptr> clients;
+  uint64_t nextClientId = 1;
+};
+
+std::string stateObject(const Lamp& lamp) {
+  char text[160];
+  snprintf(text, sizeof(text), "{\"%s\":%u,\"%s\":%d,\"%s\":%d,\"%s\":%s}", key::VERSION, lamp.stateVersion,
+           key::BRIGHTNESS, lamp.brightness, key::MODE, lamp.mode, key::ON, lamp.on ? "true" : "false");
+  return text;
+}
+
+std::string stateMessage(const Lamp& lamp) {
+  return std::string("{\"") + key::STATE + "\":" + stateObject(lamp) + "}";
+}
+
+std::string helloMessage(const Lamp& lamp) {
+  char schedule[96];
+  snprintf(schedule, sizeof(schedule), "{\"%s\":%u,\"%s\":%u}", key::BOOT_ID, lamp.bootId, key::GENERATION,
+           lamp.scheduleGeneration);
+  return std::string("{\"") + key::TYPE + "\":\"" + msg::HELLO + "\",\"" + key::STATE + "\":" + stateObject(lamp) +
+         ",\"" + key::FIRMWARE + "\":{\"" + key::VERSION + "\":\"" + lamp.firmware + "\"},\"" + key::SCHEDULE +
+         "\":" + schedule + "}";
+}
+
+void broadcast(Lamp& lamp, const std::string& text, uint64_t excludeId) {
+  std::map<uint64_t, WsConnection::Ptr> clients = lamp.clients;   // sends may close clients
+  for (auto& entry : clients) {
+    if (entry.first != excludeId) {
+      entry.second->sendText(text);
+    }
+  }
+}
+
+void handleText(Lamp& lamp, uint64_t id, const WsConnection::Ptr& conn, const std::string& text) {
+  lamp_protocol::ControlFrame frame;
+  if (lamp_protocol::parseControlFrame(reinterpret_cast<const uint8_t*>(text.data()), text.size(), frame)) {
+    lamp.commands++;
+    bool changed = false;
+    if (frame.hasBrightness && frame.brightness >= 0 && frame.brightness <= 15 && frame.brightness != lamp.brightness) {
+      lamp.brightness = frame.brightness;
+      changed = true;
+    }
+    if (frame.hasMode && frame.mode >= 0 && frame.mode <= 2 && frame.mode != lamp.mode) {
+      lamp.mode = frame.mode;
+      changed = true;
+    }
+    if (frame.hasOn && frame.on != lamp.on) {
+      lamp.on = frame.on;
+      changed = true;
+    }
+    if (changed) {
+      lamp.applied++;
+      lamp.stateVersion++;
+      broadcast(lamp, stateMessage(lamp), id);   // the sender already has it
+    }
+    return;
+  }
+
+  if (text.find(std::string("\"") + key::REQUEST_STATE + "\"") != std::string::npos) {
+    conn->sendText(stateMessage(lamp));
+    return;
+  }
+
+  std::string typeKey = std::string("\"") + key::TYPE + "\":\"";
+  size_t start = text.find(typeKey);
+  if (start == std::string::npos) {
+    return;
+  }
+  start += typeKey.size();
+  std::string type = text.substr(start, text.find('"', start) - start);
+  if (type == msg::METRICS_REQUEST) {
+    char reply[160];
+    snprintf(reply, sizeof(reply), "{\"%s\":\"%s\",\"%s\":{\"%s\":%llu,\"%s\":%llu}}", key::TYPE, msg::METRICS,
+             key::CONTROL, key::COMMANDS, (unsigned long long)lamp.commands, key::APPLIED,
+             (unsigned long long)lamp.applied);
+    conn->sendText(reply);
+  } else if (type.size() > 5 && type.compare(type.size() - 5, 5, "_sync") == 0) {
+    lamp.scheduleGeneration++;
+    char reply[192];
+    snprintf(reply, sizeof(reply), "{\"%s\":\"%s_response\",\"%s\":true,\"%s\":\"ok\",\"%s\":%u}", key::TYPE,
+             type.c_str(), key::SUCCESS, key::MESSAGE, key::SCHEDULE_GENERATION, lamp.scheduleGeneration);
+    broadcast(lamp, reply, 0);
+  }
+}
+
+std::string resultBody(bool success, const char* message) {
+  return std::string("{\"") + key::SUCCESS + "\":" + (success ? "true" : "false") + ",\"" + key::MESSAGE + "\":\"" +
+         message + "\"}";
+}
+
+// Mirrors the firmware's reboot: the response goes out, then every connection drops
+void scheduleRestart(EventLoop& loop, Lamp& lamp) {
+  lamp.restartPending = true;
+  loop.after(RESTART_DELAY_MS, [&lamp]() {
+    std::map<uint64_t, WsConnection::Ptr> clients = lamp.clients;
+    for (auto& entry : clients) {
+      entry.second->close();
+    }
+    lamp.bootId++;
+    lamp.restartPending = false;
+    fprintf(stderr, "%s: restarted\n", lamp.name.c_str());
+  });
+}
+
+HttpResponse handleUpdate(EventLoop& loop, Lamp& lamp, const HttpRequest& request) {
+  HttpResponse response;
+  if (!lamp.otaToken.empty() && request.header(key::LAMP_TOKEN) != lamp.otaToken) {
+    response.status = 401;
+    response.body = resultBody(false, "OTA token missing or wrong");
+    return response;
+  }
+  if (lamp.restartPending) {
+    response.status = 409;
+    response.body = resultBody(false, "Another update is in progress");
+    return response;
+  }
+  if (request.body.empty() || (uint8_t)request.body[0] != ESP_IMAGE_MAGIC) {
+    response.status = 400;
+    response.body = resultBody(false, "Invalid image");
+    return response;
+  }
+  // The firmware's Update.write blocks its web server the same way
+  if (lamp.flashMs > 0) {
+    usleep((useconds_t)lamp.flashMs * 1000);
+  }
+  if (lamp.failUpdates > 0) {
+    lamp.failUpdates--;
+    response.status = 500;
+    response.body = resultBody(false, "Flash write failed");
+    return response;
+  }
+  response.body = resultBody(true, "Update installed, restarting");
+  fprintf(stderr, "%s: update installed (%zu bytes)\n", lamp.name.c_str(), request.body.size());
+  scheduleRestart(loop, lamp);
+  return response;
+}
+
+HttpResponse handleHttp(EventLoop& loop, Lamp& lamp, const HttpRequest& request) {
+  HttpResponse response;
+  if (request.path == "/snapshot" && request.method == "GET" && !lamp.snapshot.empty()) {
+    response.contentType = "application/octet-stream";
+    response.body = lamp.snapshot;
+  } else if (request.path == "/snapshot" && request.method == "POST") {
+    lamp.snapshot = request.body;
+    lamp.scheduleGeneration++;
+    response.body = resultBody(true, "Snapshot imported");
+    fprintf(stderr, "%s: snapshot imported (%zu bytes)\n", lamp.name.c_str(), request.body.size());
+  } else if (request.path == "/update" && request.method == "POST") {
+    int64_t receivedMs = EventLoop::nowMs();
+    response = handleUpdate(loop, lamp, request);
+    fprintf(stderr, "%s: update answered %d (monotonic %lld..%lld ms)\n", lamp.name.c_str(), response.status,
+            (long long)receivedMs, (long long)EventLoop::nowMs());
+  } else {
+    response.status = 404;
+  }
+  return response;
+}
+
+void pingIdleClients(EventLoop& loop, Lamp& lamp) {
+  int64_t now = EventLoop::nowMs();
+  for (auto& entry : lamp.clients) {
+    if (now - entry.second->lastRxMs() >= PING_IDLE_MS) {
+      entry.second->sendPing();
+    }
+  }
+  loop.after(PING_IDLE_MS / 4, [&loop, &lamp]() { pingIdleClients(loop, lamp); });
+}
+
+void onSignal(int) {
+  if (activeLoop != nullptr) {
+    activeLoop->stop();
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Lamp lamp;
+  Endpoint listen = {"0.0.0.0", 8080};
+  bool advertise = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+      if (!parseEndpoint(argv[++i], 8080, listen)) {
+        fprintf(stderr, "invalid --listen %s\n", argv[i]);
+        return 2;
+      }
+    } else if (strcmp(argv[i], "--name") == 0 && i + 1 < argc) {
+      lamp.name = argv[++i];
+    } else if (strcmp(argv[i], "--advertise") == 0) {
+      advertise = true;
+    } else if (strcmp(argv[i], "--fail-updates") == 0 && i + 1 < argc) {
+      lamp.failUpdates = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--flash-ms") == 0 && i + 1 < argc) {
+      lamp.flashMs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--token") == 0 && i + 1 < argc) {
+      lamp.otaToken = argv[++i];
+    } else {
+      fprintf(stderr,
+              "usage: %s [--listen [host]:port] [--name name] [--advertise] [--fail-updates N]\n"
+              "          [--flash-ms N] [--token T]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+
+  EventLoop loop;
+  lamp.bootId = (uint32_t)EventLoop::nowMs() ^ (uint32_t)getpid();
+  TcpListener listener(loop, [&loop, &lamp](WsConnection::Ptr conn) {
+    conn->maxHttpBody = OTA_SLOT_SIZE;
+    conn->onHttp = [&loop, &lamp](const HttpRequest& request) { return handleHttp(loop, lamp, request); };
+    WsConnection* raw = conn.get();
+    conn->onOpen = [&lamp, raw](const std::string&) {
+      uint64_t id = lamp.nextClientId++;
+      WsConnection::Ptr client = raw->shared_from_this();
+      lamp.clients[id] = client;
+      client->onText = [&lamp, id, raw](const std::string& text) { handleText(lamp, id, raw->shared_from_this(), text); };
+      client->onClose = [&lamp, id]() { lamp.clients.erase(id); };
+      client->sendText(helloMessage(lamp));
+      fprintf(stderr, "%s: client #%llu from %s\n", lamp.name.c_str(), (unsigned long long)id, raw->peer().c_str());
+    };
+  });
+  if (!listener.listen(listen)) {
+    fprintf(stderr, "%s: cannot listen on %s:%u\n", lamp.name.c_str(), listen.host.c_str(), listen.port);
+    return 1;
+  }
+  listen.port = listener.port();        // the kernel's choice for port 0
+  fprintf(stderr, "%s: listening on %s:%u\n", lamp.name.c_str(), listen.host.c_str(), listen.port);
+
+  // Same record layout as the firmware; the instance name is unique so several stand-ins
+  // can share a host
+  MdnsResponder responder(loop);
+  if (advertise) {
+    MdnsService service;
+    service.instance = lamp.name + "._ws._tcp.local";
+    service.host = lamp.name + ".local";
+    service.address = listen.host == "0.0.0.0" ? "" : listen.host;
+    service.port = listen.port;
+    char chipId[16];
+    snprintf(chipId, sizeof(chipId), "%012x", lamp.bootId);
+    service.txt["id"] = chipId;
+    service.txt["fw"] = lamp.firmware;
+    if (!responder.start(service)) {
+      fprintf(stderr, "%s: cannot join the mDNS group\n", lamp.name.c_str());
+      return 1;
+    }
+  }
+
+  activeLoop = &loop;
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  pingIdleClients(loop, lamp);
+  loop.run();
+  return 0;
+}
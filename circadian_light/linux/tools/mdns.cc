@@ -0,0 +1,443 @@
+#include "mdns.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace {
+
+const char MDNS_GROUP[] = "224.0.0.251";
+const uint16_t MDNS_PORT = 5353;
+const uint32_t LEGACY_TTL = 10;               // RFC 6762 6.7: at most 10 s for legacy replies
+const uint32_t RECORD_TTL = 120;
+
+enum RecordType : uint16_t {
+  TYPE_A = 1,
+  TYPE_PTR = 12,
+  TYPE_TXT = 16,
+  TYPE_SRV = 33,
+  TYPE_ANY = 255,
+};
+const uint16_t CLASS_IN = 1;
+const uint16_t CLASS_MASK = 0x7FFF;           // top bit is cache-flush / unicast-response
+const uint16_t FLAG_RESPONSE = 0x8000;
+const uint16_t FLAG_AUTHORITATIVE = 0x0400;
+
+// Query repeats within the browse window; multicast is lossy and responders delay
+const int QUERY_SCHEDULE_MS[] = {0, 250, 1000};
+
+void putU16(std::string& out, uint16_t value) {
+  out += (char)(value >> 8);
+  out += (char)value;
+}
+
+void putU32(std::string& out, uint32_t value) {
+  putU16(out, (uint16_t)(value >> 16));
+  putU16(out, (uint16_t)value);
+}
+
+// Uncompressed; the instance label is the only one that could contain a dot, and ours don't
+void putName(std::string& out, const std::string& name) {
+  size_t start = 0;
+  while (start < name.size()) {
+    size_t end = name.find('.', start);
+    if (end == std::string::npos) {
+      end = name.size();
+    }
+    size_t length = end - start;
+    if (length > 0 && length < 64) {
+      out += (char)length;
+      out.append(name, start, length);
+    }
+    start = end + 1;
+  }
+  out += '\0';
+}
+
+void putRecord(std::string& out, const std::string& name, uint16_t type, uint32_t ttl, const std::string& data) {
+  putName(out, name);
+  putU16(out, type);
+  putU16(out, CLASS_IN);
+  putU32(out, ttl);
+  putU16(out, (uint16_t)data.size());
+  out += data;
+}
+
+struct Reader {
+  const std::string& packet;
+  size_t pos;
+  bool error;
+
+  uint16_t u16() {
+    if (pos + 2 > packet.size()) {
+      error = true;
+      return 0;
+    }
+    uint16_t value = (uint16_t)((uint8_t)packet[pos] << 8 | (uint8_t)packet[pos + 1]);
+    pos += 2;
+    return value;
+  }
+
+  uint32_t u32() {
+    uint32_t high = u16();
+    return high << 16 | u16();
+  }
+
+  // Follows compression pointers; the hop limit stops pointer loops
+  std::string name() {
+    std::string out;
+    size_t cursor = pos;
+    bool jumped = false;
+    for (int hops = 0; hops < 32; hops++) {
+      if (cursor >= packet.size()) {
+        break;
+      }
+      uint8_t length = (uint8_t)packet[cursor];
+      if (length == 0) {
+        if (!jumped) {
+          pos = cursor + 1;
+        }
+        return out;
+      }
+      if ((length & 0xC0) == 0xC0) {
+        if (cursor + 1 >= packet.size()) {
+          break;
+        }
+        if (!jumped) {
+          pos = cursor + 2;
+        }
+        jumped = true;
+        cursor = (size_t)(length & 0x3F) << 8 | (uint8_t)packet[cursor + 1];
+        continue;
+      }
+      if (cursor + 1 + length > packet.size()) {
+        break;
+      }
+      if (!out.empty()) {
+        out += '.';
+      }
+      out.append(packet, cursor + 1, length);
+      cursor += 1 + length;
+    }
+    error = true;
+    return out;
+  }
+};
+
+bool sameName(const std::string& a, const std::string& b) {
+  return a.size() == b.size() && strcasecmp(a.c_str(), b.c_str()) == 0;
+}
+
+sockaddr_in groupAddress() {
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(MDNS_PORT);
+  inet_pton(AF_INET, MDNS_GROUP, &addr.sin_addr);
+  return addr;
+}
+
+}  // namespace
+
+// ===== MdnsBrowser =====
+
+MdnsBrowser::MdnsBrowser(EventLoop& loop) : loop_(loop), fd_(-1), queryId_(0) {}
+
+MdnsBrowser::~MdnsBrowser() {
+  for (uint64_t timer : timers_) {
+    loop_.cancel(timer);
+  }
+  if (fd_ >= 0) {
+    loop_.remove(fd_);
+    ::close(fd_);
+  }
+}
+
+bool MdnsBrowser::browse(const std::string& type, int windowMs, Callback onDone) {
+  fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd_ < 0) {
+    return false;
+  }
+  sockaddr_in local = {};
+  local.sin_family = AF_INET;
+  unsigned char ttl = 255;
+  setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+  if (bind(fd_, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0) {
+    ::close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  if (getrandom(&queryId_, sizeof(queryId_), 0) != (ssize_t)sizeof(queryId_)) {
+    queryId_ = 0x4C4D;
+  }
+  type_ = type;
+  onDone_ = std::move(onDone);
+  instances_.clear();
+  addresses_.clear();
+  loop_.add(fd_, EPOLLIN, [this](uint32_t) { readAvailable(); });
+  for (int delay : QUERY_SCHEDULE_MS) {
+    if (delay < windowMs) {
+      timers_.push_back(loop_.after(delay, [this]() { sendQuery(); }));
+    }
+  }
+  timers_.push_back(loop_.after(windowMs, [this]() { finish(); }));
+  return true;
+}
+
+void MdnsBrowser::sendQuery() {
+  std::string packet;
+  putU16(packet, queryId_);
+  putU16(packet, 0);                          // standard query
+  putU16(packet, 1);                          // one question
+  putU16(packet, 0);
+  putU16(packet, 0);
+  putU16(packet, 0);
+  putName(packet, type_);
+  putU16(packet, TYPE_PTR);
+  putU16(packet, CLASS_IN);
+  sockaddr_in group = groupAddress();
+  if (sendto(fd_, packet.data(), packet.size(), 0, reinterpret_cast<sockaddr*>(&group), sizeof(group)) < 0) {
+    fprintf(stderr, "mdns: query failed: %s\n", strerror(errno));
+  }
+}
+
+// Every section is mined: responders put SRV/TXT/A in the additional records
+void MdnsBrowser::readAvailable() {
+  char buffer[9000];
+  for (;;) {
+    ssize_t n = recv(fd_, buffer, sizeof(buffer), 0);
+    if (n < 0) {
+      return;
+    }
+    std::string packet(buffer, (size_t)n);
+    Reader in{packet, 0, false};
+    in.u16();                                 // id: legacy replies echo ours, others send 0
+    uint16_t flags = in.u16();
+    uint16_t questions = in.u16();
+    uint16_t records = in.u16();
+    records += in.u16();
+    records += in.u16();
+    if (in.error || !(flags & FLAG_RESPONSE)) {
+      continue;
+    }
+    for (uint16_t i = 0; i < questions && !in.error; i++) {
+      in.name();
+      in.u32();
+    }
+    for (uint16_t i = 0; i < records && !in.error; i++) {
+      std::string name = in.name();
+      uint16_t type = in.u16();
+      uint16_t cls = in.u16() & CLASS_MASK;
+      in.u32();
+      uint16_t length = in.u16();
+      size_t end = in.pos + length;
+      if (in.error || end > packet.size()) {
+        break;
+      }
+      if (cls == CLASS_IN) {
+        if (type == TYPE_PTR && sameName(name, type_)) {
+          std::string instance = in.name();
+          instances_[instance].instance = instance;
+        } else if (type == TYPE_SRV && length >= 7) {
+          in.u16();                           // priority
+          in.u16();                           // weight
+          MdnsService& service = instances_[name];
+          service.port = in.u16();
+          service.host = in.name();
+        } else if (type == TYPE_TXT) {
+          MdnsService& service = instances_[name];
+          size_t cursor = in.pos;
+          while (cursor < end) {
+            size_t entryLength = (uint8_t)packet[cursor];
+            std::string entry = packet.substr(cursor + 1, std::min(entryLength, end - cursor - 1));
+            size_t eq = entry.find('=');
+            if (!entry.empty()) {
+              service.txt[entry.substr(0, eq)] = eq == std::string::npos ? "" : entry.substr(eq + 1);
+            }
+            cursor += 1 + entryLength;
+          }
+        } else if (type == TYPE_A && length == 4) {
+          char text[INET_ADDRSTRLEN];
+          inet_ntop(AF_INET, packet.data() + in.pos, text, sizeof(text));
+          addresses_[name] = text;
+        }
+      }
+      in.pos = end;
+      in.error = false;                       // a bad rdata only spoils its own record
+    }
+  }
+}
+
+void MdnsBrowser::finish() {
+  for (uint64_t timer : timers_) {
+    loop_.cancel(timer);
+  }
+  timers_.clear();
+  loop_.remove(fd_);
+  ::close(fd_);
+  fd_ = -1;
+
+  std::vector<MdnsService> services;
+  for (auto& entry : instances_) {
+    MdnsService service = entry.second;
+    if (service.instance.empty() || service.port == 0) {
+      continue;                               // SRV without PTR, or PTR without SRV
+    }
+    for (auto& address : addresses_) {
+      if (sameName(address.first, service.host)) {
+        service.address = address.second;
+      }
+    }
+    services.push_back(service);
+  }
+  Callback callback;
+  callback.swap(onDone_);
+  if (callback) {
+    callback(services);
+  }
+}
+
+// ===== MdnsResponder =====
+
+MdnsResponder::MdnsResponder(EventLoop& loop) : loop_(loop), fd_(-1) {}
+
+MdnsResponder::~MdnsResponder() {
+  if (fd_ >= 0) {
+    loop_.remove(fd_);
+    ::close(fd_);
+  }
+}
+
+bool MdnsResponder::start(const MdnsService& service) {
+  size_t typeStart = service.instance.find('.');
+  if (typeStart == std::string::npos) {
+    return false;
+  }
+  service_ = service;
+  type_ = service.instance.substr(typeStart + 1);
+
+  fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd_ < 0) {
+    return false;
+  }
+  int one = 1;
+  setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(fd_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+  sockaddr_in local = {};
+  local.sin_family = AF_INET;
+  local.sin_port = htons(MDNS_PORT);
+  ip_mreq membership = {};
+  inet_pton(AF_INET, MDNS_GROUP, &membership.imr_multiaddr);
+  membership.imr_interface.s_addr = htonl(INADDR_ANY);
+  if (bind(fd_, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0 ||
+      setsockopt(fd_, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0) {
+    ::close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  loop_.add(fd_, EPOLLIN, [this](uint32_t) { readAvailable(); });
+  return true;
+}
+
+void MdnsResponder::readAvailable() {
+  char buffer[9000];
+  for (;;) {
+    sockaddr_in from = {};
+    socklen_t fromLength = sizeof(from);
+    ssize_t n = recvfrom(fd_, buffer, sizeof(buffer), 0, reinterpret_cast<sockaddr*>(&from), &fromLength);
+    if (n < 0) {
+      return;
+    }
+    std::string packet(buffer, (size_t)n);
+    Reader in{packet, 0, false};
+    uint16_t id = in.u16();
+    uint16_t flags = in.u16();
+    uint16_t questions = in.u16();
+    if (in.error || (flags & FLAG_RESPONSE)) {
+      continue;
+    }
+    in.pos = 12;
+    std::string question;
+    bool wanted = false;
+    for (uint16_t i = 0; i < questions && !in.error; i++) {
+      size_t start = in.pos;
+      std::string name = in.name();
+      uint16_t type = in.u16();
+      in.u16();
+      if (!in.error && (type == TYPE_PTR || type == TYPE_ANY) && sameName(name, type_)) {
+        wanted = true;
+        question = packet.substr(start, in.pos - start);
+      }
+    }
+    if (!wanted) {
+      continue;
+    }
+
+    // Legacy unicast queriers get the question echoed and short TTLs (RFC 6762 6.7)
+    bool legacy = ntohs(from.sin_port) != MDNS_PORT;
+    uint32_t ttl = legacy ? LEGACY_TTL : RECORD_TTL;
+    std::string address = service_.address;
+    if (address.empty()) {
+      int probe = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+      sockaddr_in local = {};
+      socklen_t localLength = sizeof(local);
+      char text[INET_ADDRSTRLEN] = "";
+      if (probe >= 0 && connect(probe, reinterpret_cast<sockaddr*>(&from), sizeof(from)) == 0 &&
+          getsockname(probe, reinterpret_cast<sockaddr*>(&local), &localLength) == 0) {
+        inet_ntop(AF_INET, &local.sin_addr, text, sizeof(text));
+      }
+      if (probe >= 0) {
+        ::close(probe);
+      }
+      address = text;
+    }
+
+    std::string reply;
+    putU16(reply, legacy ? id : 0);
+    putU16(reply, FLAG_RESPONSE | FLAG_AUTHORITATIVE);
+    putU16(reply, legacy ? 1 : 0);
+    putU16(reply, 1);                         // PTR answer
+    putU16(reply, 0);
+    putU16(reply, address.empty() ? 2 : 3);   // SRV, TXT and A as additional records
+    if (legacy) {
+      reply += question;
+    }
+    std::string data;
+    putName(data, service_.instance);
+    putRecord(reply, type_, TYPE_PTR, ttl, data);
+    data.clear();
+    putU16(data, 0);
+    putU16(data, 0);
+    putU16(data, service_.port);
+    putName(data, service_.host);
+    putRecord(reply, service_.instance, TYPE_SRV, ttl, data);
+    data.clear();
+    for (auto& entry : service_.txt) {
+      std::string text = entry.first + "=" + entry.second;
+      if (text.size() < 256) {
+        data += (char)text.size();
+        data += text;
+      }
+    }
+    if (data.empty()) {
+      data += '\0';                           // a TXT record needs at least one string
+    }
+    putRecord(reply, service_.instance, TYPE_TXT, ttl, data);
+    if (!address.empty()) {
+      data.assign(4, '\0');
+      inet_pton(AF_INET, address.c_str(), &data[0]);
+      putRecord(reply, service_.host, TYPE_A, ttl, data);
+    }
+
+    sockaddr_in to = legacy ? from : groupAddress();
+    sendto(fd_, reply.data(), reply.size(), 0, reinterpret_cast<sockaddr*>(&to), sizeof(to));
+  }
+}
@@ -0,0 +1,78 @@
+#ifndef LAMP_TOOLS_MDNS_H_
+#define LAMP_TOOLS_MDNS_H_
+
+// Just enough multicast DNS service discovery (RFC 6762/6763) to find lamps, which
+// advertise _ws._tcp with their chip id and firmware version in TXT records. IPv4 only.
+//   - MdnsBrowser sends PTR queries from an ephemeral port, so responders answer by
+//     unicast ("legacy unicast", RFC 6762 section 6.7) and port 5353 stays free.
+//   - MdnsResponder answers those queries for one service; the lamp stand-in uses it
+//     so discovery can be exercised without hardware.
+
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "net.h"
+
+struct MdnsService {
+  std::string instance;                        // "kitchen._ws._tcp.local"
+  std::string host;                            // SRV target, "kitchen.local"
+  std::string address;                         // dotted IPv4 ("" if no A record came back)
+  uint16_t port = 0;
+  std::map<std::string, std::string> txt;
+};
+
+class MdnsBrowser {
+ public:
+  using Callback = std::function<void(const std::vector<MdnsService>& services)>;
+
+  explicit MdnsBrowser(EventLoop& loop);
+  ~MdnsBrowser();
+  MdnsBrowser(const MdnsBrowser&) = delete;
+  MdnsBrowser& operator=(const MdnsBrowser&) = delete;
+
+  // Browses `type` ("_ws._tcp.local") for `windowMs`, repeating the query a few times since
+  // multicast is lossy, then reports every instance that answered. False if no socket.
+  // May be called again once the previous browse has reported.
+  bool browse(const std::string& type, int windowMs, Callback onDone);
+
+ private:
+  void sendQuery();
+  void readAvailable();
+  void finish();
+
+  EventLoop& loop_;
+  int fd_;
+  uint16_t queryId_;
+  std::string type_;
+  Callback onDone_;
+  std::vector<uint64_t> timers_;
+  std::map<std::string, MdnsService> instances_;     // by instance name
+  std::map<std::string, std::string> addresses_;     // host -> IPv4
+};
+
+class MdnsResponder {
+ public:
+  explicit MdnsResponder(EventLoop& loop);
+  ~MdnsResponder();
+  MdnsResponder(const MdnsResponder&) = delete;
+  MdnsResponder& operator=(const MdnsResponder&) = delete;
+
+  // Joins the mDNS group on port 5353 (shared, so several responders can run on one
+  // host) and answers queries for `service`'s type. An empty service.address is filled
+  // in per query with the local address that routes back to the querier.
+  bool start(const MdnsService& service);
+
+ private:
+  void readAvailable();
+
+  EventLoop& loop_;
+  int fd_;
+  MdnsService service_;
+  std::string type_;                           // "_ws._tcp.local"
+};
+
+#endif  // LAMP_TOOLS_MDNS_H_
@@ -0,0 +1,1010 @@
+#include "net.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+const char WS_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+const size_t MAX_HTTP_HEAD = 8 * 1024;
+
+enum Opcode : uint8_t {
+  OP_CONTINUATION = 0x0,
+  OP_TEXT = 0x1,
+  OP_BINARY = 0x2,
+  OP_CLOSE = 0x8,
+  OP_PING = 0x9,
+  OP_PONG = 0xA,
+};
+
+// SHA-1 is only needed for Sec-WebSocket-Accept, so a compact implementation will do
+std::string sha1(const std::string& input) {
+  uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+  std::string msg = input;
+  uint64_t bitLength = (uint64_t)input.size() * 8;
+  msg.push_back((char)0x80);
+  while (msg.size() % 64 != 56) {
+    msg.push_back('\0');
+  }
+  for (int i = 7; i >= 0; i--) {
+    msg.push_back((char)(bitLength >> (i * 8)));
+  }
+
+  auto rotl = [](uint32_t v, int n) { return (v << n) | (v >> (32 - n)); };
+  for (size_t chunk = 0; chunk < msg.size(); chunk += 64) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+      const uint8_t* p = reinterpret_cast<const uint8_t*>(msg.data()) + chunk + i * 4;
+      w[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    }
+    for (int i = 16; i < 80; i++) {
+      w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      uint32_t t = rotl(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rotl(b, 30);
+      b = a;
+      a = t;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+
+  std::string digest;
+  for (uint32_t word : h) {
+    for (int i = 3; i >= 0; i--) {
+      digest.push_back((char)(word >> (i * 8)));
+    }
+  }
+  return digest;
+}
+
+std::string base64(const std::string& input) {
+  static const char TABLE[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  size_t i = 0;
+  for (; i + 2 < input.size(); i += 3) {
+    uint32_t v = ((uint8_t)input[i] << 16) | ((uint8_t)input[i + 1] << 8) | (uint8_t)input[i + 2];
+    out.push_back(TABLE[v >> 18]);
+    out.push_back(TABLE[(v >> 12) & 63]);
+    out.push_back(TABLE[(v >> 6) & 63]);
+    out.push_back(TABLE[v & 63]);
+  }
+  if (i < input.size()) {
+    uint32_t v = (uint8_t)input[i] << 16;
+    if (i + 1 < input.size()) {
+      v |= (uint8_t)input[i + 1] << 8;
+    }
+    out.push_back(TABLE[v >> 18]);
+    out.push_back(TABLE[(v >> 12) & 63]);
+    out.push_back(i + 1 < input.size() ? TABLE[(v >> 6) & 63] : '=');
+    out.push_back('=');
+  }
+  return out;
+}
+
+std::string acceptKey(const std::string& key) {
+  return base64(sha1(key + WS_GUID));
+}
+
+// Case-insensitive header lookup in a request/response head
+std::string headerValue(const std::string& head, const char* name) {
+  size_t nameLength = strlen(name);
+  size_t pos = head.find("\r\n");
+  while (pos != std::string::npos && pos + 2 < head.size()) {
+    size_t start = pos + 2;
+    size_t end = head.find("\r\n", start);
+    if (end == std::string::npos) {
+      end = head.size();
+    }
+    if (end - start > nameLength && head[start + nameLength] == ':' &&
+        strncasecmp(head.c_str() + start, name, nameLength) == 0) {
+      size_t value = start + nameLength + 1;
+      while (value < end && head[value] == ' ') {
+        value++;
+      }
+      return head.substr(value, end - value);
+    }
+    pos = end;
+  }
+  return "";
+}
+
+// Every header line of a request head, names as sent
+void parseHeaders(const std::string& head, std::map<std::string, std::string>& out) {
+  size_t pos = head.find("\r\n");
+  while (pos != std::string::npos && pos + 2 < head.size()) {
+    size_t start = pos + 2;
+    size_t end = head.find("\r\n", start);
+    if (end == std::string::npos) {
+      end = head.size();
+    }
+    size_t colon = head.find(':', start);
+    if (colon != std::string::npos && colon < end) {
+      size_t value = colon + 1;
+      while (value < end && head[value] == ' ') {
+        value++;
+      }
+      out[head.substr(start, colon - start)] = head.substr(value, end - value);
+    }
+    pos = end;
+  }
+}
+
+const char* statusText(int status) {
+  switch (status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 404: return "Not Found";
+    case 409: return "Conflict";
+    case 413: return "Payload Too Large";
+    case 500: return "Internal Server Error";
+    default: return "Error";
+  }
+}
+
+}  // namespace
+
+// ===== EventLoop =====
+
+EventLoop::EventLoop()
+    : epollFd_(epoll_create1(EPOLL_CLOEXEC)),
+      wakeFd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      running_(false),
+      nextTimerId_(1) {
+  add(wakeFd_, EPOLLIN, [this](uint32_t) {
+    uint64_t count;
+    while (::read(wakeFd_, &count, sizeof(count)) > 0) {
+    }
+  });
+}
+
+EventLoop::~EventLoop() {
+  ::close(wakeFd_);
+  ::close(epollFd_);
+}
+
+void EventLoop::add(int fd, uint32_t events, Handler handler) {
+  handlers_[fd] = std::make_shared<Handler>(std::move(handler));
+  epoll_event ev = {};
+  ev.events = events;
+  ev.data.fd = fd;
+  epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void EventLoop::modify(int fd, uint32_t events) {
+  epoll_event ev = {};
+  ev.events = events;
+  ev.data.fd = fd;
+  epoll_ctl(epollFd_, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void EventLoop::remove(int fd) {
+  epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+  handlers_.erase(fd);
+}
+
+uint64_t EventLoop::after(int64_t delayMs, Task task) {
+  uint64_t id = nextTimerId_++;
+  timers_.emplace(nowMs() + delayMs, Timer{id, std::move(task)});
+  return id;
+}
+
+void EventLoop::cancel(uint64_t timerId) {
+  for (auto it = timers_.begin(); it != timers_.end(); ++it) {
+    if (it->second.id == timerId) {
+      timers_.erase(it);
+      return;
+    }
+  }
+}
+
+void EventLoop::run() {
+  running_ = true;
+  epoll_event events[64];
+  while (running_) {
+    int timeout = -1;
+    if (!timers_.empty()) {
+      int64_t wait = timers_.begin()->first - nowMs();
+      timeout = wait < 0 ? 0 : (int)wait;
+    }
+    int count = epoll_wait(epollFd_, events, 64, timeout);
+    if (count < 0 && errno != EINTR) {
+      perror("epoll_wait");
+      return;
+    }
+    for (int i = 0; i < count; i++) {
+      auto it = handlers_.find(events[i].data.fd);
+      if (it == handlers_.end()) {
+        continue;                       // removed by an earlier handler in this batch
+      }
+      std::shared_ptr<Handler> handler = it->second;
+      (*handler)(events[i].events);
+    }
+
+    int64_t now = nowMs();
+    while (!timers_.empty() && timers_.begin()->first <= now) {
+      Task task = std::move(timers_.begin()->second.task);
+      timers_.erase(timers_.begin());
+      task();
+    }
+  }
+}
+
+// Only async-signal-safe calls here
+void EventLoop::stop() {
+  running_ = false;
+  uint64_t one = 1;
+  ssize_t ignored = ::write(wakeFd_, &one, sizeof(one));
+  (void)ignored;
+}
+
+int64_t EventLoop::nowMs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// ===== Sockets =====
+
+bool parseEndpoint(const std::string& text, uint16_t defaultPort, Endpoint& out) {
+  size_t colon = text.rfind(':');
+  out.host = colon == std::string::npos ? text : text.substr(0, colon);
+  out.port = defaultPort;
+  if (colon != std::string::npos) {
+    char* end;
+    long port = strtol(text.c_str() + colon + 1, &end, 10);
+    if (*end != '\0' || port < 0 || port > 65535) {
+      return false;
+    }
+    out.port = (uint16_t)port;
+  }
+  if (out.host.empty()) {
+    out.host = "0.0.0.0";
+  }
+  return true;
+}
+
+namespace {
+
+bool resolve(const Endpoint& endpoint, sockaddr_storage& addr, socklen_t& length) {
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* result = nullptr;
+  char port[8];
+  snprintf(port, sizeof(port), "%u", endpoint.port);
+  if (getaddrinfo(endpoint.host.c_str(), port, &hints, &result) != 0 || result == nullptr) {
+    return false;
+  }
+  memcpy(&addr, result->ai_addr, result->ai_addrlen);
+  length = result->ai_addrlen;
+  freeaddrinfo(result);
+  return true;
+}
+
+}  // namespace
+
+int listenTcp(const Endpoint& endpoint) {
+  sockaddr_storage addr;
+  socklen_t length;
+  if (!resolve(endpoint, addr, length)) {
+    return -1;
+  }
+  int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, reinterpret_cast<sockaddr*>(&addr), length) != 0 || ::listen(fd, 64) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int connectTcp(const Endpoint& endpoint) {
+  sockaddr_storage addr;
+  socklen_t length;
+  if (!resolve(endpoint, addr, length)) {
+    return -1;
+  }
+  int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), length) != 0 && errno != EINPROGRESS) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+std::string queryParam(const std::string& query, const std::string& name) {
+  size_t pos = 0;
+  while (pos <= query.size()) {
+    size_t end = query.find('&', pos);
+    if (end == std::string::npos) {
+      end = query.size();
+    }
+    std::string pair = query.substr(pos, end - pos);
+    size_t eq = pair.find('=');
+    if (pair.substr(0, eq) == name) {
+      return eq == std::string::npos ? "" : pair.substr(eq + 1);
+    }
+    pos = end + 1;
+  }
+  return "";
+}
+
+std::string HttpRequest::header(const char* name) const {
+  for (const auto& entry : headers) {
+    if (strcasecmp(entry.first.c_str(), name) == 0) {
+      return entry.second;
+    }
+  }
+  return "";
+}
+
+// ===== WsConnection =====
+
+WsConnection::WsConnection(EventLoop& loop, int fd, bool client)
+    : loop_(loop),
+      fd_(fd),
+      client_(client),
+      state_(client ? State::Connecting : State::Handshake),
+      outPos_(0),
+      wantWrite_(client),
+      closeAfterFlush_(false),
+      messageIsText_(false),
+      lastRxMs_(EventLoop::nowMs()) {}
+
+WsConnection::~WsConnection() {
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+}
+
+WsConnection::Ptr WsConnection::accept(EventLoop& loop, int fd) {
+  Ptr conn(new WsConnection(loop, fd, false));
+  sockaddr_storage addr;
+  socklen_t length = sizeof(addr);
+  char host[64] = "?";
+  if (getpeername(fd, reinterpret_cast<sockaddr*>(&addr), &length) == 0) {
+    getnameinfo(reinterpret_cast<sockaddr*>(&addr), length, host, sizeof(host), nullptr, 0, NI_NUMERICHOST);
+  }
+  conn->peer_ = host;
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  loop.add(fd, EPOLLIN, [conn](uint32_t events) { conn->handleEvents(events); });
+  return conn;
+}
+
+WsConnection::Ptr WsConnection::connect(EventLoop& loop, const Endpoint& endpoint, const std::string& path) {
+  int fd = connectTcp(endpoint);
+  if (fd < 0) {
+    return nullptr;
+  }
+  Ptr conn(new WsConnection(loop, fd, true));
+  conn->peer_ = endpoint.host + ":" + std::to_string(endpoint.port);
+  conn->path_ = path;
+  loop.add(fd, EPOLLIN | EPOLLOUT, [conn](uint32_t events) { conn->handleEvents(events); });
+  return conn;
+}
+
+void WsConnection::handleEvents(uint32_t events) {
+  Ptr self = shared_from_this();        // callbacks below may drop the owner's reference
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    if (!(events & EPOLLIN)) {
+      fail();
+      return;
+    }
+  }
+  if (state_ == State::Connecting && (events & EPOLLOUT)) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(fd_, SOL_SOCKET, SO_ERROR, &error, &length);
+    if (error != 0) {
+      fail();
+      return;
+    }
+    uint8_t nonce[16];
+    if (getrandom(nonce, sizeof(nonce), 0) != (ssize_t)sizeof(nonce)) {
+      fail();
+      return;
+    }
+    key_ = base64(std::string(reinterpret_cast<char*>(nonce), sizeof(nonce)));
+    state_ = State::Handshake;
+    std::string request = "GET " + path_ + " HTTP/1.1\r\nHost: " + peer_ +
+                          "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: " + key_ +
+                          "\r\nSec-WebSocket-Version: 13\r\n\r\n";
+    queue(request.data(), request.size());
+  }
+  if (events & EPOLLIN) {
+    readAvailable();
+  }
+  if (state_ != State::Closed && (events & EPOLLOUT)) {
+    flush();
+  }
+}
+
+void WsConnection::readAvailable() {
+  char buffer[16 * 1024];
+  for (;;) {
+    ssize_t n = ::read(fd_, buffer, sizeof(buffer));
+    if (n > 0) {
+      in_.append(buffer, (size_t)n);
+      lastRxMs_ = EventLoop::nowMs();
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    processInput();                     // whatever arrived before the peer closed
+    fail();
+    return;
+  }
+  processInput();
+}
+
+void WsConnection::processInput() {
+  if (state_ == State::Handshake) {
+    bool done = client_ ? processHandshakeResponse() : processHttpRequest();
+    if (!done) {
+      return;
+    }
+  }
+  if (state_ == State::Open) {
+    processFrames();
+  }
+}
+
+bool WsConnection::processHttpRequest() {
+  size_t headEnd = in_.find("\r\n\r\n");
+  if (headEnd == std::string::npos) {
+    if (in_.size() > MAX_HTTP_HEAD) {
+      fail();
+    }
+    return false;
+  }
+  std::string head = in_.substr(0, headEnd);
+  size_t lineEnd = head.find("\r\n");
+  std::string line = head.substr(0, lineEnd);
+  size_t sp1 = line.find(' ');
+  size_t sp2 = line.find(' ', sp1 + 1);
+  if (sp1 == std::string::npos || sp2 == std::string::npos) {
+    fail();
+    return false;
+  }
+  HttpRequest request;
+  request.method = line.substr(0, sp1);
+  std::string target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+  size_t question = target.find('?');
+  request.path = target.substr(0, question);
+  if (question != std::string::npos) {
+    request.query = target.substr(question + 1);
+  }
+  parseHeaders(head, request.headers);
+
+  std::string wsKey = headerValue(head, "Sec-WebSocket-Key");
+  if (!wsKey.empty() && strcasecmp(headerValue(head, "Upgrade").c_str(), "websocket") == 0) {
+    in_.erase(0, headEnd + 4);
+    std::string response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                           "Sec-WebSocket-Accept: " + acceptKey(wsKey) + "\r\n\r\n";
+    queue(response.data(), response.size());
+    state_ = State::Open;
+    path_ = request.path;
+    if (onOpen) {
+      onOpen(path_);
+    }
+    flush();
+    return state_ == State::Open;
+  }
+
+  size_t contentLength = strtoul(headerValue(head, "Content-Length").c_str(), nullptr, 10);
+  HttpResponse response;
+  if (contentLength > maxHttpBody) {
+    response.status = 413;
+  } else if (in_.size() < headEnd + 4 + contentLength) {
+    return false;                       // body still arriving
+  } else {
+    request.body = in_.substr(headEnd + 4, contentLength);
+    if (onHttp) {
+      response = onHttp(request);
+    } else {
+      response.status = 404;
+    }
+  }
+  in_.clear();
+  char header[160];
+  snprintf(header, sizeof(header),
+           "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+           response.status, statusText(response.status), response.contentType.c_str(), response.body.size());
+  queue(header, strlen(header));
+  queue(response.body.data(), response.body.size());
+  closeAfterFlush_ = true;
+  flush();
+  return false;
+}
+
+bool WsConnection::processHandshakeResponse() {
+  size_t headEnd = in_.find("\r\n\r\n");
+  if (headEnd == std::string::npos) {
+    if (in_.size() > MAX_HTTP_HEAD) {
+      fail();
+    }
+    return false;
+  }
+  std::string head = in_.substr(0, headEnd);
+  in_.erase(0, headEnd + 4);
+  if (head.compare(0, 12, "HTTP/1.1 101") != 0 || headerValue(head, "Sec-WebSocket-Accept") != acceptKey(key_)) {
+    fail();
+    return false;
+  }
+  state_ = State::Open;
+  if (onOpen) {
+    onOpen(path_);
+  }
+  return state_ == State::Open;
+}
+
+bool WsConnection::processFrames() {
+  size_t pos = 0;
+  while (state_ == State::Open) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(in_.data()) + pos;
+    size_t available = in_.size() - pos;
+    if (available < 2) {
+      break;
+    }
+    bool fin = p[0] & 0x80;
+    uint8_t opcode = p[0] & 0x0F;
+    bool masked = p[1] & 0x80;
+    uint64_t length = p[1] & 0x7F;
+    size_t header = 2;
+    if (length == 126) {
+      if (available < 4) break;
+      length = ((uint64_t)p[2] << 8) | p[3];
+      header = 4;
+    } else if (length == 127) {
+      if (available < 10) break;
+      length = 0;
+      for (int i = 0; i < 8; i++) {
+        length = (length << 8) | p[2 + i];
+      }
+      header = 10;
+    }
+    if (length > MAX_MESSAGE || masked == client_) {
+      fail();                           // oversized, or masking the wrong way round
+      return false;
+    }
+    size_t maskOffset = header;
+    if (masked) {
+      header += 4;
+    }
+    if (available < header + length) {
+      break;
+    }
+
+    std::string payload(reinterpret_cast<const char*>(p + header), (size_t)length);
+    if (masked) {
+      for (size_t i = 0; i < payload.size(); i++) {
+        payload[i] ^= p[maskOffset + (i & 3)];
+      }
+    }
+    pos += header + (size_t)length;
+
+    switch (opcode) {
+      case OP_TEXT:
+      case OP_BINARY:
+      case OP_CONTINUATION:
+        if (opcode != OP_CONTINUATION) {
+          message_.clear();
+          messageIsText_ = opcode == OP_TEXT;
+        }
+        if (message_.size() + payload.size() > MAX_MESSAGE) {
+          fail();
+          return false;
+        }
+        message_ += payload;
+        if (fin) {
+          std::string text;
+          text.swap(message_);
+          if (messageIsText_ && onText) {
+            onText(text);               // binary messages have no use in the lamp protocol
+          }
+        }
+        break;
+      case OP_PING:
+        sendFrame(OP_PONG, payload.data(), payload.size());
+        break;
+      case OP_PONG:
+        break;
+      case OP_CLOSE:
+        sendFrame(OP_CLOSE, payload.data(), payload.size() >= 2 ? 2 : 0);
+        closeAfterFlush_ = true;
+        flush();
+        return false;
+      default:
+        fail();
+        return false;
+    }
+  }
+  if (state_ != State::Closed) {
+    in_.erase(0, pos);
+  }
+  return true;
+}
+
+void WsConnection::sendText(const char* data, size_t length) {
+  if (state_ == State::Open && !closeAfterFlush_) {
+    sendFrame(OP_TEXT, data, length);
+  }
+}
+
+void WsConnection::sendPing() {
+  if (state_ == State::Open && !closeAfterFlush_) {
+    sendFrame(OP_PING, nullptr, 0);
+  }
+}
+
+void WsConnection::sendFrame(uint8_t opcode, const char* data, size_t length) {
+  uint8_t header[14];
+  size_t headerLength = 2;
+  header[0] = 0x80 | opcode;
+  if (length < 126) {
+    header[1] = (uint8_t)length;
+  } else if (length <= 0xFFFF) {
+    header[1] = 126;
+    header[2] = (uint8_t)(length >> 8);
+    header[3] = (uint8_t)length;
+    headerLength = 4;
+  } else {
+    header[1] = 127;
+    for (int i = 0; i < 8; i++) {
+      header[2 + i] = (uint8_t)((uint64_t)length >> (56 - i * 8));
+    }
+    headerLength = 10;
+  }
+
+  if (!client_) {
+    queue(reinterpret_cast<char*>(header), headerLength);
+    queue(data, length);
+  } else {
+    // Client frames are masked (RFC 6455 5.3)
+    uint8_t mask[4];
+    if (getrandom(mask, sizeof(mask), 0) != (ssize_t)sizeof(mask)) {
+      memset(mask, 0x5A, sizeof(mask));
+    }
+    header[1] |= 0x80;
+    memcpy(header + headerLength, mask, 4);
+    queue(reinterpret_cast<char*>(header), headerLength + 4);
+    std::string masked(data != nullptr ? data : "", length);
+    for (size_t i = 0; i < length; i++) {
+      masked[i] ^= mask[i & 3];
+    }
+    queue(masked.data(), masked.size());
+  }
+  flush();
+}
+
+void WsConnection::queue(const char* data, size_t length) {
+  if (outPos_ > 0 && outPos_ == out_.size()) {
+    out_.clear();
+    outPos_ = 0;
+  }
+  out_.append(data, length);
+}
+
+void WsConnection::flush() {
+  if (state_ == State::Connecting || state_ == State::Closed) {
+    return;
+  }
+  // Only a backlog that was waiting for EPOLLOUT counts as drained; a frame that goes
+  // straight out must not call back into the sender
+  bool hadQueue = wantWrite_;
+  while (outPos_ < out_.size()) {
+    ssize_t n = ::send(fd_, out_.data() + outPos_, out_.size() - outPos_, MSG_NOSIGNAL);
+    if (n > 0) {
+      outPos_ += (size_t)n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    fail();
+    return;
+  }
+  if (outPos_ == out_.size()) {
+    out_.clear();
+    outPos_ = 0;
+    if (closeAfterFlush_) {
+      close();
+      return;
+    }
+    if (hadQueue && onDrain && state_ == State::Open) {
+      onDrain();
+    }
+  }
+  updateInterest();
+}
+
+void WsConnection::updateInterest() {
+  bool want = queuedBytes() > 0;
+  if (want != wantWrite_ && state_ != State::Closed) {
+    wantWrite_ = want;
+    loop_.modify(fd_, EPOLLIN | (want ? EPOLLOUT : 0));
+  }
+}
+
+void WsConnection::close() {
+  if (state_ == State::Closed) {
+    return;
+  }
+  Ptr self = shared_from_this();        // onClose may release the owner's last reference
+  state_ = State::Closed;
+  loop_.remove(fd_);
+  ::close(fd_);
+  fd_ = -1;
+  if (onClose) {
+    std::function<void()> callback;
+    callback.swap(onClose);
+    callback();
+  }
+  onOpen = nullptr;                     // break reference cycles through captured owners
+  onText = nullptr;
+  onDrain = nullptr;
+  onHttp = nullptr;
+}
+
+void WsConnection::closeWithStatus(uint16_t code, const std::string& reason) {
+  if (state_ != State::Open) {
+    close();
+    return;
+  }
+  if (closeAfterFlush_) {
+    return;                             // a close frame is already on its way
+  }
+  std::string payload;
+  payload.push_back((char)(code >> 8));
+  payload.push_back((char)(code & 0xFF));
+  payload += reason.substr(0, 123);     // control frame payloads are capped at 125 bytes
+  sendFrame(OP_CLOSE, payload.data(), payload.size());
+  closeAfterFlush_ = true;
+  flush();
+}
+
+void WsConnection::fail() {
+  closeAfterFlush_ = false;
+  close();
+}
+
+// ===== HttpClient =====
+
+HttpClient::HttpClient(EventLoop& loop, int fd)
+    : loop_(loop), fd_(fd), connected_(false), done_(false), outPos_(0), headLength_(0) {}
+
+HttpClient::~HttpClient() {
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+}
+
+HttpClient::Ptr HttpClient::start(EventLoop& loop, const Endpoint& endpoint, const HttpRequest& request,
+                                  const std::string& contentType) {
+  int fd = connectTcp(endpoint);
+  if (fd < 0) {
+    return nullptr;
+  }
+  Ptr client(new HttpClient(loop, fd));
+  std::string target = request.path + (request.query.empty() ? "" : "?" + request.query);
+  char length[24];
+  snprintf(length, sizeof(length), "%zu", request.body.size());
+  client->out_ = request.method + " " + target + " HTTP/1.1\r\nHost: " + endpoint.host + "\r\nContent-Type: " +
+                 contentType + "\r\nContent-Length: " + length + "\r\nConnection: close\r\n";
+  for (const auto& header : request.headers) {
+    client->out_ += header.first + ": " + header.second + "\r\n";
+  }
+  client->out_ += "\r\n";
+  client->headLength_ = client->out_.size();
+  client->out_ += request.body;
+  loop.add(fd, EPOLLIN | EPOLLOUT, [client](uint32_t events) { client->handleEvents(events); });
+  return client;
+}
+
+void HttpClient::handleEvents(uint32_t events) {
+  Ptr self = shared_from_this();        // onDone may drop the owner's reference
+  if (!connected_ && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(fd_, SOL_SOCKET, SO_ERROR, &error, &length);
+    if (error != 0) {
+      finish(0, "");
+      return;
+    }
+    connected_ = true;
+  }
+  if (events & EPOLLIN) {
+    readAvailable();
+  } else if (events & (EPOLLERR | EPOLLHUP)) {
+    finish(0, "");
+  }
+  if (!done_ && (events & EPOLLOUT)) {
+    sendPending();
+  }
+}
+
+void HttpClient::sendPending() {
+  size_t before = outPos_;
+  while (outPos_ < out_.size()) {
+    ssize_t n = ::send(fd_, out_.data() + outPos_, out_.size() - outPos_, MSG_NOSIGNAL);
+    if (n > 0) {
+      outPos_ += (size_t)n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    finish(0, "");
+    return;
+  }
+  if (outPos_ != before && outPos_ > headLength_ && onProgress) {
+    onProgress(outPos_ - headLength_, out_.size() - headLength_);
+  }
+  if (outPos_ == out_.size()) {
+    std::string().swap(out_);           // images can be megabytes; keep only the response
+    outPos_ = 0;
+    headLength_ = 0;
+    loop_.modify(fd_, EPOLLIN);
+  }
+}
+
+// The response ends at Content-Length or, failing that, when the server closes
+void HttpClient::readAvailable() {
+  char buffer[16 * 1024];
+  bool eof = false;
+  for (;;) {
+    ssize_t n = ::read(fd_, buffer, sizeof(buffer));
+    if (n > 0) {
+      in_.append(buffer, (size_t)n);
+      if (in_.size() > MAX_RESPONSE) {
+        finish(0, "");
+        return;
+      }
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    eof = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+    break;
+  }
+
+  size_t headEnd = in_.find("\r\n\r\n");
+  if (headEnd == std::string::npos || in_.compare(0, 5, "HTTP/") != 0) {
+    if (eof) {
+      finish(0, "");
+    }
+    return;
+  }
+  std::string head = in_.substr(0, headEnd);
+  std::string lengthText = headerValue(head, "Content-Length");
+  size_t bodyLength = in_.size() - headEnd - 4;
+  if (!lengthText.empty()) {
+    size_t expected = strtoul(lengthText.c_str(), nullptr, 10);
+    if (bodyLength < expected) {
+      if (eof) {
+        finish(0, "");
+      }
+      return;
+    }
+    bodyLength = expected;
+  } else if (!eof) {
+    return;
+  }
+  size_t space = head.find(' ');
+  int status = space == std::string::npos ? 0 : atoi(head.c_str() + space + 1);
+  finish(status, in_.substr(headEnd + 4, bodyLength));
+}
+
+void HttpClient::finish(int status, const std::string& body) {
+  if (done_) {
+    return;
+  }
+  Ptr self = shared_from_this();
+  done_ = true;
+  loop_.remove(fd_);
+  ::close(fd_);
+  fd_ = -1;
+  onProgress = nullptr;
+  std::function<void(int, const std::string&)> callback;
+  callback.swap(onDone);
+  if (callback) {
+    callback(status, body);
+  }
+}
+
+// ===== TcpListener =====
+
+TcpListener::TcpListener(EventLoop& loop, std::function<void(WsConnection::Ptr)> onAccept)
+    : loop_(loop), onAccept_(std::move(onAccept)), fd_(-1) {}
+
+TcpListener::~TcpListener() {
+  if (fd_ >= 0) {
+    loop_.remove(fd_);
+    ::close(fd_);
+  }
+}
+
+uint16_t TcpListener::port() const {
+  sockaddr_storage addr;
+  socklen_t length = sizeof(addr);
+  if (fd_ < 0 || getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &length) != 0) {
+    return 0;
+  }
+  if (addr.ss_family == AF_INET6) {
+    return ntohs(reinterpret_cast<sockaddr_in6*>(&addr)->sin6_port);
+  }
+  return ntohs(reinterpret_cast<sockaddr_in*>(&addr)->sin_port);
+}
+
+bool TcpListener::listen(const Endpoint& endpoint) {
+  fd_ = listenTcp(endpoint);
+  if (fd_ < 0) {
+    return false;
+  }
+  loop_.add(fd_, EPOLLIN, [this](uint32_t) {
+    for (;;) {
+      int fd = accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        return;
+      }
+      onAccept_(WsConnection::accept(loop_, fd));
+    }
+  });
+  return true;
+}
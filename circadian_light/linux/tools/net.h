@@ -0,0 +1,213 @@
+#ifndef LAMP_TOOLS_NET_H_
+#define LAMP_TOOLS_NET_H_
+
+// Minimal epoll reactor plus HTTP/WebSocket connections for the native lamp tools (the
+// connection proxy, the fleet orchestrator and the lamp stand-in). Everything is single-threaded: sockets are
+// non-blocking and every callback runs on the EventLoop that owns the connection.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+
+class EventLoop {
+ public:
+  using Handler = std::function<void(uint32_t events)>;
+  using Task = std::function<void()>;
+
+  EventLoop();
+  ~EventLoop();
+  EventLoop(const EventLoop&) = delete;
+  EventLoop& operator=(const EventLoop&) = delete;
+
+  void add(int fd, uint32_t events, Handler handler);
+  void modify(int fd, uint32_t events);
+  void remove(int fd);
+
+  // One-shot timer; the returned id can be passed to cancel()
+  uint64_t after(int64_t delayMs, Task task);
+  void cancel(uint64_t timerId);
+
+  // Runs until stop(); stop() may also be called from a signal handler or another thread
+  void run();
+  void stop();
+
+  static int64_t nowMs();
+
+ private:
+  struct Timer {
+    uint64_t id;
+    Task task;
+  };
+
+  int epollFd_;
+  int wakeFd_;                        // eventfd that interrupts epoll_wait for stop()
+  std::atomic<bool> running_;
+  std::map<int, std::shared_ptr<Handler>> handlers_;
+  std::multimap<int64_t, Timer> timers_;
+  uint64_t nextTimerId_;
+};
+
+struct Endpoint {
+  std::string host;
+  uint16_t port;
+};
+
+// "host", "host:port" or ":port"; false if the port is not a number in range. Port 0
+// lets the kernel pick a free one when listening (see TcpListener::port()).
+bool parseEndpoint(const std::string& text, uint16_t defaultPort, Endpoint& out);
+
+int listenTcp(const Endpoint& endpoint);
+
+// Starts a non-blocking connect; completion is signalled by EPOLLOUT. -1 on failure.
+int connectTcp(const Endpoint& endpoint);
+
+struct HttpRequest {
+  std::string method;
+  std::string path;          // without the query string
+  std::string query;
+  std::map<std::string, std::string> headers;   // received ones, or extra ones to send
+  std::string body;
+
+  // Case-insensitive lookup in `headers`; "" when absent
+  std::string header(const char* name) const;
+};
+
+struct HttpResponse {
+  int status = 200;
+  std::string contentType = "application/json";
+  std::string body;
+};
+
+// One TCP connection speaking HTTP/1.1 or, after an upgrade, WebSocket. Accepted
+// connections answer plain requests through onHttp and upgrade requests on any path;
+// connections made with WsConnection::connect() perform the client handshake.
+class WsConnection : public std::enable_shared_from_this<WsConnection> {
+ public:
+  using Ptr = std::shared_ptr<WsConnection>;
+
+  static const size_t MAX_MESSAGE = 64 * 1024;
+
+  // Server side: `fd` is an accepted socket
+  static Ptr accept(EventLoop& loop, int fd);
+  // Client side: opens ws://endpoint/path; onOpen fires once the handshake completes
+  static Ptr connect(EventLoop& loop, const Endpoint& endpoint, const std::string& path);
+
+  ~WsConnection();
+
+  std::function<void(const std::string& path)> onOpen;
+  std::function<void(const std::string& text)> onText;
+  std::function<void()> onDrain;      // the send queue just emptied
+  std::function<void()> onClose;      // once, after the socket is closed
+  std::function<HttpResponse(const HttpRequest& request)> onHttp;
+  size_t maxHttpBody = MAX_MESSAGE;   // larger request bodies are refused with 413
+
+  void sendText(const char* data, size_t length);
+  void sendText(const std::string& text) { sendText(text.data(), text.size()); }
+  void sendPing();
+  void close();
+  // Send a close frame carrying `code` (RFC 6455 7.4) and close once it is written
+  void closeWithStatus(uint16_t code, const std::string& reason);
+
+  bool isOpen() const { return state_ == State::Open; }
+  size_t queuedBytes() const { return out_.size() - outPos_; }
+  const std::string& peer() const { return peer_; }
+  int64_t lastRxMs() const { return lastRxMs_; }
+
+ private:
+  enum class State { Connecting, Handshake, Open, Closed };
+
+  WsConnection(EventLoop& loop, int fd, bool client);
+
+  void handleEvents(uint32_t events);
+  void readAvailable();
+  void processInput();
+  bool processHttpRequest();
+  bool processHandshakeResponse();
+  bool processFrames();
+  void sendFrame(uint8_t opcode, const char* data, size_t length);
+  void queue(const char* data, size_t length);
+  void flush();
+  void updateInterest();
+  void fail();
+
+  EventLoop& loop_;
+  int fd_;
+  bool client_;
+  State state_;
+  std::string peer_;
+  std::string path_;
+  std::string key_;                   // client handshake nonce
+  std::string in_;
+  std::string out_;
+  size_t outPos_;
+  bool wantWrite_;
+  bool closeAfterFlush_;
+  std::string message_;               // fragments of the current message
+  bool messageIsText_;
+  int64_t lastRxMs_;
+};
+
+// One HTTP/1.1 request on a connection of its own (Connection: close). onProgress reports
+// how much of the request body the kernel has taken; onDone fires exactly once, with
+// status 0 if the request failed before a complete response arrived.
+class HttpClient : public std::enable_shared_from_this<HttpClient> {
+ public:
+  using Ptr = std::shared_ptr<HttpClient>;
+
+  static const size_t MAX_RESPONSE = 1024 * 1024;
+
+  // nullptr if the connection cannot be started at all (e.g. unresolvable host)
+  static Ptr start(EventLoop& loop, const Endpoint& endpoint, const HttpRequest& request,
+                   const std::string& contentType);
+
+  ~HttpClient();
+
+  std::function<void(size_t sent, size_t total)> onProgress;
+  std::function<void(int status, const std::string& body)> onDone;
+
+  // Drops the connection; onDone reports status 0
+  void abort() { finish(0, ""); }
+
+ private:
+  HttpClient(EventLoop& loop, int fd);
+
+  void handleEvents(uint32_t events);
+  void sendPending();
+  void readAvailable();
+  void finish(int status, const std::string& body);
+
+  EventLoop& loop_;
+  int fd_;
+  bool connected_;
+  bool done_;
+  std::string out_;
+  size_t outPos_;
+  size_t headLength_;                 // request head; the rest of out_ is the body
+  std::string in_;
+};
+
+// Accepts connections on `endpoint` and hands each one to `onAccept`
+class TcpListener {
+ public:
+  TcpListener(EventLoop& loop, std::function<void(WsConnection::Ptr)> onAccept);
+  ~TcpListener();
+  bool listen(const Endpoint& endpoint);
+
+  // Bound port, e.g. the one the kernel picked for port 0; 0 if not listening
+  uint16_t port() const;
+
+ private:
+  EventLoop& loop_;
+  std::function<void(WsConnection::Ptr)> onAccept_;
+  int fd_;
+};
+
+// Value of a query parameter ("" if absent); no percent-decoding
+std::string queryParam(const std::string& query, const std::string& name);
+
+#endif  // LAMP_TOOLS_NET_H_
@@ -0,0 +1,265 @@
+// Integration test for lamp_fleet --ota against a handful of lamp_standin instances:
+//   - no more than --parallel images are in flight at once, and the bound is reached
+//   - 5xx replies are retried after 1 s, then 2 s, up to --retries, then the lamp fails
+//   - a 4xx reply (a wrong OTA token) fails the lamp at once, without retries
+//   - the summary table and the exit status report each outcome
+// Upload windows come from the stand-ins' "update answered" log lines.
+//
+//   fleet_test <lamp_standin> <lamp_fleet>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tool_test.h"
+
+using tool_test::Process;
+
+namespace {
+
+const int WAIT_MS = 3000;
+const int FLEET_WAIT_MS = 20000;
+const int FLASH_MS = 250;
+const int FIRST_BACKOFF_MS = 1000;            // BACKOFF_MS in lamp_fleet.cc
+const int BACKOFF_SLACK_MS = 500;
+const size_t IMAGE_SIZE = 64 * 1024;
+
+struct Window {
+  int status;
+  long long fromMs;
+  long long toMs;
+};
+
+struct Row {
+  std::string result;
+  int attempts = -1;
+};
+
+// A temporary file, removed again when the test ends
+class TempFile {
+ public:
+  explicit TempFile(const std::string& contents) {
+    char name[] = "/tmp/fleet_test.XXXXXX";
+    int fd = mkstemp(name);
+    if (fd >= 0) {
+      path_ = name;
+      ssize_t written = write(fd, contents.data(), contents.size());
+      (void)written;
+      close(fd);
+    }
+  }
+  ~TempFile() {
+    if (!path_.empty()) {
+      unlink(path_.c_str());
+    }
+  }
+  const std::string& path() const { return path_; }
+
+ private:
+  std::string path_;
+};
+
+// Every "update answered S (monotonic A..B ms)" line in a stand-in's log
+std::vector<Window> windowsOf(const Process& standin) {
+  std::vector<Window> windows;
+  std::istringstream lines(standin.log());
+  std::string line;
+  while (std::getline(lines, line)) {
+    Window window;
+    size_t at = line.find("update answered ");
+    if (at != std::string::npos &&
+        sscanf(line.c_str() + at, "update answered %d (monotonic %lld..%lld ms)", &window.status, &window.fromMs,
+               &window.toMs) == 3) {
+      windows.push_back(window);
+    }
+  }
+  return windows;
+}
+
+// Most windows open at the same moment across all stand-ins
+int maxOverlap(const std::vector<std::unique_ptr<Process>>& standins) {
+  std::vector<std::pair<long long, int>> edges;   // closes sort before opens at the same ms
+  for (const auto& standin : standins) {
+    for (const Window& window : windowsOf(*standin)) {
+      edges.emplace_back(window.fromMs, 1);
+      edges.emplace_back(window.toMs, -1);
+    }
+  }
+  std::sort(edges.begin(), edges.end());
+  int open = 0;
+  int most = 0;
+  for (const auto& edge : edges) {
+    open += edge.second;
+    most = std::max(most, open);
+  }
+  return most;
+}
+
+// The fleet's summary table, by lamp name
+Row rowOf(const Process& fleet, const std::string& name) {
+  Row row;
+  std::istringstream lines(fleet.output());
+  std::string line;
+  while (std::getline(lines, line)) {
+    std::istringstream fields(line);
+    std::string lamp;
+    std::string address;
+    if (fields >> lamp >> address >> row.result >> row.attempts && lamp == name) {
+      return row;
+    }
+  }
+  return Row();
+}
+
+class Fixture {
+ public:
+  Fixture(EventLoop& loop, const char* standinPath, const char* fleetPath)
+      : loop_(loop), standinPath_(standinPath), fleetPath_(fleetPath) {}
+
+  // A stand-in named `name` with extra options; it joins the next fleet run's --lamp list
+  void addLamp(const std::string& name, std::vector<std::string> options) {
+    std::vector<std::string> argv = {standinPath_, "--listen", "127.0.0.1:0", "--name", name};
+    argv.insert(argv.end(), options.begin(), options.end());
+    standins_.emplace_back(new Process(loop_));
+    TOOL_CHECK(standins_.back()->start(argv), "cannot start " + name);
+    uint16_t port = standins_.back()->waitForPort(WAIT_MS);
+    TOOL_CHECK(port != 0, name + " did not report its port");
+    lamps_.push_back("--lamp");
+    lamps_.push_back(name + "=127.0.0.1:" + std::to_string(port));
+  }
+
+  // Runs lamp_fleet to completion; its exit status
+  int runFleet(std::vector<std::string> options) {
+    std::vector<std::string> argv = {fleetPath_};
+    argv.insert(argv.end(), lamps_.begin(), lamps_.end());
+    argv.insert(argv.end(), options.begin(), options.end());
+    fleet_.reset(new Process(loop_));
+    TOOL_CHECK(fleet_->start(argv), "cannot start lamp_fleet");
+    int status = fleet_->wait(FLEET_WAIT_MS);
+    TOOL_CHECK(status >= 0, "lamp_fleet did not finish");
+    return status;
+  }
+
+  const Process& fleet() const { return *fleet_; }
+  const Process& standin(size_t index) const { return *standins_[index]; }
+  const std::vector<std::unique_ptr<Process>>& standins() const { return standins_; }
+
+  void dumpLogs() const {
+    for (const auto& standin : standins_) {
+      standin->dumpLog();
+    }
+    if (fleet_) {
+      fleet_->dumpLog();
+      fprintf(stderr, "---- lamp_fleet stdout ----\n%s", fleet_->output().c_str());
+    }
+  }
+
+ private:
+  EventLoop& loop_;
+  std::string standinPath_;
+  std::string fleetPath_;
+  std::vector<std::unique_ptr<Process>> standins_;
+  std::vector<std::string> lamps_;
+  std::unique_ptr<Process> fleet_;
+};
+
+// Four healthy lamps, two at a time
+void testParallelBound(EventLoop& loop, const char* standinPath, const char* fleetPath, const std::string& image) {
+  Fixture fixture(loop, standinPath, fleetPath);
+  for (const char* name : {"lamp-a", "lamp-b", "lamp-c", "lamp-d"}) {
+    fixture.addLamp(name, {"--flash-ms", std::to_string(FLASH_MS)});
+  }
+  int status = fixture.runFleet({"--parallel", "2", "--retries", "0", "--token", "t", "--ota", image});
+  TOOL_CHECK(status == 0, "exit status " + std::to_string(status));
+  for (const char* name : {"lamp-a", "lamp-b", "lamp-c", "lamp-d"}) {
+    Row row = rowOf(fixture.fleet(), name);
+    TOOL_CHECK(row.result == "ok" && row.attempts == 1,
+               std::string(name) + ": " + row.result + " after " + std::to_string(row.attempts));
+  }
+  int overlap = maxOverlap(fixture.standins());
+  TOOL_CHECK(overlap == 2, "up to " + std::to_string(overlap) + " uploads in flight with --parallel 2");
+  if (tool_test::failureCount() > 0) {
+    fixture.dumpLogs();
+  }
+}
+
+// Retries with backoff for 5xx, none for 4xx, and a failing exit status
+void testRetries(EventLoop& loop, const char* standinPath, const char* fleetPath, const std::string& image) {
+  int failuresBefore = tool_test::failureCount();
+  TempFile tokens("# lamp-locked only accepts \"secret\"\nlamp-locked wrong\n");
+  Fixture fixture(loop, standinPath, fleetPath);
+  fixture.addLamp("lamp-flaky", {"--fail-updates", "2"});
+  fixture.addLamp("lamp-broken", {"--fail-updates", "5"});
+  fixture.addLamp("lamp-locked", {"--token", "secret"});
+  fixture.addLamp("lamp-fine", {});
+  int status = fixture.runFleet({"--parallel", "4", "--retries", "2", "--token", "t", "--tokens",
+                                 tokens.path(), "--ota", image});
+  TOOL_CHECK(status == 1, "exit status " + std::to_string(status));
+
+  Row flaky = rowOf(fixture.fleet(), "lamp-flaky");
+  TOOL_CHECK(flaky.result == "ok" && flaky.attempts == 3, flaky.result + " after " + std::to_string(flaky.attempts));
+  Row broken = rowOf(fixture.fleet(), "lamp-broken");
+  TOOL_CHECK(broken.result == "FAILED" && broken.attempts == 3,
+             broken.result + " after " + std::to_string(broken.attempts));
+  Row locked = rowOf(fixture.fleet(), "lamp-locked");
+  TOOL_CHECK(locked.result == "FAILED" && locked.attempts == 1,
+             locked.result + " after " + std::to_string(locked.attempts));
+  Row fine = rowOf(fixture.fleet(), "lamp-fine");
+  TOOL_CHECK(fine.result == "ok" && fine.attempts == 1, fine.result + " after " + std::to_string(fine.attempts));
+
+  // What each lamp actually saw: 500, 500, 200 spaced 1 s then 2 s apart; 3 x 500; one 401
+  std::vector<Window> flakyWindows = windowsOf(fixture.standin(0));
+  TOOL_CHECK(flakyWindows.size() == 3, std::to_string(flakyWindows.size()) + " uploads to lamp-flaky");
+  if (flakyWindows.size() == 3) {
+    TOOL_CHECK(flakyWindows[0].status == 500 && flakyWindows[1].status == 500 && flakyWindows[2].status == 200,
+               "unexpected statuses at lamp-flaky");
+    for (int retry = 1; retry <= 2; retry++) {
+      long long gap = flakyWindows[retry].fromMs - flakyWindows[retry - 1].toMs;
+      long long backoff = (long long)FIRST_BACKOFF_MS << (retry - 1);
+      TOOL_CHECK(gap >= backoff && gap < backoff + BACKOFF_SLACK_MS,
+                 "retry " + std::to_string(retry) + " after " + std::to_string(gap) + " ms, expected " +
+                     std::to_string(backoff));
+    }
+  }
+  TOOL_CHECK(windowsOf(fixture.standin(1)).size() == 3,
+             std::to_string(windowsOf(fixture.standin(1)).size()) + " uploads to lamp-broken");
+  std::vector<Window> lockedWindows = windowsOf(fixture.standin(2));
+  TOOL_CHECK(lockedWindows.size() == 1 && lockedWindows[0].status == 401,
+             std::to_string(lockedWindows.size()) + " uploads to lamp-locked");
+  if (tool_test::failureCount() > failuresBefore) {
+    fixture.dumpLogs();
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s <lamp_standin> <lamp_fleet>\n", argv[0]);
+    return 2;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  EventLoop loop;
+
+  std::string contents(IMAGE_SIZE, '\0');
+  contents[0] = (char)0xE9;                   // ESP_IMAGE_MAGIC, all the fleet checks locally
+  TempFile image(contents);
+  TOOL_CHECK(!image.path().empty(), "cannot write the test image");
+
+  testParallelBound(loop, argv[1], argv[2], image.path());
+  testRetries(loop, argv[1], argv[2], image.path());
+
+  if (tool_test::failureCount() > 0) {
+    fprintf(stderr, "%d check(s) failed\n", tool_test::failureCount());
+    return 1;
+  }
+  printf("fleet_test: all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,219 @@
+// Integration test for lamp_proxy against lamp_standin, both on ephemeral ports:
+//   - a late subscriber is seeded with the cached hello, then the newer state
+//   - a control change reaches every other subscriber but is not echoed to its sender
+//   - controls arriving within the coalesce interval are merged (/stats "coalesced")
+//   - replies to metrics requests go to the requester only
+//   - subscribers are refused while the lamp link is down
+//
+//   proxy_test <lamp_standin> <lamp_proxy>
+
+#include <string.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "protocol_keys.h"
+#include "tool_test.h"
+
+namespace key = lamp_protocol::key;
+namespace msg = lamp_protocol::msg;
+
+using tool_test::Process;
+using tool_test::jsonNumber;
+using tool_test::pump;
+using tool_test::waitFor;
+
+namespace {
+
+const int WAIT_MS = 3000;
+const int COALESCE_MS = 300;           // wide enough that back-to-back sends always merge
+const int QUIET_MS = 300;              // longer than the proxy's 60 ms state refresh
+
+struct Subscriber {
+  WsConnection::Ptr conn;
+  bool open = false;
+  bool closed = false;
+  std::vector<std::string> received;
+
+  void send(const std::string& text) { conn->sendText(text); }
+};
+
+std::shared_ptr<Subscriber> subscribe(EventLoop& loop, uint16_t port, const std::string& path) {
+  auto subscriber = std::make_shared<Subscriber>();
+  Subscriber* raw = subscriber.get();
+  subscriber->conn = WsConnection::connect(loop, {"127.0.0.1", port}, path);
+  subscriber->conn->onOpen = [raw](const std::string&) { raw->open = true; };
+  subscriber->conn->onText = [raw](const std::string& text) { raw->received.push_back(text); };
+  subscriber->conn->onClose = [raw]() { raw->closed = true; };
+  return subscriber;
+}
+
+bool isType(const std::string& text, const char* type) {
+  return text.find(std::string("\"") + key::TYPE + "\":\"" + type + "\"") != std::string::npos;
+}
+
+bool isState(const std::string& text) {
+  return text.compare(0, strlen(key::STATE) + 4, std::string("{\"") + key::STATE + "\":") == 0;
+}
+
+std::string control(int brightness) {
+  return std::string("{\"") + key::BRIGHTNESS + "\":" + std::to_string(brightness) + "}";
+}
+
+std::string request(const char* type) {
+  return std::string("{\"") + key::TYPE + "\":\"" + type + "\"}";
+}
+
+// Index of the first message of `type` (a msg:: name, or "state"), or -1
+int find(const Subscriber& subscriber, const char* type) {
+  for (size_t i = 0; i < subscriber.received.size(); i++) {
+    const std::string& text = subscriber.received[i];
+    if (strcmp(type, key::STATE) == 0 ? isState(text) : isType(text, type)) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+std::string stats(EventLoop& loop, uint16_t port) {
+  HttpRequest request;
+  request.method = "GET";
+  request.path = "/stats";
+  std::string body;
+  bool done = false;
+  HttpClient::Ptr client = HttpClient::start(loop, {"127.0.0.1", port}, request, "text/plain");
+  if (!client) {
+    return "";
+  }
+  client->onDone = [&body, &done](int, const std::string& reply) {
+    body = reply;
+    done = true;
+  };
+  waitFor(loop, [&done]() { return done; }, WAIT_MS);
+  return body;
+}
+
+// "coalesced" of the first lamp in GET /stats
+long long coalesced(EventLoop& loop, uint16_t port) {
+  return jsonNumber(stats(loop, port), "coalesced");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s <lamp_standin> <lamp_proxy>\n", argv[0]);
+    return 2;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  EventLoop loop;
+
+  Process standin(loop);
+  TOOL_CHECK(standin.start({argv[1], "--listen", "127.0.0.1:0", "--name", "standin"}), "cannot start lamp_standin");
+  uint16_t lampPort = standin.waitForPort(WAIT_MS);
+  TOOL_CHECK(lampPort != 0, "lamp_standin did not report its port");
+
+  // The second lamp points at a port nothing listens on, so its link never comes up
+  Process proxy(loop);
+  TOOL_CHECK(proxy.start({argv[2], "--listen", "127.0.0.1:0", "--coalesce-ms", std::to_string(COALESCE_MS),
+                          "--lamp", "lamp=127.0.0.1:" + std::to_string(lampPort), "--lamp", "offline=127.0.0.1:1"}),
+             "cannot start lamp_proxy");
+  uint16_t port = proxy.waitForPort(WAIT_MS);
+  TOOL_CHECK(port != 0, "lamp_proxy did not report its port");
+  if (tool_test::failureCount() > 0) {
+    standin.dumpLog();
+    proxy.dumpLog();
+    return 1;
+  }
+  TOOL_CHECK(waitFor(loop, [&]() { return stats(loop, port).find("\"connected\":true") != std::string::npos; },
+                     WAIT_MS),
+             "proxy never connected to the stand-in");
+
+  // ---- Late subscriber: hello, then the state that superseded it ----
+  auto first = subscribe(loop, port, "/lamp/ws");
+  TOOL_CHECK(waitFor(loop, [&]() { return !first->received.empty(); }, WAIT_MS), "no hello for the first subscriber");
+  TOOL_CHECK(!first->received.empty() && isType(first->received[0], msg::HELLO),
+             first->received.empty() ? "" : first->received[0]);
+
+  first->send(control(3));
+  pump(loop, QUIET_MS);                 // the proxy refreshes and caches the new state
+  auto late = subscribe(loop, port, "/ws");
+  TOOL_CHECK(waitFor(loop, [&]() { return late->received.size() >= 2; }, WAIT_MS), "late subscriber not seeded");
+  if (late->received.size() >= 2) {
+    TOOL_CHECK(isType(late->received[0], msg::HELLO), late->received[0]);
+    TOOL_CHECK(isState(late->received[1]) && jsonNumber(late->received[1], key::BRIGHTNESS) == 3,
+               late->received[1]);
+  }
+
+  // ---- Fan-out without echo ----
+  pump(loop, QUIET_MS);
+  first->received.clear();
+  late->received.clear();
+  first->send(control(5));
+  TOOL_CHECK(waitFor(loop, [&]() { return find(*late, key::STATE) >= 0; }, WAIT_MS), "change not fanned out");
+  pump(loop, QUIET_MS);
+  int shown = find(*late, key::STATE);
+  TOOL_CHECK(shown >= 0 && jsonNumber(late->received[shown], key::BRIGHTNESS) == 5,
+             shown >= 0 ? late->received[shown] : "");
+  TOOL_CHECK(find(*first, key::STATE) < 0, "state echoed to the sender");
+
+  // ---- Reply routing: metrics to the requester only ----
+  pump(loop, COALESCE_MS);              // the next control flushes at once
+  first->received.clear();
+  late->received.clear();
+  first->send(request(msg::METRICS_REQUEST));
+  TOOL_CHECK(waitFor(loop, [&]() { return find(*first, msg::METRICS) >= 0; }, WAIT_MS), "no metrics reply");
+  long long commandsBefore =
+      find(*first, msg::METRICS) >= 0 ? jsonNumber(first->received[find(*first, msg::METRICS)], key::COMMANDS) : -1;
+  pump(loop, QUIET_MS);
+  TOOL_CHECK(find(*late, msg::METRICS) < 0, "metrics reply leaked to another subscriber");
+
+  // ---- Coalescing: the first control goes out at once, the next two merge ----
+  long long coalescedBefore = coalesced(loop, port);
+  first->send(control(6));
+  first->send(control(7));
+  first->send(control(8));
+  TOOL_CHECK(waitFor(loop, [&]() {
+               for (const std::string& text : late->received) {
+                 if (isState(text) && jsonNumber(text, key::BRIGHTNESS) == 8) {
+                   return true;
+                 }
+               }
+               return false;
+             }, WAIT_MS),
+             "merged control never applied");
+  TOOL_CHECK(coalesced(loop, port) - coalescedBefore == 1,
+             "coalesced went from " + std::to_string(coalescedBefore) + " to " + std::to_string(coalesced(loop, port)));
+
+  late->received.clear();
+  first->received.clear();
+  late->send(request(msg::METRICS_REQUEST));
+  TOOL_CHECK(waitFor(loop, [&]() { return find(*late, msg::METRICS) >= 0; }, WAIT_MS), "no metrics reply");
+  if (find(*late, msg::METRICS) >= 0) {
+    long long commands = jsonNumber(late->received[find(*late, msg::METRICS)], key::COMMANDS);
+    TOOL_CHECK(commands - commandsBefore == 2,
+               "lamp saw " + std::to_string(commands - commandsBefore) + " control frames, expected 2");
+  }
+  pump(loop, QUIET_MS);
+  TOOL_CHECK(find(*first, msg::METRICS) < 0, "metrics reply leaked to another subscriber");
+
+  // ---- A lamp whose link is down refuses subscribers instead of leaving them silent ----
+  auto refused = subscribe(loop, port, "/offline/ws");
+  TOOL_CHECK(waitFor(loop, [&]() { return refused->closed; }, WAIT_MS), "subscriber to an offline lamp kept open");
+  TOOL_CHECK(refused->received.empty(), refused->received.empty() ? "" : refused->received[0]);
+
+  first->conn->close();
+  late->conn->close();
+  proxy.stop();
+  standin.stop();
+  pump(loop, 20);
+  if (tool_test::failureCount() > 0) {
+    standin.dumpLog();
+    proxy.dumpLog();
+    fprintf(stderr, "%d check(s) failed\n", tool_test::failureCount());
+    return 1;
+  }
+  printf("proxy_test: all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,190 @@
+#ifndef LAMP_TOOLS_TEST_TOOL_TEST_H_
+#define LAMP_TOOLS_TEST_TOOL_TEST_H_
+
+// Scaffolding for the tool integration tests (registered with ctest in ../CMakeLists.txt).
+// The real binaries run as child processes on ephemeral ports; the test drives them from
+// its own EventLoop and exits non-zero if any check failed, replaying the children's
+// stderr so the failure can be read in `ctest --output-on-failure`.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <functional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "net.h"
+
+namespace tool_test {
+
+inline int& failureCount() {
+  static int count = 0;
+  return count;
+}
+
+inline void check(bool ok, const char* file, int line, const char* condition, const std::string& detail) {
+  if (ok) {
+    return;
+  }
+  failureCount()++;
+  fprintf(stderr, "%s:%d: CHECK(%s) failed%s%s\n", file, line, condition, detail.empty() ? "" : ": ",
+          detail.c_str());
+}
+
+#define TOOL_CHECK(condition, detail) tool_test::check((condition), __FILE__, __LINE__, #condition, (detail))
+
+// Runs the loop until `done` holds or `timeoutMs` passes; true if it held
+inline bool waitFor(EventLoop& loop, const std::function<bool()>& done, int timeoutMs) {
+  int64_t deadline = EventLoop::nowMs() + timeoutMs;
+  while (!done()) {
+    if (EventLoop::nowMs() >= deadline) {
+      return false;
+    }
+    loop.after(5, [&loop]() { loop.stop(); });
+    loop.run();
+  }
+  return true;
+}
+
+// Lets pending traffic settle, e.g. before asserting that something did not arrive
+inline void pump(EventLoop& loop, int ms) {
+  waitFor(loop, []() { return false; }, ms);
+}
+
+// Integer value of the first `"name":N` in a JSON text, or -1
+inline long long jsonNumber(const std::string& text, const char* name) {
+  std::string needle = std::string("\"") + name + "\":";
+  size_t pos = text.find(needle);
+  return pos == std::string::npos ? -1 : strtoll(text.c_str() + pos + needle.size(), nullptr, 10);
+}
+
+// A tool binary running as a child; stdout and stderr are collected through the loop
+class Process {
+ public:
+  explicit Process(EventLoop& loop) : loop_(loop), pid_(-1), status_(-1) {}
+  ~Process() {
+    stop();
+    for (int fd : pipes_) {               // the loop outlives this object
+      loop_.remove(fd);
+      ::close(fd);
+    }
+  }
+  Process(const Process&) = delete;
+  Process& operator=(const Process&) = delete;
+
+  bool start(const std::vector<std::string>& argv) {
+    int out[2];
+    int err[2];
+    if (pipe2(out, O_CLOEXEC) != 0 || pipe2(err, O_CLOEXEC) != 0) {
+      return false;
+    }
+    name_ = argv[0].substr(argv[0].rfind('/') + 1);
+    pid_ = fork();
+    if (pid_ == 0) {
+      dup2(out[1], STDOUT_FILENO);
+      dup2(err[1], STDERR_FILENO);
+      std::vector<char*> args;
+      for (const std::string& arg : argv) {
+        args.push_back(const_cast<char*>(arg.c_str()));
+      }
+      args.push_back(nullptr);
+      execv(args[0], args.data());
+      _exit(127);
+    }
+    ::close(out[1]);
+    ::close(err[1]);
+    collect(out[0], output_);
+    collect(err[0], log_);
+    return pid_ > 0;
+  }
+
+  // Runs the loop until the child prints "listening on host:port"; 0 on timeout
+  uint16_t waitForPort(int timeoutMs) {
+    uint16_t port = 0;
+    waitFor(loop_, [this, &port]() {
+      size_t at = log_.find("listening on ");
+      size_t colon = at == std::string::npos ? at : log_.find(':', at + 13);
+      size_t end = colon == std::string::npos ? colon : log_.find_first_not_of("0123456789", colon + 1);
+      if (end == std::string::npos) {
+        return false;
+      }
+      port = (uint16_t)atoi(log_.c_str() + colon + 1);
+      return true;
+    }, timeoutMs);
+    return port;
+  }
+
+  // Runs the loop until the child exits; its exit status, or -1 on timeout
+  int wait(int timeoutMs) {
+    waitFor(loop_, [this]() { return reap(WNOHANG); }, timeoutMs);
+    pump(loop_, 20);                    // the last output may still be in the pipes
+    return status_;
+  }
+
+  void stop() {
+    if (pid_ > 0) {
+      kill(pid_, SIGTERM);
+      reap(0);
+    }
+  }
+
+  const std::string& output() const { return output_; }
+  const std::string& log() const { return log_; }
+
+  void dumpLog() const {
+    fprintf(stderr, "---- %s stderr ----\n%s", name_.c_str(), log_.c_str());
+  }
+
+ private:
+  void collect(int fd, std::string& into) {
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    pipes_.insert(fd);
+    loop_.add(fd, EPOLLIN, [this, fd, &into](uint32_t) {
+      char buffer[4096];
+      for (;;) {
+        ssize_t n = ::read(fd, buffer, sizeof(buffer));
+        if (n > 0) {
+          into.append(buffer, (size_t)n);
+          continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+          return;
+        }
+        loop_.remove(fd);               // EOF: the child closed its end
+        ::close(fd);
+        pipes_.erase(fd);
+        return;
+      }
+    });
+  }
+
+  bool reap(int flags) {
+    int status;
+    if (pid_ <= 0 || waitpid(pid_, &status, flags) != pid_) {
+      return pid_ <= 0;
+    }
+    status_ = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    pid_ = -1;
+    return true;
+  }
+
+  EventLoop& loop_;
+  pid_t pid_;
+  int status_;
+  std::string name_;
+  std::string output_;
+  std::string log_;
+  std::set<int> pipes_;                 // still registered with the loop
+};
+
+}  // namespace tool_test
+
+#endif  // LAMP_TOOLS_TEST_TOOL_TEST_H_
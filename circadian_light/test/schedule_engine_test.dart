@@ -0,0 +1,154 @@
+import 'package:circadian_light/core/schedule_engine.dart';
+import 'package:flutter_test/flutter_test.dart';
+
+// Golden values from esp_code/lib/schedule_core/schedule_core.cpp
+// (SC_ALARM_CURVE, then sc_alarm_levels). The Dart ports must reproduce them
+// exactly, since the lamp runs the C version.
+
+// SC_ALARM_CURVE, (warm_q8, white_q8) for each of the 33 points
+const List<(int, int)> _curve = [
+  (0, 0),
+  (11, 0),
+  (43, 0),
+  (95, 0),
+  (165, 0),
+  (252, 0),
+  (354, 0),
+  (471, 0),
+  (600, 0),
+  (740, 0),
+  (891, 0),
+  (1049, 0),
+  (1215, 29),
+  (1386, 98),
+  (1562, 190),
+  (1740, 300),
+  (1920, 426),
+  (2100, 565),
+  (2278, 718),
+  (2454, 882),
+  (2625, 1057),
+  (2791, 1242),
+  (2949, 1437),
+  (3100, 1641),
+  (3240, 1854),
+  (3369, 2075),
+  (3486, 2305),
+  (3588, 2542),
+  (3675, 2787),
+  (3745, 3040),
+  (3797, 3300),
+  (3829, 3566),
+  (3840, 3840),
+];
+
+const List<({int duration, int elapsed, int warm, int white})> _levels = [
+  (duration: 10, elapsed: -5, warm: 0, white: 0),
+  (duration: 10, elapsed: 0, warm: 0, white: 0),
+  (duration: 10, elapsed: 1, warm: 0, white: 0),
+  (duration: 10, elapsed: 37, warm: 42, white: 0),
+  (duration: 10, elapsed: 59, warm: 105, white: 0),
+  (duration: 10, elapsed: 299, warm: 1910, white: 419),
+  (duration: 10, elapsed: 300, warm: 1920, white: 426),
+  (duration: 10, elapsed: 599, warm: 3839, white: 3825),
+  (duration: 10, elapsed: 601, warm: 3840, white: 3840),
+  (duration: 10, elapsed: 900, warm: 3840, white: 3840),
+  (duration: 10, elapsed: 1234, warm: 3840, white: 3840),
+  (duration: 10, elapsed: 1799, warm: 3840, white: 3840),
+  (duration: 10, elapsed: 1800, warm: 3840, white: 3840),
+  (duration: 10, elapsed: 2699, warm: 3840, white: 3840),
+  (duration: 10, elapsed: 2700, warm: 3840, white: 3840),
+  (duration: 20, elapsed: -5, warm: 0, white: 0),
+  (duration: 20, elapsed: 0, warm: 0, white: 0),
+  (duration: 20, elapsed: 1, warm: 0, white: 0),
+  (duration: 20, elapsed: 37, warm: 10, white: 0),
+  (duration: 20, elapsed: 59, warm: 29, white: 0),
+  (duration: 20, elapsed: 299, warm: 596, white: 0),
+  (duration: 20, elapsed: 300, warm: 600, white: 0),
+  (duration: 20, elapsed: 599, warm: 1915, white: 422),
+  (duration: 20, elapsed: 601, warm: 1924, white: 429),
+  (duration: 20, elapsed: 900, warm: 3240, white: 1854),
+  (duration: 20, elapsed: 1234, warm: 3840, white: 3840),
+  (duration: 20, elapsed: 1799, warm: 3840, white: 3840),
+  (duration: 20, elapsed: 1800, warm: 3840, white: 3840),
+  (duration: 20, elapsed: 2699, warm: 3840, white: 3840),
+  (duration: 20, elapsed: 2700, warm: 3840, white: 3840),
+  (duration: 30, elapsed: -5, warm: 0, white: 0),
+  (duration: 30, elapsed: 0, warm: 0, white: 0),
+  (duration: 30, elapsed: 1, warm: 0, white: 0),
+  (duration: 30, elapsed: 37, warm: 7, white: 0),
+  (duration: 30, elapsed: 59, warm: 12, white: 0),
+  (duration: 30, elapsed: 299, warm: 283, white: 0),
+  (duration: 30, elapsed: 300, warm: 285, white: 0),
+  (duration: 30, elapsed: 599, warm: 993, white: 0),
+  (duration: 30, elapsed: 601, warm: 999, white: 0),
+  (duration: 30, elapsed: 900, warm: 1920, white: 426),
+  (duration: 30, elapsed: 1234, warm: 2939, white: 1424),
+  (duration: 30, elapsed: 1799, warm: 3839, white: 3834),
+  (duration: 30, elapsed: 1800, warm: 3840, white: 3840),
+  (duration: 30, elapsed: 2699, warm: 3840, white: 3840),
+  (duration: 30, elapsed: 2700, warm: 3840, white: 3840),
+  (duration: 45, elapsed: -5, warm: 0, white: 0),
+  (duration: 45, elapsed: 0, warm: 0, white: 0),
+  (duration: 45, elapsed: 1, warm: 0, white: 0),
+  (duration: 45, elapsed: 37, warm: 4, white: 0),
+  (duration: 45, elapsed: 59, warm: 7, white: 0),
+  (duration: 45, elapsed: 299, warm: 133, white: 0),
+  (duration: 45, elapsed: 300, warm: 133, white: 0),
+  (duration: 45, elapsed: 599, warm: 483, white: 0),
+  (duration: 45, elapsed: 601, warm: 486, white: 0),
+  (duration: 45, elapsed: 900, warm: 995, white: 0),
+  (duration: 45, elapsed: 1234, warm: 1673, white: 258),
+  (duration: 45, elapsed: 1799, warm: 2841, white: 1304),
+  (duration: 45, elapsed: 1800, warm: 2843, white: 1306),
+  (duration: 45, elapsed: 2699, warm: 3839, white: 3835),
+  (duration: 45, elapsed: 2700, warm: 3840, white: 3840),
+];
+
+void main() {
+  final engine = ScheduleEngine.portable();
+
+  test('curve points match SC_ALARM_CURVE', () {
+    // A 32 minute ramp puts point i at exactly i minutes, with no blending
+    for (var i = 0; i < _curve.length; i++) {
+      final levels = engine.sunriseLevels(32, i * 60);
+      expect((levels.warmQ8, levels.whiteQ8), _curve[i], reason: 'point $i');
+    }
+  });
+
+  test('sunrise levels match sc_alarm_levels', () {
+    for (final s in _levels) {
+      final levels = engine.sunriseLevels(s.duration, s.elapsed);
+      expect(
+        (levels.warmQ8, levels.whiteQ8),
+        (s.warm, s.white),
+        reason: '${s.duration} min at ${s.elapsed} s',
+      );
+    }
+  });
+
+  test('start == end is a single minute, not the whole day', () {
+    expect(engine.inWindow(420, 420, 420), isTrue);
+    expect(engine.inWindow(420, 420, 421), isFalse);
+    expect(engine.inWindow(420, 420, 0), isFalse);
+  });
+
+  test('windows wrap past midnight and include both ends', () {
+    expect(engine.inWindow(1380, 60, 1439), isTrue);
+    expect(engine.inWindow(1380, 60, 0), isTrue);
+    expect(engine.inWindow(1380, 60, 60), isTrue);
+    expect(engine.inWindow(1380, 60, 61), isFalse);
+    expect(engine.inWindow(1380, 60, 1379), isFalse);
+  });
+
+  test('the first enabled window wins', () {
+    final windows = <ScheduleWindow>[
+      (start: 360, end: 480, enabled: false),
+      (start: 420, end: 540, enabled: true),
+      (start: 400, end: 600, enabled: true),
+    ];
+    expect(engine.activeIndex(windows, 430), 1);
+    expect(engine.activeIndex(windows, 410), 2);
+    expect(engine.activeIndex(windows, 370), -1);
+  });
+}
@@ -0,0 +1,109 @@
+#include "alloc_tags.h"
+
+#include <stdlib.h>
+
+#include <atomic>
+
+namespace {
+
+// Keeps the payload as aligned as malloc's own result
+union BlockHeader {
+  struct {
+    uint32_t size;
+    uint8_t tag;
+  } info;
+  max_align_t align;
+};
+
+struct TagCounters {
+  std::atomic<uint32_t> liveBytes;
+  std::atomic<uint32_t> peakBytes;
+  std::atomic<uint32_t> liveBlocks;
+  std::atomic<uint32_t> allocations;
+  std::atomic<uint32_t> failures;
+};
+
+TagCounters counters[ALLOC_TAG_COUNT];
+
+const char* const TAG_NAMES[ALLOC_TAG_COUNT] = {"ws_rx", "ws_tx", "http", "msg_buffer"};
+
+void raisePeak(TagCounters& c, uint32_t live) {
+  uint32_t peak = c.peakBytes.load();
+  while (live > peak && !c.peakBytes.compare_exchange_weak(peak, live)) {
+  }
+}
+
+void noteAlloc(uint8_t tag, uint32_t size) {
+  TagCounters& c = counters[tag];
+  raisePeak(c, c.liveBytes.fetch_add(size) + size);
+  c.liveBlocks.fetch_add(1);
+  c.allocations.fetch_add(1);
+}
+
+void noteResize(uint8_t tag, uint32_t oldSize, uint32_t newSize) {
+  TagCounters& c = counters[tag];
+  c.liveBytes.fetch_sub(oldSize);
+  raisePeak(c, c.liveBytes.fetch_add(newSize) + newSize);
+}
+
+void noteFree(uint8_t tag, uint32_t size) {
+  counters[tag].liveBytes.fetch_sub(size);
+  counters[tag].liveBlocks.fetch_sub(1);
+}
+
+BlockHeader* headerOf(void* ptr) {
+  return static_cast<BlockHeader*>(ptr) - 1;
+}
+
+}  // namespace
+
+void* allocTagged(AllocTag tag, size_t size) {
+  BlockHeader* header = static_cast<BlockHeader*>(malloc(sizeof(BlockHeader) + size));
+  if (header == nullptr) {
+    counters[tag].failures.fetch_add(1);
+    return nullptr;
+  }
+  header->info.size = (uint32_t)size;
+  header->info.tag = tag;
+  noteAlloc(tag, (uint32_t)size);
+  return header + 1;
+}
+
+void* reallocTagged(AllocTag tag, void* ptr, size_t size) {
+  if (ptr == nullptr) {
+    return allocTagged(tag, size);
+  }
+  BlockHeader* header = headerOf(ptr);
+  uint8_t blockTag = header->info.tag;
+  uint32_t oldSize = header->info.size;
+  BlockHeader* moved = static_cast<BlockHeader*>(realloc(header, sizeof(BlockHeader) + size));
+  if (moved == nullptr) {
+    counters[blockTag].failures.fetch_add(1);
+    return nullptr;                // the original block is untouched and still counted
+  }
+  moved->info.size = (uint32_t)size;
+  noteResize(blockTag, oldSize, (uint32_t)size);
+  return moved + 1;
+}
+
+void freeTagged(void* ptr) {
+  if (ptr == nullptr) {
+    return;
+  }
+  BlockHeader* header = headerOf(ptr);
+  noteFree(header->info.tag, header->info.size);
+  free(header);
+}
+
+void allocTagStats(AllocTag tag, AllocTagStats& out) {
+  const TagCounters& c = counters[tag];
+  out.liveBytes = c.liveBytes.load();
+  out.peakBytes = c.peakBytes.load();
+  out.liveBlocks = c.liveBlocks.load();
+  out.allocations = c.allocations.load();
+  out.failures = c.failures.load();
+}
+
+const char* allocTagName(AllocTag tag) {
+  return tag < ALLOC_TAG_COUNT ? TAG_NAMES[tag] : "unknown";
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+// Heap accounting by subsystem. Blocks allocated through allocTagged() carry a small
+// header with their tag and size, so live bytes, block counts and peaks are attributed
+// without walking the heap. Counters are atomic because tagged memory is allocated and
+// freed from both the loop task and the AsyncTCP task. No Arduino dependencies, so it
+// also builds on the native host.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Schedules (routines, alarms, dusk fades) and the snapshot staging area are fixed static
+// arrays, not heap, so they have no tag; schedule messages are charged to ALLOC_WS_RX.
+enum AllocTag : uint8_t {
+  ALLOC_WS_RX = 0,         // documents parsed from WebSocket frames
+  ALLOC_WS_TX,             // state, hello, response and event documents sent to clients
+  ALLOC_HTTP,              // /metrics, /energy and other HTTP reports
+  ALLOC_MSG_BUFFER,        // serialised outgoing messages and the SSE replay ring
+  ALLOC_TAG_COUNT
+};
+
+struct AllocTagStats {
+  uint32_t liveBytes;      // requested bytes, excluding the per-block header
+  uint32_t peakBytes;
+  uint32_t liveBlocks;
+  uint32_t allocations;    // successful allocations since boot
+  uint32_t failures;
+};
+
+void* allocTagged(AllocTag tag, size_t size);
+
+// A null ptr allocates under tag; an existing block keeps the tag it was allocated with
+void* reallocTagged(AllocTag tag, void* ptr, size_t size);
+
+void freeTagged(void* ptr);
+
+void allocTagStats(AllocTag tag, AllocTagStats& out);
+
+const char* allocTagName(AllocTag tag);
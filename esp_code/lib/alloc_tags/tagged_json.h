@@ -0,0 +1,80 @@
+#pragma once
+
+// ArduinoJson glue for alloc_tags: an allocator that charges a document's pools and
+// strings to one tag, and serialised text held in an ALLOC_MSG_BUFFER block. ArduinoJson
+// is header-only, so this builds on the native host as well.
+
+#include <ArduinoJson.h>
+#include <string.h>
+
+#include "alloc_tags.h"
+
+class TaggedJsonAllocator : public ArduinoJson::Allocator {
+ public:
+  explicit TaggedJsonAllocator(AllocTag tag) : tag_(tag) {}
+
+  void* allocate(size_t size) override {
+    return allocTagged(tag_, size);
+  }
+
+  void deallocate(void* ptr) override {
+    freeTagged(ptr);
+  }
+
+  void* reallocate(void* ptr, size_t newSize) override {
+    return reallocTagged(tag_, ptr, newSize);
+  }
+
+ private:
+  AllocTag tag_;
+};
+
+// Owns one serialised message; empty (length 0) if the allocation failed
+class JsonText {
+ public:
+  JsonText() : data_(nullptr), length_(0) {}
+
+  explicit JsonText(const JsonDocument& doc) : JsonText() {
+    assign(doc);
+  }
+
+  ~JsonText() {
+    freeTagged(data_);
+  }
+
+  JsonText(const JsonText&) = delete;
+  JsonText& operator=(const JsonText&) = delete;
+
+  bool assign(const JsonDocument& doc) {
+    size_t length = measureJson(doc);
+    if (!reserve(length)) return false;
+    serializeJson(doc, data_, length + 1);
+    return true;
+  }
+
+  bool assign(const char* text, size_t length) {
+    if (!reserve(length)) return false;
+    memcpy(data_, text, length);
+    data_[length] = '\0';
+    return true;
+  }
+
+  const char* c_str() const {
+    return data_ != nullptr ? data_ : "";
+  }
+
+  size_t length() const {
+    return length_;
+  }
+
+ private:
+  bool reserve(size_t length) {
+    freeTagged(data_);
+    data_ = static_cast<char*>(allocTagged(ALLOC_MSG_BUFFER, length + 1));
+    length_ = data_ != nullptr ? length : 0;
+    return data_ != nullptr;
+  }
+
+  char* data_;
+  size_t length_;
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+// Allocation-free recogniser for the hot app control frames:
+//   {"brightness":7}  {"mode":1}  {"on":true}  and flat combinations of those keys.
+// Works directly on the raw WebSocket buffer. Anything it does not recognise exactly
+// (other keys, nested values, floats, strings, duplicates) returns false so the caller
+// can fall back to the general ArduinoJson parser. No Arduino dependencies, so it also
+// builds on the native host.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol_keys.h"
+
+namespace lamp_protocol {
+
+struct ControlFrame {
+  bool hasBrightness;
+  bool hasMode;
+  bool hasOn;
+  int brightness;            // as sent; range checks stay with the caller
+  int mode;
+  bool on;
+};
+
+namespace detail {
+
+inline void skipSpace(const uint8_t*& p, const uint8_t* end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+    p++;
+  }
+}
+
+inline bool matchLiteral(const uint8_t*& p, const uint8_t* end, const char* lit) {
+  const uint8_t* q = p;
+  while (*lit != '\0') {
+    if (q == end || *q != (uint8_t)*lit) {
+      return false;
+    }
+    q++;
+    lit++;
+  }
+  p = q;
+  return true;
+}
+
+// A quoted object key, e.g. key::MODE matches "mode" including the quotes
+inline bool matchKey(const uint8_t*& p, const uint8_t* end, const char* name) {
+  const uint8_t* q = p;
+  if (!matchLiteral(q, end, "\"") || !matchLiteral(q, end, name) || !matchLiteral(q, end, "\"")) {
+    return false;
+  }
+  p = q;
+  return true;
+}
+
+// Small signed integers only; anything longer, fractional or exponent form falls back
+inline bool parseSmallInt(const uint8_t*& p, const uint8_t* end, int& out) {
+  bool negative = false;
+  if (p < end && *p == '-') {
+    negative = true;
+    p++;
+  }
+  int value = 0;
+  uint8_t digits = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    if (++digits > 6) {
+      return false;
+    }
+    value = value * 10 + (*p - '0');
+    p++;
+  }
+  if (digits == 0 || (p < end && (*p == '.' || *p == 'e' || *p == 'E'))) {
+    return false;
+  }
+  out = negative ? -value : value;
+  return true;
+}
+
+}  // namespace detail
+
+inline bool parseControlFrame(const uint8_t* data, size_t len, ControlFrame& out) {
+  const uint8_t* p = data;
+  const uint8_t* end = data + len;
+  out = ControlFrame();
+
+  detail::skipSpace(p, end);
+  if (!detail::matchLiteral(p, end, "{")) {
+    return false;
+  }
+
+  bool first = true;
+  for (;;) {
+    detail::skipSpace(p, end);
+    if (detail::matchLiteral(p, end, "}")) {
+      break;
+    }
+    if (!first && !detail::matchLiteral(p, end, ",")) {
+      return false;
+    }
+    detail::skipSpace(p, end);
+    first = false;
+
+    if (detail::matchKey(p, end, key::BRIGHTNESS)) {
+      detail::skipSpace(p, end);
+      if (out.hasBrightness || !detail::matchLiteral(p, end, ":")) return false;
+      detail::skipSpace(p, end);
+      if (!detail::parseSmallInt(p, end, out.brightness)) return false;
+      out.hasBrightness = true;
+    } else if (detail::matchKey(p, end, key::MODE)) {
+      detail::skipSpace(p, end);
+      if (out.hasMode || !detail::matchLiteral(p, end, ":")) return false;
+      detail::skipSpace(p, end);
+      if (!detail::parseSmallInt(p, end, out.mode)) return false;
+      out.hasMode = true;
+    } else if (detail::matchKey(p, end, key::ON)) {
+      detail::skipSpace(p, end);
+      if (out.hasOn || !detail::matchLiteral(p, end, ":")) return false;
+      detail::skipSpace(p, end);
+      if (detail::matchLiteral(p, end, "true")) {
+        out.on = true;
+      } else if (detail::matchLiteral(p, end, "false")) {
+        out.on = false;
+      } else {
+        return false;
+      }
+      out.hasOn = true;
+    } else {
+      return false;            // any other key belongs to the general parser
+    }
+  }
+
+  detail::skipSpace(p, end);
+  return p == end && (out.hasBrightness || out.hasMode || out.hasOn);
+}
+
+}  // namespace lamp_protocol
@@ -0,0 +1,269 @@
+#pragma once
+
+// Interned names for the lamp's WebSocket/HTTP protocol: JSON keys, message types and
+// enumerated string values. Every parser, serialiser and the fast control-frame
+// recogniser refers to these instead of repeating literals, so each name exists once in
+// flash and a renamed field is a one-line change.
+//
+// The names are char arrays rather than `const char*` so ArduinoJson treats them like
+// string literals and stores keys by pointer instead of copying them into the document
+// pool. No Arduino dependencies, so it also builds on the native host.
+
+namespace lamp_protocol {
+
+// ===== JSON keys =====
+namespace key {
+
+// Envelope
+constexpr char TYPE[] = "type";
+constexpr char ACTION[] = "action";
+constexpr char DATA[] = "data";
+constexpr char SOURCE[] = "source";
+constexpr char SUCCESS[] = "success";
+constexpr char MESSAGE[] = "message";
+constexpr char VERSION[] = "version";
+constexpr char STATE[] = "state";
+constexpr char REQUEST_STATE[] = "request_state";
+constexpr char TIMESTAMP[] = "timestamp";
+constexpr char TIMESTAMP_MS[] = "timestamp_ms";
+constexpr char UPTIME_MS[] = "uptime_ms";
+constexpr char TZ[] = "tz";
+
+// Lamp output
+constexpr char BRIGHTNESS[] = "brightness";
+constexpr char MODE[] = "mode";
+constexpr char ON[] = "on";
+constexpr char KNOB_OFFSET[] = "knob_offset";
+constexpr char WARM_Q8[] = "warm_q8";
+constexpr char WHITE_Q8[] = "white_q8";
+
+// Schedule entries (routines, alarms, dusks)
+constexpr char ROUTINES[] = "routines";
+constexpr char ALARMS[] = "alarms";
+constexpr char DUSKS[] = "dusks";
+constexpr char ID[] = "id";
+constexpr char NAME[] = "name";
+constexpr char ENABLED[] = "enabled";
+constexpr char START_HOUR[] = "start_hour";
+constexpr char START_MINUTE[] = "start_minute";
+constexpr char END_HOUR[] = "end_hour";
+constexpr char END_MINUTE[] = "end_minute";
+constexpr char WAKE_HOUR[] = "wake_hour";
+constexpr char WAKE_MINUTE[] = "wake_minute";
+constexpr char DURATION_MINUTES[] = "duration_minutes";
+
+// Automation status
+constexpr char ACTIVE[] = "active";
+constexpr char SUPPRESSED_ID[] = "suppressed_id";
+constexpr char ROUTINE_ACTIVE[] = "routine_active";
+constexpr char ALARM_ACTIVE[] = "alarm_active";
+constexpr char SUN_SYNC_ACTIVE[] = "sun_sync_active";
+constexpr char ROUTINE_SUPPRESSED[] = "routine_suppressed";
+constexpr char ALARM_SUPPRESSED[] = "alarm_suppressed";
+constexpr char DUSK_SUPPRESSED[] = "dusk_suppressed";
+constexpr char SUN_SYNC_DISABLED_BY_HW[] = "sun_sync_disabled_by_hw";
+constexpr char MANUAL_CONTROL_LOCKED[] = "manual_control_locked";
+constexpr char FADE_ACTIVE[] = "fade_active";
+constexpr char FADE_REMAINING_S[] = "fade_remaining_s";
+constexpr char ROUTINE_DISABLED[] = "routine_disabled";
+constexpr char ALARM_DISABLED[] = "alarm_disabled";
+constexpr char FADE_DISABLED[] = "fade_disabled";
+constexpr char SUN_SYNC_DISABLED[] = "sun_sync_disabled";
+constexpr char SCHEDULE_GENERATION[] = "schedule_generation";
+constexpr char SCHEDULE_DIGEST[] = "schedule_digest";
+
+// Hello bundle
+constexpr char FIRMWARE[] = "firmware";
+constexpr char BUILD[] = "build";
+constexpr char SDK[] = "sdk";
+constexpr char PROTOCOL[] = "protocol";
+constexpr char CAPABILITIES[] = "capabilities";
+constexpr char SCHEDULE[] = "schedule";
+constexpr char BOOT_ID[] = "boot_id";
+constexpr char GENERATION[] = "generation";
+constexpr char DIGEST[] = "digest";
+constexpr char TIMEZONE[] = "timezone";
+constexpr char AUTOMATION[] = "automation";
+constexpr char ROUTINE[] = "routine";
+constexpr char ALARM[] = "alarm";
+constexpr char FADE[] = "fade";
+constexpr char DUSK_ID[] = "dusk_id";
+constexpr char SUN_SYNC[] = "sun_sync";
+constexpr char DISABLED_BY_HW[] = "disabled_by_hw";
+
+// Energy report
+constexpr char HOURS[] = "hours";
+constexpr char DAYS[] = "days";
+constexpr char DATE[] = "date";
+constexpr char START[] = "start";
+constexpr char WARM_ON_S[] = "warm_on_s";
+constexpr char WHITE_ON_S[] = "white_on_s";
+constexpr char WARM_MWH[] = "warm_mwh";
+constexpr char WHITE_MWH[] = "white_mwh";
+constexpr char CHANNEL_FULL_POWER_MW[] = "channel_full_power_mw";
+
+// HTTP query parameters (/history; /energy takes HOURS)
+constexpr char FROM[] = "from";
+constexpr char TO[] = "to";
+constexpr char LIMIT[] = "limit";
+
+// HTTP headers
+constexpr char LAMP_TOKEN[] = "X-Lamp-Token";   // the device's OTA token, on POST /update
+
+// Streaming and metrics
+constexpr char SAMPLES[] = "samples";
+constexpr char DELAY_MS[] = "delay_ms";
+constexpr char CONTROL[] = "control";
+constexpr char COMMANDS[] = "commands";
+constexpr char COALESCED[] = "coalesced";
+constexpr char COALESCED_PER_S[] = "coalesced_per_s";
+constexpr char APPLIED[] = "applied";
+constexpr char FAST_FRAMES[] = "fast_frames";
+constexpr char PARSED_FRAMES[] = "parsed_frames";
+constexpr char TICK_MS[] = "tick_ms";
+constexpr char COMPOSITOR[] = "compositor";
+constexpr char RENDERS[] = "renders";
+constexpr char LAYERS[] = "layers";
+constexpr char STREAM[] = "stream";
+constexpr char BUFFERED[] = "buffered";
+constexpr char LATE[] = "late";
+constexpr char DROPPED[] = "dropped";
+constexpr char UNDERRUNS[] = "underruns";
+constexpr char HOT_PATH[] = "hot_path";
+constexpr char CPU_MHZ[] = "cpu_mhz";
+constexpr char FLASH_WRITES[] = "flash_writes";
+constexpr char ENCODER_ISR[] = "encoder_isr";
+constexpr char CONTROL_TICK[] = "control_tick";
+constexpr char RENDER[] = "render";
+constexpr char LAST_CYCLES[] = "last_cycles";
+constexpr char MAX_CYCLES[] = "max_cycles";
+constexpr char MAX_FLASH_CYCLES[] = "max_flash_cycles";
+constexpr char TASKS[] = "tasks";
+constexpr char INTERVAL_MS[] = "interval_ms";
+constexpr char RUN_TIME_STATS[] = "run_time_stats";
+constexpr char TRUNCATED[] = "truncated";
+constexpr char ENTRIES[] = "entries";
+constexpr char PRIORITY[] = "priority";
+constexpr char STACK_FREE[] = "stack_free";
+constexpr char CPU_PERMILLE[] = "cpu_permille";
+constexpr char HEAP[] = "heap";
+constexpr char FREE[] = "free";
+constexpr char MIN_FREE[] = "min_free";
+constexpr char MAX_ALLOC[] = "max_alloc";
+constexpr char TAGS[] = "tags";
+constexpr char LIVE_BYTES[] = "live_bytes";
+constexpr char PEAK_BYTES[] = "peak_bytes";
+constexpr char LIVE_BLOCKS[] = "live_blocks";
+constexpr char ALLOCATIONS[] = "allocations";
+constexpr char FAILURES[] = "failures";
+constexpr char WEBSOCKET[] = "websocket";
+constexpr char SLOTS[] = "slots";
+constexpr char CONNECTED[] = "connected";
+constexpr char REJECTED[] = "rejected";
+constexpr char RX_OVERFLOWS[] = "rx_overflows";
+constexpr char RX_BUFFER[] = "rx_buffer";
+constexpr char QUEUE_LIMIT[] = "queue_limit";
+constexpr char PINGS[] = "pings";
+constexpr char DEAD_PEERS[] = "dead_peers";
+
+// Log streaming
+constexpr char LEVEL[] = "level";
+constexpr char MODULE[] = "module";
+constexpr char RECORDS[] = "records";
+
+// Runtime tunables (names double as NVS keys, so at most 15 chars)
+constexpr char VALUES[] = "values";
+constexpr char VALUE[] = "value";
+constexpr char MIN_VALUE[] = "min";
+constexpr char MAX_VALUE[] = "max";
+constexpr char DEFAULT_VALUE[] = "default";
+constexpr char DEBOUNCE_MS[] = "debounce_ms";
+constexpr char CLICK_WINDOW_MS[] = "click_window_ms";
+constexpr char BLINK_COUNT[] = "blink_count";
+constexpr char BLINK_MS[] = "blink_ms";
+constexpr char SCHEDULE_MS[] = "schedule_ms";
+constexpr char PWM_FREQ_HZ[] = "pwm_freq_hz";
+constexpr char PWM_BITS[] = "pwm_bits";
+constexpr char ENCODER_STEP[] = "encoder_step";
+constexpr char WS_IDLE_MS[] = "ws_idle_ms";
+constexpr char WS_BACKLOG_MS[] = "ws_backlog_ms";
+constexpr char WS_PONG_MS[] = "ws_pong_ms";
+
+}  // namespace key
+
+// ===== Message types =====
+namespace msg {
+
+// App -> lamp
+constexpr char ROUTINE_SYNC[] = "routine_sync";
+constexpr char ALARM_SYNC[] = "alarm_sync";
+constexpr char DUSK_SYNC[] = "dusk_sync";
+constexpr char FULL_SYNC[] = "full_sync";
+constexpr char TIME_SYNC[] = "time_sync";
+constexpr char SUN_SYNC_STATE[] = "sun_sync_state";
+constexpr char SLEEP_TIMER[] = "sleep_timer";
+constexpr char ENERGY_REQUEST[] = "energy_request";
+constexpr char METRICS_REQUEST[] = "metrics_request";
+constexpr char TASK_STATS_REQUEST[] = "task_stats_request";
+constexpr char HEAP_STATS_REQUEST[] = "heap_stats_request";
+constexpr char LOG_SUBSCRIBE[] = "log_subscribe";
+constexpr char TUNABLES_REQUEST[] = "tunables_request";
+constexpr char TUNABLES_SET[] = "tunables_set";
+constexpr char STREAM_BEGIN[] = "stream_begin";
+constexpr char STREAM_SAMPLES[] = "stream_samples";
+constexpr char STREAM_END[] = "stream_end";
+
+// Lamp -> app
+constexpr char HELLO[] = "hello";
+constexpr char ROUTINE_SYNC_RESPONSE[] = "routine_sync_response";
+constexpr char ALARM_SYNC_RESPONSE[] = "alarm_sync_response";
+constexpr char DUSK_SYNC_RESPONSE[] = "dusk_sync_response";
+constexpr char FULL_SYNC_RESPONSE[] = "full_sync_response";
+constexpr char TIME_SYNC_RESPONSE[] = "time_sync_response";
+constexpr char SUN_SYNC_RESPONSE[] = "sun_sync_response";
+constexpr char SLEEP_TIMER_RESPONSE[] = "sleep_timer_response";
+constexpr char STREAM_RESPONSE[] = "stream_response";
+constexpr char SCHEDULE_OVERRIDE_EVENT[] = "schedule_override_event";
+constexpr char ENERGY_REPORT[] = "energy_report";
+constexpr char METRICS[] = "metrics";
+constexpr char TASK_STATS[] = "task_stats";
+constexpr char HEAP_STATS[] = "heap_stats";
+constexpr char LOG[] = "log";
+constexpr char LOG_SUBSCRIBE_RESPONSE[] = "log_subscribe_response";
+constexpr char TUNABLES[] = "tunables";
+constexpr char TUNABLES_SET_RESPONSE[] = "tunables_set_response";
+constexpr char SNAPSHOT_IMPORT_RESPONSE[] = "snapshot_import_response";
+
+}  // namespace msg
+
+// ===== Enumerated values =====
+namespace val {
+
+constexpr char UPSERT[] = "upsert";
+constexpr char DELETE[] = "delete";
+constexpr char CANCEL[] = "cancel";
+
+constexpr char SOURCE_APP[] = "app";
+constexpr char SOURCE_HARDWARE[] = "hardware";
+constexpr char SOURCE_HARDWARE_OFFLINE_ROTARY[] = "hardware_offline_rotary";
+constexpr char SOURCE_HARDWARE_OFFLINE_BUTTON[] = "hardware_offline_button";
+constexpr char SOURCE_HARDWARE_WIFI_LOSS[] = "hardware_wifi_loss";
+
+}  // namespace val
+
+// ===== Capabilities =====
+// Advertised in the hello bundle's protocol.capabilities next to the message types the
+// lamp accepts, for features that are not a single WebSocket message.
+namespace cap {
+
+constexpr char ALARM_CCT_CURVE[] = "alarm_cct_curve";
+constexpr char SSE_EVENTS[] = "sse_events";
+constexpr char HISTORY_LOG[] = "history_log";
+constexpr char STREAM_CONTROL[] = "stream_control";
+constexpr char TIMEZONE[] = "timezone";
+constexpr char SNAPSHOT[] = "snapshot";
+constexpr char FIRMWARE_UPDATE[] = "firmware_update";
+
+}  // namespace cap
+
+}  // namespace lamp_protocol
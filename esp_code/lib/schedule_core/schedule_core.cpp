@@ -0,0 +1,87 @@
+#include "schedule_core.h"
+
+int32_t sc_in_window(int32_t start_minute, int32_t end_minute, int32_t now_minute) {
+  if (end_minute == start_minute) {
+    return now_minute == start_minute;   // zero-length ramp, not the whole day
+  }
+  if (end_minute > start_minute) {
+    return now_minute >= start_minute && now_minute <= end_minute;
+  }
+  // wraps midnight
+  return now_minute >= start_minute || now_minute <= end_minute;
+}
+
+int32_t sc_ranges_overlap(int32_t start1, int32_t end1, int32_t start2, int32_t end2) {
+  bool wraps1 = start1 > end1;
+  bool wraps2 = start2 > end2;
+
+  if (!wraps1 && !wraps2) {
+    return start1 < end2 && start2 < end1;
+  }
+  if (wraps1 && wraps2) {
+    return 1;              // both contain midnight
+  }
+  if (wraps1) {
+    // [start1, 24h) + [0, end1) against [start2, end2)
+    return start2 < end1 || end2 > start1;
+  }
+  return start1 < end2 || end1 > start2;
+}
+
+int32_t sc_alarm_start_minute(int32_t wake_minute, int32_t duration_minutes) {
+  int32_t start = (wake_minute - duration_minutes) % SC_MINUTES_PER_DAY;
+  return start < 0 ? start + SC_MINUTES_PER_DAY : start;
+}
+
+int32_t sc_elapsed_seconds(int32_t start_minute, int32_t now_minute, int32_t now_second) {
+  int32_t minutes = now_minute - start_minute;
+  if (minutes < 0) {
+    minutes += SC_MINUTES_PER_DAY;
+  }
+  return minutes * 60 + now_second;
+}
+
+int32_t sc_find_active_routine(const sc_routine* routines, int32_t count, int32_t now_minute) {
+  for (int32_t i = 0; i < count; i++) {
+    if (routines[i].enabled &&
+        sc_in_window(routines[i].start_minute, routines[i].end_minute, now_minute)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Warm light rises first with an ease-in curve; white joins after 35% of the ramp so the
+// mix cools toward daylight, ending with both channels at full (the post-alarm state).
+// Point i at p = i / 32, in integer Q16 (the app's Dart port derives the same values):
+//   warm = smoothstep(p) = p^2 (3 - 2p)
+//   white = w^1.5 with w = max(0, (p - 0.35) / 0.65), the root taken as isqrt(w << 16)
+// each scaled to SC_LEVEL_Q8_MAX with rounding.
+static const sc_curve_point SC_ALARM_CURVE[SC_ALARM_CURVE_POINTS] = {
+  {0, 0}, {11, 0}, {43, 0}, {95, 0}, {165, 0}, {252, 0},
+  {354, 0}, {471, 0}, {600, 0}, {740, 0}, {891, 0}, {1049, 0},
+  {1215, 29}, {1386, 98}, {1562, 190}, {1740, 300}, {1920, 426}, {2100, 565},
+  {2278, 718}, {2454, 882}, {2625, 1057}, {2791, 1242}, {2949, 1437}, {3100, 1641},
+  {3240, 1854}, {3369, 2075}, {3486, 2305}, {3588, 2542}, {3675, 2787}, {3745, 3040},
+  {3797, 3300}, {3829, 3566}, {3840, 3840},
+};
+
+void sc_alarm_levels(int32_t duration_minutes, int32_t elapsed_s, uint16_t* warm_q8, uint16_t* white_q8) {
+  int32_t total_s = duration_minutes * 60;
+  if (total_s <= 0 || elapsed_s >= total_s) {
+    *warm_q8 = SC_ALARM_CURVE[SC_ALARM_CURVE_POINTS - 1].warm_q8;
+    *white_q8 = SC_ALARM_CURVE[SC_ALARM_CURVE_POINTS - 1].white_q8;
+    return;
+  }
+  if (elapsed_s < 0) {
+    elapsed_s = 0;
+  }
+
+  uint32_t pos_q8 = (uint32_t)elapsed_s * (SC_ALARM_CURVE_POINTS - 1) * 256 / (uint32_t)total_s;
+  uint32_t index = pos_q8 >> 8;
+  int32_t frac = pos_q8 & 0xFF;
+  const sc_curve_point& a = SC_ALARM_CURVE[index];
+  const sc_curve_point& b = SC_ALARM_CURVE[index + 1];
+  *warm_q8 = (uint16_t)(a.warm_q8 + (((int32_t)b.warm_q8 - a.warm_q8) * frac >> 8));
+  *white_q8 = (uint16_t)(a.white_q8 + (((int32_t)b.white_q8 - a.white_q8) * frac >> 8));
+}
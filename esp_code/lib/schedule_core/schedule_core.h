@@ -0,0 +1,60 @@
+#pragma once
+
+// Portable schedule engine shared by the firmware (checkSchedule) and the Flutter app
+// (through dart:ffi, built as libschedule_core by the Linux runner). Plain C ABI, no
+// Arduino or Flutter dependencies, so both sides evaluate routines and alarms identically.
+// Times are minutes since local midnight (0-1439); levels are Q8 on the 0-15 scale.
+
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define SC_EXPORT __declspec(dllexport)
+#else
+#define SC_EXPORT __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SC_MINUTES_PER_DAY 1440
+#define SC_LEVEL_Q8_MAX (15 << 8)
+#define SC_ALARM_CURVE_POINTS 33
+
+typedef struct {
+  int32_t id;
+  int32_t enabled;
+  int32_t start_minute;
+  int32_t end_minute;
+  int32_t brightness;      // 0-15
+  int32_t mode;            // 0=warm, 1=white, 2=both
+} sc_routine;
+
+typedef struct {
+  uint16_t warm_q8;
+  uint16_t white_q8;
+} sc_curve_point;
+
+// Inclusive window [start, end]; an end before the start wraps past midnight, and
+// start == end is the single minute start (a zero-length alarm or fade), not the whole day
+SC_EXPORT int32_t sc_in_window(int32_t start_minute, int32_t end_minute, int32_t now_minute);
+
+// Half-open range overlap with midnight wrap, used to keep enabled schedules disjoint
+SC_EXPORT int32_t sc_ranges_overlap(int32_t start1, int32_t end1, int32_t start2, int32_t end2);
+
+// Ramp start for an alarm waking at wake_minute, normalised into the day
+SC_EXPORT int32_t sc_alarm_start_minute(int32_t wake_minute, int32_t duration_minutes);
+
+// Seconds since the window opened at start_minute (wrapping past midnight)
+SC_EXPORT int32_t sc_elapsed_seconds(int32_t start_minute, int32_t now_minute, int32_t now_second);
+
+// Index of the first enabled routine whose window contains now, or -1
+SC_EXPORT int32_t sc_find_active_routine(const sc_routine* routines, int32_t count, int32_t now_minute);
+
+// Sunrise curve value elapsed_s seconds into a ramp of duration_minutes: lookup in the one
+// shared SC_ALARM_CURVE_POINTS table (the same for every alarm) plus a linear blend
+SC_EXPORT void sc_alarm_levels(int32_t duration_minutes, int32_t elapsed_s, uint16_t* warm_q8, uint16_t* white_q8);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,129 @@
+#include "tz_table.h"
+
+#include <time.h>
+
+namespace {
+
+// Days since 1970-01-01 for a proleptic Gregorian date (H. Hinnant's days_from_civil)
+int64_t daysFromCivil(int64_t y, unsigned m, unsigned d) {
+  y -= m <= 2;
+  const int64_t era = (y >= 0 ? y : y - 399) / 400;
+  const unsigned yoe = (unsigned)(y - era * 400);
+  const unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + (int64_t)doe - 719468;
+}
+
+int64_t floorDiv(int64_t a, int64_t b) {
+  int64_t q = a / b;
+  return (a % b != 0 && ((a < 0) != (b < 0))) ? q - 1 : q;
+}
+
+const int64_t PROBE_STEP_S = 3600;   // transitions are at least hours apart
+
+}  // namespace
+
+int32_t tzLibcOffset(int64_t utc) {
+  time_t t = (time_t)utc;
+  struct tm local;
+  localtime_r(&t, &local);
+  int64_t localAsUtc = daysFromCivil(local.tm_year + 1900, local.tm_mon + 1, local.tm_mday) * 86400 +
+                       local.tm_hour * 3600 + local.tm_min * 60 + local.tm_sec;
+  return (int32_t)(localAsUtc - utc);
+}
+
+void tzTableBuildBegin(TzTableBuilder& builder, int64_t fromUtc, int64_t toUtc) {
+  TzTable& table = builder.table;
+  table.validFrom = fromUtc;
+  table.validUntil = toUtc;
+  builder.current = tzLibcOffset(fromUtc);
+  table.entries[0].utcStart = fromUtc;
+  table.entries[0].offsetS = builder.current;
+  table.count = 1;
+  builder.cursor = fromUtc;
+  builder.done = false;
+  builder.complete = false;
+}
+
+bool tzTableBuildStep(TzTableBuilder& builder, uint16_t maxProbes) {
+  TzTable& table = builder.table;
+  for (uint16_t probes = 0; probes < maxProbes && !builder.done; probes++) {
+    if (builder.cursor >= table.validUntil) {
+      builder.done = true;
+      builder.complete = true;
+      break;
+    }
+    int64_t t = builder.cursor;
+    int64_t next = t + PROBE_STEP_S;
+    builder.cursor = next;
+    int32_t offset = tzLibcOffset(next);
+    if (offset == builder.current) continue;
+
+    // Bisect to the exact second the offset changes
+    int64_t lo = t;
+    int64_t hi = next;
+    while (hi - lo > 1) {
+      int64_t mid = lo + (hi - lo) / 2;
+      if (tzLibcOffset(mid) == builder.current) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    if (table.count == TZ_TABLE_MAX_TRANSITIONS) {
+      table.validUntil = hi;   // covered only up to the first transition that did not fit
+      builder.done = true;
+      break;
+    }
+    table.entries[table.count].utcStart = hi;
+    table.entries[table.count].offsetS = offset;
+    table.count++;
+    builder.current = offset;
+  }
+  return builder.done;
+}
+
+bool tzTableBuild(TzTable& table, int64_t fromUtc, int64_t toUtc) {
+  TzTableBuilder builder;
+  tzTableBuildBegin(builder, fromUtc, toUtc);
+  while (!tzTableBuildStep(builder, UINT16_MAX)) {
+  }
+  table = builder.table;
+  return builder.complete;
+}
+
+bool tzTableCovers(const TzTable& table, int64_t utc) {
+  return table.count > 0 && utc >= table.validFrom && utc < table.validUntil;
+}
+
+int32_t tzTableOffset(const TzTable& table, int64_t utc) {
+  int32_t offset = table.entries[0].offsetS;
+  for (uint8_t i = 1; i < table.count && table.entries[i].utcStart <= utc; i++) {
+    offset = table.entries[i].offsetS;
+  }
+  return offset;
+}
+
+void tzTableLocalClock(const TzTable& table, int64_t utc, TzLocalClock& out) {
+  tzLocalClockAt(utc, tzTableOffset(table, utc), out);
+}
+
+void tzLocalClockAt(int64_t utc, int32_t offsetS, TzLocalClock& out) {
+  int64_t local = utc + offsetS;
+  int64_t days = floorDiv(local, 86400);
+  int32_t secondOfDay = (int32_t)(local - days * 86400);
+  out.minuteOfDay = secondOfDay / 60;
+  out.second = secondOfDay % 60;
+  out.weekday = (int32_t)((days % 7 + 11) % 7);   // 1970-01-01 was a Thursday
+
+  // Civil year of `days`, then the day of that year
+  int64_t z = days + 719468;
+  const int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+  const unsigned doe = (unsigned)(z - era * 146097);
+  const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  const unsigned mp = (5 * doy + 2) / 153;
+  int64_t year = (int64_t)yoe + era * 400 + (mp >= 10 ? 1 : 0);
+  out.year = (int32_t)year;
+  out.yday = (int32_t)(days - daysFromCivil(year, 1, 1));
+}
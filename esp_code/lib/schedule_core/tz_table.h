@@ -0,0 +1,61 @@
+#pragma once
+
+// UTC offset transition table for the active POSIX TZ. Built once from the C library's
+// localtime_r (newlib on the device, glibc on a host), after which converting an epoch to
+// local minute-of-day is a table lookup plus an add, with no TZ parsing per tick. A year
+// of hourly probes is several thousand localtime_r calls, so the firmware builds it a
+// slice per loop pass with TzTableBuilder and swaps the finished table in.
+
+#include <stdint.h>
+
+const uint8_t TZ_TABLE_MAX_TRANSITIONS = 8;   // a year has two DST changes; room for odd zones
+
+struct TzTransition {
+  int64_t utcStart;        // first UTC second this offset applies
+  int32_t offsetS;         // local = utc + offsetS
+};
+
+struct TzTable {
+  TzTransition entries[TZ_TABLE_MAX_TRANSITIONS];
+  uint8_t count;
+  int64_t validFrom;       // UTC range the table was built for
+  int64_t validUntil;
+};
+
+struct TzLocalClock {
+  int32_t minuteOfDay;     // 0-1439
+  int32_t second;          // 0-59
+  int32_t yday;            // 0-365, as tm_yday
+  int32_t year;
+  int32_t weekday;         // 0 = Sunday, as tm_wday
+};
+
+struct TzTableBuilder {
+  TzTable table;           // valid once done
+  int64_t cursor;          // next probe starts here
+  int32_t current;         // offset in force at cursor
+  bool done;
+  bool complete;           // false if the transitions overflowed the table
+};
+
+// Start probing the current TZ (call tzset() first) over [fromUtc, toUtc)
+void tzTableBuildBegin(TzTableBuilder& builder, int64_t fromUtc, int64_t toUtc);
+
+// Advance by up to maxProbes hourly probes; true once the table is finished
+bool tzTableBuildStep(TzTableBuilder& builder, uint16_t maxProbes);
+
+// The whole build in one call; false if it overflowed
+bool tzTableBuild(TzTable& table, int64_t fromUtc, int64_t toUtc);
+
+// True when utc falls inside the range the table was built for
+bool tzTableCovers(const TzTable& table, int64_t utc);
+
+int32_t tzTableOffset(const TzTable& table, int64_t utc);
+
+void tzTableLocalClock(const TzTable& table, int64_t utc, TzLocalClock& out);
+
+// Local clock fields for utc at a known offset (from the table or tzLibcOffset)
+void tzLocalClockAt(int64_t utc, int32_t offsetS, TzLocalClock& out);
+
+// Offset of the C library's local time at utc (the slow path the table replaces)
+int32_t tzLibcOffset(int64_t utc);
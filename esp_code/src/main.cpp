@@ -9,10 +9,69 @@
 #include <ESPAsyncWebServer.h>
 #include <ArduinoJson.h>
 #include <ESPmDNS.h>
-#include <RotaryEncoder.h>
+#include <Update.h>
 #include <time.h>
+#include <stdarg.h>
+#include <esp_partition.h>
+#include <esp_system.h>
+#include <esp_cpu.h>
+#include <esp_timer.h>
+#include <esp_rom_crc.h>
+#include <driver/gpio.h>
+#include <soc/gpio_reg.h>
+#include <hal/ledc_ll.h>
+#include <Preferences.h>
 
 #include "wifi_credentials.h"
+#include "control_frame.h"
+#include "protocol_keys.h"
+#include "schedule_core.h"
+#include "tz_table.h"
+#include "tagged_json.h"
+
+// Firmware identity reported in the WebSocket hello bundle
+#define FIRMWARE_VERSION "0.2.0"
+const uint8_t PROTOCOL_VERSION = 9;      // bump when messages are added or change shape
+
+// Protocol names (JSON keys, message types, enumerated values) shared with the parsers
+namespace key = lamp_protocol::key;
+namespace msg = lamp_protocol::msg;
+namespace val = lamp_protocol::val;
+namespace cap = lamp_protocol::cap;
+
+// ===== Logging =====
+// LAMP_LOG_LEVEL (build flag) is the most verbose level compiled in: calls above it and
+// their format strings are dropped from the image. logLevel lowers verbosity at runtime;
+// disabled calls cost one compare and never touch their arguments. logStreamLevel is the
+// most verbose level any WebSocket log subscriber wants (0 = nobody subscribed); only
+// then is a record also formatted into the RAM log ring.
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_INFO  3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LAMP_LOG_LEVEL
+#define LAMP_LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+uint8_t logLevel = LAMP_LOG_LEVEL;
+volatile uint8_t logStreamLevel = LOG_LEVEL_NONE;
+
+void logToRing(uint8_t level, const char* origin, const char* format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#define LOG_AT(level, ...) \
+  do { \
+    if (LAMP_LOG_LEVEL >= (level)) { \
+      if (logLevel >= (level)) Serial.printf(__VA_ARGS__); \
+      if (logStreamLevel >= (level)) logToRing((level), __func__, __VA_ARGS__); \
+    } \
+  } while (0)
+#define LOGE(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOGW(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOGI(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOGD(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
 
 // WiFi credentials and network configuration
 const char* SSID     = wifi_credentials::SSID;
@@ -32,22 +91,58 @@ const char* PASSWORD = wifi_credentials::PASSWORD;
 const char* ESP_IP = "10.210.232.242";   // update if the ESP32 reboots with a new IP
 const char* WS_URL = "ws://10.210.232.242/ws";
 
-// Time zone configuration for Auckland, New Zealand
-// NTP server and timezone configuration for accurate timekeeping in Auckland, New Zealand
+// NTP server and timezone configuration for accurate timekeeping
 const char* ntpServer = "pool.ntp.org";
-// POSIX timezone string for New Zealand (automatically handles NZST/NZDT transitions)
+// Default POSIX timezone string for New Zealand (automatically handles NZST/NZDT transitions)
 // NZST-12: Standard time UTC+12, NZDT: Daylight time UTC+13
 // M9.5.0: DST starts last Sunday of September, M4.1.0: DST ends first Sunday of April
-const char* timezone = "NZST-12NZDT,M9.5.0,M4.1.0";
+// The app can replace it at runtime via time_sync {"tz": "..."}; the choice is kept in NVS.
+const char* DEFAULT_TIMEZONE = "NZST-12NZDT,M9.5.0,M4.1.0";
+const uint8_t TIMEZONE_MAX_LEN = 64;
+char timezone[TIMEZONE_MAX_LEN];
+
+// Offset transitions for the active timezone, rebuilt when it changes and once a year, so
+// the schedule tick converts epoch to local time with a table lookup instead of localtime_r.
+// The build runs a slice per loop pass in tzTableBuilder and is swapped in when finished;
+// until then local time comes straight from localtime_r.
+const int64_t TZ_TABLE_SPAN_S = 366LL * 86400;
+const int64_t TZ_TABLE_REBUILD_LEAD_S = 7LL * 86400;   // start the next build a week early
+const uint16_t TZ_TABLE_PROBES_PER_PASS = 48;          // hourly localtime_r probes per loop pass
+TzTable tzTable = {};
+TzTableBuilder tzTableBuilder;
+bool tzTableBuilding = false;
+uint32_t tzTableGeneration = 0;        // bumped by applyTimezone; a build for an older one is dropped
+uint32_t tzTableBuildGeneration = 0;
+unsigned long tzTableBuildStartedMs = 0;
+portMUX_TYPE tzTableMux = portMUX_INITIALIZER_UNLOCKED;
+Preferences clockPrefs;
 
 // Create AsyncWebServer instance on port 80
 // Web server and WebSocket setup for remote control
 AsyncWebServer server(80);
 // Create AsyncWebSocket instance
 AsyncWebSocket ws("/ws");
+// Server-Sent Events stream for read-only subscribers (dashboards, curl)
+AsyncEventSource events("/events");
+
+// ===== Rotary Encoder ISR =====
+// Both encoder pins interrupt on every edge and the ISR decodes the quadrature state
+// (same transition table and four-steps-per-detent latch as the RotaryEncoder library
+// it replaces). The handler goes through the GPIO ISR service installed with
+// ESP_INTR_FLAG_IRAM and reads the pins straight from GPIO_IN1_REG, so it runs with the
+// flash cache disabled: the ISR, recordCycles and everything they touch are in IRAM/DRAM,
+// and detents keep counting while NVS or the event log is being written.
+static_assert(ROTARY_DT >= 32 && ROTARY_DT <= 39 && ROTARY_CLK >= 32 && ROTARY_CLK <= 39,
+              "the encoder ISR reads its pins from GPIO_IN1_REG (GPIO32-39)");
+DRAM_ATTR const int8_t ENCODER_DIRECTION[16] = {
+  0, -1, 1, 0, 1, 0, 0, -1, -1, 0, 0, 1, 0, 1, -1, 0
+};
 
-// Rotary encoder for brightness control
-RotaryEncoder encoder(ROTARY_DT, ROTARY_CLK);
+volatile int32_t encoderSteps = 0;       // quarter steps
+volatile int32_t encoderPosition = 0;    // detents, latched when both pins read low
+volatile uint8_t encoderState = 0;
+portMUX_TYPE encoderMux = portMUX_INITIALIZER_UNLOCKED;
+const uint8_t ENCODER_BRIGHTNESS_STEP = 1;   // brightness steps per detent (default tunable)
 
 // ===== Schedule Data Structures =====
 
@@ -69,19 +164,36 @@ struct Alarm {
   int duration_minutes;
 };
 
+// Scheduled dusk fade: fades the lamp from its current level to off
+struct DuskFade {
+  int id;
+  bool enabled;
+  int start_hour, start_minute;
+  int duration_minutes;
+};
+
 // Storage for routines and alarms (limited for ESP32 memory)
 // Storage limits for routines and alarms due to ESP32 memory constraints
 const int MAX_ROUTINES = 10;
 const int MAX_ALARMS = 5;
+const int MAX_DUSKS = 5;
 Routine routines[MAX_ROUTINES];
 Alarm alarms[MAX_ALARMS];
+DuskFade dusks[MAX_DUSKS];
+int duskFiredYday[MAX_DUSKS];        // day-of-year each dusk last started (-1 = never)
 int routine_count = 0;
 int alarm_count = 0;
+int dusk_count = 0;
+
+// Schedule generation: bumped on every schedule mutation and scoped to this boot, so a
+// client that saw (boot_id, generation) after its own sync knows nothing changed since
+uint32_t bootId = 0;
+uint32_t scheduleGeneration = 0;
 
 // Schedule tracking
 // Timing variables for periodic schedule checking
 unsigned long lastScheduleCheck = 0;
-const unsigned long SCHEDULE_CHECK_INTERVAL = 1000; // Check every second for precise timing
+const uint32_t SCHEDULE_CHECK_INTERVAL = 1000; // Check every second for precise timing
 
 // ===== New simplified control state =====
 // Lighting mode enumeration: warm, cool, or both LEDs
@@ -105,6 +217,7 @@ int alarmOriginalBrightness = 8;     // Brightness before alarm
 Mode alarmOriginalMode = MODE_BOTH;  // Mode before alarm
 bool alarmOriginalIsOn = true;       // On/off state before alarm
 int lastAlarmMinute = -1;            // Track last minute alarm was checked
+int alarmLastShown = -1;             // Reported brightness at the last alarm state update
 
 // Current lamp control state variables
 Mode mode = MODE_BOTH;                 // double-click cycles this
@@ -119,6 +232,13 @@ Alarm suppressedAlarm = {};
 bool sunSyncActive = false;
 bool sunSyncDisabledByHardware = false;
 
+// ===== Fade (sleep timer / dusk) state tracking =====
+bool fadeActive = false;             // Is a fade-to-off currently running?
+int activeDuskId = -1;               // ID of the dusk entry driving the fade (-1 = one-shot sleep timer)
+int fadeStartBrightness = 8;         // Brightness restored (with the lamp off) once the fade ends
+bool duskSuppressed = false;
+DuskFade suppressedDusk = {};
+
 unsigned long lastClickReleaseTime = 0;
 
 // Button click state (robust, polarity-agnostic)
@@ -131,6 +251,512 @@ const uint16_t MULTI_CLICK_WINDOW_MS = 600; // grouping window for single/double
 const uint8_t OVERRIDE_BLINK_COUNT   = 2;
 const uint16_t OVERRIDE_BLINK_INTERVAL_MS = 150;
 
+// ===== Server-Sent Events replay ring =====
+// Recent state payloads kept so reconnecting SSE clients can resume from Last-Event-ID.
+// Written by the broadcaster and read by onSseConnect on the AsyncTCP task, so entries
+// and sseLatestId are only touched under sseReplayLock (a mutex: assign() allocates).
+const uint8_t SSE_REPLAY_DEPTH = 8;
+const uint32_t SSE_RETRY_MS = 3000;      // reconnect delay suggested to SSE clients
+struct SseReplayEntry {
+  uint32_t id;
+  JsonText payload;
+};
+SseReplayEntry sseReplay[SSE_REPLAY_DEPTH];
+uint32_t sseLatestId = 0;                // newest id in the ring (0 = none yet)
+SemaphoreHandle_t sseReplayLock = nullptr;
+
+// JSON documents charge their memory to the subsystem that owns them (see /metrics "heap")
+TaggedJsonAllocator wsRxJson(ALLOC_WS_RX);
+TaggedJsonAllocator wsTxJson(ALLOC_WS_TX);
+TaggedJsonAllocator httpJson(ALLOC_HTTP);
+
+// State version: bumped for every state broadcast so clients can drop stale or reordered
+// updates; it doubles as the SSE event id (0 = nothing broadcast since boot). Broadcasts
+// run only on the loop task, so the bump and the serialised state it labels stay in
+// order; other tasks leave a pending broadcast for the next loop pass.
+uint32_t stateVersion = 0;
+TaskHandle_t loopTaskHandle = nullptr;
+bool broadcastPending = false;
+uint32_t broadcastPendingExclude = 0;
+portMUX_TYPE broadcastMux = portMUX_INITIALIZER_UNLOCKED;
+
+// ===== Event History Log =====
+// Fixed-size binary records appended to the "evlog" flash partition. Sectors are
+// erased only when the write head rotates into them, so the oldest sector is recycled.
+enum EventType : uint8_t {
+  EVT_BOOT = 1,            // id = esp_reset_reason()
+  EVT_STATE = 2,           // lamp output settled on a new isOn/mode/brightness
+  EVT_ROUTINE_START = 3,
+  EVT_ROUTINE_END = 4,
+  EVT_ALARM_START = 5,
+  EVT_ALARM_END = 6,
+  EVT_OVERRIDE = 7,        // source = override source, flags = disabled automations
+  EVT_WIFI = 8,            // id = wl_status_t
+  EVT_SUN_SYNC = 9,        // flags bit0 = active
+  EVT_FADE_START = 10,     // id = dusk id (-1 = sleep timer)
+  EVT_FADE_END = 11,       // flags bit0 = completed (0 = cancelled)
+};
+
+enum EventSource : uint8_t {
+  SRC_NONE = 0,
+  SRC_HARDWARE,
+  SRC_HARDWARE_OFFLINE_ROTARY,
+  SRC_HARDWARE_OFFLINE_BUTTON,
+  SRC_HARDWARE_WIFI_LOSS,
+  SRC_APP,
+  SRC_SCHEDULE,
+  SRC_OTHER,
+};
+
+struct __attribute__((packed)) EventRecord {
+  uint32_t seq;            // monotonically increasing, 0xFFFFFFFF = erased slot
+  uint32_t epoch;          // UTC seconds, 0 when the clock was not yet valid
+  uint8_t type;            // EventType
+  uint8_t source;          // EventSource
+  int16_t id;              // routine/alarm id, reset reason or WiFi status
+  uint8_t brightness;      // lamp state at the time of the event
+  uint8_t mode;
+  uint8_t flags;           // bit0 isOn (state events) or event specific bits
+  uint8_t check;           // XOR of the preceding bytes
+};
+static_assert(sizeof(EventRecord) == 16, "EventRecord must stay 16 bytes");
+
+const uint32_t EVENT_LOG_SECTOR_SIZE = 4096;
+const uint32_t EVENT_RECORDS_PER_SECTOR = EVENT_LOG_SECTOR_SIZE / sizeof(EventRecord);
+const uint8_t EVENT_PENDING_DEPTH = 16;               // RAM staging queue, flushed from loop()
+const unsigned long EVENT_STATE_SETTLE_MS = 2000;     // brightness drags are logged once settled
+const uint16_t EVENT_QUERY_DEFAULT_LIMIT = 200;
+const uint16_t EVENT_QUERY_MAX_LIMIT = 1000;
+const uint8_t EVENT_QUERY_BATCH = 16;                 // records per flash read while streaming /history
+const uint8_t EVENT_LOG_MAX_SECTORS = 32;             // 128KB evlog partition; any excess is unused
+
+// Per-sector summary kept in RAM so /history reads only sectors that can match
+struct EventSectorIndex {
+  uint16_t used;           // slots written since the sector was erased
+  uint32_t minEpoch;
+  uint32_t maxEpoch;
+};
+
+const esp_partition_t* eventLogPartition = nullptr;
+uint32_t eventLogSectors = 0;
+uint32_t eventLogSlots = 0;              // total record slots in the partition
+uint32_t eventLogHead = 0;               // next slot to write
+uint32_t eventLogNextSeq = 1;
+EventSectorIndex eventSectorIndex[EVENT_LOG_MAX_SECTORS];
+portMUX_TYPE eventIndexMux = portMUX_INITIALIZER_UNLOCKED;
+EventRecord eventPending[EVENT_PENDING_DEPTH];
+uint8_t eventPendingHead = 0;
+uint8_t eventPendingCount = 0;
+uint32_t eventPendingDropped = 0;
+portMUX_TYPE eventPendingMux = portMUX_INITIALIZER_UNLOCKED;
+unsigned long lastOutputChangeMs = 0;    // updated by applyOutput() for state settling
+
+// ===== Energy Accounting =====
+// Duty x time is integrated in writeChannels() on every output change (integer only),
+// folded into hourly buckets kept in a RAM ring. Each finished hour is journalled to NVS
+// as a single bucket; the whole ring is rewritten once the journal fills, or before a restart.
+const uint32_t PWM_FREQUENCY_HZ = 5000;
+const uint8_t PWM_RESOLUTION_BITS = 8;
+const uint32_t PWM_SOURCE_CLOCK_HZ = 80000000;           // LEDC APB clock: frequency << bits must fit
+uint16_t pwmMaxDuty = (1 << PWM_RESOLUTION_BITS) - 1;    // inverted: pwmMaxDuty = off; see configurePwm()
+const ledc_mode_t PWM_SPEED_MODE = LEDC_HIGH_SPEED_MODE;  // Arduino puts channels 0-7 in this group
+const uint16_t LED_CHANNEL_FULL_POWER_MW[2] = {3000, 3000}; // warm, white draw at 100% duty
+const uint8_t ENERGY_BUCKET_COUNT = 168;                  // one week of hourly buckets
+const uint8_t ENERGY_DEFAULT_REPORT_HOURS = 24;
+const uint32_t ENERGY_VALID_HOUR_MIN = 1600000000UL / 3600; // earlier hours mean the clock is unsynced
+const uint8_t ENERGY_JOURNAL_HOURS = 24;                  // single-bucket writes between full saves
+
+struct EnergyBucket {
+  uint32_t hour;           // UTC epoch / 3600 (small values = clock not yet synced)
+  uint32_t fullOnMs[2];    // duty-weighted on time, in ms at 100% duty
+  uint32_t onMs[2];        // time with the channel lit at any duty
+};
+
+struct EnergyJournalEntry {
+  uint8_t index;           // ring slot the bucket belongs in
+  EnergyBucket bucket;
+};
+
+EnergyBucket energyBuckets[ENERGY_BUCKET_COUNT];
+uint8_t energyHead = 0;                  // bucket for the current hour
+uint8_t energyJournalCount = 0;          // entries written since the last full save
+uint64_t energyDutyAcc[2] = {0, 0};      // duty steps x ms not yet folded into the bucket
+uint32_t energyOnAcc[2] = {0, 0};
+uint16_t energyLevel[2] = {0, 0};        // current lit duty steps per channel
+unsigned long energyLastMs = 0;
+portMUX_TYPE energyMux = portMUX_INITIALIZER_UNLOCKED;
+Preferences energyPrefs;
+
+// ===== Continuous Ramp Engine =====
+// Output levels are Q8 fixed point on the 0-15 brightness scale (level 15 << 8 = full).
+// Ramps are evaluated against millis() on every loop pass, so fades move in PWM steps
+// rather than whole brightness steps once per minute.
+const uint16_t LEVEL_Q8_MAX = 15 << 8;
+
+// ===== Hot Path Timing =====
+// Cycle counts (esp_cpu_get_ccount) around the encoder ISR, the control tick and the
+// compositor render. A sample taken during a flash write, or on the first run after one
+// (the cache comes back cold), counts towards maxFlash instead of max, so worst-case
+// latency with and without flash activity can be compared in /metrics.
+// The control tick, the manual layer update (applyOutput) and the render (composeLayers,
+// dutyForLevel, writeChannels) are IRAM_ATTR and work on DRAM globals; the duty goes straight to the LEDC registers and the clock is
+// read through esp_timer, so only the slow branches (logging, broadcasts, PWM
+// reconfiguration) call into flash.
+struct CycleStat {
+  uint32_t samples;
+  uint32_t last;
+  uint32_t max;
+  uint32_t maxFlash;
+  uint32_t flashSeen;    // flashWrites at the previous sample
+};
+
+CycleStat cyclesEncoderIsr = {};
+CycleStat cyclesControlTick = {};
+CycleStat cyclesRender = {};
+volatile bool flashWriteActive = false;  // set around event log and NVS writes
+volatile uint32_t flashWrites = 0;
+
+struct Ramp {
+  unsigned long startMs;
+  unsigned long durationMs;
+  uint16_t fromQ8;
+  uint16_t toQ8;
+};
+
+Ramp fadeRamp = {};
+int fadeLastShown = -1;                  // reported brightness at the last fade state update
+
+// ===== Lighting Compositor =====
+// Every output source contributes a layer. Layers are blended bottom-up by priority and
+// the result is rendered once per loop pass, only when a layer changed. The manual layer
+// mirrors brightness/mode/isOn; automations sit above it and leave those globals alone
+// while they run. The additive knob layer nudges whatever automation is on top.
+enum LayerId : uint8_t {
+  LAYER_MANUAL = 0,      // knob/button/app state (brightness, mode, isOn)
+  LAYER_ROUTINE,
+  LAYER_ALARM,           // sunrise warm/white mix
+  LAYER_FADE,            // sleep timer / dusk fade-to-off
+  LAYER_STREAM,          // streamed remote dimming
+  LAYER_KNOB,            // knob offset while an automation owns the lamp
+  LAYER_COUNT
+};
+
+struct LightLayer {
+  bool active;
+  bool additive;         // adds offsetQ8 to the lit channels beneath instead of blending
+  uint8_t priority;      // higher priority layers are composited on top
+  uint8_t weight;        // 0-255 blend of this layer over the result beneath it
+  uint16_t warmQ8;
+  uint16_t whiteQ8;
+  int16_t offsetQ8;
+};
+
+LightLayer layers[LAYER_COUNT] = {
+  // active, additive, priority, weight, warm, white, offset
+  {true,  false, 0,  255, 0, 0, 0},   // manual
+  {false, false, 20, 255, 0, 0, 0},   // routine
+  {false, false, 30, 255, 0, 0, 0},   // alarm
+  {false, false, 40, 255, 0, 0, 0},   // fade
+  {false, false, 50, 255, 0, 0, 0},   // stream
+  {false, true,  60, 255, 0, 0, 0},   // knob
+};
+
+struct ComposedOutput {
+  bool isOn;
+  uint16_t warmQ8;
+  uint16_t whiteQ8;
+  int brightness;        // reported 0-15: the brighter channel, rounded up
+  Mode mode;             // reported mode: which channels are lit
+};
+
+bool compositorDirty = true;
+int compositorCh0 = -1;                  // duty last written; -1 forces the next render
+int compositorCh1 = -1;
+uint32_t compositorRenders = 0;
+
+// ===== Control Mailbox =====
+// App control frames (slider drags send one per tick) only post the requested value here,
+// last writer wins per field. handleControlTick() applies the newest values at a fixed
+// rate, so a burst of frames costs a single output update and state broadcast.
+const unsigned long CONTROL_TICK_MS = 20;
+
+struct ControlMailbox {
+  bool hasBrightness;
+  bool hasMode;
+  bool hasOn;
+  int brightness;
+  int mode;
+  bool on;
+  uint32_t originClientId;               // client that posted the pending values (0 = several)
+};
+
+ControlMailbox controlMailbox = {};
+portMUX_TYPE controlMailboxMux = portMUX_INITIALIZER_UNLOCKED;
+unsigned long lastControlTick = 0;
+uint32_t controlCommandsTotal = 0;       // control fields posted since boot
+uint32_t controlCoalescedTotal = 0;      // posted fields overwritten before they were applied
+uint32_t controlAppliedTotal = 0;        // control ticks that changed the output
+uint32_t controlFastFrames = 0;          // frames handled by the allocation-free fast path
+uint32_t controlParsedFrames = 0;        // frames that went through deserializeJson()
+uint32_t controlCoalescedWindow = 0;     // overwrites in the current one second window
+uint32_t controlCoalescedPerSecond = 0;  // overwrites during the last complete second
+unsigned long controlWindowStart = 0;
+
+// ===== Streaming Control Sessions =====
+// A client streams timestamped brightness samples; each one is played out a fixed delay
+// after the least-delayed arrival seen, so Wi-Fi jitter is absorbed by the buffer and the
+// output is interpolated between samples on every loop pass instead of jumping per frame.
+const uint8_t STREAM_BUFFER_DEPTH = 16;
+const uint16_t STREAM_DEFAULT_DELAY_MS = 120;
+const uint16_t STREAM_MAX_DELAY_MS = 1000;
+const unsigned long STREAM_IDLE_TIMEOUT_MS = 1500;   // session closes this long after the last sample
+
+struct StreamSample {
+  uint32_t clientMs;                     // sender timestamp (sender clock, ms)
+  uint16_t levelQ8;                      // target level, Q8 on the 0-15 scale
+};
+
+bool streamActive = false;
+bool streamEndRequested = false;         // client ended the session; drain the buffer then commit
+uint32_t streamClientId = 0;
+uint16_t streamDelayMs = STREAM_DEFAULT_DELAY_MS;
+bool streamClockValid = false;
+long streamClockOffset = 0;              // millis() - clientMs for the least-delayed sample so far
+StreamSample streamBuffer[STREAM_BUFFER_DEPTH];
+uint8_t streamHead = 0;
+uint8_t streamCount = 0;
+uint16_t streamLevelQ8 = 0;              // level currently being played out
+bool streamStarved = false;
+unsigned long streamLastSampleMs = 0;    // arrival time of the newest sample
+portMUX_TYPE streamMux = portMUX_INITIALIZER_UNLOCKED;
+uint32_t streamSamplesTotal = 0;
+uint32_t streamLateSamples = 0;          // arrived after their playout time
+uint32_t streamDroppedSamples = 0;       // out of order or buffer overflow
+uint32_t streamUnderruns = 0;            // buffer ran dry while the session was still open
+
+// ===== Task Statistics =====
+// Every TASK_STATS_INTERVAL_MS the FreeRTOS task list is copied into a fixed table: each
+// task's CPU share over the last interval and the least free stack it has ever had.
+// CPU shares need run time stats in the SDK build; stacks only need the trace facility.
+const uint8_t TASK_STATS_MAX = 32;       // more tasks than this and the sample is skipped
+const unsigned long TASK_STATS_INTERVAL_MS = 5000;
+
+struct TaskStat {
+  char name[16];
+  TaskHandle_t handle;
+  uint8_t state;                         // eTaskState
+  uint8_t priority;
+  uint32_t stackFree;                    // high-water mark, bytes (StackType_t is a byte here)
+  uint32_t runTime;                      // run time counter at the last sample
+  uint16_t cpuPermille;                  // of one core over the last interval (cores sum to 2000)
+};
+
+TaskStat taskStats[TASK_STATS_MAX];
+uint8_t taskStatCount = 0;
+bool taskStatsTruncated = false;
+uint32_t taskStatsRunTime = 0;           // total run time counter at the last sample
+unsigned long lastTaskStatsMs = 0;
+portMUX_TYPE taskStatsMux = portMUX_INITIALIZER_UNLOCKED;
+
+// ===== Log Ring =====
+// Records formatted while somebody is subscribed (see LOG_AT), kept in RAM and sent to
+// each subscriber in batches. Subscribers filter by level and by a substring of the
+// logging function's name, e.g. "Stream" matches handleStreamBegin and stopStream.
+const uint8_t LOG_RING_DEPTH = 32;
+const uint8_t LOG_RECORD_TEXT = 96;      // longer messages are truncated
+const uint8_t LOG_BATCH_MAX = 16;        // records per "log" frame
+const uint8_t LOG_MODULE_MAX = 24;
+const unsigned long LOG_STREAM_INTERVAL_MS = 250;
+
+struct LogRecord {
+  uint32_t seq;
+  uint32_t uptimeMs;
+  uint8_t level;
+  const char* origin;                    // __func__ of the logging call
+  char text[LOG_RECORD_TEXT];
+};
+
+LogRecord logRing[LOG_RING_DEPTH];
+uint32_t logNextSeq = 1;                 // the ring holds the LOG_RING_DEPTH records before this
+portMUX_TYPE logRingMux = portMUX_INITIALIZER_UNLOCKED;
+unsigned long lastLogStreamMs = 0;
+
+// ===== WebSocket Client Slots =====
+// Connections are admitted into a fixed table sized at compile time (DEFAULT_MAX_WS_CLIENTS,
+// which also bounds cleanupClients). Each slot owns a preallocated buffer that reassembles
+// messages split across frames or TCP segments. Connections past the limit are closed with
+// 1013 (try again later) before anything is sent to them. Outbound frames queue in
+// AsyncWebSocket itself, capped per client by WS_MAX_QUEUED_MESSAGES.
+const uint8_t WS_CLIENT_SLOTS = DEFAULT_MAX_WS_CLIENTS;
+const size_t WS_RX_BUFFER_SIZE = 4096;   // a full_sync with every slot filled is ~3 KB
+const uint16_t WS_CLOSE_TRY_AGAIN_LATER = 1013;
+
+// Keepalive: a client that has been silent for a while is pinged; no pong (or any other
+// frame) within the timeout and its TCP connection is aborted, freeing the slot and its
+// queue in seconds instead of waiting minutes for TCP to give up. Quiet clients with
+// nothing queued are pinged rarely so a sleeping phone's radio is left alone; frames
+// piling up in a client's queue get it pinged early.
+#ifndef WS_PING_IDLE_MS
+#define WS_PING_IDLE_MS 20000
+#endif
+#ifndef WS_PING_BACKLOG_MS
+#define WS_PING_BACKLOG_MS 2000
+#endif
+#ifndef WS_PONG_TIMEOUT_MS
+#define WS_PONG_TIMEOUT_MS 4000
+#endif
+const unsigned long WS_KEEPALIVE_CHECK_MS = 500;
+
+unsigned long lastWsKeepaliveMs = 0;
+uint32_t wsPingsSent = 0;
+uint32_t wsDeadPeers = 0;
+
+struct WsClientSlot {
+  uint32_t clientId;                     // 0 = free
+  unsigned long lastRxMs;                // last frame of any kind, pongs included
+  unsigned long pingSentMs;              // outstanding ping; 0 = none
+  uint8_t logFilterLevel;                // log subscription; LOG_LEVEL_NONE = not subscribed
+  char logFilterModule[LOG_MODULE_MAX];  // "" = every module
+  uint32_t logCursor;                    // seq of the next record to send
+  uint32_t rxLength;                     // bytes of the current message reassembled so far
+  bool rxOverflow;                       // current message is too big; dropped at its end
+  uint8_t rxBuffer[WS_RX_BUFFER_SIZE];
+};
+
+WsClientSlot wsSlots[WS_CLIENT_SLOTS];
+uint32_t wsRejectedClients = 0;
+uint32_t wsRxOverflows = 0;
+portMUX_TYPE wsSlotsMux = portMUX_INITIALIZER_UNLOCKED;   // keepalive fields, read from the loop
+
+// ===== Runtime Tunables =====
+// Timings and PWM settings that differ between hardware revisions. Hot paths read the
+// plain `tunables` struct directly; TUNABLE_DEFS describes each field (name, width,
+// range, default) for the get/set requests and NVS. The constants above are the defaults.
+struct Tunables {
+  uint16_t debounceMs;
+  uint16_t multiClickWindowMs;
+  uint8_t overrideBlinkCount;
+  uint16_t overrideBlinkIntervalMs;
+  uint32_t scheduleCheckIntervalMs;
+  uint32_t pwmFrequencyHz;
+  uint8_t pwmResolutionBits;
+  uint8_t encoderStep;
+  uint32_t wsPingIdleMs;                 // silence before pinging an idle client
+  uint32_t wsPingBacklogMs;              // silence before pinging a client with queued frames
+  uint32_t wsPongTimeoutMs;
+};
+
+enum TunableWidth : uint8_t { TUNABLE_U8, TUNABLE_U16, TUNABLE_U32 };
+
+struct TunableDef {
+  const char* name;                      // JSON and NVS key (NVS keys are at most 15 chars)
+  TunableWidth width;
+  uint16_t offset;                       // offsetof(Tunables, field)
+  uint32_t minValue;
+  uint32_t maxValue;
+  uint32_t defaultValue;
+};
+
+const TunableDef TUNABLE_DEFS[] = {
+  {key::DEBOUNCE_MS,     TUNABLE_U16, offsetof(Tunables, debounceMs),              1,    200,    DEBOUNCE_MS},
+  {key::CLICK_WINDOW_MS, TUNABLE_U16, offsetof(Tunables, multiClickWindowMs),      150,  2000,   MULTI_CLICK_WINDOW_MS},
+  {key::BLINK_COUNT,     TUNABLE_U8,  offsetof(Tunables, overrideBlinkCount),      0,    10,     OVERRIDE_BLINK_COUNT},
+  {key::BLINK_MS,        TUNABLE_U16, offsetof(Tunables, overrideBlinkIntervalMs), 20,   1000,   OVERRIDE_BLINK_INTERVAL_MS},
+  {key::SCHEDULE_MS,     TUNABLE_U32, offsetof(Tunables, scheduleCheckIntervalMs), 100,  30000,  SCHEDULE_CHECK_INTERVAL},
+  {key::PWM_FREQ_HZ,     TUNABLE_U32, offsetof(Tunables, pwmFrequencyHz),          100,  40000,  PWM_FREQUENCY_HZ},
+  {key::PWM_BITS,        TUNABLE_U8,  offsetof(Tunables, pwmResolutionBits),       8,    16,     PWM_RESOLUTION_BITS},
+  {key::ENCODER_STEP,    TUNABLE_U8,  offsetof(Tunables, encoderStep),             1,    5,      ENCODER_BRIGHTNESS_STEP},
+  {key::WS_IDLE_MS,      TUNABLE_U32, offsetof(Tunables, wsPingIdleMs),            1000, 120000, WS_PING_IDLE_MS},
+  {key::WS_BACKLOG_MS,   TUNABLE_U32, offsetof(Tunables, wsPingBacklogMs),         500,  60000,  WS_PING_BACKLOG_MS},
+  {key::WS_PONG_MS,      TUNABLE_U32, offsetof(Tunables, wsPongTimeoutMs),         1000, 30000,  WS_PONG_TIMEOUT_MS},
+};
+const uint8_t TUNABLE_COUNT = sizeof(TUNABLE_DEFS) / sizeof(TUNABLE_DEFS[0]);
+
+Tunables tunables = {
+  DEBOUNCE_MS, MULTI_CLICK_WINDOW_MS, OVERRIDE_BLINK_COUNT, OVERRIDE_BLINK_INTERVAL_MS,
+  SCHEDULE_CHECK_INTERVAL, PWM_FREQUENCY_HZ, PWM_RESOLUTION_BITS, ENCODER_BRIGHTNESS_STEP,
+  WS_PING_IDLE_MS, WS_PING_BACKLOG_MS, WS_PONG_TIMEOUT_MS
+};
+portMUX_TYPE tunablesMux = portMUX_INITIALIZER_UNLOCKED;   // serialises whole-struct updates
+volatile bool pwmReconfigurePending = false;               // applied by the compositor (loop task)
+Preferences tunablesPrefs;
+
+// ===== Configuration Snapshot =====
+// The schedule, timezone and tunables as one versioned little-endian blob, so a lamp can
+// be cloned with a single GET /snapshot + POST /snapshot of a few hundred bytes:
+//   header:  "LCFG", version u8, reserved u8, payload length u16, CRC-32 (zlib) of payload u32
+//   payload: routine count u8, each {id u16, enabled | mode << 1 u8, start u16, end u16, brightness u8}
+//            alarm count u8, each {id u16, enabled u8, wake u16, start u16, duration u8}
+//            dusk count u8, each {id u16, enabled u8, start u16, duration u8}
+//            timezone length u8 + POSIX TZ chars
+//            tunable count u8, each value u32 in TUNABLE_DEFS order (append-only)
+// Times are minutes since local midnight.
+const char SNAPSHOT_MAGIC[] = "LCFG";
+const uint8_t SNAPSHOT_VERSION = 1;
+const size_t SNAPSHOT_HEADER_SIZE = 12;
+const size_t SNAPSHOT_MAX_SIZE = 512;
+
+struct ByteWriter {
+  uint8_t* data;
+  size_t capacity;
+  size_t length;
+  bool overflow;
+  void u8(uint8_t value);
+  void u16(uint16_t value);
+  void u32(uint32_t value);
+};
+
+struct ByteReader {
+  const uint8_t* data;
+  size_t length;
+  size_t pos;
+  bool error;                            // read past the end or a field out of range
+  uint8_t u8();
+  uint16_t u16();
+  uint32_t u32();
+};
+
+// Encoded export, held by the response until it has been sent
+struct SnapshotBlob {
+  uint8_t data[SNAPSHOT_MAX_SIZE];
+  size_t length;
+};
+
+// Decoded and validated import, applied only once the whole blob checks out
+struct ConfigSnapshot {
+  Routine routines[MAX_ROUTINES];
+  Alarm alarms[MAX_ALARMS];
+  DuskFade dusks[MAX_DUSKS];
+  int routineCount;
+  int alarmCount;
+  int duskCount;
+  char timezone[TIMEZONE_MAX_LEN];
+  Tunables tunables;
+  uint32_t tunablesChanged;              // bit per TUNABLE_DEFS entry
+};
+
+// Imports are decoded and validated on the AsyncTCP task, then applied in one step by the
+// loop task (serviceSnapshotImport) so checkSchedule never sees a half-copied table
+ConfigSnapshot snapshotStaging;
+bool snapshotPending = false;            // snapshotStaging holds an import for the loop
+portMUX_TYPE snapshotMux = portMUX_INITIALIZER_UNLOCKED;
+
+// ===== Firmware Update =====
+// POST /update streams a raw application image (.pio/build/<env>/firmware.bin) into the
+// idle OTA slot; esp_ota_end() validates it before the boot partition is switched. The
+// lamp restarts once the response has had time to go out.
+// The upload must carry the lamp's OTA token in X-Lamp-Token. It is generated on first
+// boot and kept in NVS, and printed on the serial console at every boot (never into the
+// log stream), so it is read off the port the first image was flashed through and handed
+// to lamp_fleet with --token/--tokens.
+const uint32_t OTA_RESTART_DELAY_MS = 1000;
+const uint8_t OTA_TOKEN_BYTES = 16;
+Preferences otaPrefs;
+char otaToken[OTA_TOKEN_BYTES * 2 + 1] = "";   // hex; empty refuses every upload
+
+AsyncWebServerRequest* otaOwner = nullptr;   // upload that holds the Update singleton
+volatile uint32_t otaRestartAt = 0;          // millis() deadline, 0 = none
+
 // ===== Forward Declarations =====
 // Forward declarations for schedule management functions
 void handleRoutineSync(JsonDocument& doc);
@@ -146,27 +772,110 @@ Alarm* findAlarmById(int id);
 bool isWithinTimeRange(int startHour, int startMinute, int endHour, int endMinute, int currentTime);
 void updateSuppressionWindows(int currentTime);
 void blinkLamp(uint8_t count, uint16_t intervalMs);
+void suppressActiveSchedule(const char* source);
 bool hardwareOverrideActiveAutomations(const char* source, bool shouldBlink);
-void broadcastOverrideEvent(const char* source, bool routineWasActive, bool alarmWasActive, bool sunSyncWasActive);
+void broadcastOverrideEvent(const char* source, bool routineWasActive, bool alarmWasActive, bool sunSyncWasActive,
+                            bool fadeWasActive);
 void sendSunSyncState(bool active, const char* source);
 void handleRotaryEncoder();
 void handleButtonClicks();
 void handleScheduleTick();
 void handleWifiState();
+void serializeState(JsonText& out);
+void fillStateObject(JsonObject state);
+void sendHello(AsyncWebSocketClient* client);
+uint32_t scheduleDigest();
+void bumpScheduleGeneration();
+void publishStateEvent(const JsonText& payload, uint32_t id);
+void broadcastState(uint32_t excludeClientId);
+void serviceStateBroadcast();
+void onSseConnect(AsyncEventSourceClient* client);
+void initEventLog();
+void logEvent(EventType type, uint8_t source, int id, uint8_t flags);
+uint8_t eventSourceCode(const char* source);
+void serviceEventLog();
+void handleHistoryRequest(AsyncWebServerRequest* request);
+void writeChannels(int ch0, int ch1);
+void initEnergyAccounting();
+void serviceEnergyAccounting();
+void handleEnergyRequest(AsyncWebSocketClient* client, JsonDocument& doc);
+void handleEnergyHttpRequest(AsyncWebServerRequest* request);
+void handleDuskSync(JsonDocument& doc);
+void handleSleepTimer(JsonDocument& doc);
+bool readDuskFields(JsonObject obj, DuskFade& out);
+bool startFade(unsigned long durationMs, int duskId);
+void cancelFade(const char* reason);
+void handleRampTick();
+void checkDuskSchedule(int currentTime, int currentSecond, int yday);
+void lookupAlarmCurve(const Alarm& alarm, long elapsedS, uint16_t& warmQ8, uint16_t& whiteQ8);
+void postControlCommand(const lamp_protocol::ControlFrame& frame, uint32_t clientId);
+void handleControlTick();
+void handleEncoderIsr(void* arg);
+void initEncoder();
+void recordCycles(CycleStat& stat, uint32_t startCycles);
+void addCycleStat(JsonObject obj, const CycleStat& stat);
+void beginFlashWrite();
+void endFlashWrite();
+void buildMetricsReport(JsonDocument& out);
+void handleMetricsRequest(AsyncWebSocketClient* client);
+void sampleTaskStats();
+void fillTaskStats(JsonObject obj);
+void handleTaskStatsRequest(AsyncWebSocketClient* client);
+void handleWsMessage(AsyncWebSocketClient* client, uint8_t* data, size_t len);
+void serviceWsKeepalive();
+void handleLogSubscribe(AsyncWebSocketClient* client, JsonDocument& doc);
+void updateLogStreamLevel();
+void initTunables();
+void configurePwm();
+void handleTunablesRequest(AsyncWebSocketClient* client);
+void handleTunablesSet(JsonDocument& doc);
+void handleTunablesHttpGet(AsyncWebServerRequest* request);
+void handleTunablesHttpSet(AsyncWebServerRequest* request);
+void commitTunables(const Tunables& next, uint32_t changed);
+void sendHttpResult(AsyncWebServerRequest* request, int code, bool success, const char* message);
+void handleSnapshotExport(AsyncWebServerRequest* request);
+void handleSnapshotBody(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total);
+void handleSnapshotImport(AsyncWebServerRequest* request);
+void serviceSnapshotImport();
+void handleUpdateBody(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total);
+void handleUpdate(AsyncWebServerRequest* request);
+void initOtaToken();
+void serviceFirmwareUpdate();
+void serviceLogStream();
+void fillHeapStats(JsonObject obj);
+void handleHeapStatsRequest(AsyncWebSocketClient* client);
+void handleMetricsHttpRequest(AsyncWebServerRequest* request);
+void handleStreamBegin(AsyncWebSocketClient* client, JsonDocument& doc);
+void handleStreamSamples(AsyncWebSocketClient* client, JsonDocument& doc);
+void handleStreamEnd(uint32_t clientId);
+void stopStream(bool commit, const char* reason);
+void handleStreamTick();
+void initTimezone();
+void applyTimezone(const char* posix, bool persist);
+bool getLocalClock(TzLocalClock& out);
+void serviceTimezoneTable();
+void applyOutput();
+void setLayerLevels(LayerId id, uint16_t warmQ8, uint16_t whiteQ8);
+void setLayerState(LayerId id, bool on, Mode layerMode, uint16_t levelQ8);
+void clearLayer(LayerId id);
+void releaseLayer(LayerId id);
+void nudgeKnobLayer(int steps);
+void composeLayers(ComposedOutput& out);
+void serviceCompositor();
 
 // ===== Validation Helpers =====
 // Helper functions for validating and parsing JSON input fields
 bool readIntField(JsonObject obj, const char* key, int minValue, int maxValue, int& outValue) {
   JsonVariant valueVariant = obj[key];
   if (!valueVariant.is<int>() && !valueVariant.is<long>()) {
-    Serial.printf("Validation error: '%s' missing or not an integer\n", key);
+    LOGW("Validation error: '%s' missing or not an integer\n", key);
     return false;
   }
 
   long value = valueVariant.as<long>();
   if (value < minValue || value > maxValue) {
-    Serial.printf("Validation error: '%s' value %ld outside [%d, %d]\n",
-                  key, value, minValue, maxValue);
+    LOGW("Validation error: '%s' value %ld outside [%d, %d]\n",
+         key, value, minValue, maxValue);
     return false;
   }
 
@@ -177,7 +886,7 @@ bool readIntField(JsonObject obj, const char* key, int minValue, int maxValue, i
 bool readBoolField(JsonObject obj, const char* key, bool& outValue) {
   JsonVariant valueVariant = obj[key];
   if (!valueVariant.is<bool>()) {
-    Serial.printf("Validation error: '%s' missing or not a boolean\n", key);
+    LOGW("Validation error: '%s' missing or not a boolean\n", key);
     return false;
   }
 
@@ -186,207 +895,773 @@ bool readBoolField(JsonObject obj, const char* key, bool& outValue) {
 }
 
 // ===== Helpers =====
-// Function to broadcast current lamp state to all connected WebSocket clients
+// Serialize the current lamp state into the shared {"state":{...}} payload
+void serializeState(JsonText& out) {
+  JsonDocument doc(&wsTxJson);
+  fillStateObject(doc[key::STATE].to<JsonObject>());
+  out.assign(doc);
+}
+
+// Populate the lamp state fields shared by state updates and the hello bundle
+void fillStateObject(JsonObject state) {
+  ComposedOutput out;
+  composeLayers(out);
+  state[key::VERSION] = stateVersion;
+  state[key::BRIGHTNESS] = out.brightness;
+  state[key::MODE] = (int)out.mode;
+  state[key::ON] = out.isOn;
+  if (layers[LAYER_KNOB].active) {
+    state[key::KNOB_OFFSET] = layers[LAYER_KNOB].offsetQ8 / 256;
+  }
+  state[key::ROUTINE_ACTIVE] = routineActive;
+  state[key::ALARM_ACTIVE] = alarmActive;
+  state[key::SUN_SYNC_ACTIVE] = sunSyncActive;
+  state[key::ROUTINE_SUPPRESSED] = routineSuppressed;
+  state[key::ALARM_SUPPRESSED] = alarmSuppressed;
+  state[key::SUN_SYNC_DISABLED_BY_HW] = sunSyncDisabledByHardware;
+  state[key::MANUAL_CONTROL_LOCKED] = isManualControlLocked();
+  state[key::FADE_ACTIVE] = fadeActive;
+  state[key::DUSK_SUPPRESSED] = duskSuppressed;
+  if (fadeActive) {
+    unsigned long elapsed = millis() - fadeRamp.startMs;
+    state[key::FADE_REMAINING_S] = elapsed < fadeRamp.durationMs ? (fadeRamp.durationMs - elapsed) / 1000 : 0;
+  }
+}
+
+// FNV-1a over the schedule fields the app syncs; lets a client verify its copy in one frame
+uint32_t scheduleDigest() {
+  uint32_t hash = 2166136261UL;
+  auto mix = [&hash](int value) {
+    for (uint8_t i = 0; i < 4; i++) {
+      hash ^= (uint8_t)(value >> (8 * i));
+      hash *= 16777619UL;
+    }
+  };
+
+  mix(routine_count);
+  for (int i = 0; i < routine_count; i++) {
+    const Routine& r = routines[i];
+    mix(r.id); mix(r.enabled); mix(r.start_hour); mix(r.start_minute);
+    mix(r.end_hour); mix(r.end_minute); mix(r.brightness); mix(r.mode);
+  }
+  mix(alarm_count);
+  for (int i = 0; i < alarm_count; i++) {
+    const Alarm& a = alarms[i];
+    mix(a.id); mix(a.enabled); mix(a.wake_hour); mix(a.wake_minute);
+    mix(a.start_hour); mix(a.start_minute); mix(a.duration_minutes);
+  }
+  mix(dusk_count);
+  for (int i = 0; i < dusk_count; i++) {
+    const DuskFade& d = dusks[i];
+    mix(d.id); mix(d.enabled); mix(d.start_hour); mix(d.start_minute); mix(d.duration_minutes);
+  }
+  return hash;
+}
+
+void bumpScheduleGeneration() {
+  scheduleGeneration++;
+}
+
+// Handshake for a newly connected client only: state, firmware/protocol capabilities,
+// schedule generation/digest and the automation currently in control
+void sendHello(AsyncWebSocketClient* client) {
+  JsonDocument doc(&wsTxJson);
+  doc[key::TYPE] = msg::HELLO;
+  fillStateObject(doc[key::STATE].to<JsonObject>());
+
+  JsonObject firmware = doc[key::FIRMWARE].to<JsonObject>();
+  firmware[key::VERSION] = FIRMWARE_VERSION;
+  firmware[key::BUILD] = __DATE__ " " __TIME__;
+  firmware[key::SDK] = ESP.getSdkVersion();
+  firmware[key::UPTIME_MS] = millis();
+
+  JsonObject protocol = doc[key::PROTOCOL].to<JsonObject>();
+  protocol[key::VERSION] = PROTOCOL_VERSION;
+  JsonArray caps = protocol[key::CAPABILITIES].to<JsonArray>();
+  caps.add(msg::ROUTINE_SYNC);
+  caps.add(msg::ALARM_SYNC);
+  caps.add(msg::DUSK_SYNC);
+  caps.add(msg::FULL_SYNC);
+  caps.add(msg::TIME_SYNC);
+  caps.add(msg::SUN_SYNC_STATE);
+  caps.add(msg::SLEEP_TIMER);
+  caps.add(msg::ENERGY_REQUEST);
+  caps.add(cap::ALARM_CCT_CURVE);
+  caps.add(cap::SSE_EVENTS);
+  caps.add(cap::HISTORY_LOG);
+  caps.add(msg::METRICS_REQUEST);
+  caps.add(cap::STREAM_CONTROL);
+  caps.add(cap::TIMEZONE);
+  caps.add(msg::TASK_STATS_REQUEST);
+  caps.add(msg::HEAP_STATS_REQUEST);
+  caps.add(msg::LOG_SUBSCRIBE);
+  caps.add(msg::TUNABLES_REQUEST);
+  caps.add(msg::TUNABLES_SET);
+  caps.add(cap::SNAPSHOT);
+  caps.add(cap::FIRMWARE_UPDATE);
+
+  JsonObject schedule = doc[key::SCHEDULE].to<JsonObject>();
+  char digest[9];
+  snprintf(digest, sizeof(digest), "%08x", scheduleDigest());
+  schedule[key::BOOT_ID] = bootId;
+  schedule[key::GENERATION] = scheduleGeneration;
+  schedule[key::DIGEST] = digest;
+  schedule[key::ROUTINES] = routine_count;
+  schedule[key::ALARMS] = alarm_count;
+  schedule[key::DUSKS] = dusk_count;
+  schedule[key::TIMEZONE] = timezone;
+
+  JsonObject automation = doc[key::AUTOMATION].to<JsonObject>();
+  JsonObject routine = automation[key::ROUTINE].to<JsonObject>();
+  routine[key::ACTIVE] = routineActive;
+  routine[key::ID] = activeRoutineId;
+  routine[key::SUPPRESSED_ID] = routineSuppressed ? suppressedRoutine.id : -1;
+  JsonObject alarm = automation[key::ALARM].to<JsonObject>();
+  alarm[key::ACTIVE] = alarmActive;
+  alarm[key::ID] = activeAlarmId;
+  alarm[key::SUPPRESSED_ID] = alarmSuppressed ? suppressedAlarm.id : -1;
+  if (alarmActive && layers[LAYER_ALARM].active) {
+    alarm[key::WARM_Q8] = layers[LAYER_ALARM].warmQ8;
+    alarm[key::WHITE_Q8] = layers[LAYER_ALARM].whiteQ8;
+  }
+  JsonObject fade = automation[key::FADE].to<JsonObject>();
+  fade[key::ACTIVE] = fadeActive;
+  fade[key::DUSK_ID] = activeDuskId;
+  fade[key::SUPPRESSED_ID] = duskSuppressed ? suppressedDusk.id : -1;
+  JsonObject sunSync = automation[key::SUN_SYNC].to<JsonObject>();
+  sunSync[key::ACTIVE] = sunSyncActive;
+  sunSync[key::DISABLED_BY_HW] = sunSyncDisabledByHardware;
+
+  JsonText jsonText(doc);
+  client->text(jsonText.c_str(), jsonText.length());
+
+  LOGD("Sent hello to client #%u (%u bytes, generation %u)\n",
+       client->id(), (unsigned)jsonText.length(), scheduleGeneration);
+}
+
+// Function to broadcast current lamp state to all connected WebSocket and SSE clients
 void sendStateUpdate() {
-  // Send current state to all connected WebSocket clients
-  JsonDocument doc;
-  JsonObject state = doc["state"].to<JsonObject>();
-  state["brightness"] = brightness;
-  state["mode"] = (int)mode;
-  state["on"] = isOn;
-  state["routine_active"] = routineActive;
-  state["alarm_active"] = alarmActive;
-  state["sun_sync_active"] = sunSyncActive;
-  state["routine_suppressed"] = routineSuppressed;
-  state["alarm_suppressed"] = alarmSuppressed;
-  state["sun_sync_disabled_by_hw"] = sunSyncDisabledByHardware;
-  state["manual_control_locked"] = isManualControlLocked();
-  
-  String jsonString;
-  serializeJson(doc, jsonString);
-  ws.textAll(jsonString);
-  
-  Serial.printf("Sent state update: %s\n", jsonString.c_str());
+  broadcastState(0);
 }
 
-// Function to apply current brightness and mode settings to LED PWM outputs
-void applyOutput() {
-  int ch0 = 15;
-  int ch1 = 15;
+// Bump the state version and send the new state to every WebSocket client except
+// `excludeClientId` (the originator of an app change; 0 = nobody) and to SSE subscribers.
+// Called off the loop task it only marks the broadcast pending (see serviceStateBroadcast).
+void broadcastState(uint32_t excludeClientId) {
+  if (xTaskGetCurrentTaskHandle() != loopTaskHandle) {
+    // Two pending broadcasts with different originators collapse into one to everybody
+    portENTER_CRITICAL(&broadcastMux);
+    if (broadcastPending && broadcastPendingExclude != excludeClientId) {
+      broadcastPendingExclude = 0;
+    } else if (!broadcastPending) {
+      broadcastPendingExclude = excludeClientId;
+    }
+    broadcastPending = true;
+    portEXIT_CRITICAL(&broadcastMux);
+    return;
+  }
+
+  // Serialize once and hand the same buffer to every transport
+  stateVersion++;
+  JsonText jsonText;
+  serializeState(jsonText);
 
-  if (!isOn) {
-    // When OFF: force both channels to 15 (inverted logic - high PWM = off)
-    ledcWrite(0, ch0);
-    ledcWrite(1, ch1);
-    Serial.printf("applyOutput: isOn=%d mode=%d brightness=%d -> ch0=%d ch1=%d (OFF)\n",
-                  (int)isOn, (int)mode, brightness, ch0, ch1);
+  if (excludeClientId == 0) {
+    ws.textAll(jsonText.c_str(), jsonText.length());
+  } else {
+    for (AsyncWebSocketClient& c : ws.getClients()) {
+      if (c.id() != excludeClientId && c.status() == WS_CONNECTED) {
+        c.text(jsonText.c_str(), jsonText.length());
+      }
+    }
+  }
+  publishStateEvent(jsonText, stateVersion);
+
+  LOGD("Sent state update (v%u, excluding #%u): %s\n", stateVersion, excludeClientId, jsonText.c_str());
+}
+
+// Send the broadcast another task asked for; called once per loop pass
+void serviceStateBroadcast() {
+  portENTER_CRITICAL(&broadcastMux);
+  bool pending = broadcastPending;
+  uint32_t excludeClientId = broadcastPendingExclude;
+  broadcastPending = false;
+  portEXIT_CRITICAL(&broadcastMux);
+  if (pending) {
+    broadcastState(excludeClientId);
+  }
+}
+
+// Record a state payload in the replay ring and push it to SSE subscribers
+void publishStateEvent(const JsonText& payload, uint32_t id) {
+  xSemaphoreTake(sseReplayLock, portMAX_DELAY);
+  SseReplayEntry& entry = sseReplay[id % SSE_REPLAY_DEPTH];
+  entry.id = id;
+  entry.payload.assign(payload.c_str(), payload.length());
+  sseLatestId = id;
+  xSemaphoreGive(sseReplayLock);
+
+  if (events.count() > 0) {
+    events.send(payload.c_str(), "state", id);
+  }
+}
+
+// SSE connect handler: resume from Last-Event-ID when the ring still covers it, otherwise
+// start the subscriber from the newest ring entry, which is the current state. Runs on the
+// AsyncTCP task, so it reads only the ring, under its lock.
+void onSseConnect(AsyncEventSourceClient* client) {
+  uint32_t lastId = client->lastId();
+  xSemaphoreTake(sseReplayLock, portMAX_DELAY);
+  uint32_t latestId = sseLatestId;
+  uint32_t oldestId = (latestId >= SSE_REPLAY_DEPTH) ? latestId - SSE_REPLAY_DEPTH + 1 : 1;
+
+  if (lastId > 0 && lastId <= latestId && lastId + 1 >= oldestId) {
+    uint8_t replayed = 0;
+    for (uint32_t id = lastId + 1; id <= latestId; id++) {
+      const SseReplayEntry& entry = sseReplay[id % SSE_REPLAY_DEPTH];
+      if (entry.id != id) continue;
+      client->send(entry.payload.c_str(), "state", id, SSE_RETRY_MS);
+      replayed++;
+    }
+    xSemaphoreGive(sseReplayLock);
+    LOGI("SSE client resumed from event %u (%u replayed)\n", lastId, replayed);
     return;
   }
 
-  // When ON: ensure minimum brightness is 1, compute channel values based on mode
-  int safeBrightness = max(1, brightness); // Ensure minimum brightness of 1 when on
-  // Invert brightness: 1 becomes 14, 15 becomes 0 (for correct LED behavior)
-  int invertedBrightness = 15 - safeBrightness;
-  
-  switch (mode) {
-    case MODE_WARM:   // mode 0
-      ch0 = invertedBrightness; // warm channel active
-      ch1 = 15;                 // white channel off (high PWM = off)
-      break;
-    case MODE_WHITE:  // mode 1
-      ch0 = 15;                 // warm channel off (high PWM = off)
-      ch1 = invertedBrightness; // white channel active
-      break;
-    case MODE_BOTH:   // mode 2
-    default:
-      ch0 = invertedBrightness; // both channels active
-      ch1 = invertedBrightness;
-      break;
+  // New subscriber or Last-Event-ID outside the ring: a full snapshot is always sufficient
+  if (latestId > 0) {
+    const SseReplayEntry& entry = sseReplay[latestId % SSE_REPLAY_DEPTH];
+    client->send(entry.payload.c_str(), "state", latestId, SSE_RETRY_MS);
+    xSemaphoreGive(sseReplayLock);
+  } else {
+    xSemaphoreGive(sseReplayLock);
+    JsonText jsonText;                   // nothing broadcast since boot
+    serializeState(jsonText);
+    client->send(jsonText.c_str(), "state", 0, SSE_RETRY_MS);
+  }
+  LOGI("SSE client connected (last id %u): sent state snapshot\n", lastId);
+}
+
+// Milliseconds since boot like millis(), which is not in IRAM
+unsigned long IRAM_ATTR uptimeMs() {
+  return (unsigned long)(esp_timer_get_time() / 1000);
+}
+
+// ledcWrite() without the flash-resident driver: same register sequence as ledc_set_duty()
+// plus ledc_update_duty(), and the same "all bits set = fully on" rule
+void IRAM_ATTR writeDutyRegister(ledc_channel_t channel, uint32_t duty) {
+  if (duty >= pwmMaxDuty && pwmMaxDuty != 1) {
+    duty = pwmMaxDuty + 1;
+  }
+  ledc_dev_t* hw = LEDC_LL_GET_HW();
+  ledc_ll_set_duty_int_part(hw, PWM_SPEED_MODE, channel, duty);
+  ledc_ll_set_duty_direction(hw, PWM_SPEED_MODE, channel, LEDC_DUTY_DIR_INCREASE);
+  ledc_ll_set_duty_num(hw, PWM_SPEED_MODE, channel, 1);
+  ledc_ll_set_duty_cycle(hw, PWM_SPEED_MODE, channel, 1);
+  ledc_ll_set_duty_scale(hw, PWM_SPEED_MODE, channel, 0);
+  ledc_ll_set_sig_out_en(hw, PWM_SPEED_MODE, channel, true);
+  ledc_ll_set_duty_start(hw, PWM_SPEED_MODE, channel, true);
+  ledc_ll_ls_channel_update(hw, PWM_SPEED_MODE, channel);
+}
+
+// Single write path for both PWM channels; accounts the previous duty before switching
+void IRAM_ATTR writeChannels(int ch0, int ch1) {
+  unsigned long now = uptimeMs();
+  portENTER_CRITICAL(&energyMux);
+  uint32_t elapsed = now - energyLastMs;
+  energyLastMs = now;
+  for (uint8_t c = 0; c < 2; c++) {
+    energyDutyAcc[c] += (uint64_t)energyLevel[c] * elapsed;
+    if (energyLevel[c] > 0) {
+      energyOnAcc[c] += elapsed;
+    }
+  }
+  energyLevel[0] = pwmMaxDuty - constrain(ch0, 0, (int)pwmMaxDuty);
+  energyLevel[1] = pwmMaxDuty - constrain(ch1, 0, (int)pwmMaxDuty);
+  portEXIT_CRITICAL(&energyMux);
+
+  writeDutyRegister(LEDC_CHANNEL_0, (uint32_t)max(ch0, 0));
+  writeDutyRegister(LEDC_CHANNEL_1, (uint32_t)max(ch1, 0));
+}
+
+// Convert a Q8 output level to an inverted PWM duty (pwmMaxDuty = off)
+int IRAM_ATTR dutyForLevel(uint16_t levelQ8) {
+  levelQ8 = min(levelQ8, LEVEL_Q8_MAX);
+  return pwmMaxDuty - (int)(((uint32_t)levelQ8 * pwmMaxDuty) / LEVEL_Q8_MAX);
+}
+
+void IRAM_ATTR recordCycles(CycleStat& stat, uint32_t startCycles) {
+  uint32_t cycles = esp_cpu_get_ccount() - startCycles;
+  uint32_t writes = flashWrites;
+  bool duringFlash = flashWriteActive || writes != stat.flashSeen;
+  stat.flashSeen = writes;
+  stat.samples++;
+  stat.last = cycles;
+  if (duringFlash) {
+    if (cycles > stat.maxFlash) stat.maxFlash = cycles;
+  } else if (cycles > stat.max) {
+    stat.max = cycles;
+  }
+}
+
+// Bracket every flash write so hot path samples taken meanwhile are classed as such
+void beginFlashWrite() {
+  flashWriteActive = true;
+}
+
+void endFlashWrite() {
+  flashWriteActive = false;
+  flashWrites = flashWrites + 1;
+}
+
+// ===== Lighting Compositor =====
+// Set a layer's per-channel levels; the compositor is only woken when something changed
+void IRAM_ATTR setLayerLevels(LayerId id, uint16_t warmQ8, uint16_t whiteQ8) {
+  LightLayer& layer = layers[id];
+  if (layer.active && layer.warmQ8 == warmQ8 && layer.whiteQ8 == whiteQ8) {
+    return;
+  }
+  layer.active = true;
+  layer.warmQ8 = warmQ8;
+  layer.whiteQ8 = whiteQ8;
+  compositorDirty = true;
+}
+
+// Set a layer from a single level in one of the lamp modes (both channels dark when off)
+void IRAM_ATTR setLayerState(LayerId id, bool on, Mode layerMode, uint16_t levelQ8) {
+  uint16_t warmQ8 = (on && layerMode != MODE_WHITE) ? levelQ8 : 0;
+  uint16_t whiteQ8 = (on && layerMode != MODE_WARM) ? levelQ8 : 0;
+  setLayerLevels(id, warmQ8, whiteQ8);
+}
+
+// Drop a layer; the knob offset goes with the last automation it was nudging
+void clearLayer(LayerId id) {
+  if (id == LAYER_MANUAL || !layers[id].active) {
+    return;
+  }
+  layers[id].active = false;
+  layers[id].offsetQ8 = 0;
+  compositorDirty = true;
+
+  if (id != LAYER_KNOB && layers[LAYER_KNOB].active && !sunSyncActive &&
+      !layers[LAYER_ROUTINE].active && !layers[LAYER_ALARM].active &&
+      !layers[LAYER_FADE].active && !layers[LAYER_STREAM].active) {
+    clearLayer(LAYER_KNOB);
+  }
+}
+
+// Drop a layer but keep what it was showing: the composite becomes the manual state,
+// so the lamp holds its level when a routine ends or an automation is overridden
+void releaseLayer(LayerId id) {
+  if (id == LAYER_MANUAL || !layers[id].active) {
+    return;
+  }
+  ComposedOutput out;
+  composeLayers(out);
+  isOn = out.isOn;
+  if (out.isOn) {
+    brightness = out.brightness;
+    mode = out.mode;
+  }
+  if (id != LAYER_KNOB && layers[LAYER_KNOB].active) {
+    layers[LAYER_KNOB].offsetQ8 = 0;   // folded into the manual state above
+  }
+  clearLayer(id);
+  applyOutput();
+}
+
+// Knob turned while an automation owns the lamp: offset it instead of overriding it
+void nudgeKnobLayer(int steps) {
+  LightLayer& knob = layers[LAYER_KNOB];
+  int offset = constrain(knob.offsetQ8 + steps * 256, -(int)LEVEL_Q8_MAX, (int)LEVEL_Q8_MAX);
+  knob.active = true;
+  knob.offsetQ8 = (int16_t)offset;
+  compositorDirty = true;
+}
+
+// Blend the active layers bottom-up by priority (integer only; at most LAYER_COUNT layers)
+void IRAM_ATTR composeLayers(ComposedOutput& out) {
+  uint8_t order[LAYER_COUNT];
+  for (uint8_t i = 0; i < LAYER_COUNT; i++) {
+    uint8_t j = i;
+    while (j > 0 && layers[order[j - 1]].priority > layers[i].priority) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = i;
+  }
+
+  int32_t warm = 0;
+  int32_t white = 0;
+  for (uint8_t i = 0; i < LAYER_COUNT; i++) {
+    const LightLayer& layer = layers[order[i]];
+    if (!layer.active) continue;
+    if (layer.additive) {
+      // Offsets never switch a lit channel off or light a dark one
+      if (warm > 0) warm = constrain(warm + layer.offsetQ8, (int32_t)(1 << 8), (int32_t)LEVEL_Q8_MAX);
+      if (white > 0) white = constrain(white + layer.offsetQ8, (int32_t)(1 << 8), (int32_t)LEVEL_Q8_MAX);
+      continue;
+    }
+    warm += ((int32_t)layer.warmQ8 - warm) * layer.weight / 255;
+    white += ((int32_t)layer.whiteQ8 - white) * layer.weight / 255;
+  }
+
+  out.warmQ8 = (uint16_t)warm;
+  out.whiteQ8 = (uint16_t)white;
+  out.isOn = warm > 0 || white > 0;
+  if (out.isOn) {
+    out.brightness = constrain((int)((max(warm, white) + 255) >> 8), 1, 15);
+    out.mode = (warm > 0 && white > 0) ? MODE_BOTH : (warm > 0 ? MODE_WARM : MODE_WHITE);
+  } else {
+    out.brightness = brightness;   // off: report the level the lamp returns to
+    out.mode = mode;
+  }
+}
+
+// Render the composite to PWM; called once per loop pass
+void IRAM_ATTR serviceCompositor() {
+  if (!compositorDirty) return;
+  compositorDirty = false;
+  if (pwmReconfigurePending) {
+    pwmReconfigurePending = false;
+    configurePwm();
+    compositorCh0 = -1;                  // duties are on the new scale; force the write
+    compositorCh1 = -1;
+  }
+
+  uint32_t started = esp_cpu_get_ccount();
+  ComposedOutput out;
+  composeLayers(out);
+  int ch0 = dutyForLevel(out.warmQ8);    // level 0 = pwmMaxDuty = off (inverted)
+  int ch1 = dutyForLevel(out.whiteQ8);
+  recordCycles(cyclesRender, started);
+  if (ch0 == compositorCh0 && ch1 == compositorCh1) {
+    return;
   }
+  compositorCh0 = ch0;
+  compositorCh1 = ch1;
+  compositorRenders++;
+  lastOutputChangeMs = uptimeMs();
+  writeChannels(ch0, ch1);
+}
 
-  ledcWrite(0, ch0);
-  ledcWrite(1, ch1);
-  Serial.printf("applyOutput: isOn=%d mode=%d brightness=%d safeBrightness=%d inverted=%d -> ch0=%d ch1=%d\n",
-                (int)isOn, (int)mode, brightness, safeBrightness, invertedBrightness, ch0, ch1);
+// Function to apply current brightness and mode settings: updates the manual layer,
+// which the compositor renders on the next loop pass
+void IRAM_ATTR applyOutput() {
+  // When ON: ensure minimum brightness is 1
+  int safeBrightness = max(1, brightness);
+  setLayerState(LAYER_MANUAL, isOn, mode, (uint16_t)(safeBrightness << 8));
+  LOGD("applyOutput: isOn=%d mode=%d brightness=%d\n", (int)isOn, (int)mode, brightness);
 }
 
 // WebSocket message handler for processing commands from the Flutter app
+// Slots are claimed and released from WebSocket events (AsyncTCP task); the keepalive
+// pass in the loop reads clientId and the timestamps under wsSlotsMux
+WsClientSlot* acquireWsSlot(uint32_t clientId) {
+  for (uint8_t i = 0; i < WS_CLIENT_SLOTS; i++) {
+    if (wsSlots[i].clientId == 0) {
+      portENTER_CRITICAL(&wsSlotsMux);
+      wsSlots[i].clientId = clientId;
+      wsSlots[i].lastRxMs = millis();
+      wsSlots[i].pingSentMs = 0;
+      wsSlots[i].logFilterLevel = LOG_LEVEL_NONE;
+      portEXIT_CRITICAL(&wsSlotsMux);
+      wsSlots[i].rxLength = 0;
+      wsSlots[i].rxOverflow = false;
+      return &wsSlots[i];
+    }
+  }
+  return nullptr;
+}
+
+// Any inbound frame proves the peer is alive and answers an outstanding ping
+void noteWsActivity(WsClientSlot* slot) {
+  portENTER_CRITICAL(&wsSlotsMux);
+  slot->lastRxMs = millis();
+  slot->pingSentMs = 0;
+  portEXIT_CRITICAL(&wsSlotsMux);
+}
+
+void serviceWsKeepalive() {
+  unsigned long now = millis();
+  if (now - lastWsKeepaliveMs < WS_KEEPALIVE_CHECK_MS) {
+    return;
+  }
+  lastWsKeepaliveMs = now;
+
+  for (uint8_t i = 0; i < WS_CLIENT_SLOTS; i++) {
+    portENTER_CRITICAL(&wsSlotsMux);
+    uint32_t clientId = wsSlots[i].clientId;
+    unsigned long lastRxMs = wsSlots[i].lastRxMs;
+    unsigned long pingSentMs = wsSlots[i].pingSentMs;
+    portEXIT_CRITICAL(&wsSlotsMux);
+    if (clientId == 0) continue;
+
+    AsyncWebSocketClient* client = ws.client(clientId);
+    if (client == nullptr) continue;
+
+    if (pingSentMs != 0) {
+      if (now - pingSentMs >= tunables.wsPongTimeoutMs) {
+        wsDeadPeers++;
+        LOGW("WebSocket client #%u missed its pong (silent %lu ms); dropping\n", clientId, now - lastRxMs);
+        client->client()->abort();   // no close handshake: the peer is gone
+      }
+      continue;
+    }
+
+    uint32_t silence = now - lastRxMs;
+    bool backlog = client->queueLen() > 0;
+    if (silence >= tunables.wsPingIdleMs || (backlog && silence >= tunables.wsPingBacklogMs)) {
+      if (client->ping()) {
+        portENTER_CRITICAL(&wsSlotsMux);
+        if (wsSlots[i].clientId == clientId) {
+          wsSlots[i].pingSentMs = now;
+        }
+        portEXIT_CRITICAL(&wsSlotsMux);
+        wsPingsSent++;
+      }
+    }
+  }
+}
+
+WsClientSlot* findWsSlot(uint32_t clientId) {
+  for (uint8_t i = 0; i < WS_CLIENT_SLOTS; i++) {
+    if (wsSlots[i].clientId == clientId) {
+      return &wsSlots[i];
+    }
+  }
+  return nullptr;
+}
+
+uint8_t wsSlotsInUse() {
+  uint8_t used = 0;
+  for (uint8_t i = 0; i < WS_CLIENT_SLOTS; i++) {
+    if (wsSlots[i].clientId != 0) used++;
+  }
+  return used;
+}
+
 void onWSMsg(AsyncWebSocket *ws, AsyncWebSocketClient *client,
              AwsEventType type, void *arg, uint8_t *data, size_t len) {
   // --- Debug: log connect / disconnect ---
   if (type == WS_EVT_CONNECT) {
-    Serial.printf("WebSocket client #%u connected\n", client->id());
-    // Send current state to newly connected client
-    sendStateUpdate();
+    if (acquireWsSlot(client->id()) == nullptr) {
+      wsRejectedClients++;
+      LOGW("WebSocket client #%u rejected: all %u slots in use\n", client->id(), WS_CLIENT_SLOTS);
+      client->close(WS_CLOSE_TRY_AGAIN_LATER, "too many clients");
+      return;
+    }
+    // A full queue drops the newest frame instead of closing the client; state frames
+    // are superseded by the next one anyway
+    client->setCloseClientOnQueueFull(false);
+    LOGI("WebSocket client #%u connected\n", client->id());
+    // Send the handshake bundle to this client only; existing clients are not disturbed
+    sendHello(client);
     return;                         // nothing else to do
   }
   if (type == WS_EVT_DISCONNECT) {
-    Serial.printf("WebSocket client #%u disconnected\n", client->id());
+    LOGI("WebSocket client #%u disconnected\n", client->id());
+    WsClientSlot* slot = findWsSlot(client->id());
+    if (slot != nullptr) {
+      portENTER_CRITICAL(&wsSlotsMux);
+      slot->clientId = 0;
+      slot->logFilterLevel = LOG_LEVEL_NONE;
+      portEXIT_CRITICAL(&wsSlotsMux);
+      updateLogStreamLevel();
+    }
+    handleStreamEnd(client->id());  // play out whatever the client already sent
     return;
   }
   // ---------------------------------------
-  if (type != WS_EVT_DATA) return;
+  if (type != WS_EVT_DATA && type != WS_EVT_PONG) return;
+  WsClientSlot* slot = findWsSlot(client->id());
+  if (slot == nullptr) return;      // rejected and still closing
+  noteWsActivity(slot);
+  if (type == WS_EVT_PONG) return;
   AwsFrameInfo *info = (AwsFrameInfo*)arg;
-  if (!info->final || info->opcode != WS_TEXT) return;
+  if (info->message_opcode != WS_TEXT) return;
+
+  // A message in a single frame and a single chunk is handled in place
+  bool firstChunk = info->num == 0 && info->index == 0;
+  bool lastChunk = info->final && info->index + len == info->len;
+  if (firstChunk && lastChunk) {
+    handleWsMessage(client, data, len);
+    return;
+  }
+
+  // Otherwise reassemble it in the slot's buffer
+  if (firstChunk) {
+    slot->rxLength = 0;
+    slot->rxOverflow = false;
+  }
+  if (slot->rxOverflow || slot->rxLength + len > WS_RX_BUFFER_SIZE) {
+    slot->rxOverflow = true;
+  } else {
+    memcpy(slot->rxBuffer + slot->rxLength, data, len);
+    slot->rxLength += len;
+  }
+  if (!lastChunk) return;
+
+  if (slot->rxOverflow) {
+    wsRxOverflows++;
+    LOGW("WebSocket client #%u message exceeds %u bytes; dropped\n", client->id(), (unsigned)WS_RX_BUFFER_SIZE);
+  } else {
+    handleWsMessage(client, slot->rxBuffer, slot->rxLength);
+  }
+  slot->rxLength = 0;
+  slot->rxOverflow = false;
+}
 
-  // Debug: print raw incoming payload
-  String payload = String((const char*)data, len);
-  Serial.printf("WS RX raw: %s\n", payload.c_str());
+// One complete text message from a client
+void handleWsMessage(AsyncWebSocketClient* client, uint8_t* data, size_t len) {
+  // Fast path: slider/toggle frames are recognised in place without building a document
+  lamp_protocol::ControlFrame frame;
+  if (lamp_protocol::parseControlFrame(data, len, frame)) {
+    controlFastFrames++;
+    postControlCommand(frame, client->id());
+    return;
+  }
+  controlParsedFrames++;
 
-  JsonDocument doc;           // ArduinoJson v7 – elastic capacity
+  JsonDocument doc(&wsRxJson);   // ArduinoJson v7 – elastic capacity
   DeserializationError err = deserializeJson(doc, data, len);
   if (err) {
-    Serial.printf("WS JSON parse error: %s\n", err.c_str());
+    LOGW("WS JSON parse error: %s (%u bytes)\n", err.c_str(), (unsigned)len);
     return;
   }
 
-  // Handle WebSocket commands that respect the button control system
+  // Handle WebSocket commands that respect the button control system.
+  // brightness/mode/on are posted to the control mailbox and applied by handleControlTick().
   bool recognized = false;
-  bool stateChanged = false;
-  if (doc["brightness"].is<int>()) {    // brightness control from app
-    int newBrightness = constrain(doc["brightness"].as<int>(), 0, 15);
-    
-    // If lamp is on, enforce minimum brightness of 1
-    if (isOn && newBrightness < 1) {
-      newBrightness = 1;
-    }
-    
-    if (newBrightness != brightness) {
-      brightness = newBrightness;
-      stateChanged = true;
-      Serial.printf("WebSocket: brightness -> %d (enforced min for isOn=%s)\n", 
-                    brightness, isOn ? "true" : "false");
-    }
-    recognized = true;
-  }
-  if (doc["mode"].is<int>()) {    // mode control from app
-    int newMode = constrain(doc["mode"].as<int>(), 0, 2);
-    if ((Mode)newMode != mode) {
-      mode = (Mode)newMode;
-      stateChanged = true;
-      Serial.printf("WebSocket: mode -> %d (0=WARM,1=WHITE,2=BOTH)\n", newMode);
-    }
-    recognized = true;
-  }
-  if (doc["on"].is<bool>()) {    // on/off control from app
-    bool newIsOn = doc["on"].as<bool>();
-    if (newIsOn != isOn) {
-      isOn = newIsOn;
-      stateChanged = true;
-      Serial.printf("WebSocket: isOn -> %s\n", isOn ? "ON" : "OFF");
-    }
+  frame.hasBrightness = doc[key::BRIGHTNESS].is<int>();
+  frame.hasMode = doc[key::MODE].is<int>();
+  frame.hasOn = doc[key::ON].is<bool>();
+  if (frame.hasBrightness || frame.hasMode || frame.hasOn) {
+    frame.brightness = doc[key::BRIGHTNESS].as<int>();
+    frame.mode = doc[key::MODE].as<int>();
+    frame.on = doc[key::ON].as<bool>();
+    postControlCommand(frame, client->id());
     recognized = true;
+  } else {
+    // Debug: print raw incoming payload (control frames arrive per slider tick and are not echoed)
+    LOGD("WS RX raw: %.*s\n", (int)len, (const char*)data);
   }
 
   // Handle state request from app (when reconnecting)
-  if (doc["request_state"].is<bool>() && doc["request_state"].as<bool>()) {
-    sendStateUpdate();
-    Serial.println("WebSocket: sent current state on request");
+  if (doc[key::REQUEST_STATE].is<bool>() && doc[key::REQUEST_STATE].as<bool>()) {
+    // Reply to the requester only; nothing changed, so the version is not bumped
+    JsonText jsonText;
+    serializeState(jsonText);
+    client->text(jsonText.c_str(), jsonText.length());
+    LOGI("WebSocket: sent current state on request\n");
     recognized = true;
   }
 
   // Handle sync messages from app
-  if (doc["type"].is<const char*>()) {
-    const char* msgType = doc["type"];
+  if (doc[key::TYPE].is<const char*>()) {
+    const char* msgType = doc[key::TYPE];
     
-    if (strcmp(msgType, "routine_sync") == 0) {
+    if (strcmp(msgType, msg::ROUTINE_SYNC) == 0) {
       handleRoutineSync(doc);
       recognized = true;
     }
-    else if (strcmp(msgType, "alarm_sync") == 0) {
+    else if (strcmp(msgType, msg::ALARM_SYNC) == 0) {
       handleAlarmSync(doc);
       recognized = true;
     }
-    else if (strcmp(msgType, "full_sync") == 0) {
+    else if (strcmp(msgType, msg::FULL_SYNC) == 0) {
       handleFullSync(doc);
       recognized = true;
     }
-    else if (strcmp(msgType, "time_sync") == 0) {
+    else if (strcmp(msgType, msg::TIME_SYNC) == 0) {
       handleTimeSync(doc);
       recognized = true;
     }
-    else if (strcmp(msgType, "sun_sync_state") == 0) {
+    else if (strcmp(msgType, msg::ENERGY_REQUEST) == 0) {
+      handleEnergyRequest(client, doc);
+      recognized = true;
+    }
+    else if (strcmp(msgType, msg::METRICS_REQUEST) == 0) {
+      handleMetricsRequest(client);
+      recognized = true;
+    }
+    else if (strcmp(msgType, msg::TASK_STATS_REQUEST) == 0) {
+      handleTaskStatsRequest(client);
+      recognized = true;
+    }
+    else if (strcmp(msgType, msg::TUNABLES_REQUEST) == 0) {
+      handleTunablesRequest(client);
+      recognized = true;
+    }
+    else if (strcmp(msgType, msg::TUNABLES_SET) == 0) {
+      handleTunablesSet(doc);
+      recognized = true;
+    }
+    else if (strcmp(msgType, msg::LOG_SUBSCRIBE) == 0) {
+      handleLogSubscribe(client, doc);
+      recognized = true;
+    }
+    else if (strcmp(msgType, msg::HEAP_STATS_REQUEST) == 0) {
+      handleHeapStatsRequest(client);
+      recognized = true;
+    }
+    else if (strcmp(msgType, msg::STREAM_SAMPLES) == 0) {
+      handleStreamSamples(client, doc);
+      recognized = true;
+    }
+    else if (strcmp(msgType, msg::STREAM_BEGIN) == 0) {
+      handleStreamBegin(client, doc);
+      recognized = true;
+    }
+    else if (strcmp(msgType, msg::STREAM_END) == 0) {
+      handleStreamEnd(client->id());
+      recognized = true;
+    }
+    else if (strcmp(msgType, msg::DUSK_SYNC) == 0) {
+      handleDuskSync(doc);
+      recognized = true;
+    }
+    else if (strcmp(msgType, msg::SLEEP_TIMER) == 0) {
+      handleSleepTimer(doc);
+      recognized = true;
+    }
+    else if (strcmp(msgType, msg::SUN_SYNC_STATE) == 0) {
       JsonObject root = doc.as<JsonObject>();
       bool active;
-      if (!readBoolField(root, "active", active)) {
-        Serial.println("🌞 ERROR: Sun sync payload missing active boolean");
-        sendSyncResponse("sun_sync_response", false, "Invalid field: active");
+      if (!readBoolField(root, key::ACTIVE, active)) {
+        LOGE("🌞 ERROR: Sun sync payload missing active boolean\n");
+        sendSyncResponse(msg::SUN_SYNC_RESPONSE, false, "Invalid field: active");
       } else {
-        const char* source = root["source"].is<const char*>() ? root["source"].as<const char*>() : "app";
+        const char* source = root[key::SOURCE].is<const char*>() ? root[key::SOURCE].as<const char*>() : val::SOURCE_APP;
         handleSunSyncState(active, source);
-        sendSyncResponse("sun_sync_response", true, active ? "Sun sync enabled" : "Sun sync disabled");
+        sendSyncResponse(msg::SUN_SYNC_RESPONSE, true, active ? "Sun sync enabled" : "Sun sync disabled");
       }
       recognized = true;
     }
   }
 
-  if (stateChanged) {
-    applyOutput();
-    // Don't send state update back since this change came from the app
-  }
-
   if (!recognized) {
-    Serial.println("WS RX: no recognized keys in payload");
+    LOGW("WS RX: no recognized keys in payload\n");
   }
 }
 
 // ===== Schedule Management Functions =====
 void handleRoutineSync(JsonDocument& doc) {
-  const char* action = doc["action"].is<const char*>() ? doc["action"].as<const char*>() : nullptr;
+  const char* action = doc[key::ACTION].is<const char*>() ? doc[key::ACTION].as<const char*>() : nullptr;
   if (action == nullptr) {
-    Serial.println("📅 ERROR: Routine sync missing action field");
-    sendSyncResponse("routine_sync_response", false, "Missing action for routine sync");
+    LOGE("📅 ERROR: Routine sync missing action field\n");
+    sendSyncResponse(msg::ROUTINE_SYNC_RESPONSE, false, "Missing action for routine sync");
     return;
   }
 
-  if (strcmp(action, "upsert") == 0) {
-    if (!doc["data"].is<JsonObject>()) {
-      Serial.println("📅 ERROR: Routine sync missing data object");
-      sendSyncResponse("routine_sync_response", false, "Invalid routine payload (data missing)");
+  if (strcmp(action, val::UPSERT) == 0) {
+    if (!doc[key::DATA].is<JsonObject>()) {
+      LOGE("📅 ERROR: Routine sync missing data object\n");
+      sendSyncResponse(msg::ROUTINE_SYNC_RESPONSE, false, "Invalid routine payload (data missing)");
       return;
     }
 
-    JsonObject data = doc["data"].as<JsonObject>();
+    JsonObject data = doc[key::DATA].as<JsonObject>();
 
     int id;
     bool enabled;
@@ -397,27 +1672,27 @@ void handleRoutineSync(JsonDocument& doc) {
     int brightnessValue;
     int modeValue;
 
-    if (!readIntField(data, "id", 0, 32767, id)) {
-      sendSyncResponse("routine_sync_response", false, "Invalid field: id");
+    if (!readIntField(data, key::ID, 0, 32767, id)) {
+      sendSyncResponse(msg::ROUTINE_SYNC_RESPONSE, false, "Invalid field: id");
       return;
     }
-    if (!readBoolField(data, "enabled", enabled)) {
-      sendSyncResponse("routine_sync_response", false, "Invalid field: enabled");
+    if (!readBoolField(data, key::ENABLED, enabled)) {
+      sendSyncResponse(msg::ROUTINE_SYNC_RESPONSE, false, "Invalid field: enabled");
       return;
     }
-    if (!readIntField(data, "start_hour", 0, 23, startHour) ||
-        !readIntField(data, "start_minute", 0, 59, startMinute) ||
-        !readIntField(data, "end_hour", 0, 23, endHour) ||
-        !readIntField(data, "end_minute", 0, 59, endMinute)) {
-      sendSyncResponse("routine_sync_response", false, "Invalid start/end time");
+    if (!readIntField(data, key::START_HOUR, 0, 23, startHour) ||
+        !readIntField(data, key::START_MINUTE, 0, 59, startMinute) ||
+        !readIntField(data, key::END_HOUR, 0, 23, endHour) ||
+        !readIntField(data, key::END_MINUTE, 0, 59, endMinute)) {
+      sendSyncResponse(msg::ROUTINE_SYNC_RESPONSE, false, "Invalid start/end time");
       return;
     }
-    if (!readIntField(data, "brightness", 0, 15, brightnessValue)) {
-      sendSyncResponse("routine_sync_response", false, "Invalid field: brightness");
+    if (!readIntField(data, key::BRIGHTNESS, 0, 15, brightnessValue)) {
+      sendSyncResponse(msg::ROUTINE_SYNC_RESPONSE, false, "Invalid field: brightness");
       return;
     }
-    if (!readIntField(data, "mode", 0, 2, modeValue)) {
-      sendSyncResponse("routine_sync_response", false, "Invalid field: mode");
+    if (!readIntField(data, key::MODE, 0, 2, modeValue)) {
+      sendSyncResponse(msg::ROUTINE_SYNC_RESPONSE, false, "Invalid field: mode");
       return;
     }
 
@@ -444,27 +1719,28 @@ void handleRoutineSync(JsonDocument& doc) {
       routines[index].brightness = brightnessValue;
       routines[index].mode = modeValue;
 
-      const char* name = data["name"].is<const char*>() ? data["name"].as<const char*>() : "(unnamed)";
-      Serial.printf("📅 ROUTINE SYNC: ID=%d, Name=%s\n", id, name);
-      Serial.printf("  - Enabled: %s\n", routines[index].enabled ? "YES" : "NO");
-      Serial.printf("  - Time: %02d:%02d to %02d:%02d\n",
-                    routines[index].start_hour, routines[index].start_minute,
-                    routines[index].end_hour, routines[index].end_minute);
-      Serial.printf("  - Brightness: %d (1-15 scale)\n", routines[index].brightness);
-      Serial.printf("  - Mode: %d (0=warm, 1=white, 2=both)\n", routines[index].mode);
-      Serial.printf("  - Total routines: %d/%d\n", routine_count, MAX_ROUTINES);
-
-      sendSyncResponse("routine_sync_response", true, "Routine synced successfully");
+      const char* name = data[key::NAME].is<const char*>() ? data[key::NAME].as<const char*>() : "(unnamed)";
+      LOGD("📅 ROUTINE SYNC: ID=%d, Name=%s\n", id, name);
+      LOGD("  - Enabled: %s\n", routines[index].enabled ? "YES" : "NO");
+      LOGD("  - Time: %02d:%02d to %02d:%02d\n",
+           routines[index].start_hour, routines[index].start_minute,
+           routines[index].end_hour, routines[index].end_minute);
+      LOGD("  - Brightness: %d (1-15 scale)\n", routines[index].brightness);
+      LOGD("  - Mode: %d (0=warm, 1=white, 2=both)\n", routines[index].mode);
+      LOGD("  - Total routines: %d/%d\n", routine_count, MAX_ROUTINES);
+
+      bumpScheduleGeneration();
+      sendSyncResponse(msg::ROUTINE_SYNC_RESPONSE, true, "Routine synced successfully");
     } else {
-      Serial.println("📅 ERROR: Failed to sync routine: storage full");
-      sendSyncResponse("routine_sync_response", false, "Storage full");
+      LOGE("📅 ERROR: Failed to sync routine: storage full\n");
+      sendSyncResponse(msg::ROUTINE_SYNC_RESPONSE, false, "Storage full");
     }
   }
-  else if (strcmp(action, "delete") == 0) {
+  else if (strcmp(action, val::DELETE) == 0) {
     JsonObject root = doc.as<JsonObject>();
     int id;
-    if (!readIntField(root, "id", 0, 32767, id)) {
-      sendSyncResponse("routine_sync_response", false, "Invalid field: id");
+    if (!readIntField(root, key::ID, 0, 32767, id)) {
+      sendSyncResponse(msg::ROUTINE_SYNC_RESPONSE, false, "Invalid field: id");
       return;
     }
 
@@ -476,35 +1752,36 @@ void handleRoutineSync(JsonDocument& doc) {
           routines[j] = routines[j + 1];
         }
         routine_count--;
-        Serial.printf("Routine %d deleted\n", id);
-        sendSyncResponse("routine_sync_response", true, "Routine deleted");
+        LOGI("Routine %d deleted\n", id);
+        bumpScheduleGeneration();
+        sendSyncResponse(msg::ROUTINE_SYNC_RESPONSE, true, "Routine deleted");
         return;
       }
     }
-    Serial.printf("Routine %d not found for deletion\n", id);
-    sendSyncResponse("routine_sync_response", false, "Routine not found");
+    LOGW("Routine %d not found for deletion\n", id);
+    sendSyncResponse(msg::ROUTINE_SYNC_RESPONSE, false, "Routine not found");
   } else {
-    Serial.printf("📅 ERROR: Unknown routine action '%s'\n", action);
-    sendSyncResponse("routine_sync_response", false, "Unknown routine action");
+    LOGE("📅 ERROR: Unknown routine action '%s'\n", action);
+    sendSyncResponse(msg::ROUTINE_SYNC_RESPONSE, false, "Unknown routine action");
   }
 }
 
 void handleAlarmSync(JsonDocument& doc) {
-  const char* action = doc["action"].is<const char*>() ? doc["action"].as<const char*>() : nullptr;
+  const char* action = doc[key::ACTION].is<const char*>() ? doc[key::ACTION].as<const char*>() : nullptr;
   if (action == nullptr) {
-    Serial.println("⏰ ERROR: Alarm sync missing action field");
-    sendSyncResponse("alarm_sync_response", false, "Missing action for alarm sync");
+    LOGE("⏰ ERROR: Alarm sync missing action field\n");
+    sendSyncResponse(msg::ALARM_SYNC_RESPONSE, false, "Missing action for alarm sync");
     return;
   }
 
-  if (strcmp(action, "upsert") == 0) {
-    if (!doc["data"].is<JsonObject>()) {
-      Serial.println("⏰ ERROR: Alarm sync missing data object");
-      sendSyncResponse("alarm_sync_response", false, "Invalid alarm payload (data missing)");
+  if (strcmp(action, val::UPSERT) == 0) {
+    if (!doc[key::DATA].is<JsonObject>()) {
+      LOGE("⏰ ERROR: Alarm sync missing data object\n");
+      sendSyncResponse(msg::ALARM_SYNC_RESPONSE, false, "Invalid alarm payload (data missing)");
       return;
     }
 
-    JsonObject data = doc["data"].as<JsonObject>();
+    JsonObject data = doc[key::DATA].as<JsonObject>();
 
     int id;
     bool enabled;
@@ -514,23 +1791,23 @@ void handleAlarmSync(JsonDocument& doc) {
     int startMinute;
     int durationMinutes;
 
-    if (!readIntField(data, "id", 0, 32767, id)) {
-      sendSyncResponse("alarm_sync_response", false, "Invalid field: id");
+    if (!readIntField(data, key::ID, 0, 32767, id)) {
+      sendSyncResponse(msg::ALARM_SYNC_RESPONSE, false, "Invalid field: id");
       return;
     }
-    if (!readBoolField(data, "enabled", enabled)) {
-      sendSyncResponse("alarm_sync_response", false, "Invalid field: enabled");
+    if (!readBoolField(data, key::ENABLED, enabled)) {
+      sendSyncResponse(msg::ALARM_SYNC_RESPONSE, false, "Invalid field: enabled");
       return;
     }
-    if (!readIntField(data, "wake_hour", 0, 23, wakeHour) ||
-        !readIntField(data, "wake_minute", 0, 59, wakeMinute) ||
-        !readIntField(data, "start_hour", 0, 23, startHour) ||
-        !readIntField(data, "start_minute", 0, 59, startMinute)) {
-      sendSyncResponse("alarm_sync_response", false, "Invalid start/wake time");
+    if (!readIntField(data, key::WAKE_HOUR, 0, 23, wakeHour) ||
+        !readIntField(data, key::WAKE_MINUTE, 0, 59, wakeMinute) ||
+        !readIntField(data, key::START_HOUR, 0, 23, startHour) ||
+        !readIntField(data, key::START_MINUTE, 0, 59, startMinute)) {
+      sendSyncResponse(msg::ALARM_SYNC_RESPONSE, false, "Invalid start/wake time");
       return;
     }
-    if (!readIntField(data, "duration_minutes", 1, 240, durationMinutes)) {
-      sendSyncResponse("alarm_sync_response", false, "Invalid field: duration_minutes");
+    if (!readIntField(data, key::DURATION_MINUTES, 1, 240, durationMinutes)) {
+      sendSyncResponse(msg::ALARM_SYNC_RESPONSE, false, "Invalid field: duration_minutes");
       return;
     }
 
@@ -556,18 +1833,19 @@ void handleAlarmSync(JsonDocument& doc) {
       alarms[index].start_minute = startMinute;
       alarms[index].duration_minutes = durationMinutes;
 
-      Serial.printf("Alarm %d synced\n", id);
-      sendSyncResponse("alarm_sync_response", true, "Alarm synced successfully");
+      LOGI("Alarm %d synced\n", id);
+      bumpScheduleGeneration();
+      sendSyncResponse(msg::ALARM_SYNC_RESPONSE, true, "Alarm synced successfully");
     } else {
-      Serial.println("Failed to sync alarm: storage full");
-      sendSyncResponse("alarm_sync_response", false, "Storage full");
+      LOGE("Failed to sync alarm: storage full\n");
+      sendSyncResponse(msg::ALARM_SYNC_RESPONSE, false, "Storage full");
     }
   }
-  else if (strcmp(action, "delete") == 0) {
+  else if (strcmp(action, val::DELETE) == 0) {
     JsonObject root = doc.as<JsonObject>();
     int id;
-    if (!readIntField(root, "id", 0, 32767, id)) {
-      sendSyncResponse("alarm_sync_response", false, "Invalid field: id");
+    if (!readIntField(root, key::ID, 0, 32767, id)) {
+      sendSyncResponse(msg::ALARM_SYNC_RESPONSE, false, "Invalid field: id");
       return;
     }
 
@@ -579,16 +1857,17 @@ void handleAlarmSync(JsonDocument& doc) {
           alarms[j] = alarms[j + 1];
         }
         alarm_count--;
-        Serial.printf("Alarm %d deleted\n", id);
-        sendSyncResponse("alarm_sync_response", true, "Alarm deleted");
+        LOGI("Alarm %d deleted\n", id);
+        bumpScheduleGeneration();
+        sendSyncResponse(msg::ALARM_SYNC_RESPONSE, true, "Alarm deleted");
         return;
       }
     }
-    Serial.printf("Alarm %d not found for deletion\n", id);
-    sendSyncResponse("alarm_sync_response", false, "Alarm not found");
+    LOGW("Alarm %d not found for deletion\n", id);
+    sendSyncResponse(msg::ALARM_SYNC_RESPONSE, false, "Alarm not found");
   } else {
-    Serial.printf("⏰ ERROR: Unknown alarm action '%s'\n", action);
-    sendSyncResponse("alarm_sync_response", false, "Unknown alarm action");
+    LOGE("⏰ ERROR: Unknown alarm action '%s'\n", action);
+    sendSyncResponse(msg::ALARM_SYNC_RESPONSE, false, "Unknown alarm action");
   }
 }
 
@@ -601,8 +1880,8 @@ void handleFullSync(JsonDocument& doc) {
   int invalidAlarmCount = 0;
 
   // Sync routines
-  if (doc["routines"].is<JsonArray>()) {
-    JsonArray routineArray = doc["routines"].as<JsonArray>();
+  if (doc[key::ROUTINES].is<JsonArray>()) {
+    JsonArray routineArray = doc[key::ROUTINES].as<JsonArray>();
     for (JsonObject routineObj : routineArray) {
       int id;
       bool enabled;
@@ -614,18 +1893,18 @@ void handleFullSync(JsonDocument& doc) {
       int modeValue;
 
       if (routine_count >= MAX_ROUTINES) {
-        Serial.println("📅 WARNING: Routine storage full during full sync");
+        LOGW("📅 WARNING: Routine storage full during full sync\n");
         break;
       }
 
-      if (!readIntField(routineObj, "id", 0, 32767, id) ||
-          !readBoolField(routineObj, "enabled", enabled) ||
-          !readIntField(routineObj, "start_hour", 0, 23, startHour) ||
-          !readIntField(routineObj, "start_minute", 0, 59, startMinute) ||
-          !readIntField(routineObj, "end_hour", 0, 23, endHour) ||
-          !readIntField(routineObj, "end_minute", 0, 59, endMinute) ||
-          !readIntField(routineObj, "brightness", 0, 15, brightnessValue) ||
-          !readIntField(routineObj, "mode", 0, 2, modeValue)) {
+      if (!readIntField(routineObj, key::ID, 0, 32767, id) ||
+          !readBoolField(routineObj, key::ENABLED, enabled) ||
+          !readIntField(routineObj, key::START_HOUR, 0, 23, startHour) ||
+          !readIntField(routineObj, key::START_MINUTE, 0, 59, startMinute) ||
+          !readIntField(routineObj, key::END_HOUR, 0, 23, endHour) ||
+          !readIntField(routineObj, key::END_MINUTE, 0, 59, endMinute) ||
+          !readIntField(routineObj, key::BRIGHTNESS, 0, 15, brightnessValue) ||
+          !readIntField(routineObj, key::MODE, 0, 2, modeValue)) {
         invalidRoutineCount++;
         continue;
       }
@@ -640,14 +1919,14 @@ void handleFullSync(JsonDocument& doc) {
       routines[routine_count].mode = modeValue;
       routine_count++;
     }
-  } else if (doc["routines"].is<JsonVariant>() && !doc["routines"].is<JsonArray>()) {
-    Serial.println("📅 WARNING: Routines payload not an array");
+  } else if (doc[key::ROUTINES].is<JsonVariant>() && !doc[key::ROUTINES].is<JsonArray>()) {
+    LOGW("📅 WARNING: Routines payload not an array\n");
     invalidRoutineCount++;
   }
 
   // Sync alarms
-  if (doc["alarms"].is<JsonArray>()) {
-    JsonArray alarmArray = doc["alarms"].as<JsonArray>();
+  if (doc[key::ALARMS].is<JsonArray>()) {
+    JsonArray alarmArray = doc[key::ALARMS].as<JsonArray>();
     for (JsonObject alarmObj : alarmArray) {
       int id;
       bool enabled;
@@ -658,17 +1937,17 @@ void handleFullSync(JsonDocument& doc) {
       int durationMinutes;
 
       if (alarm_count >= MAX_ALARMS) {
-        Serial.println("⏰ WARNING: Alarm storage full during full sync");
+        LOGW("⏰ WARNING: Alarm storage full during full sync\n");
         break;
       }
 
-      if (!readIntField(alarmObj, "id", 0, 32767, id) ||
-          !readBoolField(alarmObj, "enabled", enabled) ||
-          !readIntField(alarmObj, "wake_hour", 0, 23, wakeHour) ||
-          !readIntField(alarmObj, "wake_minute", 0, 59, wakeMinute) ||
-          !readIntField(alarmObj, "start_hour", 0, 23, startHour) ||
-          !readIntField(alarmObj, "start_minute", 0, 59, startMinute) ||
-          !readIntField(alarmObj, "duration_minutes", 1, 240, durationMinutes)) {
+      if (!readIntField(alarmObj, key::ID, 0, 32767, id) ||
+          !readBoolField(alarmObj, key::ENABLED, enabled) ||
+          !readIntField(alarmObj, key::WAKE_HOUR, 0, 23, wakeHour) ||
+          !readIntField(alarmObj, key::WAKE_MINUTE, 0, 59, wakeMinute) ||
+          !readIntField(alarmObj, key::START_HOUR, 0, 23, startHour) ||
+          !readIntField(alarmObj, key::START_MINUTE, 0, 59, startMinute) ||
+          !readIntField(alarmObj, key::DURATION_MINUTES, 1, 240, durationMinutes)) {
         invalidAlarmCount++;
         continue;
       }
@@ -682,16 +1961,35 @@ void handleFullSync(JsonDocument& doc) {
       alarms[alarm_count].duration_minutes = durationMinutes;
       alarm_count++;
     }
-  } else if (doc["alarms"].is<JsonVariant>() && !doc["alarms"].is<JsonArray>()) {
-    Serial.println("⏰ WARNING: Alarms payload not an array");
+  } else if (doc[key::ALARMS].is<JsonVariant>() && !doc[key::ALARMS].is<JsonArray>()) {
+    LOGW("⏰ WARNING: Alarms payload not an array\n");
     invalidAlarmCount++;
   }
 
-  Serial.printf("Full sync result: %d routines (%d invalid), %d alarms (%d invalid)\n",
-                routine_count, invalidRoutineCount, alarm_count, invalidAlarmCount);
-
-  const bool success = (invalidRoutineCount == 0 && invalidAlarmCount == 0);
-  String responseMessage;
+  // Dusk fades are optional in full sync so older app builds do not wipe them
+  int invalidDuskCount = 0;
+  if (doc[key::DUSKS].is<JsonArray>()) {
+    dusk_count = 0;
+    for (JsonObject duskObj : doc[key::DUSKS].as<JsonArray>()) {
+      if (dusk_count >= MAX_DUSKS) {
+        LOGW("🌇 WARNING: Dusk storage full during full sync\n");
+        break;
+      }
+      if (!readDuskFields(duskObj, dusks[dusk_count])) {
+        invalidDuskCount++;
+        continue;
+      }
+      duskFiredYday[dusk_count] = -1;
+      dusk_count++;
+    }
+  }
+
+  LOGI("Full sync result: %d routines (%d invalid), %d alarms (%d invalid), %d dusks (%d invalid)\n",
+       routine_count, invalidRoutineCount, alarm_count, invalidAlarmCount, dusk_count, invalidDuskCount);
+
+  invalidAlarmCount += invalidDuskCount;   // reported together with alarms in the response message
+  const bool success = (invalidRoutineCount == 0 && invalidAlarmCount == 0);
+  String responseMessage;
   if (success) {
     responseMessage = "Full sync complete";
   } else {
@@ -708,255 +2006,2429 @@ void handleFullSync(JsonDocument& doc) {
     }
   }
 
-  sendSyncResponse("full_sync_response", success, responseMessage.c_str());
+  bumpScheduleGeneration();
+  sendSyncResponse(msg::FULL_SYNC_RESPONSE, success, responseMessage.c_str());
+}
+
+void sendSyncResponse(const char* type, bool success, const char* message) {
+  JsonDocument doc(&wsTxJson);
+  doc[key::TYPE] = type;
+  doc[key::SUCCESS] = success;
+  doc[key::MESSAGE] = message;
+  doc[key::SCHEDULE_GENERATION] = scheduleGeneration;
+  char digest[9];
+  snprintf(digest, sizeof(digest), "%08x", scheduleDigest());
+  doc[key::SCHEDULE_DIGEST] = digest;
+  
+  JsonText jsonText(doc);
+  ws.textAll(jsonText.c_str(), jsonText.length());
+  
+  LOGD("Sent sync response: %s\n", jsonText.c_str());
+}
+
+bool isManualControlLocked() {
+  if (WiFi.status() != WL_CONNECTED) {
+    return false;
+  }
+  return (routineActive || alarmActive || sunSyncActive || fadeActive);
+}
+
+Routine* findRoutineById(int id) {
+  if (id < 0) return nullptr;
+  for (int i = 0; i < routine_count; i++) {
+    if (routines[i].id == id) {
+      return &routines[i];
+    }
+  }
+  return nullptr;
+}
+
+Alarm* findAlarmById(int id) {
+  if (id < 0) return nullptr;
+  for (int i = 0; i < alarm_count; i++) {
+    if (alarms[i].id == id) {
+      return &alarms[i];
+    }
+  }
+  return nullptr;
+}
+
+bool isWithinTimeRange(int startHour, int startMinute, int endHour, int endMinute, int currentTime) {
+  return sc_in_window(startHour * 60 + startMinute, endHour * 60 + endMinute, currentTime);
+}
+
+void updateSuppressionWindows(int currentTime) {
+  if (routineSuppressed) {
+    if (!isWithinTimeRange(suppressedRoutine.start_hour, suppressedRoutine.start_minute,
+                           suppressedRoutine.end_hour, suppressedRoutine.end_minute, currentTime)) {
+      LOGI("Routine %d suppression window ended\n", suppressedRoutine.id);
+      routineSuppressed = false;
+    }
+  }
+
+  if (alarmSuppressed) {
+    if (!isWithinTimeRange(suppressedAlarm.start_hour, suppressedAlarm.start_minute,
+                           suppressedAlarm.wake_hour, suppressedAlarm.wake_minute, currentTime)) {
+      LOGI("Alarm %d suppression window ended\n", suppressedAlarm.id);
+      alarmSuppressed = false;
+    }
+  }
+
+  if (duskSuppressed) {
+    int endTime = (suppressedDusk.start_hour * 60 + suppressedDusk.start_minute + suppressedDusk.duration_minutes) % 1440;
+    if (!isWithinTimeRange(suppressedDusk.start_hour, suppressedDusk.start_minute,
+                           endTime / 60, endTime % 60, currentTime)) {
+      LOGI("Dusk %d suppression window ended\n", suppressedDusk.id);
+      duskSuppressed = false;
+    }
+  }
+}
+
+void blinkLamp(uint8_t count, uint16_t intervalMs) {
+  int savedCh0 = ledcRead(0);
+  int savedCh1 = ledcRead(1);
+  ComposedOutput out;
+  composeLayers(out);
+  bool lampWasOn = out.isOn;
+
+  for (uint8_t i = 0; i < count; ++i) {
+    // Off phase
+    writeChannels(pwmMaxDuty, pwmMaxDuty);
+    delay(intervalMs);
+
+    // On phase - restore saved channels or provide a gentle pulse if lamp was off
+    if (lampWasOn) {
+      writeChannels(savedCh0, savedCh1);
+    } else {
+      writeChannels(dutyForLevel(3 << 8), dutyForLevel(3 << 8));
+    }
+    delay(intervalMs);
+  }
+
+  // The blink wrote PWM behind the compositor's back; force the next render
+  compositorCh0 = -1;
+  compositorCh1 = -1;
+  compositorDirty = true;
+  applyOutput();
+}
+
+void sendSunSyncState(bool active, const char* source) {
+  JsonDocument doc(&wsTxJson);
+  doc[key::TYPE] = msg::SUN_SYNC_STATE;
+  doc[key::ACTIVE] = active;
+  doc[key::SOURCE] = source;
+  doc[key::TIMESTAMP_MS] = millis();
+
+  JsonText jsonText(doc);
+  ws.textAll(jsonText.c_str(), jsonText.length());
+
+  LOGD("Sent sun sync state (%s): %s\n", source, jsonText.c_str());
+}
+
+void broadcastOverrideEvent(const char* source, bool routineWasActive, bool alarmWasActive, bool sunSyncWasActive,
+                            bool fadeWasActive) {
+  JsonDocument doc(&wsTxJson);
+  doc[key::TYPE] = msg::SCHEDULE_OVERRIDE_EVENT;
+  doc[key::SOURCE] = source;
+  doc[key::TIMESTAMP_MS] = millis();
+  doc[key::ROUTINE_DISABLED] = routineWasActive;
+  doc[key::ALARM_DISABLED] = alarmWasActive;
+  doc[key::SUN_SYNC_DISABLED] = sunSyncWasActive;
+  doc[key::FADE_DISABLED] = fadeWasActive;
+  doc[key::ROUTINE_SUPPRESSED] = routineSuppressed;
+  doc[key::ALARM_SUPPRESSED] = alarmSuppressed;
+  doc[key::SUN_SYNC_ACTIVE] = sunSyncActive;
+  doc[key::DUSK_SUPPRESSED] = duskSuppressed;
+
+  JsonText jsonText(doc);
+  ws.textAll(jsonText.c_str(), jsonText.length());
+
+  LOGD("Sent override event: %s\n", jsonText.c_str());
+
+  uint8_t disabled = (routineWasActive ? 0x01 : 0) | (alarmWasActive ? 0x02 : 0) | (sunSyncWasActive ? 0x04 : 0) |
+                     (fadeWasActive ? 0x08 : 0);
+  logEvent(EVT_OVERRIDE, eventSourceCode(source), -1, disabled);
+}
+
+void handleSunSyncState(bool active, const char* source) {
+  bool previous = sunSyncActive;
+  sunSyncActive = active;
+
+  if (active) {
+    sunSyncDisabledByHardware = false;
+  } else if (strcmp(source, val::SOURCE_HARDWARE) == 0) {
+    sunSyncDisabledByHardware = true;
+  } else {
+    sunSyncDisabledByHardware = false;
+  }
+
+  LOGI("Sun sync state updated by %s -> %s\n", source, active ? "ACTIVE" : "INACTIVE");
+  if (!active) {
+    releaseLayer(LAYER_KNOB);   // keep the nudged level once sun sync stops driving the lamp
+  }
+
+  if (previous != sunSyncActive) {
+    logEvent(EVT_SUN_SYNC, eventSourceCode(source), -1, sunSyncActive ? 1 : 0);
+    sendStateUpdate();
+  }
+}
+
+// Suppress the running routine and alarm until their windows end. Each layer is released
+// into the manual state, so the lamp holds the level it was showing.
+void suppressActiveSchedule(const char* source) {
+  if (routineActive) {
+    Routine* routinePtr = findRoutineById(activeRoutineId);
+    if (routinePtr != nullptr) {
+      suppressedRoutine = *routinePtr;
+      routineSuppressed = true;
+      LOGI("Routine %d suppressed by %s override\n", suppressedRoutine.id, source);
+    } else {
+      routineSuppressed = false;
+      LOGW("Warning: active routine ID %d not found during %s override\n", activeRoutineId, source);
+    }
+    releaseLayer(LAYER_ROUTINE);   // hold the routine's level as the manual state
+    routineActive = false;
+    activeRoutineId = -1;
+    lastRoutineMinute = -1;
+    wasOffBeforeRoutine = false;
+  }
+
+  if (alarmActive) {
+    Alarm* alarmPtr = findAlarmById(activeAlarmId);
+    if (alarmPtr != nullptr) {
+      suppressedAlarm = *alarmPtr;
+      alarmSuppressed = true;
+      LOGI("Alarm %d suppressed by %s override\n", suppressedAlarm.id, source);
+    } else {
+      alarmSuppressed = false;
+      LOGW("Warning: active alarm ID %d not found during %s override\n", activeAlarmId, source);
+    }
+    releaseLayer(LAYER_ALARM);
+    alarmActive = false;
+    activeAlarmId = -1;
+    lastAlarmMinute = -1;
+    wasOffBeforeAlarm = false;
+  }
+}
+
+bool hardwareOverrideActiveAutomations(const char* source, bool shouldBlink) {
+  bool routineWasActive = routineActive;
+  bool alarmWasActive = alarmActive;
+  bool sunSyncWasActive = sunSyncActive;
+  // Fades run entirely on the device, so losing WiFi is no reason to abandon one
+  bool fadeWasActive = fadeActive && strcmp(source, val::SOURCE_HARDWARE_WIFI_LOSS) != 0;
+
+  if (!routineWasActive && !alarmWasActive && !sunSyncWasActive && !fadeWasActive) {
+    LOGI("Override requested by %s but no active automation\n", source);
+    return false;
+  }
+
+  suppressActiveSchedule(source);
+
+  if (fadeWasActive) {
+    DuskFade* duskPtr = nullptr;
+    for (int i = 0; i < dusk_count; i++) {
+      if (dusks[i].id == activeDuskId) duskPtr = &dusks[i];
+    }
+    if (duskPtr != nullptr) {
+      suppressedDusk = *duskPtr;
+      duskSuppressed = true;
+      LOGI("Dusk %d suppressed by %s override\n", suppressedDusk.id, source);
+    }
+    cancelFade(source);
+  }
+
+  if (sunSyncWasActive) {
+    sunSyncActive = false;
+    releaseLayer(LAYER_KNOB);
+    sunSyncDisabledByHardware = true;
+    sendSunSyncState(false, source);
+    LOGI("Sun sync disabled by %s override\n", source);
+  }
+
+  if (shouldBlink) {
+    blinkLamp(tunables.overrideBlinkCount, tunables.overrideBlinkIntervalMs);
+  }
+
+  applyOutput();
+  sendStateUpdate();
+  broadcastOverrideEvent(source, routineWasActive, alarmWasActive, sunSyncWasActive, fadeWasActive);
+  return true;
+}
+
+void handleTripleClick() {
+  LOGI("Triple click detected: disabling active schedules for current instance\n");
+  if (!hardwareOverrideActiveAutomations(val::SOURCE_HARDWARE, true)) {
+    LOGI("Triple click detected but no active routine/alarm/sun sync to disable\n");
+  }
+}
+
+void handleTimeSync(JsonDocument& doc) {
+  // Optional POSIX TZ string, e.g. "CET-1CEST,M3.5.0,M10.5.0/3"
+  if (doc[key::TZ].is<const char*>()) {
+    const char* tz = doc[key::TZ];
+    size_t tzLen = strlen(tz);
+    if (tzLen == 0 || tzLen >= TIMEZONE_MAX_LEN) {
+      LOGE("🕐 ERROR: Invalid time sync data - bad tz\n");
+      sendSyncResponse(msg::TIME_SYNC_RESPONSE, false, "Invalid field: tz");
+      return;
+    }
+    applyTimezone(tz, true);
+  }
+
+  if (doc[key::TIMESTAMP].is<long long>()) {
+    long long timestamp = doc[key::TIMESTAMP];
+    
+    // Convert milliseconds to seconds (UTC timestamp)
+    time_t utcTimeSeconds = timestamp / 1000;
+    
+    // Print UTC time first
+    struct tm* utcTime = gmtime(&utcTimeSeconds);
+    LOGI("🕐 RECEIVED UTC: %04d-%02d-%02d %02d:%02d:%02d\n",
+         utcTime->tm_year + 1900, utcTime->tm_mon + 1, utcTime->tm_mday,
+         utcTime->tm_hour, utcTime->tm_min, utcTime->tm_sec);
+    
+    // Set system time with UTC time (local time comes from the timezone table)
+    struct timeval tv;
+    tv.tv_sec = utcTimeSeconds;
+    tv.tv_usec = 0;
+    settimeofday(&tv, NULL);
+    
+    // Print what the ESP32 thinks the time is after setting
+    TzLocalClock localClock;
+    if (getLocalClock(localClock)) {
+      LOGI("🕐 ESP32 LOCAL TIME (%s): day %d of %d, %02d:%02d:%02d\n", timezone,
+           localClock.yday + 1, localClock.year, localClock.minuteOfDay / 60, localClock.minuteOfDay % 60, localClock.second);
+    } else {
+      LOGE("🕐 ERROR: Failed to get local time after sync\n");
+    }
+
+    sendSyncResponse(msg::TIME_SYNC_RESPONSE, true, "Time synchronized with automatic DST");
+  } else if (doc[key::TZ].is<const char*>()) {
+    sendSyncResponse(msg::TIME_SYNC_RESPONSE, true, "Timezone updated");
+  } else {
+    LOGE("🕐 ERROR: Invalid time sync data - missing timestamp\n");
+    sendSyncResponse(msg::TIME_SYNC_RESPONSE, false, "Invalid time data");
+  }
+}
+
+// ===== Event History Log =====
+uint8_t eventSourceCode(const char* source) {
+  if (source == nullptr) return SRC_NONE;
+  if (strcmp(source, val::SOURCE_HARDWARE) == 0) return SRC_HARDWARE;
+  if (strcmp(source, val::SOURCE_HARDWARE_OFFLINE_ROTARY) == 0) return SRC_HARDWARE_OFFLINE_ROTARY;
+  if (strcmp(source, val::SOURCE_HARDWARE_OFFLINE_BUTTON) == 0) return SRC_HARDWARE_OFFLINE_BUTTON;
+  if (strcmp(source, val::SOURCE_HARDWARE_WIFI_LOSS) == 0) return SRC_HARDWARE_WIFI_LOSS;
+  if (strcmp(source, val::SOURCE_APP) == 0) return SRC_APP;
+  return SRC_OTHER;
+}
+
+const char* eventSourceName(uint8_t source) {
+  switch (source) {
+    case SRC_NONE: return "none";
+    case SRC_HARDWARE: return val::SOURCE_HARDWARE;
+    case SRC_HARDWARE_OFFLINE_ROTARY: return val::SOURCE_HARDWARE_OFFLINE_ROTARY;
+    case SRC_HARDWARE_OFFLINE_BUTTON: return val::SOURCE_HARDWARE_OFFLINE_BUTTON;
+    case SRC_HARDWARE_WIFI_LOSS: return val::SOURCE_HARDWARE_WIFI_LOSS;
+    case SRC_APP: return val::SOURCE_APP;
+    case SRC_SCHEDULE: return "schedule";
+    default: return "other";
+  }
+}
+
+const char* eventTypeName(uint8_t type) {
+  switch (type) {
+    case EVT_BOOT: return "boot";
+    case EVT_STATE: return "state";
+    case EVT_ROUTINE_START: return "routine_start";
+    case EVT_ROUTINE_END: return "routine_end";
+    case EVT_ALARM_START: return "alarm_start";
+    case EVT_ALARM_END: return "alarm_end";
+    case EVT_OVERRIDE: return "override";
+    case EVT_WIFI: return "wifi";
+    case EVT_SUN_SYNC: return "sun_sync";
+    case EVT_FADE_START: return "fade_start";
+    case EVT_FADE_END: return "fade_end";
+    default: return "unknown";
+  }
+}
+
+uint8_t eventRecordCheck(const EventRecord& record) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&record);
+  uint8_t check = 0x5A;
+  for (size_t i = 0; i < sizeof(EventRecord) - 1; i++) {
+    check ^= bytes[i];
+  }
+  return check;
+}
+
+bool eventRecordValid(const EventRecord& record) {
+  return record.seq != 0xFFFFFFFF && record.check == eventRecordCheck(record);
+}
+
+void resetEventSectorIndex(EventSectorIndex& index) {
+  index.used = 0;
+  index.minEpoch = UINT32_MAX;
+  index.maxEpoch = 0;
+}
+
+void noteEventSectorRecord(EventSectorIndex& index, const EventRecord& record) {
+  uint32_t epoch = record.epoch;
+  if (epoch < index.minEpoch) index.minEpoch = epoch;
+  if (epoch > index.maxEpoch) index.maxEpoch = epoch;
+}
+
+// Summarise one sector into eventSectorIndex (records are appended from its first slot
+// on, so the first erased slot ends it); returns the highest valid sequence number seen
+uint32_t indexEventSector(uint32_t sector) {
+  EventSectorIndex& index = eventSectorIndex[sector];
+  resetEventSectorIndex(index);
+  uint32_t lastSeq = 0;
+  EventRecord batch[EVENT_QUERY_BATCH];
+  while (index.used < EVENT_RECORDS_PER_SECTOR) {
+    uint32_t slot = sector * EVENT_RECORDS_PER_SECTOR + index.used;
+    if (esp_partition_read(eventLogPartition, slot * sizeof(EventRecord), batch, sizeof(batch)) != ESP_OK) {
+      break;
+    }
+    for (uint8_t i = 0; i < EVENT_QUERY_BATCH; i++) {
+      if (batch[i].seq == 0xFFFFFFFF) {
+        return lastSeq;
+      }
+      index.used++;
+      if (batch[i].check == eventRecordCheck(batch[i])) {
+        noteEventSectorRecord(index, batch[i]);
+        if (batch[i].seq > lastSeq) lastSeq = batch[i].seq;
+      }
+    }
+  }
+  return lastSeq;
+}
+
+// Index every sector; the one holding the highest sequence number is the newest, and
+// its first erased slot is where appending resumes
+void initEventLog() {
+  eventLogPartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)0x40, "evlog");
+  if (eventLogPartition == nullptr) {
+    LOGW("📜 Event log partition 'evlog' not found; history disabled\n");
+    return;
+  }
+
+  eventLogSectors = min(eventLogPartition->size / EVENT_LOG_SECTOR_SIZE, (uint32_t)EVENT_LOG_MAX_SECTORS);
+  eventLogSlots = eventLogSectors * EVENT_RECORDS_PER_SECTOR;
+
+  int32_t newestSector = -1;
+  uint32_t newestSeq = 0;
+  for (uint32_t sector = 0; sector < eventLogSectors; sector++) {
+    uint32_t lastSeq = indexEventSector(sector);
+    if (lastSeq > newestSeq) {
+      newestSeq = lastSeq;
+      newestSector = sector;
+    }
+  }
+
+  if (newestSector < 0) {
+    eventLogHead = 0;
+    eventLogNextSeq = 1;
+  } else {
+    eventLogHead = (newestSector * EVENT_RECORDS_PER_SECTOR + eventSectorIndex[newestSector].used) % eventLogSlots;
+    eventLogNextSeq = newestSeq + 1;
+  }
+
+  LOGI("📜 Event log ready: %u slots, head=%u, next seq=%u\n",
+       eventLogSlots, eventLogHead, eventLogNextSeq);
+}
+
+// Stage an event in RAM; safe to call from WebSocket callbacks and the main loop alike
+void logEvent(EventType type, uint8_t source, int id, uint8_t flags) {
+  EventRecord record = {};
+  time_t now = time(nullptr);
+  record.epoch = (now > 1600000000) ? (uint32_t)now : 0;
+  record.type = type;
+  record.source = source;
+  record.id = (int16_t)id;
+  ComposedOutput out;
+  composeLayers(out);
+  record.brightness = (uint8_t)out.brightness;
+  record.mode = (uint8_t)out.mode;
+  record.flags = flags;
+
+  portENTER_CRITICAL(&eventPendingMux);
+  if (eventPendingCount < EVENT_PENDING_DEPTH) {
+    eventPending[(eventPendingHead + eventPendingCount) % EVENT_PENDING_DEPTH] = record;
+    eventPendingCount++;
+  } else {
+    eventPendingDropped++;
+  }
+  portEXIT_CRITICAL(&eventPendingMux);
+}
+
+void appendEventRecord(EventRecord& record) {
+  if (eventLogHead % EVENT_RECORDS_PER_SECTOR == 0) {
+    // Rotating into a sector: recycle it (drops the oldest 256 records)
+    beginFlashWrite();
+    esp_err_t err = esp_partition_erase_range(eventLogPartition, eventLogHead * sizeof(EventRecord), EVENT_LOG_SECTOR_SIZE);
+    endFlashWrite();
+    if (err != ESP_OK) {
+      LOGE("📜 ERROR: Event log sector erase failed (%s)\n", esp_err_to_name(err));
+      return;
+    }
+    portENTER_CRITICAL(&eventIndexMux);
+    resetEventSectorIndex(eventSectorIndex[eventLogHead / EVENT_RECORDS_PER_SECTOR]);
+    portEXIT_CRITICAL(&eventIndexMux);
+  }
+
+  record.seq = eventLogNextSeq;
+  record.check = eventRecordCheck(record);
+  beginFlashWrite();
+  esp_err_t err = esp_partition_write(eventLogPartition, eventLogHead * sizeof(EventRecord), &record, sizeof(record));
+  endFlashWrite();
+  if (err != ESP_OK) {
+    LOGE("📜 ERROR: Event log write failed (%s)\n", esp_err_to_name(err));
+    return;
+  }
+
+  portENTER_CRITICAL(&eventIndexMux);
+  EventSectorIndex& index = eventSectorIndex[eventLogHead / EVENT_RECORDS_PER_SECTOR];
+  index.used++;
+  noteEventSectorRecord(index, record);
+  portEXIT_CRITICAL(&eventIndexMux);
+  eventLogNextSeq++;
+  eventLogHead = (eventLogHead + 1) % eventLogSlots;
+}
+
+// Flush staged events to flash and record settled lamp state transitions
+void serviceEventLog() {
+  static bool loggedIsOn = false;
+  static int loggedBrightness = -1;
+  static Mode loggedMode = MODE_BOTH;
+
+  if (eventLogPartition == nullptr) {
+    portENTER_CRITICAL(&eventPendingMux);
+    eventPendingCount = 0;
+    portEXIT_CRITICAL(&eventPendingMux);
+    return;
+  }
+
+  ComposedOutput out;
+  composeLayers(out);
+  bool stateDiffers = (out.isOn != loggedIsOn || out.mode != loggedMode || out.brightness != loggedBrightness);
+  if (stateDiffers && millis() - lastOutputChangeMs >= EVENT_STATE_SETTLE_MS) {
+    loggedIsOn = out.isOn;
+    loggedMode = out.mode;
+    loggedBrightness = out.brightness;
+    logEvent(EVT_STATE, SRC_NONE, -1, out.isOn ? 1 : 0);
+  }
+
+  while (true) {
+    EventRecord record;
+    portENTER_CRITICAL(&eventPendingMux);
+    if (eventPendingCount == 0) {
+      portEXIT_CRITICAL(&eventPendingMux);
+      break;
+    }
+    record = eventPending[eventPendingHead];
+    eventPendingHead = (eventPendingHead + 1) % EVENT_PENDING_DEPTH;
+    eventPendingCount--;
+    portEXIT_CRITICAL(&eventPendingMux);
+
+    appendEventRecord(record);
+  }
+}
+
+// Cursor shared between chunked-response callbacks of one /history request. Sectors are
+// visited oldest first and read EVENT_QUERY_BATCH records at a time; the batch survives
+// across chunks so a record that did not fit is emitted from it next time.
+struct HistoryQuery {
+  uint32_t from;
+  uint32_t to;
+  uint16_t remaining;
+  uint32_t lastSeq;        // guards against a sector recycled mid-query
+  uint32_t nextSector;
+  uint32_t sectorsLeft;
+  uint32_t sectorBase;     // first slot of the sector being read
+  uint16_t slot;           // next slot to read within it
+  uint16_t sectorUsed;
+  EventRecord batch[EVENT_QUERY_BATCH];
+  uint8_t batchLen;
+  uint8_t batchPos;
+  bool started;
+  bool finished;
+};
+
+// Load the next batch of records that can fall inside the query's time range; false
+// once every sector has been visited
+bool fillHistoryBatch(HistoryQuery& query) {
+  while (query.slot >= query.sectorUsed) {
+    if (query.sectorsLeft == 0) {
+      return false;
+    }
+    uint32_t sector = query.nextSector;
+    query.nextSector = (sector + 1) % eventLogSectors;
+    query.sectorsLeft--;
+
+    portENTER_CRITICAL(&eventIndexMux);
+    EventSectorIndex index = eventSectorIndex[sector];
+    portEXIT_CRITICAL(&eventIndexMux);
+    if (index.used == 0 || index.maxEpoch < query.from || index.minEpoch > query.to) {
+      continue;
+    }
+    query.sectorBase = sector * EVENT_RECORDS_PER_SECTOR;
+    query.slot = 0;
+    query.sectorUsed = index.used;
+  }
+
+  uint8_t count = (uint8_t)min((uint32_t)EVENT_QUERY_BATCH, (uint32_t)(query.sectorUsed - query.slot));
+  if (esp_partition_read(eventLogPartition, (query.sectorBase + query.slot) * sizeof(EventRecord),
+                         query.batch, count * sizeof(EventRecord)) != ESP_OK) {
+    return false;
+  }
+  query.slot += count;
+  query.batchLen = count;
+  query.batchPos = 0;
+  return true;
+}
+
+size_t writeHistoryRecord(const EventRecord& record, bool first, uint8_t* buffer, size_t maxLen) {
+  int written = snprintf((char*)buffer, maxLen,
+                         "%s{\"seq\":%u,\"t\":%u,\"type\":\"%s\",\"source\":\"%s\",\"id\":%d,"
+                         "\"brightness\":%u,\"mode\":%u,\"flags\":%u}",
+                         first ? "" : ",", record.seq, record.epoch, eventTypeName(record.type),
+                         eventSourceName(record.source), record.id, record.brightness, record.mode, record.flags);
+  if (written < 0 || (size_t)written >= maxLen) {
+    return 0;
+  }
+  return (size_t)written;
+}
+
+// GET /history?from=<epoch>&to=<epoch>&limit=<n>: records in the range, oldest first
+void handleHistoryRequest(AsyncWebServerRequest* request) {
+  if (eventLogPartition == nullptr) {
+    request->send(503, "application/json", "{\"error\":\"event log unavailable\"}");
+    return;
+  }
+
+  std::shared_ptr<HistoryQuery> query = std::make_shared<HistoryQuery>();
+  query->from = request->hasParam(key::FROM) ? strtoul(request->getParam(key::FROM)->value().c_str(), nullptr, 10) : 0;
+  query->to = request->hasParam(key::TO) ? strtoul(request->getParam(key::TO)->value().c_str(), nullptr, 10) : UINT32_MAX;
+  long limit = request->hasParam(key::LIMIT) ? request->getParam(key::LIMIT)->value().toInt() : EVENT_QUERY_DEFAULT_LIMIT;
+  query->remaining = (uint16_t)constrain(limit, 1L, (long)EVENT_QUERY_MAX_LIMIT);
+  query->lastSeq = 0;
+  query->sectorsLeft = eventLogSectors;
+  query->slot = 0;
+  query->sectorUsed = 0;
+  query->batchLen = 0;
+  query->batchPos = 0;
+  query->started = false;
+  query->finished = false;
+
+  // The oldest data is in the sector after the one being written (when the head sits
+  // on a boundary that is the head's own sector, which is recycled next)
+  uint32_t headSector = eventLogHead / EVENT_RECORDS_PER_SECTOR;
+  query->nextSector = (eventLogHead % EVENT_RECORDS_PER_SECTOR == 0) ? headSector : (headSector + 1) % eventLogSectors;
+
+  AsyncWebServerResponse* response = request->beginChunkedResponse("application/json",
+      [query](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+    size_t used = 0;
+    if (!query->started) {
+      buffer[used++] = '[';
+      query->started = true;
+    }
+
+    while (!query->finished && query->remaining > 0) {
+      if (query->batchPos == query->batchLen && !fillHistoryBatch(*query)) {
+        break;
+      }
+      const EventRecord& record = query->batch[query->batchPos];
+      if (!eventRecordValid(record) || record.seq <= query->lastSeq ||
+          record.epoch < query->from || record.epoch > query->to) {
+        query->batchPos++;
+        continue;
+      }
+      size_t len = writeHistoryRecord(record, index + used == 1, buffer + used, maxLen - used - 1);
+      if (len == 0) {
+        return used;       // buffer full; resume this record in the next chunk
+      }
+      used += len;
+      query->batchPos++;
+      query->lastSeq = record.seq;
+      query->remaining--;
+    }
+
+    if (!query->finished && used < maxLen) {
+      buffer[used++] = ']';
+      query->finished = true;
+    }
+    return used;
+  });
+  request->send(response);
+}
+
+// ===== Energy Accounting =====
+// Move whole duty-ms from the live accumulators into the current bucket (remainder is kept)
+void foldEnergyAccumulators() {
+  unsigned long now = millis();
+  portENTER_CRITICAL(&energyMux);
+  uint32_t elapsed = now - energyLastMs;
+  energyLastMs = now;
+  EnergyBucket& bucket = energyBuckets[energyHead];
+  for (uint8_t c = 0; c < 2; c++) {
+    energyDutyAcc[c] += (uint64_t)energyLevel[c] * elapsed;
+    if (energyLevel[c] > 0) {
+      energyOnAcc[c] += elapsed;
+    }
+    bucket.fullOnMs[c] += (uint32_t)(energyDutyAcc[c] / pwmMaxDuty);
+    energyDutyAcc[c] %= pwmMaxDuty;
+    bucket.onMs[c] += energyOnAcc[c];
+    energyOnAcc[c] = 0;
+  }
+  portEXIT_CRITICAL(&energyMux);
+}
+
+uint32_t currentEnergyHour() {
+  time_t now = time(nullptr);
+  return (uint32_t)(now / 3600);
+}
+
+// Rewrite the whole ring, including the running hour, and empty the journal
+void saveEnergyBuckets() {
+  foldEnergyAccumulators();
+  beginFlashWrite();
+  energyPrefs.putBytes("buckets", energyBuckets, sizeof(energyBuckets));
+  energyPrefs.putUChar("head", energyHead);
+  energyPrefs.putUChar("jcount", 0);
+  endFlashWrite();
+  energyJournalCount = 0;
+}
+
+// Persist one finished bucket as a journal entry ("j0".."j23"), or the whole ring once
+// the journal is full
+void persistEnergyBucket(uint8_t index) {
+  if (energyJournalCount >= ENERGY_JOURNAL_HOURS) {
+    saveEnergyBuckets();
+    return;
+  }
+  EnergyJournalEntry entry = {index, energyBuckets[index]};
+  char name[8];
+  snprintf(name, sizeof(name), "j%u", energyJournalCount);
+  beginFlashWrite();
+  energyPrefs.putBytes(name, &entry, sizeof(entry));
+  energyPrefs.putUChar("jcount", energyJournalCount + 1);
+  endFlashWrite();
+  energyJournalCount++;
+}
+
+// Restore the last full save, then replay the journal over it in order
+void initEnergyAccounting() {
+  energyPrefs.begin("energy", false);
+  memset(energyBuckets, 0, sizeof(energyBuckets));
+  energyHead = 0;
+  bool restored = false;
+  if (energyPrefs.getBytesLength("buckets") == sizeof(energyBuckets)) {
+    energyPrefs.getBytes("buckets", energyBuckets, sizeof(energyBuckets));
+    energyHead = energyPrefs.getUChar("head", 0) % ENERGY_BUCKET_COUNT;
+    restored = true;
+  }
+
+  energyJournalCount = min(energyPrefs.getUChar("jcount", 0), ENERGY_JOURNAL_HOURS);
+  for (uint8_t i = 0; i < energyJournalCount; i++) {
+    EnergyJournalEntry entry;
+    char name[8];
+    snprintf(name, sizeof(name), "j%u", i);
+    if (energyPrefs.getBytes(name, &entry, sizeof(entry)) == sizeof(entry) && entry.index < ENERGY_BUCKET_COUNT) {
+      energyBuckets[entry.index] = entry.bucket;
+      energyHead = entry.index;
+      restored = true;
+    }
+  }
+
+  if (restored) {
+    // Start this boot in a fresh bucket so the restored hour keeps its label
+    energyHead = (energyHead + 1) % ENERGY_BUCKET_COUNT;
+    memset(&energyBuckets[energyHead], 0, sizeof(EnergyBucket));
+    LOGI("⚡ Energy history restored (%u hourly buckets, %u journalled)\n", ENERGY_BUCKET_COUNT, energyJournalCount);
+  }
+  energyBuckets[energyHead].hour = currentEnergyHour();
+  energyLastMs = millis();
+}
+
+// Roll to a new bucket when the hour changes and persist the finished one
+void serviceEnergyAccounting() {
+  static unsigned long lastCheck = 0;
+  if (millis() - lastCheck < 1000) {
+    return;
+  }
+  lastCheck = millis();
+
+  uint32_t hour = currentEnergyHour();
+  if (hour == energyBuckets[energyHead].hour) {
+    return;
+  }
+
+  // Clock just became valid (NTP/time_sync): label the running bucket instead of rolling
+  if (energyBuckets[energyHead].hour < ENERGY_VALID_HOUR_MIN && hour >= ENERGY_VALID_HOUR_MIN) {
+    energyBuckets[energyHead].hour = hour;
+    return;
+  }
+
+  foldEnergyAccumulators();
+  persistEnergyBucket(energyHead);
+  energyHead = (energyHead + 1) % ENERGY_BUCKET_COUNT;
+  memset(&energyBuckets[energyHead], 0, sizeof(EnergyBucket));
+  energyBuckets[energyHead].hour = hour;
+}
+
+uint32_t energyMilliwattHours(uint32_t fullOnMs, uint8_t channel) {
+  return (uint32_t)((uint64_t)fullOnMs * LED_CHANNEL_FULL_POWER_MW[channel] / 3600000ULL);
+}
+
+// Build the energy report: newest `hours` buckets plus per-local-day totals
+void buildEnergyReport(JsonDocument& doc, uint8_t hours) {
+  foldEnergyAccumulators();
+  hours = constrain(hours, (uint8_t)1, ENERGY_BUCKET_COUNT);
+
+  doc[key::TYPE] = msg::ENERGY_REPORT;
+  JsonArray power = doc[key::CHANNEL_FULL_POWER_MW].to<JsonArray>();
+  power.add(LED_CHANNEL_FULL_POWER_MW[0]);
+  power.add(LED_CHANNEL_FULL_POWER_MW[1]);
+
+  JsonArray buckets = doc[key::HOURS].to<JsonArray>();
+  JsonArray days = doc[key::DAYS].to<JsonArray>();
+  JsonObject day;
+  int currentYday = -1;
+
+  for (int i = hours - 1; i >= 0; i--) {
+    const EnergyBucket& bucket = energyBuckets[(energyHead + ENERGY_BUCKET_COUNT - i) % ENERGY_BUCKET_COUNT];
+    if (bucket.hour < ENERGY_VALID_HOUR_MIN && bucket.onMs[0] == 0 && bucket.onMs[1] == 0) continue;
+
+    JsonObject entry = buckets.add<JsonObject>();
+    entry[key::START] = (uint32_t)bucket.hour * 3600;
+    entry[key::WARM_ON_S] = bucket.onMs[0] / 1000;
+    entry[key::WHITE_ON_S] = bucket.onMs[1] / 1000;
+    entry[key::WARM_MWH] = energyMilliwattHours(bucket.fullOnMs[0], 0);
+    entry[key::WHITE_MWH] = energyMilliwattHours(bucket.fullOnMs[1], 1);
+
+    time_t start = (time_t)bucket.hour * 3600;
+    struct tm local;
+    localtime_r(&start, &local);
+    if (local.tm_yday != currentYday) {
+      currentYday = local.tm_yday;
+      char date[11];
+      snprintf(date, sizeof(date), "%04d-%02d-%02d", local.tm_year + 1900, local.tm_mon + 1, local.tm_mday);
+      day = days.add<JsonObject>();
+      day[key::DATE] = date;
+      day[key::WARM_ON_S] = 0;
+      day[key::WHITE_ON_S] = 0;
+      day[key::WARM_MWH] = 0;
+      day[key::WHITE_MWH] = 0;
+    }
+    day[key::WARM_ON_S] = day[key::WARM_ON_S].as<uint32_t>() + bucket.onMs[0] / 1000;
+    day[key::WHITE_ON_S] = day[key::WHITE_ON_S].as<uint32_t>() + bucket.onMs[1] / 1000;
+    day[key::WARM_MWH] = day[key::WARM_MWH].as<uint32_t>() + energyMilliwattHours(bucket.fullOnMs[0], 0);
+    day[key::WHITE_MWH] = day[key::WHITE_MWH].as<uint32_t>() + energyMilliwattHours(bucket.fullOnMs[1], 1);
+  }
+}
+
+// WebSocket {"type":"energy_request","hours":n}: reply to the requesting client only
+void handleEnergyRequest(AsyncWebSocketClient* client, JsonDocument& doc) {
+  uint8_t hours = ENERGY_DEFAULT_REPORT_HOURS;
+  int requested;
+  if (doc[key::HOURS].is<int>() && readIntField(doc.as<JsonObject>(), key::HOURS, 1, ENERGY_BUCKET_COUNT, requested)) {
+    hours = (uint8_t)requested;
+  }
+
+  JsonDocument report(&wsTxJson);
+  buildEnergyReport(report, hours);
+  JsonText jsonText(report);
+  client->text(jsonText.c_str(), jsonText.length());
+  LOGI("⚡ Sent energy report (%u hours) to client #%u\n", hours, client->id());
+}
+
+// GET /energy?hours=n
+void handleEnergyHttpRequest(AsyncWebServerRequest* request) {
+  long hours = request->hasParam(key::HOURS) ? request->getParam(key::HOURS)->value().toInt() : ENERGY_DEFAULT_REPORT_HOURS;
+
+  JsonDocument report(&httpJson);
+  buildEnergyReport(report, (uint8_t)constrain(hours, 1L, (long)ENERGY_BUCKET_COUNT));
+  String jsonString;
+  serializeJson(report, jsonString);
+  request->send(200, "application/json", jsonString);
+}
+
+// ===== Sunrise Curve =====
+// The trajectory is one shared table in lib/schedule_core, so the app previews the exact
+// same curve. Value `elapsedS` seconds into the alarm: lookup plus linear blend of neighbours
+void lookupAlarmCurve(const Alarm& alarm, long elapsedS, uint16_t& warmQ8, uint16_t& whiteQ8) {
+  sc_alarm_levels(alarm.duration_minutes, (int32_t)elapsedS, &warmQ8, &whiteQ8);
+}
+
+// ===== Fade Automation (sleep timer and dusk) =====
+// Linear Q8 interpolation of a ramp at `now` (integer only)
+uint16_t rampLevelQ8(const Ramp& ramp, unsigned long now) {
+  unsigned long elapsed = now - ramp.startMs;
+  if (ramp.durationMs == 0 || elapsed >= ramp.durationMs) {
+    return ramp.toQ8;
+  }
+  int32_t span = (int32_t)ramp.toQ8 - (int32_t)ramp.fromQ8;
+  return (uint16_t)(ramp.fromQ8 + (int32_t)(((int64_t)span * elapsed) / ramp.durationMs));
+}
+
+bool readDuskFields(JsonObject obj, DuskFade& out) {
+  return readIntField(obj, key::ID, 0, 32767, out.id) &&
+         readBoolField(obj, key::ENABLED, out.enabled) &&
+         readIntField(obj, key::START_HOUR, 0, 23, out.start_hour) &&
+         readIntField(obj, key::START_MINUTE, 0, 59, out.start_minute) &&
+         readIntField(obj, key::DURATION_MINUTES, 1, 240, out.duration_minutes);
+}
+
+void handleDuskSync(JsonDocument& doc) {
+  const char* action = doc[key::ACTION].is<const char*>() ? doc[key::ACTION].as<const char*>() : nullptr;
+  if (action == nullptr) {
+    LOGE("🌇 ERROR: Dusk sync missing action field\n");
+    sendSyncResponse(msg::DUSK_SYNC_RESPONSE, false, "Missing action for dusk sync");
+    return;
+  }
+
+  if (strcmp(action, val::UPSERT) == 0) {
+    if (!doc[key::DATA].is<JsonObject>()) {
+      sendSyncResponse(msg::DUSK_SYNC_RESPONSE, false, "Invalid dusk payload (data missing)");
+      return;
+    }
+
+    DuskFade dusk;
+    if (!readDuskFields(doc[key::DATA].as<JsonObject>(), dusk)) {
+      sendSyncResponse(msg::DUSK_SYNC_RESPONSE, false, "Invalid dusk fields");
+      return;
+    }
+
+    int index = -1;
+    for (int i = 0; i < dusk_count; i++) {
+      if (dusks[i].id == dusk.id) {
+        index = i;
+        break;
+      }
+    }
+    if (index == -1 && dusk_count < MAX_DUSKS) {
+      index = dusk_count++;
+    }
+
+    if (index >= 0) {
+      dusks[index] = dusk;
+      duskFiredYday[index] = -1;
+      LOGI("🌇 DUSK SYNC: ID=%d %s at %02d:%02d over %d min\n", dusk.id,
+           dusk.enabled ? "enabled" : "disabled", dusk.start_hour, dusk.start_minute, dusk.duration_minutes);
+      bumpScheduleGeneration();
+      sendSyncResponse(msg::DUSK_SYNC_RESPONSE, true, "Dusk synced successfully");
+    } else {
+      LOGE("🌇 ERROR: Failed to sync dusk: storage full\n");
+      sendSyncResponse(msg::DUSK_SYNC_RESPONSE, false, "Storage full");
+    }
+  }
+  else if (strcmp(action, val::DELETE) == 0) {
+    int id;
+    if (!readIntField(doc.as<JsonObject>(), key::ID, 0, 32767, id)) {
+      sendSyncResponse(msg::DUSK_SYNC_RESPONSE, false, "Invalid field: id");
+      return;
+    }
+
+    for (int i = 0; i < dusk_count; i++) {
+      if (dusks[i].id == id) {
+        for (int j = i; j < dusk_count - 1; j++) {
+          dusks[j] = dusks[j + 1];
+          duskFiredYday[j] = duskFiredYday[j + 1];
+        }
+        dusk_count--;
+        if (fadeActive && activeDuskId == id) {
+          cancelFade("dusk deleted");
+        }
+        LOGI("Dusk %d deleted\n", id);
+        bumpScheduleGeneration();
+        sendSyncResponse(msg::DUSK_SYNC_RESPONSE, true, "Dusk deleted");
+        return;
+      }
+    }
+    sendSyncResponse(msg::DUSK_SYNC_RESPONSE, false, "Dusk not found");
+  } else {
+    LOGE("🌇 ERROR: Unknown dusk action '%s'\n", action);
+    sendSyncResponse(msg::DUSK_SYNC_RESPONSE, false, "Unknown dusk action");
+  }
+}
+
+// One-shot sleep timer: {"type":"sleep_timer","action":"start","duration_minutes":30} or "cancel"
+void handleSleepTimer(JsonDocument& doc) {
+  const char* action = doc[key::ACTION].is<const char*>() ? doc[key::ACTION].as<const char*>() : "start";
+
+  if (strcmp(action, val::CANCEL) == 0) {
+    if (fadeActive && activeDuskId < 0) {
+      cancelFade(val::SOURCE_APP);
+      sendSyncResponse(msg::SLEEP_TIMER_RESPONSE, true, "Sleep timer cancelled");
+    } else {
+      sendSyncResponse(msg::SLEEP_TIMER_RESPONSE, false, "No sleep timer running");
+    }
+    return;
+  }
+
+  int durationMinutes;
+  if (!readIntField(doc.as<JsonObject>(), key::DURATION_MINUTES, 1, 240, durationMinutes)) {
+    sendSyncResponse(msg::SLEEP_TIMER_RESPONSE, false, "Invalid field: duration_minutes");
+    return;
+  }
+  if (routineActive || alarmActive) {
+    sendSyncResponse(msg::SLEEP_TIMER_RESPONSE, false, "Routine or alarm currently active");
+    return;
+  }
+  if (!startFade((unsigned long)durationMinutes * 60000UL, -1)) {
+    sendSyncResponse(msg::SLEEP_TIMER_RESPONSE, false, "Lamp is off");
+    return;
+  }
+  sendSyncResponse(msg::SLEEP_TIMER_RESPONSE, true, "Sleep timer started");
+}
+
+bool startFade(unsigned long durationMs, int duskId) {
+  if (!isOn) {
+    return false;
+  }
+
+  fadeStartBrightness = max(1, brightness);
+  fadeRamp.startMs = millis();
+  fadeRamp.durationMs = durationMs;
+  fadeRamp.fromQ8 = (uint16_t)(fadeStartBrightness << 8);
+  fadeRamp.toQ8 = 0;
+  fadeLastShown = fadeStartBrightness;
+  fadeActive = true;
+  activeDuskId = duskId;
+  setLayerState(LAYER_FADE, true, mode, fadeRamp.fromQ8);
+
+  LOGI("🌙 Fade started (%s %d): brightness %d -> off over %lu s\n",
+       duskId >= 0 ? "dusk" : "sleep timer", duskId, fadeStartBrightness, durationMs / 1000);
+  logEvent(EVT_FADE_START, duskId >= 0 ? SRC_SCHEDULE : SRC_APP, duskId, 0);
+  sendStateUpdate();
+  return true;
+}
+
+// Stop a running fade, leaving the lamp at its current level (the caller decides the output)
+void cancelFade(const char* reason) {
+  if (!fadeActive) return;
+  fadeActive = false;
+  LOGI("🌙 Fade %d cancelled (%s) at brightness %d\n", activeDuskId, reason, fadeLastShown);
+  logEvent(EVT_FADE_END, eventSourceCode(reason), activeDuskId, 0);
+  activeDuskId = -1;
+  // Hold the level the fade had reached, unless the lamp was switched off underneath it
+  if (isOn) {
+    releaseLayer(LAYER_FADE);
+  } else {
+    clearLayer(LAYER_FADE);
+  }
+}
+
+// Evaluate the running fade every loop pass; only writes PWM when the duty actually moves
+void handleRampTick() {
+  if (!fadeActive) return;
+
+  if (routineActive || alarmActive || !isOn) {
+    cancelFade(isOn ? "schedule" : "lamp off");
+    return;
+  }
+
+  unsigned long now = millis();
+  if (now - fadeRamp.startMs >= fadeRamp.durationMs) {
+    LOGI("🌙 Fade %d complete: lamp off\n", activeDuskId);
+    logEvent(EVT_FADE_END, activeDuskId >= 0 ? SRC_SCHEDULE : SRC_APP, activeDuskId, 1);
+    fadeActive = false;
+    activeDuskId = -1;
+    clearLayer(LAYER_FADE);
+    isOn = false;
+    brightness = fadeStartBrightness;   // next switch-on returns to the pre-fade level
+    applyOutput();
+    sendStateUpdate();
+    return;
+  }
+
+  uint16_t levelQ8 = rampLevelQ8(fadeRamp, now);
+  setLayerState(LAYER_FADE, true, mode, max(levelQ8, (uint16_t)1));
+
+  // Keep clients in step with the fade (reported brightness is rounded up, never 0 while on)
+  int shown = max(1, (levelQ8 + 255) >> 8);
+  if (shown != fadeLastShown) {
+    fadeLastShown = shown;
+    sendStateUpdate();
+  }
+}
+
+// Start a scheduled dusk fade once per day when its window opens; a lamp that is
+// already off is left alone. Booting mid-window fades over the remaining time.
+void checkDuskSchedule(int currentTime, int currentSecond, int yday) {
+  if (fadeActive) return;
+
+  for (int i = 0; i < dusk_count; i++) {
+    if (!dusks[i].enabled || duskFiredYday[i] == yday) continue;
+
+    int startTime = dusks[i].start_hour * 60 + dusks[i].start_minute;
+    int offset = (currentTime - startTime + 1440) % 1440;
+    if (offset >= dusks[i].duration_minutes) continue;
+
+    if (duskSuppressed && suppressedDusk.id == dusks[i].id) {
+      continue;
+    }
+
+    duskFiredYday[i] = yday;
+    unsigned long remainingMs = (unsigned long)(dusks[i].duration_minutes - offset) * 60000UL - currentSecond * 1000UL;
+    if (!startFade(remainingMs, dusks[i].id)) {
+      LOGI("🌇 Dusk %d window open but lamp already off; skipping\n", dusks[i].id);
+    }
+    return;
+  }
+}
+
+// ===== Control Mailbox =====
+// Called from the network task: record the newest requested values, last writer wins
+void postControlCommand(const lamp_protocol::ControlFrame& frame, uint32_t clientId) {
+  bool hasBrightness = frame.hasBrightness;
+  bool hasMode = frame.hasMode;
+  bool hasOn = frame.hasOn;
+  int newBrightness = constrain(frame.brightness, 0, 15);
+  int newMode = constrain(frame.mode, 0, 2);
+  bool newOn = frame.on;
+
+  portENTER_CRITICAL(&controlMailboxMux);
+  bool pending = controlMailbox.hasBrightness || controlMailbox.hasMode || controlMailbox.hasOn;
+  if (pending && controlMailbox.originClientId != clientId) {
+    controlMailbox.originClientId = 0;   // mixed writers: every client needs the result
+  } else {
+    controlMailbox.originClientId = clientId;
+  }
+  if (hasBrightness) {
+    if (controlMailbox.hasBrightness) {
+      controlCoalescedTotal++;
+      controlCoalescedWindow++;
+    }
+    controlMailbox.brightness = newBrightness;
+    controlMailbox.hasBrightness = true;
+    controlCommandsTotal++;
+  }
+  if (hasMode) {
+    if (controlMailbox.hasMode) {
+      controlCoalescedTotal++;
+      controlCoalescedWindow++;
+    }
+    controlMailbox.mode = newMode;
+    controlMailbox.hasMode = true;
+    controlCommandsTotal++;
+  }
+  if (hasOn) {
+    if (controlMailbox.hasOn) {
+      controlCoalescedTotal++;
+      controlCoalescedWindow++;
+    }
+    controlMailbox.on = newOn;
+    controlMailbox.hasOn = true;
+    controlCommandsTotal++;
+  }
+  portEXIT_CRITICAL(&controlMailboxMux);
+}
+
+// Apply the newest mailbox values once per CONTROL_TICK_MS and roll the coalescing rate
+void IRAM_ATTR handleControlTick() {
+  unsigned long now = uptimeMs();
+  if (now - lastControlTick < CONTROL_TICK_MS) {
+    return;
+  }
+  lastControlTick = now;
+  uint32_t started = esp_cpu_get_ccount();
+
+  ControlMailbox cmd;
+  portENTER_CRITICAL(&controlMailboxMux);
+  cmd = controlMailbox;
+  controlMailbox = {};
+  if (now - controlWindowStart >= 1000) {
+    controlCoalescedPerSecond = controlCoalescedWindow;
+    controlCoalescedWindow = 0;
+    controlWindowStart = now;
+  }
+  portEXIT_CRITICAL(&controlMailboxMux);
+
+  if (!cmd.hasBrightness && !cmd.hasMode && !cmd.hasOn) {
+    return;
+  }
+
+  if (streamActive && (cmd.hasBrightness || cmd.hasOn)) {
+    stopStream(false, "direct control");   // a plain command supersedes the stream
+  }
+
+  // App input that changes what a routine or alarm is showing takes the lamp back from it
+  // until the next schedule transition, like a knob override; otherwise the schedule
+  // layers would keep masking the manual layer and the command would appear to do nothing
+  bool routineWasActive = routineActive;
+  bool alarmWasActive = alarmActive;
+  if (routineWasActive || alarmWasActive) {
+    ComposedOutput shown;
+    composeLayers(shown);
+    if ((cmd.hasBrightness && cmd.brightness != shown.brightness) ||
+        (cmd.hasMode && (Mode)cmd.mode != shown.mode) || (cmd.hasOn && cmd.on != shown.isOn)) {
+      suppressActiveSchedule(val::SOURCE_APP);
+    } else {
+      routineWasActive = alarmWasActive = false;
+    }
+  }
+  bool scheduleOverridden = routineWasActive || alarmWasActive;
+
+  bool stateChanged = false;
+  if (cmd.hasBrightness) {
+    // If lamp is on, enforce minimum brightness of 1
+    int newBrightness = (isOn && cmd.brightness < 1) ? 1 : cmd.brightness;
+    if (newBrightness != brightness) {
+      brightness = newBrightness;
+      stateChanged = true;
+    }
+  }
+  if (cmd.hasMode && (Mode)cmd.mode != mode) {
+    mode = (Mode)cmd.mode;
+    stateChanged = true;
+  }
+  if (cmd.hasOn && cmd.on != isOn) {
+    isOn = cmd.on;
+    stateChanged = true;
+  }
+
+  if (stateChanged || scheduleOverridden) {
+    if (fadeActive) {
+      cancelFade("app control");   // an explicit app change takes the lamp back from the fade
+    }
+    applyOutput();
+    controlAppliedTotal++;
+  }
+  recordCycles(cyclesControlTick, started);   // logging and the broadcast are not hot path
+
+  if (scheduleOverridden) {
+    LOGI("App control overrode the active %s\n", routineWasActive ? "routine" : "alarm");
+    broadcastOverrideEvent(val::SOURCE_APP, routineWasActive, alarmWasActive, false, false);
+    logEvent(EVT_OVERRIDE, SRC_APP, -1, (routineWasActive ? 0x01 : 0) | (alarmWasActive ? 0x02 : 0));
+  }
+  if (stateChanged || scheduleOverridden) {
+    LOGD("WebSocket: brightness=%d mode=%d isOn=%s (client #%u)\n",
+         brightness, (int)mode, isOn ? "ON" : "OFF", cmd.originClientId);
+    // The originator already shows what it asked for, unless the composite differs (a
+    // layer above the manual one, or the minimum-brightness clamp); then it needs it too
+    ComposedOutput result;
+    composeLayers(result);
+    bool asRequested = (!cmd.hasBrightness || cmd.brightness == result.brightness) &&
+                       (!cmd.hasMode || (Mode)cmd.mode == result.mode) &&
+                       (!cmd.hasOn || cmd.on == result.isOn);
+    broadcastState(asRequested ? cmd.originClientId : 0);
+  }
+}
+
+// ===== Metrics =====
+// Runtime counters for diagnosing throughput; served over WS and GET /metrics
+void buildMetricsReport(JsonDocument& out) {
+  out[key::TYPE] = msg::METRICS;
+  out[key::UPTIME_MS] = millis();
+
+  JsonObject control = out[key::CONTROL].to<JsonObject>();
+  portENTER_CRITICAL(&controlMailboxMux);
+  control[key::COMMANDS] = controlCommandsTotal;
+  control[key::COALESCED] = controlCoalescedTotal;
+  control[key::COALESCED_PER_S] = controlCoalescedPerSecond;
+  portEXIT_CRITICAL(&controlMailboxMux);
+  control[key::APPLIED] = controlAppliedTotal;
+  control[key::FAST_FRAMES] = controlFastFrames;
+  control[key::PARSED_FRAMES] = controlParsedFrames;
+  control[key::TICK_MS] = CONTROL_TICK_MS;
+
+  JsonObject compositor = out[key::COMPOSITOR].to<JsonObject>();
+  compositor[key::RENDERS] = compositorRenders;
+  JsonArray active = compositor[key::LAYERS].to<JsonArray>();
+  for (uint8_t i = 0; i < LAYER_COUNT; i++) {
+    if (layers[i].active) active.add(i);
+  }
+
+  JsonObject stream = out[key::STREAM].to<JsonObject>();
+  stream[key::ACTIVE] = streamActive;
+  stream[key::DELAY_MS] = streamDelayMs;
+  portENTER_CRITICAL(&streamMux);
+  stream[key::BUFFERED] = streamCount;
+  stream[key::SAMPLES] = streamSamplesTotal;
+  stream[key::LATE] = streamLateSamples;
+  stream[key::DROPPED] = streamDroppedSamples;
+  stream[key::UNDERRUNS] = streamUnderruns;
+  portEXIT_CRITICAL(&streamMux);
+
+  JsonObject hotPath = out[key::HOT_PATH].to<JsonObject>();
+  hotPath[key::CPU_MHZ] = ESP.getCpuFreqMHz();
+  hotPath[key::FLASH_WRITES] = flashWrites;
+  portENTER_CRITICAL(&encoderMux);
+  CycleStat encoderIsr = cyclesEncoderIsr;
+  portEXIT_CRITICAL(&encoderMux);
+  addCycleStat(hotPath[key::ENCODER_ISR].to<JsonObject>(), encoderIsr);
+  addCycleStat(hotPath[key::CONTROL_TICK].to<JsonObject>(), cyclesControlTick);
+  addCycleStat(hotPath[key::RENDER].to<JsonObject>(), cyclesRender);
+
+  fillTaskStats(out[key::TASKS].to<JsonObject>());
+  fillHeapStats(out[key::HEAP].to<JsonObject>());
+
+  JsonObject websocket = out[key::WEBSOCKET].to<JsonObject>();
+  websocket[key::SLOTS] = WS_CLIENT_SLOTS;
+  websocket[key::CONNECTED] = wsSlotsInUse();
+  websocket[key::REJECTED] = wsRejectedClients;
+  websocket[key::RX_OVERFLOWS] = wsRxOverflows;
+  websocket[key::RX_BUFFER] = WS_RX_BUFFER_SIZE;
+  websocket[key::QUEUE_LIMIT] = WS_MAX_QUEUED_MESSAGES;
+  websocket[key::PINGS] = wsPingsSent;
+  websocket[key::DEAD_PEERS] = wsDeadPeers;
+}
+
+// Hot path timings are reported in CPU cycles; divide by cpu_mhz for microseconds
+void addCycleStat(JsonObject obj, const CycleStat& stat) {
+  obj[key::SAMPLES] = stat.samples;
+  obj[key::LAST_CYCLES] = stat.last;
+  obj[key::MAX_CYCLES] = stat.max;
+  obj[key::MAX_FLASH_CYCLES] = stat.maxFlash;
+}
+
+void handleMetricsRequest(AsyncWebSocketClient* client) {
+  JsonDocument report(&wsTxJson);
+  buildMetricsReport(report);
+  JsonText jsonText(report);
+  client->text(jsonText.c_str(), jsonText.length());
+}
+
+// GET /metrics
+void handleMetricsHttpRequest(AsyncWebServerRequest* request) {
+  JsonDocument report(&httpJson);
+  buildMetricsReport(report);
+  String jsonString;
+  serializeJson(report, jsonString);
+  request->send(200, "application/json", jsonString);
+}
+
+// ===== Task Statistics =====
+void sampleTaskStats() {
+  unsigned long now = millis();
+  if (now - lastTaskStatsMs < TASK_STATS_INTERVAL_MS) {
+    return;
+  }
+  lastTaskStatsMs = now;
+
+#if configUSE_TRACE_FACILITY
+  static TaskStatus_t status[TASK_STATS_MAX];
+  uint32_t totalRunTime = 0;
+  UBaseType_t count = uxTaskGetSystemState(status, TASK_STATS_MAX, &totalRunTime);
+  if (count == 0) {
+    // The table is too small for the current task list; keep the previous sample
+    taskStatsTruncated = true;
+    return;
+  }
+
+  uint32_t elapsed = totalRunTime - taskStatsRunTime;
+  TaskStat previous[TASK_STATS_MAX];
+  portENTER_CRITICAL(&taskStatsMux);
+  uint8_t previousCount = taskStatCount;
+  memcpy(previous, taskStats, sizeof(TaskStat) * previousCount);
+  for (UBaseType_t i = 0; i < count; i++) {
+    TaskStat& stat = taskStats[i];
+    strncpy(stat.name, status[i].pcTaskName, sizeof(stat.name) - 1);
+    stat.name[sizeof(stat.name) - 1] = '\0';
+    stat.handle = status[i].xHandle;
+    stat.state = (uint8_t)status[i].eCurrentState;
+    stat.priority = (uint8_t)status[i].uxCurrentPriority;
+    stat.stackFree = status[i].usStackHighWaterMark;
+    stat.runTime = status[i].ulRunTimeCounter;
+    stat.cpuPermille = 0;
+#if configGENERATE_RUN_TIME_STATS
+    for (uint8_t j = 0; j < previousCount; j++) {
+      // Tasks new since the last sample get a share from the next interval on
+      if (previous[j].handle == stat.handle && elapsed > 0) {
+        stat.cpuPermille = (uint16_t)(((uint64_t)(stat.runTime - previous[j].runTime) * 1000) / elapsed);
+        break;
+      }
+    }
+#endif
+  }
+  taskStatCount = (uint8_t)count;
+  taskStatsTruncated = false;
+  portEXIT_CRITICAL(&taskStatsMux);
+  taskStatsRunTime = totalRunTime;
+#endif
+}
+
+void fillTaskStats(JsonObject obj) {
+  obj[key::INTERVAL_MS] = TASK_STATS_INTERVAL_MS;
+#if configGENERATE_RUN_TIME_STATS
+  obj[key::RUN_TIME_STATS] = true;
+#else
+  obj[key::RUN_TIME_STATS] = false;
+#endif
+  obj[key::TRUNCATED] = taskStatsTruncated;
+  JsonArray entries = obj[key::ENTRIES].to<JsonArray>();
+  for (uint8_t i = 0; i < TASK_STATS_MAX; i++) {
+    portENTER_CRITICAL(&taskStatsMux);
+    bool present = i < taskStatCount;
+    TaskStat stat = present ? taskStats[i] : TaskStat();
+    portEXIT_CRITICAL(&taskStatsMux);
+    if (!present) break;
+
+    JsonObject entry = entries.add<JsonObject>();
+    entry[key::NAME] = stat.name;
+    entry[key::STATE] = stat.state;
+    entry[key::PRIORITY] = stat.priority;
+    entry[key::STACK_FREE] = stat.stackFree;
+    entry[key::CPU_PERMILLE] = stat.cpuPermille;
+  }
+}
+
+void handleTaskStatsRequest(AsyncWebSocketClient* client) {
+  JsonDocument report(&wsTxJson);
+  report[key::TYPE] = msg::TASK_STATS;
+  fillTaskStats(report[key::TASKS].to<JsonObject>());
+  JsonText jsonText(report);
+  client->text(jsonText.c_str(), jsonText.length());
+}
+
+// ===== Log Streaming =====
+// Called by LOG_AT only while logStreamLevel admits the record; any task may log
+void logToRing(uint8_t level, const char* origin, const char* format, ...) {
+  char text[LOG_RECORD_TEXT];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  size_t length = strlen(text);
+  if (length > 0 && text[length - 1] == '\n') {
+    text[length - 1] = '\0';              // records are lines already
+  }
+
+  portENTER_CRITICAL(&logRingMux);
+  LogRecord& record = logRing[logNextSeq % LOG_RING_DEPTH];
+  record.seq = logNextSeq++;
+  record.uptimeMs = millis();
+  record.level = level;
+  record.origin = origin;
+  memcpy(record.text, text, sizeof(text));
+  portEXIT_CRITICAL(&logRingMux);
+}
+
+// The most verbose level any subscriber wants; LOG_AT skips the ring below it
+void updateLogStreamLevel() {
+  uint8_t level = LOG_LEVEL_NONE;
+  portENTER_CRITICAL(&wsSlotsMux);
+  for (uint8_t i = 0; i < WS_CLIENT_SLOTS; i++) {
+    if (wsSlots[i].clientId != 0 && wsSlots[i].logFilterLevel > level) {
+      level = wsSlots[i].logFilterLevel;
+    }
+  }
+  portEXIT_CRITICAL(&wsSlotsMux);
+  logStreamLevel = min(level, (uint8_t)LAMP_LOG_LEVEL);
+}
+
+// {"type":"log_subscribe","level":4,"module":"Stream"}: stream matching records to this
+// client, starting with whatever the ring still holds; level 0 unsubscribes
+void handleLogSubscribe(AsyncWebSocketClient* client, JsonDocument& doc) {
+  int level;
+  if (!readIntField(doc.as<JsonObject>(), key::LEVEL, LOG_LEVEL_NONE, LOG_LEVEL_DEBUG, level)) {
+    sendSyncResponse(msg::LOG_SUBSCRIBE_RESPONSE, false, "Invalid field: level");
+    return;
+  }
+  WsClientSlot* slot = findWsSlot(client->id());
+  if (slot == nullptr) {
+    return;
+  }
+  const char* module = doc[key::MODULE].is<const char*>() ? doc[key::MODULE].as<const char*>() : "";
+
+  portENTER_CRITICAL(&logRingMux);
+  uint32_t oldest = logNextSeq > LOG_RING_DEPTH ? logNextSeq - LOG_RING_DEPTH : 1;
+  portEXIT_CRITICAL(&logRingMux);
+  portENTER_CRITICAL(&wsSlotsMux);
+  slot->logFilterLevel = (uint8_t)level;
+  strncpy(slot->logFilterModule, module, LOG_MODULE_MAX - 1);
+  slot->logFilterModule[LOG_MODULE_MAX - 1] = '\0';
+  slot->logCursor = oldest;
+  portEXIT_CRITICAL(&wsSlotsMux);
+  updateLogStreamLevel();
+
+  sendSyncResponse(msg::LOG_SUBSCRIBE_RESPONSE, true, level > LOG_LEVEL_NONE ? "Log stream started" : "Log stream stopped");
+}
+
+// Send each subscriber the records it has not seen yet, at most LOG_BATCH_MAX per frame.
+// Records overwritten before a subscriber caught up are reported as "dropped".
+void serviceLogStream() {
+  if (logStreamLevel == LOG_LEVEL_NONE) {
+    return;
+  }
+  unsigned long now = millis();
+  if (now - lastLogStreamMs < LOG_STREAM_INTERVAL_MS) {
+    return;
+  }
+  lastLogStreamMs = now;
+
+  for (uint8_t i = 0; i < WS_CLIENT_SLOTS; i++) {
+    portENTER_CRITICAL(&wsSlotsMux);
+    uint32_t clientId = wsSlots[i].clientId;
+    uint8_t level = wsSlots[i].logFilterLevel;
+    uint32_t cursor = wsSlots[i].logCursor;
+    char module[LOG_MODULE_MAX];
+    memcpy(module, wsSlots[i].logFilterModule, sizeof(module));
+    portEXIT_CRITICAL(&wsSlotsMux);
+    if (clientId == 0 || level == LOG_LEVEL_NONE) continue;
+
+    AsyncWebSocketClient* client = ws.client(clientId);
+    if (client == nullptr || client->queueIsFull()) continue;   // catch up on a later pass
+
+    // Unfiltered records are copied into the free tail of the batch under the lock and
+    // filtered after it, so the strstr never runs with interrupts masked; repeated until
+    // the batch is full, the subscriber has caught up or a ring's worth has been scanned
+    LogRecord batch[LOG_BATCH_MAX];
+    uint8_t count = 0;
+    uint32_t dropped = 0;
+    uint16_t scanned = 0;
+    bool pending = true;
+    while (pending && count < LOG_BATCH_MAX && scanned < LOG_RING_DEPTH) {
+      uint8_t end = count;
+      portENTER_CRITICAL(&logRingMux);
+      uint32_t oldest = logNextSeq > LOG_RING_DEPTH ? logNextSeq - LOG_RING_DEPTH : 1;
+      if (cursor < oldest) {
+        dropped += oldest - cursor;
+        cursor = oldest;
+      }
+      while (cursor < logNextSeq && end < LOG_BATCH_MAX) {
+        batch[end++] = logRing[cursor % LOG_RING_DEPTH];
+        cursor++;
+      }
+      pending = cursor < logNextSeq;
+      portEXIT_CRITICAL(&logRingMux);
+      scanned += end - count;
+
+      for (uint8_t r = count; r < end; r++) {
+        if (batch[r].level > level) continue;
+        if (module[0] != '\0' && strstr(batch[r].origin, module) == nullptr) continue;
+        if (r != count) {
+          batch[count] = batch[r];
+        }
+        count++;
+      }
+    }
+
+    portENTER_CRITICAL(&wsSlotsMux);
+    if (wsSlots[i].clientId == clientId) {
+      wsSlots[i].logCursor = cursor;
+    }
+    portEXIT_CRITICAL(&wsSlotsMux);
+    if (count == 0 && dropped == 0) continue;
+
+    // Records are [seq, uptime_ms, level, origin, text]
+    JsonDocument doc(&wsTxJson);
+    doc[key::TYPE] = msg::LOG;
+    doc[key::DROPPED] = dropped;
+    JsonArray records = doc[key::RECORDS].to<JsonArray>();
+    for (uint8_t r = 0; r < count; r++) {
+      JsonArray entry = records.add<JsonArray>();
+      entry.add(batch[r].seq);
+      entry.add(batch[r].uptimeMs);
+      entry.add(batch[r].level);
+      entry.add(batch[r].origin);
+      entry.add(batch[r].text);
+    }
+    JsonText jsonText(doc);
+    client->text(jsonText.c_str(), jsonText.length());
+  }
+}
+
+// ===== Runtime Tunables =====
+uint32_t readTunable(const Tunables& t, const TunableDef& def) {
+  const uint8_t* field = reinterpret_cast<const uint8_t*>(&t) + def.offset;
+  switch (def.width) {
+    case TUNABLE_U8:  return *field;
+    case TUNABLE_U16: return *reinterpret_cast<const uint16_t*>(field);
+    default:          return *reinterpret_cast<const uint32_t*>(field);
+  }
+}
+
+void writeTunable(Tunables& t, const TunableDef& def, uint32_t value) {
+  uint8_t* field = reinterpret_cast<uint8_t*>(&t) + def.offset;
+  switch (def.width) {
+    case TUNABLE_U8:  *field = (uint8_t)value; break;
+    case TUNABLE_U16: *reinterpret_cast<uint16_t*>(field) = (uint16_t)value; break;
+    default:          *reinterpret_cast<uint32_t*>(field) = value; break;
+  }
+}
+
+const TunableDef* findTunable(const char* name) {
+  for (uint8_t i = 0; i < TUNABLE_COUNT; i++) {
+    if (strcmp(TUNABLE_DEFS[i].name, name) == 0) {
+      return &TUNABLE_DEFS[i];
+    }
+  }
+  return nullptr;
+}
+
+bool pwmConfigValid(uint32_t frequencyHz, uint8_t bits) {
+  return ((uint64_t)frequencyHz << bits) <= PWM_SOURCE_CLOCK_HZ;
+}
+
+// Stored values replace the defaults; anything out of range is ignored
+void initTunables() {
+  tunablesPrefs.begin("tunables", false);
+  for (uint8_t i = 0; i < TUNABLE_COUNT; i++) {
+    const TunableDef& def = TUNABLE_DEFS[i];
+    uint32_t value = tunablesPrefs.getUInt(def.name, def.defaultValue);
+    if (value < def.minValue || value > def.maxValue) {
+      LOGW("Tunable %s = %u out of range; using %u\n", def.name, value, def.defaultValue);
+      value = def.defaultValue;
+    }
+    writeTunable(tunables, def, value);
+  }
+  if (!pwmConfigValid(tunables.pwmFrequencyHz, tunables.pwmResolutionBits)) {
+    LOGW("Stored PWM %u Hz x %u bits exceeds the LEDC clock; using defaults\n",
+         tunables.pwmFrequencyHz, tunables.pwmResolutionBits);
+    tunables.pwmFrequencyHz = PWM_FREQUENCY_HZ;
+    tunables.pwmResolutionBits = PWM_RESOLUTION_BITS;
+  }
+}
+
+// (Re)configure both LEDC timers. Duty integrated so far is folded into the energy bucket
+// on the old scale first; called from setup and from the compositor after a change.
+void configurePwm() {
+  portENTER_CRITICAL(&tunablesMux);
+  uint32_t frequencyHz = tunables.pwmFrequencyHz;
+  uint8_t bits = tunables.pwmResolutionBits;
+  portEXIT_CRITICAL(&tunablesMux);
+
+  foldEnergyAccumulators();
+  portENTER_CRITICAL(&energyMux);
+  pwmMaxDuty = (1 << bits) - 1;
+  energyDutyAcc[0] = 0;                  // sub-ms remainders on the old scale
+  energyDutyAcc[1] = 0;
+  portEXIT_CRITICAL(&energyMux);
+
+  for (uint8_t channel = 0; channel < 2; channel++) {
+    if (ledcSetup(channel, frequencyHz, bits) == 0) {
+      LOGE("PWM channel %u rejected %u Hz x %u bits\n", channel, frequencyHz, bits);
+    }
+  }
+  LOGI("PWM: %u Hz, %u-bit duty\n", frequencyHz, bits);
+}
+
+// Validate every entry first and apply them together, so one bad value changes nothing.
+// Set requests arrive on the AsyncTCP task; the loop sees each field change atomically.
+bool applyTunables(JsonObject values, char* error, size_t errorSize) {
+  Tunables next;
+  portENTER_CRITICAL(&tunablesMux);
+  next = tunables;
+  portEXIT_CRITICAL(&tunablesMux);
+
+  uint32_t changed = 0;                  // bit per TUNABLE_DEFS entry
+  for (JsonPair entry : values) {
+    const TunableDef* def = findTunable(entry.key().c_str());
+    int value;
+    if (def == nullptr || !readIntField(values, def->name, (int)def->minValue, (int)def->maxValue, value)) {
+      snprintf(error, errorSize, "Invalid tunable: %s", entry.key().c_str());
+      return false;
+    }
+    writeTunable(next, *def, (uint32_t)value);
+    changed |= 1UL << (def - TUNABLE_DEFS);
+  }
+  if (!pwmConfigValid(next.pwmFrequencyHz, next.pwmResolutionBits)) {
+    snprintf(error, errorSize, "Invalid tunable: %u Hz x %u bits exceeds the PWM clock",
+             next.pwmFrequencyHz, next.pwmResolutionBits);
+    return false;
+  }
+  commitTunables(next, changed);
+  return true;
+}
+
+// Publish a validated set and persist the entries flagged in `changed`
+void commitTunables(const Tunables& next, uint32_t changed) {
+  portENTER_CRITICAL(&tunablesMux);
+  bool pwmChanged = next.pwmFrequencyHz != tunables.pwmFrequencyHz ||
+                    next.pwmResolutionBits != tunables.pwmResolutionBits;
+  tunables = next;
+  portEXIT_CRITICAL(&tunablesMux);
+  if (pwmChanged) {
+    pwmReconfigurePending = true;
+    compositorDirty = true;
+  }
+
+  beginFlashWrite();
+  for (uint8_t i = 0; i < TUNABLE_COUNT; i++) {
+    if (changed & (1UL << i)) {
+      tunablesPrefs.putUInt(TUNABLE_DEFS[i].name, readTunable(next, TUNABLE_DEFS[i]));
+    }
+  }
+  endFlashWrite();
+  LOGI("Tunables updated (%u values)\n", __builtin_popcount(changed));
+}
+
+void buildTunablesReport(JsonDocument& doc) {
+  JsonArray entries = doc[key::ENTRIES].to<JsonArray>();
+  for (uint8_t i = 0; i < TUNABLE_COUNT; i++) {
+    const TunableDef& def = TUNABLE_DEFS[i];
+    JsonObject entry = entries.add<JsonObject>();
+    entry[key::NAME] = def.name;
+    entry[key::VALUE] = readTunable(tunables, def);
+    entry[key::MIN_VALUE] = def.minValue;
+    entry[key::MAX_VALUE] = def.maxValue;
+    entry[key::DEFAULT_VALUE] = def.defaultValue;
+  }
+}
+
+// {"type":"tunables_request"} -> {"type":"tunables","entries":[{"name","value","min","max","default"}]}
+void handleTunablesRequest(AsyncWebSocketClient* client) {
+  JsonDocument doc(&wsTxJson);
+  doc[key::TYPE] = msg::TUNABLES;
+  buildTunablesReport(doc);
+  JsonText jsonText(doc);
+  client->text(jsonText.c_str(), jsonText.length());
+}
+
+// {"type":"tunables_set","values":{"debounce_ms":40}}; the new values go to every client
+void handleTunablesSet(JsonDocument& doc) {
+  JsonObject values = doc[key::VALUES];
+  if (values.isNull()) {
+    sendSyncResponse(msg::TUNABLES_SET_RESPONSE, false, "Invalid field: values");
+    return;
+  }
+  char error[64];
+  if (!applyTunables(values, error, sizeof(error))) {
+    sendSyncResponse(msg::TUNABLES_SET_RESPONSE, false, error);
+    return;
+  }
+  sendSyncResponse(msg::TUNABLES_SET_RESPONSE, true, "Tunables updated");
+
+  JsonDocument report(&wsTxJson);
+  report[key::TYPE] = msg::TUNABLES;
+  buildTunablesReport(report);
+  JsonText jsonText(report);
+  ws.textAll(jsonText.c_str(), jsonText.length());
+}
+
+void handleTunablesHttpGet(AsyncWebServerRequest* request) {
+  JsonDocument report(&httpJson);
+  buildTunablesReport(report);
+  String jsonString;
+  serializeJson(report, jsonString);
+  request->send(200, "application/json", jsonString);
+}
+
+// POST /tunables?debounce_ms=40&pwm_freq_hz=2000 (query or form parameters)
+void handleTunablesHttpSet(AsyncWebServerRequest* request) {
+  JsonDocument values(&httpJson);
+  for (size_t i = 0; i < request->params(); i++) {
+    const AsyncWebParameter* param = request->getParam(i);
+    const char* text = param->value().c_str();
+    char* end;
+    long value = strtol(text, &end, 10);
+    if (*text != '\0' && *end == '\0') {
+      values[param->name()] = value;
+    } else {
+      values[param->name()] = text;        // rejected by the range check below
+    }
+  }
+
+  char error[64];
+  if (!applyTunables(values.as<JsonObject>(), error, sizeof(error))) {
+    sendHttpResult(request, 400, false, error);
+    return;
+  }
+  handleTunablesHttpGet(request);
+}
+
+void sendHttpResult(AsyncWebServerRequest* request, int code, bool success, const char* message) {
+  JsonDocument response(&httpJson);
+  response[key::SUCCESS] = success;
+  response[key::MESSAGE] = message;
+  String jsonString;
+  serializeJson(response, jsonString);
+  request->send(code, "application/json", jsonString);
+}
+
+// ===== Configuration Snapshot =====
+void ByteWriter::u8(uint8_t value) {
+  if (length + 1 > capacity) {
+    overflow = true;
+    return;
+  }
+  data[length++] = value;
+}
+
+void ByteWriter::u16(uint16_t value) {
+  u8((uint8_t)value);
+  u8((uint8_t)(value >> 8));
+}
+
+void ByteWriter::u32(uint32_t value) {
+  u16((uint16_t)value);
+  u16((uint16_t)(value >> 16));
+}
+
+uint8_t ByteReader::u8() {
+  if (pos + 1 > length) {
+    error = true;
+    return 0;
+  }
+  return data[pos++];
+}
+
+uint16_t ByteReader::u16() {
+  uint16_t low = u8();
+  return low | (uint16_t)(u8() << 8);
 }
 
-void sendSyncResponse(const char* type, bool success, const char* message) {
-  JsonDocument doc;
-  doc["type"] = type;
-  doc["success"] = success;
-  doc["message"] = message;
-  
-  String jsonString;
-  serializeJson(doc, jsonString);
-  ws.textAll(jsonString);
-  
-  Serial.printf("Sent sync response: %s\n", jsonString.c_str());
+uint32_t ByteReader::u32() {
+  uint32_t low = u16();
+  return low | ((uint32_t)u16() << 16);
 }
 
-bool isManualControlLocked() {
-  if (WiFi.status() != WL_CONNECTED) {
-    return false;
+// Reads a field and range-checks it; the first failure sticks in `error`
+uint32_t readSnapshotField(ByteReader& in, uint8_t width, uint32_t minValue, uint32_t maxValue) {
+  uint32_t value = width == 1 ? in.u8() : (width == 2 ? in.u16() : in.u32());
+  if (value < minValue || value > maxValue) {
+    in.error = true;
   }
-  return (routineActive || alarmActive || sunSyncActive);
+  return value;
 }
 
-Routine* findRoutineById(int id) {
-  if (id < 0) return nullptr;
+// Serialise the live configuration; returns the blob length, 0 if `capacity` is too small
+size_t encodeSnapshot(uint8_t* out, size_t capacity) {
+  ByteWriter w = {out, capacity, SNAPSHOT_HEADER_SIZE, capacity < SNAPSHOT_HEADER_SIZE};
+
+  w.u8((uint8_t)routine_count);
   for (int i = 0; i < routine_count; i++) {
-    if (routines[i].id == id) {
-      return &routines[i];
-    }
+    const Routine& r = routines[i];
+    w.u16((uint16_t)r.id);
+    w.u8((uint8_t)((r.enabled ? 1 : 0) | (r.mode << 1)));
+    w.u16((uint16_t)(r.start_hour * 60 + r.start_minute));
+    w.u16((uint16_t)(r.end_hour * 60 + r.end_minute));
+    w.u8((uint8_t)r.brightness);
   }
-  return nullptr;
+  w.u8((uint8_t)alarm_count);
+  for (int i = 0; i < alarm_count; i++) {
+    const Alarm& a = alarms[i];
+    w.u16((uint16_t)a.id);
+    w.u8(a.enabled ? 1 : 0);
+    w.u16((uint16_t)(a.wake_hour * 60 + a.wake_minute));
+    w.u16((uint16_t)(a.start_hour * 60 + a.start_minute));
+    w.u8((uint8_t)a.duration_minutes);
+  }
+  w.u8((uint8_t)dusk_count);
+  for (int i = 0; i < dusk_count; i++) {
+    const DuskFade& d = dusks[i];
+    w.u16((uint16_t)d.id);
+    w.u8(d.enabled ? 1 : 0);
+    w.u16((uint16_t)(d.start_hour * 60 + d.start_minute));
+    w.u8((uint8_t)d.duration_minutes);
+  }
+
+  size_t tzLength = strlen(timezone);
+  w.u8((uint8_t)tzLength);
+  for (size_t i = 0; i < tzLength; i++) {
+    w.u8((uint8_t)timezone[i]);
+  }
+
+  w.u8(TUNABLE_COUNT);
+  for (uint8_t i = 0; i < TUNABLE_COUNT; i++) {
+    w.u32(readTunable(tunables, TUNABLE_DEFS[i]));
+  }
+
+  if (w.overflow) {
+    return 0;
+  }
+  uint16_t payloadLength = (uint16_t)(w.length - SNAPSHOT_HEADER_SIZE);
+  ByteWriter header = {out, SNAPSHOT_HEADER_SIZE, 0, false};
+  for (uint8_t i = 0; i < 4; i++) {
+    header.u8((uint8_t)SNAPSHOT_MAGIC[i]);
+  }
+  header.u8(SNAPSHOT_VERSION);
+  header.u8(0);                          // reserved
+  header.u16(payloadLength);
+  header.u32(esp_rom_crc32_le(0, out + SNAPSHOT_HEADER_SIZE, payloadLength));
+  return w.length;
 }
 
-Alarm* findAlarmById(int id) {
-  if (id < 0) return nullptr;
-  for (int i = 0; i < alarm_count; i++) {
-    if (alarms[i].id == id) {
-      return &alarms[i];
+// Check and decode a blob into `out` without touching the live configuration
+bool decodeSnapshot(const uint8_t* blob, size_t length, ConfigSnapshot& out, const char*& error) {
+  ByteReader in = {blob, length, 0, false};
+  for (uint8_t i = 0; i < 4; i++) {
+    if (in.u8() != (uint8_t)SNAPSHOT_MAGIC[i]) {
+      error = "Not a configuration snapshot";
+      return false;
     }
   }
-  return nullptr;
+  if (in.u8() != SNAPSHOT_VERSION) {
+    error = "Unsupported snapshot version";
+    return false;
+  }
+  in.u8();                               // reserved
+  uint16_t payloadLength = in.u16();
+  uint32_t crc = in.u32();
+  if (in.error || SNAPSHOT_HEADER_SIZE + payloadLength != length) {
+    error = "Snapshot length mismatch";
+    return false;
+  }
+  if (esp_rom_crc32_le(0, blob + SNAPSHOT_HEADER_SIZE, payloadLength) != crc) {
+    error = "Snapshot CRC mismatch";
+    return false;
+  }
+
+  out.routineCount = readSnapshotField(in, 1, 0, MAX_ROUTINES);
+  for (int i = 0; i < out.routineCount && !in.error; i++) {
+    Routine& r = out.routines[i];
+    r.id = readSnapshotField(in, 2, 0, 32767);
+    uint8_t flags = readSnapshotField(in, 1, 0, 5);   // bit 0 enabled, bits 1-2 mode
+    uint16_t start = readSnapshotField(in, 2, 0, SC_MINUTES_PER_DAY - 1);
+    uint16_t end = readSnapshotField(in, 2, 0, SC_MINUTES_PER_DAY - 1);
+    r.brightness = readSnapshotField(in, 1, 0, 15);
+    r.enabled = flags & 1;
+    r.mode = flags >> 1;
+    r.start_hour = start / 60;
+    r.start_minute = start % 60;
+    r.end_hour = end / 60;
+    r.end_minute = end % 60;
+  }
+  out.alarmCount = readSnapshotField(in, 1, 0, MAX_ALARMS);
+  for (int i = 0; i < out.alarmCount && !in.error; i++) {
+    Alarm& a = out.alarms[i];
+    a.id = readSnapshotField(in, 2, 0, 32767);
+    a.enabled = readSnapshotField(in, 1, 0, 1);
+    uint16_t wake = readSnapshotField(in, 2, 0, SC_MINUTES_PER_DAY - 1);
+    uint16_t start = readSnapshotField(in, 2, 0, SC_MINUTES_PER_DAY - 1);
+    a.duration_minutes = readSnapshotField(in, 1, 1, 240);
+    a.wake_hour = wake / 60;
+    a.wake_minute = wake % 60;
+    a.start_hour = start / 60;
+    a.start_minute = start % 60;
+  }
+  out.duskCount = readSnapshotField(in, 1, 0, MAX_DUSKS);
+  for (int i = 0; i < out.duskCount && !in.error; i++) {
+    DuskFade& d = out.dusks[i];
+    d.id = readSnapshotField(in, 2, 0, 32767);
+    d.enabled = readSnapshotField(in, 1, 0, 1);
+    uint16_t start = readSnapshotField(in, 2, 0, SC_MINUTES_PER_DAY - 1);
+    d.duration_minutes = readSnapshotField(in, 1, 1, 240);
+    d.start_hour = start / 60;
+    d.start_minute = start % 60;
+  }
+
+  uint8_t tzLength = readSnapshotField(in, 1, 1, TIMEZONE_MAX_LEN - 1);
+  for (uint8_t i = 0; i < tzLength && !in.error; i++) {
+    out.timezone[i] = (char)readSnapshotField(in, 1, 0x20, 0x7e);
+  }
+  out.timezone[in.error ? 0 : tzLength] = '\0';
+
+  // Entries follow TUNABLE_DEFS order; newer firmware's extra entries are skipped
+  out.tunables = tunables;
+  out.tunablesChanged = 0;
+  uint8_t tunableCount = in.u8();
+  for (uint8_t i = 0; i < tunableCount && !in.error; i++) {
+    if (i >= TUNABLE_COUNT) {
+      in.u32();
+      continue;
+    }
+    const TunableDef& def = TUNABLE_DEFS[i];
+    uint32_t value = readSnapshotField(in, 4, def.minValue, def.maxValue);
+    if (value != readTunable(out.tunables, def)) {
+      writeTunable(out.tunables, def, value);
+      out.tunablesChanged |= 1UL << i;
+    }
+  }
+
+  if (in.error || in.pos != length) {
+    error = "Invalid snapshot contents";
+    return false;
+  }
+  if (!pwmConfigValid(out.tunables.pwmFrequencyHz, out.tunables.pwmResolutionBits)) {
+    error = "Invalid snapshot PWM settings";
+    return false;
+  }
+  return true;
 }
 
-bool isWithinTimeRange(int startHour, int startMinute, int endHour, int endMinute, int currentTime) {
-  int startTime = startHour * 60 + startMinute;
-  int endTime = endHour * 60 + endMinute;
+// Replace the schedule, timezone and tunables in one step on the loop task, the same task
+// as checkSchedule. The schedule goes straight into the live tables; timezone and
+// tunables persist as usual.
+void applySnapshot(const ConfigSnapshot& snapshot) {
+  routine_count = 0;
+  alarm_count = 0;
+  dusk_count = 0;
+  memcpy(routines, snapshot.routines, sizeof(Routine) * snapshot.routineCount);
+  memcpy(alarms, snapshot.alarms, sizeof(Alarm) * snapshot.alarmCount);
+  memcpy(dusks, snapshot.dusks, sizeof(DuskFade) * snapshot.duskCount);
+  for (int i = 0; i < MAX_DUSKS; i++) {
+    duskFiredYday[i] = -1;
+  }
+  routine_count = snapshot.routineCount;
+  alarm_count = snapshot.alarmCount;
+  dusk_count = snapshot.duskCount;
 
-  if (endTime > startTime) {
-    return currentTime >= startTime && currentTime <= endTime;
+  if (strcmp(snapshot.timezone, timezone) != 0) {
+    applyTimezone(snapshot.timezone, true);
   }
-  // wraps midnight
-  return currentTime >= startTime || currentTime <= endTime;
+  if (snapshot.tunablesChanged != 0) {
+    commitTunables(snapshot.tunables, snapshot.tunablesChanged);
+  }
+  bumpScheduleGeneration();
+  LOGI("Snapshot imported: %d routines, %d alarms, %d dusks\n", routine_count, alarm_count, dusk_count);
 }
 
-void updateSuppressionWindows(int currentTime) {
-  if (routineSuppressed) {
-    if (!isWithinTimeRange(suppressedRoutine.start_hour, suppressedRoutine.start_minute,
-                           suppressedRoutine.end_hour, suppressedRoutine.end_minute, currentTime)) {
-      Serial.printf("Routine %d suppression window ended\n", suppressedRoutine.id);
-      routineSuppressed = false;
-    }
+// GET /snapshot: the whole configuration as application/octet-stream
+void handleSnapshotExport(AsyncWebServerRequest* request) {
+  std::shared_ptr<SnapshotBlob> blob = std::make_shared<SnapshotBlob>();
+  blob->length = encodeSnapshot(blob->data, sizeof(blob->data));
+  if (blob->length == 0) {
+    sendHttpResult(request, 500, false, "Snapshot too large");
+    return;
   }
+  // Sent with a Content-Length; the filler owns the blob until the last byte is out
+  AsyncWebServerResponse* response = request->beginResponse("application/octet-stream", blob->length,
+      [blob](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+    size_t count = min(maxLen, blob->length - index);
+    memcpy(buffer, blob->data + index, count);
+    return count;
+  });
+  request->send(response);
+}
 
-  if (alarmSuppressed) {
-    if (!isWithinTimeRange(suppressedAlarm.start_hour, suppressedAlarm.start_minute,
-                           suppressedAlarm.wake_hour, suppressedAlarm.wake_minute, currentTime)) {
-      Serial.printf("Alarm %d suppression window ended\n", suppressedAlarm.id);
-      alarmSuppressed = false;
-    }
+// POST /snapshot body chunks are collected in the request's _tempObject (released by the
+// library with free(), hence plain malloc) and imported once complete
+void handleSnapshotBody(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total) {
+  if (total > SNAPSHOT_MAX_SIZE) {
+    return;                              // rejected in handleSnapshotImport
+  }
+  if (index == 0 && request->_tempObject == nullptr) {
+    request->_tempObject = malloc(total);
+  }
+  if (request->_tempObject != nullptr && index + len <= total) {
+    memcpy(static_cast<uint8_t*>(request->_tempObject) + index, data, len);
   }
 }
 
-void blinkLamp(uint8_t count, uint16_t intervalMs) {
-  int savedCh0 = ledcRead(0);
-  int savedCh1 = ledcRead(1);
-  bool lampWasOn = isOn;
+void handleSnapshotImport(AsyncWebServerRequest* request) {
+  size_t length = request->contentLength();
+  if (length == 0 || length > SNAPSHOT_MAX_SIZE || request->_tempObject == nullptr) {
+    sendHttpResult(request, 400, false, "Snapshot missing or too large");
+    return;
+  }
+  portENTER_CRITICAL(&snapshotMux);
+  bool busy = snapshotPending;
+  portEXIT_CRITICAL(&snapshotMux);
+  if (busy) {
+    sendHttpResult(request, 503, false, "Snapshot import in progress");
+    return;
+  }
+  const char* error = nullptr;
+  if (!decodeSnapshot(static_cast<const uint8_t*>(request->_tempObject), length, snapshotStaging, error)) {
+    LOGW("Snapshot import rejected: %s\n", error);
+    sendHttpResult(request, 400, false, error);
+    return;
+  }
+  // Fully validated, so applying it cannot fail; the loop task does that on its next pass
+  portENTER_CRITICAL(&snapshotMux);
+  snapshotPending = true;
+  portEXIT_CRITICAL(&snapshotMux);
+  sendHttpResult(request, 200, true, "Snapshot imported");
+}
 
-  for (uint8_t i = 0; i < count; ++i) {
-    // Off phase
-    ledcWrite(0, 15);
-    ledcWrite(1, 15);
-    delay(intervalMs);
+// Apply a validated import between schedule checks; called once per loop pass
+void serviceSnapshotImport() {
+  portENTER_CRITICAL(&snapshotMux);
+  bool pending = snapshotPending;
+  portEXIT_CRITICAL(&snapshotMux);
+  if (!pending) return;
+
+  applySnapshot(snapshotStaging);
+  portENTER_CRITICAL(&snapshotMux);
+  snapshotPending = false;               // staging may be reused from here on
+  portEXIT_CRITICAL(&snapshotMux);
+  sendSyncResponse(msg::SNAPSHOT_IMPORT_RESPONSE, true, "Snapshot imported");
+  sendStateUpdate();
+}
 
-    // On phase - restore saved channels or provide a gentle pulse if lamp was off
-    if (lampWasOn) {
-      ledcWrite(0, savedCh0);
-      ledcWrite(1, savedCh1);
-    } else {
-      ledcWrite(0, 12);
-      ledcWrite(1, 12);
+// ===== Firmware Update =====
+// Load the OTA token, creating it on first boot. Called once WiFi has been started:
+// esp_random() only draws on hardware entropy while the radio is on.
+void initOtaToken() {
+  otaPrefs.begin("ota", false);
+  String stored = otaPrefs.getString("token", "");
+  if (stored.length() == OTA_TOKEN_BYTES * 2) {
+    strncpy(otaToken, stored.c_str(), sizeof(otaToken) - 1);
+  } else {
+    for (uint8_t i = 0; i < OTA_TOKEN_BYTES; i += 4) {
+      snprintf(otaToken + i * 2, sizeof(otaToken) - i * 2, "%08x", (unsigned)esp_random());
     }
-    delay(intervalMs);
+    beginFlashWrite();
+    otaPrefs.putString("token", otaToken);
+    endFlashWrite();
   }
-
-  applyOutput();
+  Serial.printf("OTA token: %s\n", otaToken);
 }
 
-void sendSunSyncState(bool active, const char* source) {
-  JsonDocument doc;
-  doc["type"] = "sun_sync_state";
-  doc["active"] = active;
-  doc["source"] = source;
-  doc["timestamp_ms"] = millis();
+// Compared in constant time so the response timing does not reveal a matching prefix
+bool otaAuthorized(AsyncWebServerRequest* request) {
+  const AsyncWebHeader* header = request->getHeader(key::LAMP_TOKEN);
+  size_t length = strlen(otaToken);
+  if (header == nullptr || length == 0 || header->value().length() != length) {
+    return false;
+  }
+  const char* offered = header->value().c_str();
+  uint8_t diff = 0;
+  for (size_t i = 0; i < length; i++) {
+    diff |= (uint8_t)(offered[i] ^ otaToken[i]);
+  }
+  return diff == 0;
+}
 
-  String jsonString;
-  serializeJson(doc, jsonString);
-  ws.textAll(jsonString);
+// Body chunks arrive in order on the AsyncTCP task. The first one claims the Update
+// singleton; an unauthorised or second concurrent upload is ignored here and refused in
+// handleUpdate.
+void handleUpdateBody(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total) {
+  if (index == 0) {
+    if (otaOwner != nullptr || otaRestartAt != 0 || !otaAuthorized(request)) {
+      return;
+    }
+    otaOwner = request;
+    // A dropped upload never reaches handleUpdate; release the slot for the next attempt
+    request->onDisconnect([request]() {
+      if (otaOwner == request) {
+        Update.abort();
+        otaOwner = nullptr;
+        LOGW("Firmware update aborted: client disconnected\n");
+      }
+    });
+    if (!Update.begin(total, U_FLASH)) {
+      LOGW("Firmware update refused: %s\n", Update.errorString());
+      return;
+    }
+    LOGI("Firmware update started: %u bytes\n", (unsigned)total);
+  }
+  if (otaOwner != request || Update.hasError() || !Update.isRunning()) {
+    return;
+  }
+  beginFlashWrite();
+  size_t written = Update.write(data, len);
+  endFlashWrite();
+  if (written != len) {
+    LOGW("Firmware update write failed at %u: %s\n", (unsigned)index, Update.errorString());
+    Update.abort();
+    return;
+  }
+  if (index + len == total && !Update.end()) {
+    LOGW("Firmware update rejected: %s\n", Update.errorString());
+  }
+}
 
-  Serial.printf("Sent sun sync state (%s): %s\n", source, jsonString.c_str());
+void handleUpdate(AsyncWebServerRequest* request) {
+  if (!otaAuthorized(request)) {
+    LOGW("Firmware update refused: OTA token missing or wrong\n");
+    sendHttpResult(request, 401, false, "OTA token missing or wrong");
+    return;
+  }
+  if (request->contentLength() == 0) {
+    sendHttpResult(request, 400, false, "Image missing");
+    return;
+  }
+  if (otaOwner != request) {
+    sendHttpResult(request, 409, false, "Another update is in progress");
+    return;
+  }
+  otaOwner = nullptr;
+  if (!Update.isFinished() || Update.hasError()) {
+    const char* error = Update.hasError() ? Update.errorString() : "Image incomplete";
+    if (Update.isRunning()) {
+      Update.abort();
+    }
+    sendHttpResult(request, 400, false, error);
+    return;
+  }
+  LOGI("Firmware update complete, restarting\n");
+  sendHttpResult(request, 200, true, "Update installed, restarting");
+  otaRestartAt = millis() + OTA_RESTART_DELAY_MS;
+  if (otaRestartAt == 0) {
+    otaRestartAt = 1;
+  }
 }
 
-void broadcastOverrideEvent(const char* source, bool routineWasActive, bool alarmWasActive, bool sunSyncWasActive) {
-  JsonDocument doc;
-  doc["type"] = "schedule_override_event";
-  doc["source"] = source;
-  doc["timestamp_ms"] = millis();
-  doc["routine_disabled"] = routineWasActive;
-  doc["alarm_disabled"] = alarmWasActive;
-  doc["sun_sync_disabled"] = sunSyncWasActive;
-  doc["routine_suppressed"] = routineSuppressed;
-  doc["alarm_suppressed"] = alarmSuppressed;
-  doc["sun_sync_active"] = sunSyncActive;
+void serviceFirmwareUpdate() {
+  uint32_t restartAt = otaRestartAt;
+  if (restartAt != 0 && (int32_t)(millis() - restartAt) >= 0) {
+    ws.closeAll();
+    saveEnergyBuckets();
+    ESP.restart();
+  }
+}
 
-  String jsonString;
-  serializeJson(doc, jsonString);
-  ws.textAll(jsonString);
+// ===== Heap Accounting =====
+// Whole-heap figures next to the per-subsystem tags; a falling max_alloc with steady
+// live bytes points at fragmentation rather than a leak
+void fillHeapStats(JsonObject obj) {
+  obj[key::FREE] = ESP.getFreeHeap();
+  obj[key::MIN_FREE] = ESP.getMinFreeHeap();
+  obj[key::MAX_ALLOC] = ESP.getMaxAllocHeap();
+  JsonObject tags = obj[key::TAGS].to<JsonObject>();
+  for (uint8_t i = 0; i < ALLOC_TAG_COUNT; i++) {
+    AllocTagStats stats;
+    allocTagStats((AllocTag)i, stats);
+    JsonObject tag = tags[allocTagName((AllocTag)i)].to<JsonObject>();
+    tag[key::LIVE_BYTES] = stats.liveBytes;
+    tag[key::PEAK_BYTES] = stats.peakBytes;
+    tag[key::LIVE_BLOCKS] = stats.liveBlocks;
+    tag[key::ALLOCATIONS] = stats.allocations;
+    tag[key::FAILURES] = stats.failures;
+  }
+}
 
-  Serial.printf("Sent override event: %s\n", jsonString.c_str());
+void handleHeapStatsRequest(AsyncWebSocketClient* client) {
+  JsonDocument report(&wsTxJson);
+  report[key::TYPE] = msg::HEAP_STATS;
+  fillHeapStats(report[key::HEAP].to<JsonObject>());
+  JsonText jsonText(report);
+  client->text(jsonText.c_str(), jsonText.length());
 }
 
-void handleSunSyncState(bool active, const char* source) {
-  bool previous = sunSyncActive;
-  sunSyncActive = active;
+// ===== Streaming Control Sessions =====
+// {"type":"stream_begin","delay_ms":120}: open a session for this client (replaces any other)
+void handleStreamBegin(AsyncWebSocketClient* client, JsonDocument& doc) {
+  int delayMs = STREAM_DEFAULT_DELAY_MS;
+  if (!doc[key::DELAY_MS].isNull() &&
+      !readIntField(doc.as<JsonObject>(), key::DELAY_MS, 0, STREAM_MAX_DELAY_MS, delayMs)) {
+    sendSyncResponse(msg::STREAM_RESPONSE, false, "Invalid field: delay_ms");
+    return;
+  }
+  if (!isOn || isManualControlLocked()) {
+    sendSyncResponse(msg::STREAM_RESPONSE, false, "Lamp is off or under automation control");
+    return;
+  }
+  if (fadeActive) {
+    cancelFade("stream control");
+  }
 
-  if (active) {
-    sunSyncDisabledByHardware = false;
-  } else if (strcmp(source, "hardware") == 0) {
-    sunSyncDisabledByHardware = true;
-  } else {
-    sunSyncDisabledByHardware = false;
+  portENTER_CRITICAL(&streamMux);
+  streamActive = true;
+  streamEndRequested = false;
+  streamClientId = client->id();
+  streamDelayMs = (uint16_t)delayMs;
+  streamClockValid = false;
+  streamHead = 0;
+  streamCount = 0;
+  streamLevelQ8 = (uint16_t)(max(1, brightness) << 8);
+  streamStarved = false;
+  streamLastSampleMs = millis();
+  portEXIT_CRITICAL(&streamMux);
+
+  LOGI("🎚️ Stream session opened by client #%u (delay %d ms)\n", client->id(), delayMs);
+  sendSyncResponse(msg::STREAM_RESPONSE, true, "Stream started");
+}
+
+// {"type":"stream_samples","samples":[[t_ms, level_q8], ...]} with t on the sender's clock
+void handleStreamSamples(AsyncWebSocketClient* client, JsonDocument& doc) {
+  if (!streamActive || client->id() != streamClientId) {
+    return;   // stale frames after the session closed or another client took over
+  }
+  // Parse before taking the lock: a frame may hold any number of entries, and only the
+  // newest STREAM_BUFFER_DEPTH of them could end up in the buffer anyway
+  StreamSample parsed[STREAM_BUFFER_DEPTH];
+  uint32_t valid = 0;
+  uint32_t malformed = 0;
+  for (JsonVariant entry : doc[key::SAMPLES].as<JsonArray>()) {
+    JsonArray sample = entry.as<JsonArray>();
+    if (!sample[0].is<uint32_t>() || !sample[1].is<int>()) {
+      malformed++;
+      continue;
+    }
+    StreamSample& slot = parsed[valid % STREAM_BUFFER_DEPTH];
+    slot.clientMs = sample[0].as<uint32_t>();
+    slot.levelQ8 = (uint16_t)constrain(sample[1].as<int>(), 1 << 8, (int)LEVEL_Q8_MAX);
+    valid++;
   }
+  uint32_t kept = min(valid, (uint32_t)STREAM_BUFFER_DEPTH);
+  uint32_t first = valid - kept;         // older ones were overwritten above
+  unsigned long now = millis();
+
+  portENTER_CRITICAL(&streamMux);
+  streamSamplesTotal += valid;
+  streamDroppedSamples += malformed + first;
+  for (uint32_t i = first; i < valid; i++) {
+    uint32_t clientMs = parsed[i % STREAM_BUFFER_DEPTH].clientMs;
+    uint16_t levelQ8 = parsed[i % STREAM_BUFFER_DEPTH].levelQ8;
+
+    if (streamCount > 0) {
+      const StreamSample& newest = streamBuffer[(streamHead + streamCount - 1) % STREAM_BUFFER_DEPTH];
+      if ((int32_t)(clientMs - newest.clientMs) <= 0) {
+        streamDroppedSamples++;          // reordered or duplicate
+        continue;
+      }
+    }
 
-  Serial.printf("Sun sync state updated by %s -> %s\n", source, active ? "ACTIVE" : "INACTIVE");
+    // Track the least-delayed arrival; later samples are timed relative to it
+    long offset = (long)(now - clientMs);
+    if (!streamClockValid || offset < streamClockOffset) {
+      streamClockOffset = offset;
+      streamClockValid = true;
+    } else if ((long)(clientMs + streamClockOffset + streamDelayMs - now) < 0) {
+      streamLateSamples++;
+    }
 
-  if (previous != sunSyncActive) {
-    sendStateUpdate();
+    if (streamCount == STREAM_BUFFER_DEPTH) {
+      streamHead = (streamHead + 1) % STREAM_BUFFER_DEPTH;   // drop the oldest
+      streamCount--;
+      streamDroppedSamples++;
+    }
+    StreamSample& slot = streamBuffer[(streamHead + streamCount) % STREAM_BUFFER_DEPTH];
+    slot.clientMs = clientMs;
+    slot.levelQ8 = levelQ8;
+    streamCount++;
+    streamLastSampleMs = now;
   }
+  portEXIT_CRITICAL(&streamMux);
 }
 
-bool hardwareOverrideActiveAutomations(const char* source, bool shouldBlink) {
-  bool routineWasActive = routineActive;
-  bool alarmWasActive = alarmActive;
-  bool sunSyncWasActive = sunSyncActive;
+// {"type":"stream_end"} or client disconnect: the tick drains the buffer, then commits
+void handleStreamEnd(uint32_t clientId) {
+  portENTER_CRITICAL(&streamMux);
+  if (streamActive && clientId == streamClientId) {
+    streamEndRequested = true;
+  }
+  portEXIT_CRITICAL(&streamMux);
+}
 
-  if (!routineWasActive && !alarmWasActive && !sunSyncWasActive) {
-    Serial.printf("Override requested by %s but no active automation\n", source);
-    return false;
+// Close the session; on commit the last played level becomes the lamp brightness
+void stopStream(bool commit, const char* reason) {
+  portENTER_CRITICAL(&streamMux);
+  streamActive = false;
+  streamEndRequested = false;
+  streamCount = 0;
+  uint16_t levelQ8 = streamLevelQ8;
+  portEXIT_CRITICAL(&streamMux);
+
+  LOGI("🎚️ Stream session closed (%s)\n", reason);
+  clearLayer(LAYER_STREAM);
+  if (commit) {
+    brightness = constrain((levelQ8 + 128) >> 8, 1, 15);
+    applyOutput();
+    broadcastState(0);   // the sender's slider may differ from the rounded brightness
   }
+}
 
-  if (routineWasActive) {
-    Routine* routinePtr = findRoutineById(activeRoutineId);
-    if (routinePtr != nullptr) {
-      suppressedRoutine = *routinePtr;
-      routineSuppressed = true;
-      Serial.printf("Routine %d suppressed by %s override\n", suppressedRoutine.id, source);
-    } else {
-      routineSuppressed = false;
-      Serial.printf("Warning: active routine ID %d not found during %s override\n", activeRoutineId, source);
-    }
-    routineActive = false;
-    activeRoutineId = -1;
-    lastRoutineMinute = -1;
-    wasOffBeforeRoutine = false;
+// Play the buffer out: interpolate between the samples straddling now on every loop pass
+void handleStreamTick() {
+  if (!streamActive) return;
+
+  if (!isOn || isManualControlLocked()) {
+    stopStream(false, isOn ? "automation" : "lamp off");
+    return;
   }
 
-  if (alarmWasActive) {
-    Alarm* alarmPtr = findAlarmById(activeAlarmId);
-    if (alarmPtr != nullptr) {
-      suppressedAlarm = *alarmPtr;
-      alarmSuppressed = true;
-      Serial.printf("Alarm %d suppressed by %s override\n", suppressedAlarm.id, source);
-    } else {
-      alarmSuppressed = false;
-      Serial.printf("Warning: active alarm ID %d not found during %s override\n", activeAlarmId, source);
+  unsigned long now = millis();
+  bool finished = false;
+  portENTER_CRITICAL(&streamMux);
+  // Discard samples whose successor is already due
+  while (streamCount >= 2) {
+    const StreamSample& next = streamBuffer[(streamHead + 1) % STREAM_BUFFER_DEPTH];
+    if ((long)(next.clientMs + streamClockOffset + streamDelayMs - now) > 0) break;
+    streamHead = (streamHead + 1) % STREAM_BUFFER_DEPTH;
+    streamCount--;
+  }
+  if (streamCount > 0) {
+    const StreamSample& a = streamBuffer[streamHead];
+    long sinceA = (long)(now - (a.clientMs + streamClockOffset + streamDelayMs));
+    if (sinceA >= 0) {
+      if (streamCount >= 2) {
+        const StreamSample& b = streamBuffer[(streamHead + 1) % STREAM_BUFFER_DEPTH];
+        long span = (long)(b.clientMs - a.clientMs);
+        streamLevelQ8 = (uint16_t)(a.levelQ8 + ((long)b.levelQ8 - (long)a.levelQ8) * sinceA / span);
+        streamStarved = false;
+      } else {
+        streamLevelQ8 = a.levelQ8;       // holding the newest sample
+        if (!streamEndRequested && !streamStarved) {
+          streamStarved = true;
+          streamUnderruns++;
+        }
+      }
     }
-    alarmActive = false;
-    activeAlarmId = -1;
-    lastAlarmMinute = -1;
-    wasOffBeforeAlarm = false;
   }
+  bool drained = streamCount <= 1 &&
+                 (streamCount == 0 ||
+                  (long)(now - (streamBuffer[streamHead].clientMs + streamClockOffset + streamDelayMs)) >= 0);
+  finished = drained && (streamEndRequested || now - streamLastSampleMs > STREAM_IDLE_TIMEOUT_MS);
+  uint16_t levelQ8 = streamLevelQ8;
+  portEXIT_CRITICAL(&streamMux);
 
-  if (sunSyncWasActive) {
-    sunSyncActive = false;
-    sunSyncDisabledByHardware = true;
-    sendSunSyncState(false, source);
-    Serial.printf("Sun sync disabled by %s override\n", source);
-  }
+  setLayerState(LAYER_STREAM, true, mode, levelQ8);
 
-  if (shouldBlink) {
-    blinkLamp(OVERRIDE_BLINK_COUNT, OVERRIDE_BLINK_INTERVAL_MS);
+  if (finished) {
+    stopStream(true, "drained");
   }
+}
 
-  applyOutput();
-  sendStateUpdate();
-  broadcastOverrideEvent(source, routineWasActive, alarmWasActive, sunSyncWasActive);
-  return true;
+// ===== Timezone =====
+// Load the stored timezone (or the default) and export it as TZ
+void initTimezone() {
+  clockPrefs.begin("clock", false);
+  String stored = clockPrefs.getString("tz", "");
+  applyTimezone(stored.length() > 0 ? stored.c_str() : DEFAULT_TIMEZONE, false);
 }
 
-void handleTripleClick() {
-  Serial.println("Triple click detected: disabling active schedules for current instance");
-  if (!hardwareOverrideActiveAutomations("hardware", true)) {
-    Serial.println("Triple click detected but no active routine/alarm/sun sync to disable");
+void applyTimezone(const char* posix, bool persist) {
+  strncpy(timezone, posix, TIMEZONE_MAX_LEN - 1);
+  timezone[TIMEZONE_MAX_LEN - 1] = '\0';
+  setenv("TZ", timezone, 1);
+  tzset();
+  portENTER_CRITICAL(&tzTableMux);
+  tzTable.count = 0;                 // rebuilt by serviceTimezoneTable
+  tzTableGeneration++;
+  portEXIT_CRITICAL(&tzTableMux);
+  if (persist) {
+    beginFlashWrite();
+    clockPrefs.putString("tz", timezone);
+    endFlashWrite();
   }
+  LOGI("🕐 Timezone set to %s\n", timezone);
 }
 
-void handleTimeSync(JsonDocument& doc) {
-  if (doc["timestamp"].is<long long>()) {
-    long long timestamp = doc["timestamp"];
-    
-    // Convert milliseconds to seconds (UTC timestamp)
-    time_t utcTimeSeconds = timestamp / 1000;
-    
-    // Print UTC time first
-    struct tm* utcTime = gmtime(&utcTimeSeconds);
-    Serial.printf("🕐 RECEIVED UTC: %04d-%02d-%02d %02d:%02d:%02d\n",
-                  utcTime->tm_year + 1900, utcTime->tm_mon + 1, utcTime->tm_mday,
-                  utcTime->tm_hour, utcTime->tm_min, utcTime->tm_sec);
-    
-    // Set system time with UTC time (timezone conversion handled automatically by configTzTime)
-    struct timeval tv;
-    tv.tv_sec = utcTimeSeconds;
-    tv.tv_usec = 0;
-    settimeofday(&tv, NULL);
-    
-    // Print what the ESP32 thinks the time is after setting
-    struct tm timeinfo;
-    if (getLocalTime(&timeinfo)) {
-      Serial.printf("🕐 ESP32 AUCKLAND TIME: %04d-%02d-%02d %02d:%02d:%02d\n",
-                    timeinfo.tm_year + 1900, timeinfo.tm_mon + 1, timeinfo.tm_mday,
-                    timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec);
-    } else {
-      Serial.println("🕐 ERROR: Failed to get Auckland local time after sync");
-    }
+// Local minute-of-day/second/yday for now; false until the clock has been set
+bool getLocalClock(TzLocalClock& out) {
+  time_t now = time(nullptr);
+  if (now < 1600000000) {
+    return false;
+  }
+  portENTER_CRITICAL(&tzTableMux);
+  bool covered = tzTableCovers(tzTable, now);
+  int32_t offsetS = covered ? tzTableOffset(tzTable, now) : 0;
+  portEXIT_CRITICAL(&tzTableMux);
+  if (!covered) {
+    offsetS = tzLibcOffset(now);     // no table yet, or the timezone just changed
+  }
+  tzLocalClockAt(now, offsetS, out);
+  return true;
+}
 
-    sendSyncResponse("time_sync_response", true, "Time synchronized to Auckland timezone with automatic DST");
-  } else {
-    Serial.println("🕐 ERROR: Invalid time sync data - missing timestamp");
-    sendSyncResponse("time_sync_response", false, "Invalid time data");
+// Build the next table a slice per pass once the current one is missing or due to run out,
+// so no single loop pass spends a year of localtime_r probes
+void serviceTimezoneTable() {
+  time_t now = time(nullptr);
+  if (now < 1600000000) {
+    return;
   }
+  if (!tzTableBuilding) {
+    portENTER_CRITICAL(&tzTableMux);
+    bool fresh = tzTableCovers(tzTable, (int64_t)now + TZ_TABLE_REBUILD_LEAD_S);
+    tzTableBuildGeneration = tzTableGeneration;
+    portEXIT_CRITICAL(&tzTableMux);
+    if (fresh) return;
+    tzTableBuildBegin(tzTableBuilder, (int64_t)now - 86400, (int64_t)now + TZ_TABLE_SPAN_S);
+    tzTableBuilding = true;
+    tzTableBuildStartedMs = millis();
+  }
+  if (!tzTableBuildStep(tzTableBuilder, TZ_TABLE_PROBES_PER_PASS)) {
+    return;
+  }
+  tzTableBuilding = false;
+
+  portENTER_CRITICAL(&tzTableMux);
+  bool current = tzTableBuildGeneration == tzTableGeneration;
+  if (current) {
+    tzTable = tzTableBuilder.table;
+  }
+  portEXIT_CRITICAL(&tzTableMux);
+  if (!current) return;              // the timezone changed mid-build; the next pass starts over
+  LOGI("🕐 Timezone table rebuilt: %u offsets over %lu ms%s\n", tzTable.count,
+       millis() - tzTableBuildStartedMs, tzTableBuilder.complete ? "" : " (truncated)");
 }
 
 // Main function to check and apply scheduled routines and alarms based on current time
@@ -965,33 +4437,33 @@ void checkSchedule() {
   if (WiFi.status() != WL_CONNECTED) {
     static unsigned long lastOfflineWarning = 0;
     if (millis() - lastOfflineWarning > 30000) {
-      Serial.println("⚠️  SCHEDULE: Skipping schedule check (WiFi disconnected)");
+      LOGW("⚠️  SCHEDULE: Skipping schedule check (WiFi disconnected)\n");
       lastOfflineWarning = millis();
     }
     return;
   }
 
-  struct tm timeinfo;
-  if (!getLocalTime(&timeinfo)) {
+  TzLocalClock localClock;
+  if (!getLocalClock(localClock)) {
     static unsigned long lastTimeWarning = 0;
     if (millis() - lastTimeWarning > 30000) { // Warn every 30 seconds
-      Serial.println("⚠️  SCHEDULE: No valid time available for schedule checking");
+      LOGW("⚠️  SCHEDULE: No valid time available for schedule checking\n");
       lastTimeWarning = millis();
     }
     return; // No valid time available
   }
   
-  int currentHour = timeinfo.tm_hour;
-  int currentMinute = timeinfo.tm_min;
-  int currentTime = currentHour * 60 + currentMinute; // Convert to minutes since midnight
+  int currentTime = localClock.minuteOfDay; // minutes since midnight
+  int currentHour = currentTime / 60;
+  int currentMinute = currentTime % 60;
 
   updateSuppressionWindows(currentTime);
 
   // Debug: Print current time only when minute changes
   static int lastDebugMinute = -1;
   if (currentMinute != lastDebugMinute) {
-    Serial.printf("🕐 SCHEDULE CHECK: Current time %02d:%02d (%d minutes), Routines: %d, Alarms: %d\n",
-                  currentHour, currentMinute, currentTime, routine_count, alarm_count);
+    LOGD("🕐 SCHEDULE CHECK: Current time %02d:%02d (%d minutes), Routines: %d, Alarms: %d\n",
+         currentHour, currentMinute, currentTime, routine_count, alarm_count);
     lastDebugMinute = currentMinute;
   }
 
@@ -1005,16 +4477,9 @@ void checkSchedule() {
     int endTime = routines[i].end_hour * 60 + routines[i].end_minute;
 
     // Handle routines that span midnight
-    bool inTimeRange;
-    if (endTime > startTime) {
-      inTimeRange = (currentTime >= startTime && currentTime <= endTime);
-    } else {
-      inTimeRange = (currentTime >= startTime || currentTime <= endTime);
-    }
-
-    if (inTimeRange) {
+    if (sc_in_window(startTime, endTime, currentTime)) {
       if (routineSuppressed && suppressedRoutine.id == routines[i].id) {
-        Serial.printf("📅 Routine %d is suppressed for current window; skipping application\n", routines[i].id);
+        LOGD("📅 Routine %d is suppressed for current window; skipping application\n", routines[i].id);
         return;
       }
 
@@ -1036,22 +4501,21 @@ void checkSchedule() {
           originalBrightness = brightness;
           originalMode = mode;
           wasOffBeforeRoutine = !isOn;
-          Serial.printf("✨ Starting routine %d: saved state (isOn=%s, brightness=%d, mode=%d)\n",
-                        routines[i].id, originalIsOn ? "true" : "false", originalBrightness, (int)originalMode);
+          LOGI("✨ Starting routine %d: saved state (isOn=%s, brightness=%d, mode=%d)\n",
+               routines[i].id, originalIsOn ? "true" : "false", originalBrightness, (int)originalMode);
+          logEvent(EVT_ROUTINE_START, SRC_SCHEDULE, routines[i].id, 0);
         }
 
         routineActive = true;
         activeRoutineId = routines[i].id;
         lastRoutineMinute = currentMinute;
 
-        // Apply routine settings
-        brightness = routines[i].brightness;
-        mode = (Mode)routines[i].mode;
-        isOn = true;  // Routine always turns lamp on
-        applyOutput();
+        // Apply routine settings as its layer (routine always turns the lamp on)
+        setLayerState(LAYER_ROUTINE, true, (Mode)routines[i].mode,
+                      (uint16_t)(max(1, routines[i].brightness) << 8));
 
-        Serial.printf("📅 Applied routine %d: brightness=%d, mode=%d at %02d:%02d\n",
-                      routines[i].id, brightness, (int)mode, currentHour, currentMinute);
+        LOGD("📅 Applied routine %d: brightness=%d, mode=%d at %02d:%02d\n",
+             routines[i].id, routines[i].brightness, routines[i].mode, currentHour, currentMinute);
         sendStateUpdate();
       }
       return; // Only apply one routine at a time
@@ -1060,15 +4524,18 @@ void checkSchedule() {
   
   // If no routine is active now but one was active before
   if (routineActive && !foundActiveRoutine) {
-    Serial.printf("⏹️  Routine %d ended: keeping current state (isOn=%s, brightness=%d, mode=%d)\n",
-                  activeRoutineId, isOn ? "true" : "false", brightness, (int)mode);
+    // State remains as the routine left it: its layer becomes the manual state
+    releaseLayer(LAYER_ROUTINE);
+    LOGI("⏹️  Routine %d ended: keeping current state (isOn=%s, brightness=%d, mode=%d)\n",
+         activeRoutineId, isOn ? "true" : "false", brightness, (int)mode);
+    logEvent(EVT_ROUTINE_END, SRC_SCHEDULE, activeRoutineId, 0);
 
     routineActive = false;
     activeRoutineId = -1;
     wasOffBeforeRoutine = false;
     lastRoutineMinute = -1;
 
-    // State remains as the routine left it; notify clients so they stay in sync
+    // Notify clients so they stay in sync
     sendStateUpdate();
     return;
   }
@@ -1083,49 +4550,48 @@ void checkSchedule() {
       int startTime = alarms[i].start_hour * 60 + alarms[i].start_minute;
       int wakeTime = alarms[i].wake_hour * 60 + alarms[i].wake_minute;
 
-      if (currentTime >= startTime && currentTime <= wakeTime) {
+      // Same wrap rule as routines: a sunrise may start before midnight
+      if (sc_in_window(startTime, wakeTime, currentTime)) {
         if (alarmSuppressed && suppressedAlarm.id == alarms[i].id) {
-          Serial.printf("⏰ Alarm %d is suppressed for current window; skipping application\n", alarms[i].id);
+          LOGD("⏰ Alarm %d is suppressed for current window; skipping application\n", alarms[i].id);
           return;
         }
 
         foundActiveAlarm = true;
 
-        // Only trigger alarm updates once per minute
-        bool shouldUpdate = false;
-        if (!alarmActive || activeAlarmId != alarms[i].id) {
-          shouldUpdate = true;
-        } else if (lastAlarmMinute != currentMinute) {
-          shouldUpdate = true; // Update every minute for gradual brightness increase
+        bool startingAlarm = (!alarmActive || activeAlarmId != alarms[i].id);
+        // Save current state if starting a new alarm
+        if (!alarmActive) {
+          alarmOriginalIsOn = isOn;
+          alarmOriginalBrightness = brightness;
+          alarmOriginalMode = mode;
+          wasOffBeforeAlarm = !isOn;
+          LOGI("🌅 Starting alarm %d: saved state (isOn=%s, brightness=%d, mode=%d)\n",
+               alarms[i].id, alarmOriginalIsOn ? "true" : "false", alarmOriginalBrightness, (int)alarmOriginalMode);
+          logEvent(EVT_ALARM_START, SRC_SCHEDULE, alarms[i].id, 0);
         }
 
-        if (shouldUpdate) {
-          // Save current state if starting a new alarm
-          if (!alarmActive) {
-            alarmOriginalIsOn = isOn;
-            alarmOriginalBrightness = brightness;
-            alarmOriginalMode = mode;
-            wasOffBeforeAlarm = !isOn;
-            Serial.printf("🌅 Starting alarm %d: saved state (isOn=%s, brightness=%d, mode=%d)\n",
-                          alarms[i].id, alarmOriginalIsOn ? "true" : "false", alarmOriginalBrightness, (int)alarmOriginalMode);
-          }
-
-          alarmActive = true;
-          activeAlarmId = alarms[i].id;
-          lastAlarmMinute = currentMinute;
+        alarmActive = true;
+        activeAlarmId = alarms[i].id;
 
-          // Calculate progress through alarm (0.0 to 1.0)
-          float progress = (float)(currentTime - startTime) / (float)alarms[i].duration_minutes;
-          progress = constrain(progress, 0.0, 1.0);
+        // Sunrise trajectory: warm first at low intensity, white joins as wake time nears.
+        // Evaluated every schedule tick; the per-tick cost is a table lookup.
+        long elapsedS = sc_elapsed_seconds(startTime, currentTime, localClock.second);
+        uint16_t warmQ8;
+        uint16_t whiteQ8;
+        lookupAlarmCurve(alarms[i], elapsedS, warmQ8, whiteQ8);
 
-          // Gradually increase brightness across both LED channels
-          brightness = (int)(progress * 15); // Scale to 0-15
-          mode = MODE_BOTH; // Use mixed output so both LEDs ramp together
-          isOn = true;
-          applyOutput();
+        // The alarm layer keeps the lamp lit even at the very start of the curve
+        setLayerLevels(LAYER_ALARM, max(warmQ8, (uint16_t)1), whiteQ8);
 
-          Serial.printf("🌅 Alarm %d progress: %.2f, brightness=%d at %02d:%02d\n",
-                        alarms[i].id, progress, brightness, currentHour, currentMinute);
+        // Reported brightness tracks the brighter channel; clients are updated once per minute
+        // or when that value moves
+        int shown = max(1, (max(warmQ8, whiteQ8) + 255) >> 8);
+        if (startingAlarm || shown != alarmLastShown || lastAlarmMinute != currentMinute) {
+          alarmLastShown = shown;
+          lastAlarmMinute = currentMinute;
+          LOGD("🌅 Alarm %d at %lds: warm=%u white=%u (Q8), brightness=%d at %02d:%02d\n",
+               alarms[i].id, elapsedS, warmQ8, whiteQ8, shown, currentHour, currentMinute);
           sendStateUpdate();
         }
         return; // Only apply one alarm at a time
@@ -1134,8 +4600,9 @@ void checkSchedule() {
 
     // If no alarm is active now but one was active before
     if (alarmActive && !foundActiveAlarm) {
-      Serial.printf("⏹️  Alarm %d ended: holding daytime state (isOn=true, brightness=15, mode=%d)\n",
-                    activeAlarmId, (int)MODE_BOTH);
+      LOGI("⏹️  Alarm %d ended: holding daytime state (isOn=true, brightness=15, mode=%d)\n",
+           activeAlarmId, (int)MODE_BOTH);
+      logEvent(EVT_ALARM_END, SRC_SCHEDULE, activeAlarmId, 0);
 
       // Lock in full brightness mixed mode until user or another event changes it
       isOn = true;
@@ -1143,6 +4610,7 @@ void checkSchedule() {
       mode = MODE_BOTH;
 
       alarmActive = false;
+      clearLayer(LAYER_ALARM);
       activeAlarmId = -1;
       wasOffBeforeAlarm = false;
       lastAlarmMinute = -1;
@@ -1152,16 +4620,35 @@ void checkSchedule() {
       return;
     }
   }
+
+  // Dusk fades only start while no routine or alarm owns the lamp
+  if (!routineActive && !alarmActive) {
+    checkDuskSchedule(currentTime, localClock.second, localClock.yday);
+  }
 }
 
 // Arduino setup function: initialize hardware, WiFi, time, and web services
 void setup() {
   Serial.begin(115200);
   pinMode(LED_BUILTIN, OUTPUT);
+  bootId = esp_random();
+  loopTaskHandle = xTaskGetCurrentTaskHandle();   // setup() runs on the loop task
+  sseReplayLock = xSemaphoreCreateMutex();
+
+  initEventLog();
+  logEvent(EVT_BOOT, SRC_NONE, (int)esp_reset_reason(), 0);
+  initEnergyAccounting();
+  initTimezone();
+  initTunables();
+
+  for (int i = 0; i < MAX_DUSKS; i++) {
+    duskFiredYday[i] = -1;
+  }
 
-  // two PWM channels, 8-bit duty
-  ledcSetup(0, 5000, 4); ledcAttachPin(LED_A_PIN, 0);
-  ledcSetup(1, 5000, 4); ledcAttachPin(LED_B_PIN, 1);
+  // two PWM channels; frequency and resolution come from the tunables
+  configurePwm();
+  ledcAttachPin(LED_A_PIN, 0);
+  ledcAttachPin(LED_B_PIN, 1);
 
 
   WiFi.begin(SSID, PASSWORD);
@@ -1175,63 +4662,120 @@ void setup() {
   if (WiFi.status() == WL_CONNECTED) {
     Serial.println(WiFi.localIP());
     
-    // Initialize time for Auckland, New Zealand with automatic DST handling
+    // Initialize NTP with the configured timezone (automatic DST handling)
     configTzTime(timezone, ntpServer);
-    Serial.println("NTP time initialized for Auckland with automatic NZST/NZDT transitions");
+    LOGI("NTP time initialized for %s\n", timezone);
     
-    // Wait a bit and show current Auckland time
+    // Wait a bit and show current local time
     delay(2000);
-    struct tm timeinfo;
-    if (getLocalTime(&timeinfo)) {
-      Serial.printf("🕐 Current Auckland time: %04d-%02d-%02d %02d:%02d:%02d\n",
-                    timeinfo.tm_year + 1900, timeinfo.tm_mon + 1, timeinfo.tm_mday,
-                    timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec);
+    TzLocalClock localClock;
+    if (getLocalClock(localClock)) {
+      LOGI("🕐 Current local time: day %d of %d, %02d:%02d:%02d\n",
+           localClock.yday + 1, localClock.year, localClock.minuteOfDay / 60, localClock.minuteOfDay % 60, localClock.second);
     }
   } else {
-    Serial.println("\nWiFi not connected, continuing without WiFi.");
+    LOGI("\nWiFi not connected, continuing without WiFi.\n");
   }
+  initOtaToken();
 
   // ----- mDNS -----
   if (!MDNS.begin("circadian-light")) {          // hostname = circadian-light.local
-    Serial.println("Error starting mDNS");
+    LOGE("Error starting mDNS\n");
   } else {
-    Serial.println("mDNS responder started");
+    LOGI("mDNS responder started\n");
     MDNS.addService("_ws", "_tcp", 80);          // advertise the WebSocket port
+    // Fleet tools tell lamps apart by chip id, since every lamp uses the same hostname
+    char chipId[13];
+    snprintf(chipId, sizeof(chipId), "%012llx", (unsigned long long)ESP.getEfuseMac());
+    MDNS.addServiceTxt("_ws", "_tcp", "id", chipId);
+    MDNS.addServiceTxt("_ws", "_tcp", "fw", FIRMWARE_VERSION);
   }
   // -----------------
 
   ws.onEvent(onWSMsg);
   server.addHandler(&ws);
+  events.onConnect(onSseConnect);
+  server.addHandler(&events);
+  server.on("/history", HTTP_GET, handleHistoryRequest);
+  server.on("/energy", HTTP_GET, handleEnergyHttpRequest);
+  server.on("/metrics", HTTP_GET, handleMetricsHttpRequest);
+  server.on("/tunables", HTTP_GET, handleTunablesHttpGet);
+  server.on("/tunables", HTTP_POST, handleTunablesHttpSet);
+  server.on("/snapshot", HTTP_GET, handleSnapshotExport);
+  server.on("/snapshot", HTTP_POST, handleSnapshotImport, nullptr, handleSnapshotBody);
+  server.on("/update", HTTP_POST, handleUpdate, nullptr, handleUpdateBody);
   server.begin();
 
+  initEncoder();
   pinMode(ROTARY_BTN, INPUT_PULLUP);
   {
     int idle = digitalRead(ROTARY_BTN);
-    Serial.printf("ROTARY_BTN idle read: %d (expect %s when unpressed)\n",
-                  idle, BUTTON_ACTIVE_LOW ? "HIGH" : "LOW");
+    LOGD("ROTARY_BTN idle read: %d (expect %s when unpressed)\n",
+         idle, BUTTON_ACTIVE_LOW ? "HIGH" : "LOW");
   }
 
   applyOutput();
 }
 
+// Pins idle high through the pull-ups; the first decode starts from the current state.
+// attachInterrupt would route through Arduino's dispatcher, which is not IRAM-safe.
+void initEncoder() {
+  pinMode(ROTARY_DT, INPUT_PULLUP);
+  pinMode(ROTARY_CLK, INPUT_PULLUP);
+  encoderState = digitalRead(ROTARY_DT) | (digitalRead(ROTARY_CLK) << 1);
+
+  esp_err_t err = gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
+  if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {   // INVALID_STATE: already installed
+    LOGE("GPIO ISR service failed: %s\n", esp_err_to_name(err));
+    return;
+  }
+  gpio_set_intr_type((gpio_num_t)ROTARY_DT, GPIO_INTR_ANYEDGE);
+  gpio_set_intr_type((gpio_num_t)ROTARY_CLK, GPIO_INTR_ANYEDGE);
+  gpio_isr_handler_add((gpio_num_t)ROTARY_DT, handleEncoderIsr, nullptr);
+  gpio_isr_handler_add((gpio_num_t)ROTARY_CLK, handleEncoderIsr, nullptr);
+}
+
+void IRAM_ATTR handleEncoderIsr(void* arg) {
+  uint32_t started = esp_cpu_get_ccount();
+  uint32_t levels = REG_READ(GPIO_IN1_REG);
+  uint8_t state = ((levels >> (ROTARY_DT - 32)) & 1) | (((levels >> (ROTARY_CLK - 32)) & 1) << 1);
+
+  portENTER_CRITICAL_ISR(&encoderMux);
+  if (state != encoderState) {
+    encoderSteps += ENCODER_DIRECTION[state | (encoderState << 2)];
+    encoderState = state;
+    if (state == 0) {
+      encoderPosition = encoderSteps >> 2;
+    }
+  }
+  recordCycles(cyclesEncoderIsr, started);
+  portEXIT_CRITICAL_ISR(&encoderMux);
+}
+
 // ===== Loop Helper Functions =====
 
 // Handle rotary encoder input for brightness adjustment
 void handleRotaryEncoder() {
-  encoder.tick();
-  static int lastPos = encoder.getPosition();
-  int pos = encoder.getPosition();
+  static int lastPos = 0;
+  int pos = encoderPosition;
   if (pos != lastPos) {
-    int delta = pos - lastPos;
+    int delta = (pos - lastPos) * tunables.encoderStep;
     lastPos = pos;
 
+    if (streamActive) {
+      stopStream(true, "rotary input");   // the knob continues from the streamed level
+    }
+
     if (isManualControlLocked()) {
       if (WiFi.status() != WL_CONNECTED) {
-        Serial.println("Rotary input forcing offline override (WiFi disconnected)");
-        hardwareOverrideActiveAutomations("hardware_offline_rotary", false);
+        LOGI("Rotary input forcing offline override (WiFi disconnected)\n");
+        hardwareOverrideActiveAutomations(val::SOURCE_HARDWARE_OFFLINE_ROTARY, false);
       }
       if (isManualControlLocked()) {
-        Serial.println("Rotary input ignored: schedule or sun sync currently active");
+        // Nudge the automation with an offset layer rather than taking the lamp over
+        nudgeKnobLayer(delta);
+        LOGD("Rotary nudge over active automation: offset %+d\n", layers[LAYER_KNOB].offsetQ8 / 256);
+        sendStateUpdate();
         return;
       }
     }
@@ -1240,11 +4784,11 @@ void handleRotaryEncoder() {
     int minBrightness = isOn ? 1 : 0;  // Minimum 1 when on, can be 0 when off
     int maxBrightness = 15;
 
-    int newBrightness = constrain(brightness + delta * 1, minBrightness, maxBrightness);
+    int newBrightness = constrain(brightness + delta, minBrightness, maxBrightness);
     if (newBrightness != brightness) {
       brightness = newBrightness;
-      Serial.printf("Brightness -> %d (limits: %d-%d, isOn: %s)\n", 
-                    brightness, minBrightness, maxBrightness, isOn ? "true" : "false");
+      LOGD("Brightness -> %d (limits: %d-%d, isOn: %s)\n", 
+           brightness, minBrightness, maxBrightness, isOn ? "true" : "false");
       applyOutput();
       sendStateUpdate(); // Send update to Flutter app
     }
@@ -1260,7 +4804,7 @@ void handleButtonClicks() {
   int raw = digitalRead(ROTARY_BTN);
   bool pressed = BUTTON_ACTIVE_LOW ? (raw == LOW) : (raw == HIGH);
 
-  if (pressed != prevPressed && (now - lastChange) > DEBOUNCE_MS) {
+  if (pressed != prevPressed && (now - lastChange) > tunables.debounceMs) {
     lastChange = now;
 
     // Trigger on RELEASE edge regardless of polarity
@@ -1270,9 +4814,9 @@ void handleButtonClicks() {
       }
       clickCount++;
       lastClickReleaseTime = now;
-      Serial.println("Button RELEASE detected");
+      LOGD("Button RELEASE detected\n");
 
-      if (clickCount >= 3 && (now - firstClickTime) <= MULTI_CLICK_WINDOW_MS) {
+      if (clickCount >= 3 && (now - firstClickTime) <= tunables.multiClickWindowMs) {
         handleTripleClick();
         clickCount = 0;
       }
@@ -1281,7 +4825,7 @@ void handleButtonClicks() {
     prevPressed = pressed;
   }
 
-  if (clickCount > 0 && (now - lastClickReleaseTime) > MULTI_CLICK_WINDOW_MS) {
+  if (clickCount > 0 && (now - lastClickReleaseTime) > tunables.multiClickWindowMs) {
     uint8_t clicks = clickCount;
     clickCount = 0;
 
@@ -1289,27 +4833,27 @@ void handleButtonClicks() {
       handleTripleClick();
     } else if (clicks == 2) {
       if (isManualControlLocked() && WiFi.status() != WL_CONNECTED) {
-        Serial.println("Double click forcing offline override (WiFi disconnected)");
-        hardwareOverrideActiveAutomations("hardware_offline_button", false);
+        LOGI("Double click forcing offline override (WiFi disconnected)\n");
+        hardwareOverrideActiveAutomations(val::SOURCE_HARDWARE_OFFLINE_BUTTON, false);
       }
       if (isManualControlLocked()) {
-        Serial.println("Double click ignored: schedule or sun sync active");
+        LOGI("Double click ignored: schedule or sun sync active\n");
       } else {
         mode = (Mode)((mode + 1) % 3); // warm -> white -> both -> warm ...
-        Serial.printf("Double click: mode -> %d (0=WARM,1=WHITE,2=BOTH)\n", (int)mode);
+        LOGI("Double click: mode -> %d (0=WARM,1=WHITE,2=BOTH)\n", (int)mode);
         applyOutput();
         sendStateUpdate();
       }
     } else if (clicks == 1) {
       if (isManualControlLocked() && WiFi.status() != WL_CONNECTED) {
-        Serial.println("Single click forcing offline override (WiFi disconnected)");
-        hardwareOverrideActiveAutomations("hardware_offline_button", false);
+        LOGI("Single click forcing offline override (WiFi disconnected)\n");
+        hardwareOverrideActiveAutomations(val::SOURCE_HARDWARE_OFFLINE_BUTTON, false);
       }
       if (isManualControlLocked()) {
-        Serial.println("Single click ignored: schedule or sun sync active");
+        LOGI("Single click ignored: schedule or sun sync active\n");
       } else {
         isOn = !isOn;
-        Serial.printf("Single click: isOn -> %s\n", isOn ? "ON" : "OFF");
+        LOGI("Single click: isOn -> %s\n", isOn ? "ON" : "OFF");
         applyOutput();
         sendStateUpdate();
       }
@@ -1319,7 +4863,7 @@ void handleButtonClicks() {
 
 // Periodic schedule checking with timing control
 void handleScheduleTick() {
-  if (millis() - lastScheduleCheck >= SCHEDULE_CHECK_INTERVAL) {
+  if (millis() - lastScheduleCheck >= tunables.scheduleCheckIntervalMs) {
     lastScheduleCheck = millis();
     checkSchedule();
   }
@@ -1332,10 +4876,11 @@ void handleWifiState() {
     return;
   }
 
-  Serial.printf("WiFi status changed: %d -> %d\n", lastStatus, status);
+  LOGI("WiFi status changed: %d -> %d\n", lastStatus, status);
+  logEvent(EVT_WIFI, SRC_NONE, (int)status, 0);
 
   if (status != WL_CONNECTED) {
-    hardwareOverrideActiveAutomations("hardware_wifi_loss", false);
+    hardwareOverrideActiveAutomations(val::SOURCE_HARDWARE_WIFI_LOSS, false);
   }
 
   lastStatus = status;
@@ -1347,10 +4892,36 @@ void loop() {
   // Handle hardware inputs
   handleRotaryEncoder();
   handleButtonClicks();
+  // Apply the newest app control values posted since the last tick
+  handleControlTick();
+  handleStreamTick();
   
+  // Apply a snapshot validated by POST /snapshot before the schedule looks at the tables
+  serviceSnapshotImport();
+
   // Handle scheduled operations
   handleScheduleTick();
+  handleRampTick();
+  serviceTimezoneTable();
+
+  // Render the composited output once, only if a layer changed this pass
+  serviceCompositor();
+  serviceStateBroadcast();
+
+  // Persist staged history events and roll hourly energy buckets
+  serviceEventLog();
+  serviceEnergyAccounting();
+
+  // Refresh the per-task CPU and stack table for /metrics
+  sampleTaskStats();
   
+  // Ping quiet WebSocket clients and drop the ones that stopped answering
+  serviceWsKeepalive();
+  serviceLogStream();
+
+  // Restart into a freshly installed image once its response went out
+  serviceFirmwareUpdate();
+
   // Cleanup WebSocket connections
   ws.cleanupClients();
 }
\ No newline at end of file
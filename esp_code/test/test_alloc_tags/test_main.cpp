@@ -0,0 +1,142 @@
+// Host test for the heap tag counters: live bytes, blocks, allocation and failure counts
+// and peaks must follow alloc/realloc/free exactly, and a reallocated block must stay
+// charged to the tag it was allocated under.
+//   pio test -e native -f test_alloc_tags
+
+#include <stdint.h>
+#include <string.h>
+#include <unity.h>
+
+#include "alloc_tags.h"
+
+namespace {
+
+// Far beyond any heap, so malloc/realloc refuse it
+const size_t IMPOSSIBLE_SIZE = SIZE_MAX / 2;
+
+// Counters are global and cumulative, so each test starts from a snapshot
+AllocTagStats statsOf(AllocTag tag) {
+  AllocTagStats stats;
+  allocTagStats(tag, stats);
+  return stats;
+}
+
+}  // namespace
+
+void setUp() {}
+void tearDown() {}
+
+void test_alloc_and_free_track_live_bytes() {
+  AllocTagStats before = statsOf(ALLOC_WS_RX);
+  void* a = allocTagged(ALLOC_WS_RX, 100);
+  void* b = allocTagged(ALLOC_WS_RX, 28);
+  TEST_ASSERT_NOT_NULL(a);
+  TEST_ASSERT_NOT_NULL(b);
+  memset(a, 0xA5, 100);              // the whole requested size is usable
+  memset(b, 0x5A, 28);
+
+  AllocTagStats during = statsOf(ALLOC_WS_RX);
+  TEST_ASSERT_EQUAL_UINT32(before.liveBytes + 128, during.liveBytes);
+  TEST_ASSERT_EQUAL_UINT32(before.liveBlocks + 2, during.liveBlocks);
+  TEST_ASSERT_EQUAL_UINT32(before.allocations + 2, during.allocations);
+
+  freeTagged(a);
+  freeTagged(b);
+  freeTagged(nullptr);               // ignored
+  AllocTagStats after = statsOf(ALLOC_WS_RX);
+  TEST_ASSERT_EQUAL_UINT32(before.liveBytes, after.liveBytes);
+  TEST_ASSERT_EQUAL_UINT32(before.liveBlocks, after.liveBlocks);
+  TEST_ASSERT_EQUAL_UINT32(before.allocations + 2, after.allocations);
+}
+
+void test_peak_survives_free() {
+  AllocTagStats before = statsOf(ALLOC_HTTP);
+  void* a = allocTagged(ALLOC_HTTP, 4000);
+  void* b = allocTagged(ALLOC_HTTP, 1000);
+  freeTagged(a);
+  freeTagged(b);
+  AllocTagStats after = statsOf(ALLOC_HTTP);
+  TEST_ASSERT_EQUAL_UINT32(before.liveBytes, after.liveBytes);
+  uint32_t expectedPeak = before.liveBytes + 5000;
+  TEST_ASSERT_EQUAL_UINT32(expectedPeak > before.peakBytes ? expectedPeak : before.peakBytes, after.peakBytes);
+
+  // A smaller burst later does not lower it
+  void* c = allocTagged(ALLOC_HTTP, 10);
+  freeTagged(c);
+  TEST_ASSERT_EQUAL_UINT32(after.peakBytes, statsOf(ALLOC_HTTP).peakBytes);
+}
+
+void test_realloc_resizes_and_raises_peak() {
+  AllocTagStats before = statsOf(ALLOC_MSG_BUFFER);
+  char* text = static_cast<char*>(reallocTagged(ALLOC_MSG_BUFFER, nullptr, 16));   // null allocates
+  TEST_ASSERT_NOT_NULL(text);
+  strcpy(text, "brightness:7");
+
+  text = static_cast<char*>(reallocTagged(ALLOC_MSG_BUFFER, text, 6000));
+  TEST_ASSERT_NOT_NULL(text);
+  TEST_ASSERT_EQUAL_STRING("brightness:7", text);   // contents move with the block
+  AllocTagStats grown = statsOf(ALLOC_MSG_BUFFER);
+  TEST_ASSERT_EQUAL_UINT32(before.liveBytes + 6000, grown.liveBytes);
+  TEST_ASSERT_EQUAL_UINT32(before.liveBlocks + 1, grown.liveBlocks);
+  TEST_ASSERT_EQUAL_UINT32(before.allocations + 1, grown.allocations);   // a resize is not an allocation
+  TEST_ASSERT_TRUE(grown.peakBytes >= before.liveBytes + 6000);
+
+  text = static_cast<char*>(reallocTagged(ALLOC_MSG_BUFFER, text, 64));
+  AllocTagStats shrunk = statsOf(ALLOC_MSG_BUFFER);
+  TEST_ASSERT_EQUAL_UINT32(before.liveBytes + 64, shrunk.liveBytes);
+  TEST_ASSERT_EQUAL_UINT32(grown.peakBytes, shrunk.peakBytes);
+
+  freeTagged(text);
+  TEST_ASSERT_EQUAL_UINT32(before.liveBytes, statsOf(ALLOC_MSG_BUFFER).liveBytes);
+  TEST_ASSERT_EQUAL_UINT32(before.liveBlocks, statsOf(ALLOC_MSG_BUFFER).liveBlocks);
+}
+
+// ArduinoJson reallocates through whichever allocator owns the document now
+void test_realloc_keeps_the_original_tag() {
+  AllocTagStats rxBefore = statsOf(ALLOC_WS_RX);
+  AllocTagStats txBefore = statsOf(ALLOC_WS_TX);
+  void* block = allocTagged(ALLOC_WS_RX, 32);
+  block = reallocTagged(ALLOC_WS_TX, block, 256);
+  TEST_ASSERT_NOT_NULL(block);
+  TEST_ASSERT_EQUAL_UINT32(rxBefore.liveBytes + 256, statsOf(ALLOC_WS_RX).liveBytes);
+  TEST_ASSERT_EQUAL_UINT32(txBefore.liveBytes, statsOf(ALLOC_WS_TX).liveBytes);
+  TEST_ASSERT_EQUAL_UINT32(txBefore.allocations, statsOf(ALLOC_WS_TX).allocations);
+
+  freeTagged(block);
+  TEST_ASSERT_EQUAL_UINT32(rxBefore.liveBytes, statsOf(ALLOC_WS_RX).liveBytes);
+  TEST_ASSERT_EQUAL_UINT32(rxBefore.liveBlocks, statsOf(ALLOC_WS_RX).liveBlocks);
+}
+
+void test_failures_are_counted_and_leave_blocks_intact() {
+  AllocTagStats before = statsOf(ALLOC_HTTP);
+  TEST_ASSERT_NULL(allocTagged(ALLOC_HTTP, IMPOSSIBLE_SIZE));
+  AllocTagStats failed = statsOf(ALLOC_HTTP);
+  TEST_ASSERT_EQUAL_UINT32(before.failures + 1, failed.failures);
+  TEST_ASSERT_EQUAL_UINT32(before.allocations, failed.allocations);
+  TEST_ASSERT_EQUAL_UINT32(before.liveBytes, failed.liveBytes);
+
+  void* block = allocTagged(ALLOC_HTTP, 48);
+  TEST_ASSERT_NULL(reallocTagged(ALLOC_HTTP, block, IMPOSSIBLE_SIZE));
+  AllocTagStats kept = statsOf(ALLOC_HTTP);
+  TEST_ASSERT_EQUAL_UINT32(before.failures + 2, kept.failures);
+  TEST_ASSERT_EQUAL_UINT32(before.liveBytes + 48, kept.liveBytes);   // still counted, still owned
+  freeTagged(block);
+  TEST_ASSERT_EQUAL_UINT32(before.liveBytes, statsOf(ALLOC_HTTP).liveBytes);
+}
+
+void test_tag_names() {
+  TEST_ASSERT_EQUAL_STRING("ws_rx", allocTagName(ALLOC_WS_RX));
+  TEST_ASSERT_EQUAL_STRING("msg_buffer", allocTagName(ALLOC_MSG_BUFFER));
+  TEST_ASSERT_EQUAL_STRING("unknown", allocTagName(ALLOC_TAG_COUNT));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_alloc_and_free_track_live_bytes);
+  RUN_TEST(test_peak_survives_free);
+  RUN_TEST(test_realloc_resizes_and_raises_peak);
+  RUN_TEST(test_realloc_keeps_the_original_tag);
+  RUN_TEST(test_failures_are_counted_and_leave_blocks_intact);
+  RUN_TEST(test_tag_names);
+  return UNITY_END();
+}
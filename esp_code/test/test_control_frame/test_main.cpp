@@ -0,0 +1,155 @@
+// Host test for the control-frame recogniser: every frame in a recorded app corpus goes
+// through both parseControlFrame and ArduinoJson, the fast path must agree with the
+// document wherever it accepts a frame, and everything else must fall back.
+//   pio test -e native -f test_control_frame
+
+#include <ArduinoJson.h>
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include <chrono>
+
+#include "control_frame.h"
+
+using lamp_protocol::ControlFrame;
+using lamp_protocol::parseControlFrame;
+
+namespace {
+
+// Frames in the shapes the app and the proxy send (slider drag, power toggle, reconnect,
+// schedule and stream messages), plus malformed edge cases the recogniser must refuse
+struct CorpusFrame {
+  const char* text;
+  bool fast;               // expected outcome of parseControlFrame
+};
+
+const CorpusFrame CORPUS[] = {
+  {"{\"brightness\":7}", true},
+  {"{\"brightness\":15}", true},
+  {"{\"brightness\":1}", true},
+  {"{\"mode\":0}", true},
+  {"{\"mode\":2}", true},
+  {"{\"on\":true}", true},
+  {"{\"on\":false}", true},
+  {"{\"on\":true,\"brightness\":9,\"mode\":1}", true},
+  {"{\"brightness\":4,\"mode\":2}", true},
+  {" { \"brightness\" : 12 ,\n\"on\" :\tfalse } ", true},
+  {"{\"brightness\":-3}", true},                 // out of range is the caller's call
+  {"{\"brightness\":999999}", true},
+
+  {"{\"brightness\":7.5}", false},               // float
+  {"{\"brightness\":1e1}", false},               // exponent form
+  {"{\"brightness\":\"7\"}", false},             // string value
+  {"{\"brightness\":1234567}", false},           // too many digits
+  {"{\"brightness\":7,\"brightness\":8}", false},
+  {"{\"on\":1}", false},
+  {"{\"on\":null}", false},
+  {"{\"mode\":[1]}", false},
+  {"{\"mode\":{\"v\":1}}", false},
+  {"{\"brightness\":7,}", false},
+  {"{,\"brightness\":7}", false},
+  {"{\"brightness\":7", false},
+  {"{\"brightness\":7}x", false},
+  {"{}", false},
+  {"[]", false},
+  {"", false},
+  {"{\"request_state\":true}", false},
+  {"{\"brightness\":7,\"source\":\"app\"}", false},
+  {"{\"type\":\"stream_samples\",\"samples\":[[0,1792],[16,1800]]}", false},
+  {"{\"type\":\"time_sync\",\"timestamp\":1760000000000,\"tz\":\"NZST-12NZDT,M9.5.0,M4.1.0\"}", false},
+  {"{\"type\":\"routine_sync\",\"action\":\"upsert\",\"id\":3,\"brightness\":10,\"mode\":1}", false},
+};
+const size_t CORPUS_SIZE = sizeof(CORPUS) / sizeof(CORPUS[0]);
+
+const uint32_t TIMING_ROUNDS = 2000;
+
+bool parseFast(const char* text, ControlFrame& frame) {
+  return parseControlFrame(reinterpret_cast<const uint8_t*>(text), strlen(text), frame);
+}
+
+// What handleWsMessage's fallback path reads from the same frame
+bool parseDocument(const char* text, ControlFrame& frame) {
+  JsonDocument doc;
+  if (deserializeJson(doc, text, strlen(text))) {
+    return false;
+  }
+  frame.hasBrightness = doc[lamp_protocol::key::BRIGHTNESS].is<int>();
+  frame.hasMode = doc[lamp_protocol::key::MODE].is<int>();
+  frame.hasOn = doc[lamp_protocol::key::ON].is<bool>();
+  frame.brightness = doc[lamp_protocol::key::BRIGHTNESS].as<int>();
+  frame.mode = doc[lamp_protocol::key::MODE].as<int>();
+  frame.on = doc[lamp_protocol::key::ON].as<bool>();
+  return frame.hasBrightness || frame.hasMode || frame.hasOn;
+}
+
+}  // namespace
+
+void setUp() {}
+void tearDown() {}
+
+void test_corpus_outcomes() {
+  for (size_t i = 0; i < CORPUS_SIZE; i++) {
+    ControlFrame frame;
+    TEST_ASSERT_EQUAL_MESSAGE(CORPUS[i].fast, parseFast(CORPUS[i].text, frame), CORPUS[i].text);
+  }
+}
+
+void test_fast_path_matches_document() {
+  for (size_t i = 0; i < CORPUS_SIZE; i++) {
+    ControlFrame fast;
+    if (!parseFast(CORPUS[i].text, fast)) {
+      continue;
+    }
+    ControlFrame parsed;
+    TEST_ASSERT_TRUE_MESSAGE(parseDocument(CORPUS[i].text, parsed), CORPUS[i].text);
+    TEST_ASSERT_EQUAL_MESSAGE(parsed.hasBrightness, fast.hasBrightness, CORPUS[i].text);
+    TEST_ASSERT_EQUAL_MESSAGE(parsed.hasMode, fast.hasMode, CORPUS[i].text);
+    TEST_ASSERT_EQUAL_MESSAGE(parsed.hasOn, fast.hasOn, CORPUS[i].text);
+    if (fast.hasBrightness) TEST_ASSERT_EQUAL_INT_MESSAGE(parsed.brightness, fast.brightness, CORPUS[i].text);
+    if (fast.hasMode) TEST_ASSERT_EQUAL_INT_MESSAGE(parsed.mode, fast.mode, CORPUS[i].text);
+    if (fast.hasOn) TEST_ASSERT_EQUAL_MESSAGE(parsed.on, fast.on, CORPUS[i].text);
+  }
+}
+
+// Timings are reported, not asserted: host numbers only show the relative cost
+void test_report_timings() {
+  using Clock = std::chrono::steady_clock;
+  uint32_t accepted = 0;
+  uint32_t frames = 0;
+
+  Clock::time_point start = Clock::now();
+  for (uint32_t round = 0; round < TIMING_ROUNDS; round++) {
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+      if (!CORPUS[i].fast) continue;
+      ControlFrame frame;
+      accepted += parseFast(CORPUS[i].text, frame) ? 1 : 0;
+      frames++;
+    }
+  }
+  double fastNs = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / frames;
+
+  start = Clock::now();
+  for (uint32_t round = 0; round < TIMING_ROUNDS; round++) {
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+      if (!CORPUS[i].fast) continue;
+      ControlFrame frame;
+      accepted += parseDocument(CORPUS[i].text, frame) ? 1 : 0;
+    }
+  }
+  double documentNs = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / frames;
+  TEST_ASSERT_EQUAL_UINT32(2 * frames, accepted);
+
+  char line[128];
+  snprintf(line, sizeof(line), "control frames: parseControlFrame %.0f ns, deserializeJson %.0f ns (x%.1f)",
+           fastNs, documentNs, documentNs / fastNs);
+  TEST_MESSAGE(line);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_corpus_outcomes);
+  RUN_TEST(test_fast_path_matches_document);
+  RUN_TEST(test_report_timings);
+  return UNITY_END();
+}
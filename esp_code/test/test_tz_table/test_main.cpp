@@ -0,0 +1,139 @@
+// Host test for the timezone transition table: for zones with southern, northern and no
+// DST (and a non-hour offset), the table's local clock must match glibc's localtime_r
+// hourly across the year and at every second within 2 s of each offset change, and the
+// sliced build the firmware runs must produce the same table as the one-shot build.
+//   pio test -e native -f test_tz_table
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unity.h>
+
+#include "tz_table.h"
+
+namespace {
+
+struct Zone {
+  const char* posix;
+  uint8_t offsets;         // table entries expected over the year
+};
+
+const Zone ZONES[] = {
+  {"NZST-12NZDT,M9.5.0,M4.1.0", 3},        // the firmware default; DST across new year
+  {"EST5EDT,M3.2.0,M11.1.0", 3},
+  {"CET-1CEST,M3.5.0,M10.5.0/3", 3},
+  {"AEST-10AEDT,M10.1.0,M4.1.0/3", 3},
+  {"IST-5:30", 1},
+  {"<+0545>-5:45", 1},
+};
+
+const int64_t YEAR_START = 1735689600;   // 2025-01-01T00:00:00Z
+const int64_t FROM = YEAR_START - 86400;
+const int64_t UNTIL = YEAR_START + 366LL * 86400;
+const int64_t SCAN_STEP_S = 900;         // finer than any real offset change spacing
+
+void useZone(const char* posix) {
+  setenv("TZ", posix, 1);
+  tzset();
+}
+
+void expectClockAt(const TzTable& table, int64_t utc, const char* zone) {
+  time_t t = (time_t)utc;
+  struct tm expected;
+  localtime_r(&t, &expected);
+  TzLocalClock actual;
+  tzTableLocalClock(table, utc, actual);
+
+  char message[96];
+  snprintf(message, sizeof(message), "%s at %lld", zone, (long long)utc);
+  TEST_ASSERT_EQUAL_INT_MESSAGE(expected.tm_hour * 60 + expected.tm_min, actual.minuteOfDay, message);
+  TEST_ASSERT_EQUAL_INT_MESSAGE(expected.tm_sec, actual.second, message);
+  TEST_ASSERT_EQUAL_INT_MESSAGE(expected.tm_yday, actual.yday, message);
+  TEST_ASSERT_EQUAL_INT_MESSAGE(expected.tm_year + 1900, actual.year, message);
+  TEST_ASSERT_EQUAL_INT_MESSAGE(expected.tm_wday, actual.weekday, message);
+}
+
+}  // namespace
+
+void setUp() {}
+void tearDown() {}
+
+void test_hourly_matches_localtime() {
+  for (const Zone& zone : ZONES) {
+    useZone(zone.posix);
+    TzTable table;
+    TEST_ASSERT_TRUE_MESSAGE(tzTableBuild(table, FROM, UNTIL), zone.posix);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(zone.offsets, table.count, zone.posix);
+    for (int64_t utc = FROM; utc < UNTIL; utc += 3600) {
+      expectClockAt(table, utc, zone.posix);
+    }
+  }
+}
+
+// Offset changes are found from localtime_r alone, independently of the table's list
+void test_every_transition_to_the_second() {
+  for (const Zone& zone : ZONES) {
+    useZone(zone.posix);
+    TzTable table;
+    tzTableBuild(table, FROM, UNTIL);
+
+    int changes = 0;
+    int32_t previous = tzLibcOffset(FROM);
+    for (int64_t utc = FROM + SCAN_STEP_S; utc < UNTIL; utc += SCAN_STEP_S) {
+      int32_t offset = tzLibcOffset(utc);
+      if (offset == previous) continue;
+      changes++;
+      for (int64_t s = utc - SCAN_STEP_S - 2; s <= utc + 2; s++) {
+        expectClockAt(table, s, zone.posix);
+      }
+      previous = offset;
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(zone.offsets - 1, changes, zone.posix);
+  }
+}
+
+void test_sliced_build_matches_one_shot() {
+  for (const Zone& zone : ZONES) {
+    useZone(zone.posix);
+    TzTable oneShot;
+    tzTableBuild(oneShot, FROM, UNTIL);
+
+    TzTableBuilder builder;
+    tzTableBuildBegin(builder, FROM, UNTIL);
+    int passes = 1;
+    while (!tzTableBuildStep(builder, 48)) {
+      passes++;
+    }
+    TEST_ASSERT_TRUE_MESSAGE(builder.complete, zone.posix);
+    TEST_ASSERT_TRUE_MESSAGE(passes > 100, zone.posix);   // a year is ~8800 probes
+    TEST_ASSERT_EQUAL_INT_MESSAGE(oneShot.count, builder.table.count, zone.posix);
+    TEST_ASSERT_TRUE_MESSAGE(oneShot.validFrom == builder.table.validFrom, zone.posix);
+    TEST_ASSERT_TRUE_MESSAGE(oneShot.validUntil == builder.table.validUntil, zone.posix);
+    for (uint8_t i = 0; i < oneShot.count; i++) {
+      TEST_ASSERT_TRUE_MESSAGE(oneShot.entries[i].utcStart == builder.table.entries[i].utcStart, zone.posix);
+      TEST_ASSERT_EQUAL_INT_MESSAGE(oneShot.entries[i].offsetS, builder.table.entries[i].offsetS, zone.posix);
+    }
+  }
+}
+
+void test_coverage_bounds() {
+  useZone(ZONES[0].posix);
+  TzTable table;
+  tzTableBuild(table, FROM, UNTIL);
+  TEST_ASSERT_TRUE(tzTableCovers(table, FROM));
+  TEST_ASSERT_TRUE(tzTableCovers(table, UNTIL - 1));
+  TEST_ASSERT_FALSE(tzTableCovers(table, FROM - 1));
+  TEST_ASSERT_FALSE(tzTableCovers(table, UNTIL));
+
+  table.count = 0;                   // what applyTimezone does to force a rebuild
+  TEST_ASSERT_FALSE(tzTableCovers(table, YEAR_START));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_hourly_matches_localtime);
+  RUN_TEST(test_every_transition_to_the_second);
+  RUN_TEST(test_sliced_build_matches_one_shot);
+  RUN_TEST(test_coverage_bounds);
+  return UNITY_END();
+}